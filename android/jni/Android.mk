@@ -61,6 +61,9 @@ CRENGINE_SRC_FILES := \
     ../../crengine/src/lvrend.cpp \
     ../../crengine/src/wolutil.cpp \
     ../../crengine/src/crconcurrent.cpp \
+    ../../crengine/src/crtrace.cpp \
+    ../../crengine/src/crmemgov.cpp \
+    ../../crengine/src/crlibscan.cpp \
     ../../crengine/src/hist.cpp
 #    ../../crengine/src/cri18n.cpp
 #    ../../crengine/src/crgui.cpp \
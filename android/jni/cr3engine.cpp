@@ -15,6 +15,7 @@
 
 #include "cr3java.h"
 #include "../../crengine/include/cr3version.h"
+#include "../../crengine/include/crmemgov.h"
 #include "docview.h"
 #include "../../crengine/include/crengine.h"
 #include "../../crengine/include/epubfmt.h"
@@ -646,6 +647,38 @@ JNIEXPORT void JNICALL Java_org_coolreader_crengine_Engine_suspendLongOperationI
 }
 
 
+/*
+ * Class:     org_coolreader_crengine_Engine
+ * Method:    setMemoryBudgetInternal
+ * Signature: (I)V
+ */
+JNIEXPORT void JNICALL Java_org_coolreader_crengine_Engine_setMemoryBudgetInternal
+  (JNIEnv *, jclass, jint bytes)
+{
+	CRMemoryGovernor::setBudget(bytes);
+}
+
+// ComponentCallbacks2.TRIM_MEMORY_RUNNING_CRITICAL
+#define TRIM_MEMORY_RUNNING_CRITICAL 15
+/*
+ * Class:     org_coolreader_crengine_Engine
+ * Method:    trimMemoryInternal
+ * Signature: (I)V
+ */
+JNIEXPORT void JNICALL Java_org_coolreader_crengine_Engine_trimMemoryInternal
+  (JNIEnv *, jclass, jint level)
+{
+	// called in engine thread (Engine.trimMemory() posts it there): storages
+	// of non-concurrent documents compact unpacked chunks right away
+	// level of onTrimMemory(): critical or worse releases all caches
+	if (level >= TRIM_MEMORY_RUNNING_CRITICAL) {
+		CRMemoryGovernor::trim(CRMEM_TRIM_COMPLETE);
+		LVStyleSheet::clearLayerCache();
+	} else {
+		CRMemoryGovernor::trim(CRMEM_TRIM_MODERATE);
+	}
+}
+
 #define BUTTON_BACKLIGHT_CONTROL_PATH "/sys/class/leds/button-backlight/brightness"
 /*
  * Class:     org_coolreader_crengine_Engine
@@ -111,6 +111,22 @@ JNIEXPORT jboolean JNICALL Java_org_coolreader_crengine_Engine_setKeyBacklightIn
 JNIEXPORT void JNICALL Java_org_coolreader_crengine_Engine_drawBookCoverInternal
   (JNIEnv *, jclass, jobject bmp, jbyteArray data, jstring fontFace, jstring title, jstring authors, jstring seriesName, jint seriesNumber, jint bpp);
 
+/*
+ * Class:     org_coolreader_crengine_Engine
+ * Method:    setMemoryBudgetInternal
+ * Signature: (I)V
+ */
+JNIEXPORT void JNICALL Java_org_coolreader_crengine_Engine_setMemoryBudgetInternal
+  (JNIEnv *, jclass, jint);
+
+/*
+ * Class:     org_coolreader_crengine_Engine
+ * Method:    trimMemoryInternal
+ * Signature: (I)V
+ */
+JNIEXPORT void JNICALL Java_org_coolreader_crengine_Engine_trimMemoryInternal
+  (JNIEnv *, jclass, jint);
+
 
 #ifdef __cplusplus
 }
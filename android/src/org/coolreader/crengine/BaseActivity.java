@@ -482,6 +482,18 @@ public class BaseActivity extends Activity implements Settings {
 		super.onConfigurationChanged(newConfig);
 	}
 
+	@Override
+	public void onTrimMemory(int level) {
+		super.onTrimMemory(level);
+		Engine.trimMemory(level);
+	}
+
+	@Override
+	public void onLowMemory() {
+		super.onLowMemory();
+		Engine.trimMemory(TRIM_MEMORY_COMPLETE);
+	}
+
 	private boolean mFullscreen = false;
 	public boolean isFullscreen() {
 		return mFullscreen;
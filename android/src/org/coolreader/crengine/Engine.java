@@ -570,6 +570,36 @@ public class Engine {
     public static void suspendLongOperation() {
    		suspendLongOperationInternal();
     }
+
+	private native static void setMemoryBudgetInternal(int bytes); // 0 to use built-in limits of engine caches
+
+	private native static void trimMemoryInternal(int level); // level of onTrimMemory(); call it from engine thread
+
+	/**
+	 * Releases memory of engine caches on low memory signal.
+	 * Caches are trimmed in engine thread, which owns document data.
+	 * @param level is level passed to onTrimMemory()
+	 */
+	public static void trimMemory(final int level) {
+		BackgroundThread.instance().postBackground(new Runnable() {
+			public void run() {
+				log.i("Trimming engine caches, level " + level);
+				trimMemoryInternal(level);
+			}
+		});
+	}
+
+	// part of max Java heap size given to engine caches as memory budget
+	private static final int MEMORY_BUDGET_DIVISOR = 2;
+
+	private static void initMemoryBudget() {
+		// max heap size follows memory class of device
+		long budget = Runtime.getRuntime().maxMemory() / MEMORY_BUDGET_DIVISOR;
+		if (budget > Integer.MAX_VALUE)
+			budget = Integer.MAX_VALUE;
+		log.i("Engine caches memory budget: " + budget);
+		setMemoryBudgetInternal((int)budget);
+	}
 	
 	/**
 	 * Checks whether specified directlry or file is symbolic link.
@@ -1534,6 +1564,7 @@ public class Engine {
 			throw new RuntimeException("Cannot initialize CREngine JNI");
 		}
 		initCacheDirectory();
+		initMemoryBudget();
 		log.i("Engine() : initialization done");
 	}
 }
@@ -266,6 +266,13 @@ bool InitCREngine( const char * exename, lString16Collection & fontDirs )
     #endif
         getDirectoryFonts( fontDirs, fontExt, fonts, true );
 
+    #ifdef _LINUX
+        // keep scanned font properties in catalog to avoid opening all font files on each start
+        const char * home = getenv("HOME");
+        if ( home && LVDirectoryExists( Utf8ToUnicode(lString8(home)) + "/.crengine" ) )
+            fontMan->SetFontCatalogFile( lString8(home) + "/.crengine/fontcatalog.dat" );
+    #endif
+
         // load fonts from file
         CRLog::debug("%d font files found", fonts.length());
         //if (!fontMan->GetFontCount()) {
@@ -276,6 +283,7 @@ bool InitCREngine( const char * exename, lString16Collection & fontDirs )
                     CRLog::trace("    failed\n");
                 }
             }
+            fontMan->SaveFontCatalog();
         //}
     #else
             #define MAX_FONT_FILE 128
@@ -0,0 +1,1343 @@
+/*******************************************************
+
+   CoolReader Engine
+
+   crbench.cpp:  headless engine benchmarks
+
+   This source code is distributed under the terms of
+   GNU General Public License
+
+   See LICENSE file for details
+
+*******************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "crengine.h"
+#include "crconcurrent.h"
+#include "crtrace.h"
+#include "crmemgov.h"
+#include "crlibscan.h"
+#include "crgui.h"
+
+#if (CR_CONCURRENT_DOCUMENTS==1)
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <chrono>
+
+/// recursive mutex and monitor for engine guards
+class CRBenchMonitor : public CRMonitor
+{
+    std::recursive_mutex _mutex;
+    std::condition_variable_any _cond;
+public:
+    virtual void acquire() { _mutex.lock(); }
+    virtual void release() { _mutex.unlock(); }
+    virtual void wait() { _cond.wait( _mutex ); }
+    virtual void notify() { _cond.notify_one(); }
+    virtual void notifyAll() { _cond.notify_all(); }
+};
+
+class CRBenchThread : public CRThread
+{
+    CRRunnable * _task;
+    std::thread _thread;
+public:
+    CRBenchThread( CRRunnable * task ) : _task(task) { }
+    virtual ~CRBenchThread() { join(); }
+    virtual void start() { _thread = std::thread( &CRRunnable::run, _task ); }
+    virtual void join() { if ( _thread.joinable() ) _thread.join(); }
+};
+
+/// concurrency provider for headless use: there is no GUI thread, GUI tasks are run immediately,
+/// or queued until runGuiTasks() when emulating idle time of GUI loop
+class CRBenchConcurrencyProvider : public CRConcurrencyProvider
+{
+    bool _queueGui;
+    std::vector<CRRunnable *> _guiTasks;
+public:
+    CRBenchConcurrencyProvider() : _queueGui(false) { }
+    /// queue GUI tasks instead of running them immediately
+    void setQueueGui( bool queue ) { _queueGui = queue; }
+    /// runs queued GUI tasks including ones they post, returns number of tasks run
+    int runGuiTasks() {
+        int count = 0;
+        while ( !_guiTasks.empty() ) {
+            CRRunnable * task = _guiTasks.front();
+            _guiTasks.erase( _guiTasks.begin() );
+            task->run();
+            delete task;
+            count++;
+        }
+        return count;
+    }
+    virtual CRMutex * createMutex() { return new CRBenchMonitor(); }
+    virtual CRMonitor * createMonitor() { return new CRBenchMonitor(); }
+    virtual CRThread * createThread( CRRunnable * threadTask ) { return new CRBenchThread( threadTask ); }
+    virtual void executeGui( CRRunnable * task ) {
+        if ( _queueGui ) {
+            _guiTasks.push_back( task );
+            return;
+        }
+        task->run();
+        delete task;
+    }
+    virtual void executeGui( CRRunnable * task, int delayMillis ) {
+        if ( !task )
+            return;
+        sleepMs( delayMillis );
+        executeGui( task );
+    }
+    virtual void sleepMs( int durationMs ) {
+        std::this_thread::sleep_for( std::chrono::milliseconds(durationMs) );
+    }
+};
+#endif
+
+#if defined(__GLIBC__)
+#include <malloc.h>
+// counts heap allocations made by the engine while allocCounting is set,
+// and peak of heap growth since counting started
+extern "C" void * __libc_malloc( size_t size );
+extern "C" void * __libc_calloc( size_t count, size_t size );
+extern "C" void * __libc_realloc( void * ptr, size_t size );
+extern "C" void __libc_free( void * ptr );
+static bool allocCounting = false;
+static long allocCount = 0;
+static long allocBytes = 0;
+static long allocPeak = 0;
+static void countAlloc( void * ptr )
+{
+    allocCount++;
+    if ( ptr ) {
+        allocBytes += (long)malloc_usable_size( ptr );
+        if ( allocBytes > allocPeak )
+            allocPeak = allocBytes;
+    }
+}
+extern "C" void * malloc( size_t size )
+{
+    void * res = __libc_malloc( size );
+    if ( allocCounting )
+        countAlloc( res );
+    return res;
+}
+extern "C" void * calloc( size_t count, size_t size )
+{
+    void * res = __libc_calloc( count, size );
+    if ( allocCounting )
+        countAlloc( res );
+    return res;
+}
+extern "C" void * realloc( void * ptr, size_t size )
+{
+    if ( allocCounting && ptr )
+        allocBytes -= (long)malloc_usable_size( ptr );
+    void * res = __libc_realloc( ptr, size );
+    if ( allocCounting )
+        countAlloc( res );
+    return res;
+}
+extern "C" void free( void * ptr )
+{
+    if ( allocCounting && ptr )
+        allocBytes -= (long)malloc_usable_size( ptr );
+    __libc_free( ptr );
+}
+#define CRBENCH_COUNT_ALLOCS 1
+#endif
+
+/// change of corpus benchmark metric against baseline reported as regression, percent
+#define CRBENCH_REGRESSION_PERCENT 10
+/// corpus benchmark runs per book, best time of runs is reported
+#define CRBENCH_CORPUS_RUNS 3
+
+static lUInt64 benchStart;
+
+static void startTimer()
+{
+    benchStart = GetCurrentTimeMillis();
+}
+
+static lUInt64 elapsed()
+{
+    return GetCurrentTimeMillis() - benchStart;
+}
+
+/// fills page with text lines, returns number of glyphs drawn
+static int drawTextPage( LVDrawBuf * buf, LVFontRef font )
+{
+    static const char * sample =
+        "The quick brown fox jumps over the lazy dog. "
+        "Pack my box with five dozen liquor jugs. "
+        "Sphinx of black quartz, judge my vow! 0123456789";
+    lString16 text = Utf8ToUnicode( lString8(sample) );
+    int lineHeight = font->getHeight();
+    int count = 0;
+    for ( int y=0; y + lineHeight <= buf->GetHeight(); y += lineHeight ) {
+        // shift lines horizontally to test unaligned 1/2 bpp destinations
+        int x = (y / lineHeight) % 8 - 4;
+        font->DrawTextString( buf, x, y, text.c_str(), text.length(), '?', NULL, false );
+        count += text.length();
+    }
+    return count;
+}
+
+/// benchmark of glyph blitting: full page of text drawn into buffers of all supported depths
+static int benchGlyphs( const char * fontFile, int iterations )
+{
+    // font may be already known from system font directories: not an error
+    fontMan->RegisterFont( lString8(fontFile) );
+    LVFontRef font = fontMan->GetFont( 22, 400, false, css_ff_sans_serif, lString8("") );
+    if ( font.isNull() ) {
+        printf("cannot get font\n");
+        return 1;
+    }
+    static const int grayBpp[] = { 1, 2, 4, 8 };
+    static const int colorBpp[] = { 16, 32 };
+    const int dx = 1072;
+    const int dy = 1448;
+    for ( int i=0; i<6; i++ ) {
+        LVDrawBuf * buf;
+        int bpp;
+        if ( i<4 ) {
+            bpp = grayBpp[i];
+            buf = new LVGrayDrawBuf( dx, dy, bpp );
+        } else {
+            bpp = colorBpp[i-4];
+            buf = new LVColorDrawBuf( dx, dy, bpp );
+        }
+        buf->SetTextColor( 0x000000 );
+        // warm up glyph cache
+        buf->Clear( 0xFFFFFF );
+        int glyphs = drawTextPage( buf, font );
+        startTimer();
+        for ( int n=0; n<iterations; n++ ) {
+            buf->Clear( 0xFFFFFF );
+            drawTextPage( buf, font );
+        }
+        lUInt64 t = elapsed();
+        printf("glyphs: %2d bpp  %dx%d  %d glyphs/page  %d pages  %5d ms  %.2f ms/page\n",
+               bpp, dx, dy, glyphs, iterations, (int)t, (double)t / iterations);
+        delete buf;
+    }
+    return 0;
+}
+
+/// benchmark of paragraph measurement and drawing without kerning and with freetype kerning
+static int benchKerning( const char * fontFile, int iterations )
+{
+    fontMan->RegisterFont( lString8(fontFile) );
+    LVFontRef font = fontMan->GetFont( 22, 400, false, css_ff_serif, lString8("") );
+    if ( font.isNull() ) {
+        printf("cannot get font\n");
+        return 1;
+    }
+    // paragraph of words from sample text in pseudo random order
+    static const char * words[] = { "The", "quick", "brown", "fox", "jumps", "over", "the", "lazy", "dog.",
+        "AVATAR", "Typography", "Wavy", "Tokyo", "yellow", "LTA", "office", "We", "were", "Yes,", "To",
+        "P.", "F.", "Vowel", "kerning", "AWAY", "Te", "Ty", "Yo", "\"Quoted\"", "(Voyage)" };
+    const int wordCount = sizeof(words) / sizeof(words[0]);
+    lString16 text;
+    lUInt32 seed = 1;
+    while ( text.length() < 2000 ) {
+        seed = seed * 1103515245 + 12345;
+        if ( !text.empty() )
+            text << ' ';
+        text << Utf8ToUnicode( lString8(words[(seed >> 16) % wordCount]) );
+    }
+    int len = text.length();
+    lUInt16 * widths = new lUInt16[len + 1];
+    lUInt16 * kernedWidths = new lUInt16[len + 1];
+    lUInt8 * flags = new lUInt8[len + 1];
+    LVGrayDrawBuf buf( 600, 100, 4 );
+    CRTraceMode mode = CRTrace::getMode();
+    CRTrace::setMode( CRTRACE_MODE_COUNTERS );
+    for ( int kerning=0; kerning<2; kerning++ ) {
+        font->setKerningMode( kerning ? KERNING_MODE_FREETYPE : KERNING_MODE_DISABLED );
+        if ( kerning && !font->kerningEnabled() ) {
+            printf("kerning: font has no kerning table\n");
+            break;
+        }
+        // the first measurement fills caches
+        font->measureText( text.c_str(), len, widths, flags, 0x7FFF, '?', 0, false );
+        CRTrace::reset();
+        startTimer();
+        for ( int n=0; n<iterations; n++ )
+            font->measureText( text.c_str(), len, kerning ? kernedWidths : widths, flags, 0x7FFF, '?', 0, false );
+        lUInt64 tMeasure = elapsed();
+        lUInt64 hits = CRTrace::getStats( CRTRACE_KERNING_CACHE_HIT ).count;
+        startTimer();
+        for ( int n=0; n<iterations; n++ )
+            font->DrawTextString( &buf, 0, 0, text.c_str(), len, '?', NULL, false );
+        lUInt64 tDraw = elapsed();
+        printf("kerning: %-8s  %d chars x %d  measure %d ms  %.1f Mchars/s  draw %d ms  %.2f kerning cache hits per char\n",
+               kerning ? "freetype" : "off", len, iterations, (int)tMeasure,
+               tMeasure ? (double)len * iterations / tMeasure / 1000 : 0, (int)tDraw,
+               (double)hits / len / iterations);
+        if ( kerning ) {
+            int kerned = 0;
+            for ( int i=0; i<len; i++ )
+                if ( kernedWidths[i] != widths[i] )
+                    kerned++;
+            printf("kerning: %d of %d chars moved by kerning\n", kerned, len);
+        }
+    }
+    font->setKerningMode( KERNING_MODE_DISABLED );
+    CRTrace::setMode( mode );
+    delete[] widths;
+    delete[] kernedWidths;
+    delete[] flags;
+    return 0;
+}
+
+/// loads, renders and draws one document on the calling thread, returns number of pages drawn
+static int drawDocument( const char * fileName, int maxPages )
+{
+    const int dx = 600;
+    const int dy = 800;
+    LVDocView view( 4, true );
+    view.Resize( dx, dy );
+    if ( !view.LoadDocument( fileName ) )
+        return -1;
+    view.checkRender();
+    LVGrayDrawBuf buf( dx, dy, 4 );
+    int pages = view.getPageCount();
+    if ( pages > maxPages )
+        pages = maxPages;
+    for ( int i=0; i<pages; i++ ) {
+        view.goToPage( i );
+        view.Draw( buf, false );
+    }
+    return pages;
+}
+
+/// benchmark of documents opened, rendered and drawn at once on separate threads
+static int benchDocs( const char * fileName, int threadCount, int maxPages )
+{
+    // also warms up font caches
+    if ( drawDocument( fileName, 1 ) < 0 ) {
+        printf("cannot open document %s\n", fileName);
+        return 1;
+    }
+#if (CR_CONCURRENT_DOCUMENTS==1)
+    double baseRate = 0;
+    // 1, 2, 4... threads, then threadCount
+    for ( int n=1; ; n = n*2<threadCount ? n*2 : threadCount ) {
+        std::vector<std::thread> threads;
+        std::vector<int> pages( n, 0 );
+        startTimer();
+        for ( int i=0; i<n; i++ )
+            threads.push_back( std::thread( [&pages, i, fileName, maxPages]() {
+                pages[i] = drawDocument( fileName, maxPages );
+            } ) );
+        int total = 0;
+        for ( int i=0; i<n; i++ ) {
+            threads[i].join();
+            if ( pages[i] < 0 ) {
+                printf("docs: thread %d failed\n", i);
+                return 1;
+            }
+            total += pages[i];
+        }
+        lUInt64 t = elapsed();
+        double rate = t ? (double)n * 1000 / t : 0;
+        if ( n==1 )
+            baseRate = rate;
+        printf("docs: %2d threads  %d docs  %d pages  %5d ms  %.2f docs/s  scaling %.2f\n",
+               n, n, total, (int)t, rate, baseRate ? rate / baseRate : 0);
+        if ( n >= threadCount )
+            break;
+    }
+#else
+    CR_UNUSED(threadCount);
+    printf("docs: built without CR_CONCURRENT_DOCUMENTS, running single thread\n");
+    startTimer();
+    int total = drawDocument( fileName, maxPages );
+    printf("docs:  1 threads  1 docs  %d pages  %5d ms\n", total, (int)elapsed());
+#endif
+    return 0;
+}
+
+/// benchmark of style tweaks toggling: restyle of changed elements only vs full restyle
+static int benchRestyle( const char * fileName, const char * element, int iterations )
+{
+    LVDocView view( 4, true );
+    view.Resize( 600, 800 );
+    if ( !view.LoadDocument( fileName ) ) {
+        printf("cannot open document %s\n", fileName);
+        return 1;
+    }
+    view.checkRender();
+    ldomDocument * doc = view.getDocument();
+    lString8 css;
+    lString8 tweak = lString8(element) + " { color: red }";
+    lUInt64 tTargeted = 0;
+    lUInt64 tFull = 0;
+    int targeted = 0;
+    int full = 0;
+    for ( int i=0; i<iterations; i++ ) {
+        view.setStyleSheet( i & 1 ? css : tweak );
+        startTimer();
+        view.checkRender();
+        tTargeted += elapsed();
+        targeted = doc->getLastRestyledNodeCount();
+        doc->forceReinitStyles();
+        view.requestRender();
+        startTimer();
+        view.checkRender();
+        tFull += elapsed();
+        full = doc->getLastRestyledNodeCount();
+    }
+    printf("restyle: %s  %d of %d elements  targeted %d ms  full %d ms  (%d renders each)\n",
+           element, targeted, full, (int)tTargeted, (int)tFull, iterations);
+    return 0;
+}
+
+/// benchmark of opening a book from its cache file, compared to parsing it
+static int benchReopen( const char * fileName, const char * cacheDir, int iterations )
+{
+    if ( !ldomDocCache::init( Utf8ToUnicode(cacheDir), 0x10000000 ) ) {
+        printf("cannot use cache directory %s\n", cacheDir);
+        return 1;
+    }
+    lUInt64 tParse = 0;
+    lUInt64 tOpen = 0;
+    lUInt64 tDraw = 0;
+    int pages = 0;
+    for ( int i=0; i<=iterations; i++ ) {
+        LVDocView view( 4, true );
+        view.Resize( 600, 800 );
+        // without block elements the whole book would be a single final block
+        view.setStyleSheet( lString8("body, section, title, p { display: block }") );
+        startTimer();
+        if ( !view.LoadDocument( fileName ) ) {
+            printf("cannot open document %s\n", fileName);
+            return 1;
+        }
+        view.checkRender();
+        lUInt64 t = elapsed();
+        if ( i==0 ) {
+            // first pass parses the book and writes the cache file
+            tParse = t;
+            view.updateCache();
+            continue;
+        }
+        tOpen += t;
+        startTimer();
+        LVGrayDrawBuf buf( 600, 800, 4 );
+        view.goToPage( view.getPageCount() / 2 );
+        view.Draw( buf, false );
+        tDraw += elapsed();
+        pages = view.getPageCount();
+    }
+    ldomDocCacheStats stats = ldomDocCache::getStats();
+    ldomDocCache::clear();
+    ldomDocCache::close();
+    if ( iterations > 0 )
+        printf("reopen: %d pages  parse %d ms  open from cache %d ms  first draw %d ms  (%d opens)\n",
+               pages, (int)tParse, (int)(tOpen / iterations), (int)(tDraw / iterations), iterations);
+    printf("cache: %d hits  %d misses  %d evictions  %d files  %d KB\n",
+           stats.hits, stats.misses, stats.evictions, stats.files, (int)(stats.size / 1024));
+    return 0;
+}
+
+static void printMemoryStats( const char * title )
+{
+    printf("%-8s", title);
+    lUInt64 total = 0;
+    for ( int s=0; s<CRMEM_SUBSYSTEM_COUNT; s++ ) {
+        CRMemoryStats stats = CRMemoryGovernor::getStats( (CRMemorySubsystem)s );
+        total += stats.used;
+        if ( stats.consumers )
+            printf("  %s %d/%d KB", CRMemoryGovernor::getName( (CRMemorySubsystem)s ),
+                   (int)(stats.used / 1024), (int)(stats.limit / 1024));
+    }
+    printf("  total %d KB\n", (int)(total / 1024));
+}
+
+/// pages through a book with memory budget of engine caches, then trims them
+static int benchMemory( const char * fileName, const char * cacheDir, int budgetKb, int pages )
+{
+    if ( !ldomDocCache::init( Utf8ToUnicode(cacheDir), 0x10000000 ) ) {
+        printf("cannot use cache directory %s\n", cacheDir);
+        return 1;
+    }
+    CRMemoryGovernor::setBudget( budgetKb * 1024 );
+    {
+        LVDocView view( 4, true );
+        view.Resize( 600, 800 );
+        if ( !view.LoadDocument( fileName ) ) {
+            printf("cannot open document %s\n", fileName);
+            return 1;
+        }
+        view.checkRender();
+        // with cache file storages can release unpacked chunks
+        view.swapToCache();
+        LVGrayDrawBuf buf( 600, 800, 4 );
+        if ( pages > view.getPageCount() )
+            pages = view.getPageCount();
+        startTimer();
+        for ( int i=0; i<pages; i++ ) {
+            view.goToPage( i );
+            view.Draw( buf, false );
+        }
+        lUInt64 t = elapsed();
+        printf("memory: budget %d KB  %d pages  %d ms\n", budgetKb, pages, (int)t);
+        printMemoryStats( "drawn" );
+        CRMemoryGovernor::trim( CRMEM_TRIM_MODERATE );
+        view.goToPage( 0 );
+        view.Draw( buf, false );
+        printMemoryStats( "moderate" );
+        CRMemoryGovernor::trim( CRMEM_TRIM_COMPLETE );
+        printMemoryStats( "complete" );
+    }
+    CRMemoryGovernor::setBudget( 0 );
+    ldomDocCache::clear();
+    ldomDocCache::close();
+    return 0;
+}
+
+/// collects engine phase timers while opening a book, paging through it and reopening it from cache
+static int benchTrace( const char * fileName, const char * cacheDir, const char * traceFile, int pages )
+{
+    if ( !ldomDocCache::init( Utf8ToUnicode(cacheDir), 0x10000000 ) ) {
+        printf("cannot use cache directory %s\n", cacheDir);
+        return 1;
+    }
+    CRTrace::setMode( CRTRACE_MODE_EVENTS );
+    for ( int pass=0; pass<2; pass++ ) {
+        // second pass opens the book from the cache file written by the first one
+        LVDocView view( 4, true );
+        view.Resize( 600, 800 );
+        if ( !view.LoadDocument( fileName ) ) {
+            printf("cannot open document %s\n", fileName);
+            return 1;
+        }
+        view.checkRender();
+        LVGrayDrawBuf buf( 600, 800, 4 );
+        for ( int i=0; i<pages && i<view.getPageCount(); i++ ) {
+            view.goToPage( i );
+            view.Draw( buf, false );
+        }
+        if ( pass==0 )
+            view.updateCache();
+    }
+    ldomDocCache::clear();
+    ldomDocCache::close();
+    printf("%s", CRTrace::getCountersJson().c_str());
+    lString8 trace = CRTrace::getChromeTraceJson();
+    CRTrace::setMode( CRTRACE_MODE_OFF );
+    LVStreamRef out = LVOpenFileStream( traceFile, LVOM_WRITE );
+    if ( out.isNull() || out->Write( trace.c_str(), trace.length(), NULL ) != LVERR_OK ) {
+        printf("cannot write %s\n", traceFile);
+        return 1;
+    }
+    return 0;
+}
+
+/// phases measured by corpus benchmark
+enum CorpusMetric {
+    CM_DETECT, CM_PARSE, CM_STYLE, CM_RENDER, CM_PAGINATE, CM_FIRST_DRAW, CM_ALL_DRAW, CM_CACHE_SAVE, CM_REOPEN, CM_PEAK_RSS, CM_COUNT
+};
+
+static const char * corpusMetricNames[CM_COUNT] = {
+    "detect_ms", "parse_ms", "style_ms", "render_ms", "paginate_ms", "first_draw_ms", "all_draw_ms", "cache_save_ms", "reopen_ms", "peak_rss_kb"
+};
+
+/// resets peak resident set size of process, returns false if not supported
+static bool resetPeakRss()
+{
+#ifdef __linux__
+    FILE * f = fopen( "/proc/self/clear_refs", "w" );
+    if ( !f )
+        return false;
+    bool res = fputs( "5", f ) >= 0;
+    return fclose( f ) == 0 && res;
+#else
+    return false;
+#endif
+}
+
+/// returns peak resident set size of process since last reset, KB
+static int getPeakRss()
+{
+#ifdef __linux__
+    FILE * f = fopen( "/proc/self/status", "r" );
+    int kb = 0;
+    char line[128];
+    while ( f && fgets( line, sizeof(line), f ) ) {
+        if ( !strncmp( line, "VmHWM:", 6 ) )
+            kb = atoi( line + 6 );
+    }
+    if ( f )
+        fclose( f );
+    return kb;
+#else
+    return 0;
+#endif
+}
+
+static double traceMs( CRTracePoint point )
+{
+    return CRTrace::getStats( point ).totalUs / 1000.0;
+}
+
+/// measures phases of one book, returns false if it cannot be opened
+static bool benchCorpusBook( const lString16 & pathName, double * metrics, lString8 & format, int & pages )
+{
+    const int dx = 600;
+    const int dy = 800;
+    LVGrayDrawBuf buf( dx, dy, 4 );
+    // first open must parse the book
+    ldomDocCache::clear();
+    resetPeakRss();
+    {
+        LVDocView view( 4, true );
+        view.Resize( dx, dy );
+        CRTrace::reset();
+        lUInt64 t = CRTrace::now();
+        if ( !view.LoadDocument( pathName.c_str() ) )
+            return false;
+        double open = (CRTrace::now() - t) / 1000.0;
+        view.checkRender();
+        // styles are set while parsing: parse time excludes them
+        metrics[CM_DETECT] = open - traceMs( CRTRACE_PARSE );
+        metrics[CM_PARSE] = traceMs( CRTRACE_PARSE ) - traceMs( CRTRACE_STYLE );
+        metrics[CM_STYLE] = traceMs( CRTRACE_STYLE );
+        metrics[CM_RENDER] = traceMs( CRTRACE_RENDER );
+        metrics[CM_PAGINATE] = traceMs( CRTRACE_PAGINATE );
+        format = UnicodeToUtf8( view.getDocProps()->getStringDef( DOC_PROP_FILE_FORMAT, "" ) );
+        pages = view.getPageCount();
+        t = CRTrace::now();
+        view.goToPage( 0 );
+        view.Draw( buf, false );
+        metrics[CM_FIRST_DRAW] = (CRTrace::now() - t) / 1000.0;
+        t = CRTrace::now();
+        for ( int i=0; i<pages; i++ ) {
+            view.goToPage( i );
+            view.Draw( buf, false );
+        }
+        metrics[CM_ALL_DRAW] = (CRTrace::now() - t) / 1000.0;
+        t = CRTrace::now();
+        view.updateCache();
+        metrics[CM_CACHE_SAVE] = (CRTrace::now() - t) / 1000.0;
+    }
+    {
+        LVDocView view( 4, true );
+        view.Resize( dx, dy );
+        lUInt64 t = CRTrace::now();
+        if ( !view.LoadDocument( pathName.c_str() ) )
+            return false;
+        view.checkRender();
+        view.Draw( buf, false );
+        metrics[CM_REOPEN] = (CRTrace::now() - t) / 1000.0;
+    }
+    metrics[CM_PEAK_RSS] = getPeakRss();
+    return true;
+}
+
+/// escapes string to be written inside quotes of JSON results
+static lString8 jsonEscape( const lString8 & str )
+{
+    lString8 res;
+    for ( int i=0; i<str.length(); i++ ) {
+        lUInt8 ch = (lUInt8)str[i];
+        if ( ch=='"' || ch=='\\' ) {
+            res << '\\' << (char)ch;
+        } else if ( ch < 0x20 ) {
+            char buf[8];
+            sprintf( buf, "\\u%04x", ch );
+            res << buf;
+        } else {
+            res << (char)ch;
+        }
+    }
+    return res;
+}
+
+/// reads metric of book from results file written by benchCorpus, returns -1 if absent
+static double findBaselineMetric( const lString8 & baseline, const lString8 & fileName, const char * metric )
+{
+    lString8 key = lString8("{\"file\": \"") + jsonEscape( fileName ) + "\"";
+    int start = baseline.pos( key );
+    if ( start < 0 )
+        return -1;
+    int end = baseline.pos( "}", start );
+    lString8 name = lString8("\"") + metric + "\": ";
+    int pos = baseline.pos( name, start );
+    if ( pos < 0 || (end >= 0 && pos > end) )
+        return -1;
+    return atof( baseline.c_str() + pos + name.length() );
+}
+
+/// times load phases of every book in directory, writes results as JSON and compares them with baseline results
+static int benchCorpus( const char * dir, const char * cacheDir, const char * resultsFile, const char * baselineFile )
+{
+    LVContainerRef container = LVOpenDirectory( Utf8ToUnicode(dir).c_str() );
+    if ( container.isNull() ) {
+        printf("cannot open directory %s\n", dir);
+        return 1;
+    }
+    lString16Collection files;
+    for ( int i=0; i<container->GetObjectCount(); i++ ) {
+        const LVContainerItemInfo * item = container->GetObjectInfo( i );
+        if ( !item->IsContainer() )
+            files.add( item->GetName() );
+    }
+    files.sort();
+    lString8 baseline;
+    if ( baselineFile ) {
+        LVStreamRef in = LVOpenFileStream( baselineFile, LVOM_READ );
+        if ( in.isNull() ) {
+            printf("cannot read baseline %s\n", baselineFile);
+            return 1;
+        }
+        baseline.append( (int)in->GetSize(), ' ' );
+        in->Read( baseline.modify(), baseline.length(), NULL );
+    }
+    if ( !ldomDocCache::init( Utf8ToUnicode(cacheDir), 0x40000000 ) ) {
+        printf("cannot use cache directory %s\n", cacheDir);
+        return 1;
+    }
+    CRTrace::setMode( CRTRACE_MODE_COUNTERS );
+    lString16 path = Utf8ToUnicode( dir );
+    LVAppendPathDelimiter( path );
+    lString8 json( "{\"books\": [\n" );
+    int regressions = 0;
+    int count = 0;
+    printf("%-32s %-6s %6s", "book", "format", "pages");
+    for ( int m=0; m<CM_COUNT; m++ )
+        printf(" %*s", (int)strlen(corpusMetricNames[m]), corpusMetricNames[m]);
+    printf("\n");
+    for ( int i=0; i<files.length(); i++ ) {
+        lString8 name = UnicodeToUtf8( files[i] );
+        double metrics[CM_COUNT];
+        lString8 format;
+        int pages = 0;
+        bool ok = true;
+        for ( int run=0; run<CRBENCH_CORPUS_RUNS && ok; run++ ) {
+            double runMetrics[CM_COUNT];
+            ok = benchCorpusBook( path + files[i], runMetrics, format, pages );
+            for ( int m=0; m<CM_COUNT; m++ ) {
+                if ( !run || runMetrics[m] < metrics[m] )
+                    metrics[m] = runMetrics[m];
+            }
+        }
+        if ( !ok ) {
+            printf("%-32s cannot open\n", name.c_str());
+            continue;
+        }
+        char buf[128];
+        sprintf( buf, "%s{\"file\": \"", count++ ? ",\n" : "" );
+        json << buf << jsonEscape( name );
+        sprintf( buf, "\", \"format\": \"%s\", \"pages\": %d", format.c_str(), pages );
+        json << buf;
+        printf("%-32s %-6s %6d", name.c_str(), format.c_str(), pages);
+        for ( int m=0; m<CM_COUNT; m++ ) {
+            sprintf( buf, m==CM_PEAK_RSS ? ", \"%s\": %.0f" : ", \"%s\": %.2f", corpusMetricNames[m], metrics[m] );
+            json << buf;
+            printf(" %*.*f", (int)strlen(corpusMetricNames[m]), m==CM_PEAK_RSS ? 0 : 1, metrics[m]);
+        }
+        json << "}";
+        printf("\n");
+        if ( baseline.empty() )
+            continue;
+        // times of a few ms are too noisy to compare
+        for ( int m=0; m<CM_COUNT; m++ ) {
+            double base = findBaselineMetric( baseline, name, corpusMetricNames[m] );
+            if ( base < (m==CM_PEAK_RSS ? 1024 : 5) )
+                continue;
+            double change = (metrics[m] - base) * 100 / base;
+            if ( change > CRBENCH_REGRESSION_PERCENT ) {
+                printf("  regression: %s %.1f -> %.1f (+%.0f%%)\n", corpusMetricNames[m], base, metrics[m], change);
+                regressions++;
+            } else if ( change < -CRBENCH_REGRESSION_PERCENT ) {
+                printf("  improvement: %s %.1f -> %.1f (%.0f%%)\n", corpusMetricNames[m], base, metrics[m], change);
+            }
+        }
+    }
+    json << "\n]}\n";
+    CRTrace::setMode( CRTRACE_MODE_OFF );
+    ldomDocCache::clear();
+    ldomDocCache::close();
+    if ( resultsFile ) {
+        LVStreamRef out = LVOpenFileStream( resultsFile, LVOM_WRITE );
+        if ( out.isNull() || out->Write( json.c_str(), json.length(), NULL ) != LVERR_OK ) {
+            printf("cannot write %s\n", resultsFile);
+            return 1;
+        }
+    }
+    if ( regressions ) {
+        printf("%d regressions over %d%% against baseline\n", regressions, CRBENCH_REGRESSION_PERCENT);
+        return 2;
+    }
+    return 0;
+}
+
+/// heap allocations made by a full render of a book
+static int benchAllocs( const char * fileName )
+{
+#ifdef CRBENCH_COUNT_ALLOCS
+    LVDocView view( 4, true );
+    view.Resize( 600, 800 );
+    view.setStyleSheet( lString8("body, section, title, p { display: block }") );
+    if ( !view.LoadDocument( fileName ) ) {
+        printf("cannot open document %s\n", fileName);
+        return 1;
+    }
+    allocCount = 0;
+    allocCounting = true;
+    startTimer();
+    view.checkRender();
+    lUInt64 t = elapsed();
+    allocCounting = false;
+    printf("allocs: %d pages  %ld allocations  %d ms  full render\n", view.getPageCount(), allocCount, (int)t);
+    return 0;
+#else
+    CR_UNUSED(fileName);
+    printf("allocs: allocations can only be counted with glibc\n");
+    return 1;
+#endif
+}
+
+/// draws image file scaled to width, nearest neighbour vs smooth scaling
+static int benchImages( const char * fileName, int width, int iterations )
+{
+    LVStreamRef stream = LVOpenFileStream( fileName, LVOM_READ );
+    LVImageSourceRef img = stream.isNull() ? LVImageSourceRef() : LVCreateStreamImageSource( stream );
+    if ( img.isNull() || img->GetWidth()<=0 || img->GetHeight()<=0 ) {
+        printf("cannot open image %s\n", fileName);
+        return 1;
+    }
+    int height = (int)((lInt64)img->GetHeight() * width / img->GetWidth());
+    if ( height<1 )
+        height = 1;
+    for ( int pass=0; pass<2; pass++ ) {
+        LVColorDrawBuf buf( width, height, 32 );
+        buf.setSmoothScalingImages( pass==1 );
+        long peak = -1;
+#ifdef CRBENCH_COUNT_ALLOCS
+        allocBytes = 0;
+        allocPeak = 0;
+        allocCounting = true;
+        buf.Draw( img, 0, 0, width, height, false );
+        allocCounting = false;
+        peak = allocPeak;
+#endif
+        startTimer();
+        for ( int i=0; i<iterations; i++ )
+            buf.Draw( img, 0, 0, width, height, false );
+        lUInt64 t = elapsed();
+        printf("images: %s  %dx%d -> %dx%d  %.1f ms per draw  peak heap %ld KB\n", pass ? "smooth " : "nearest",
+               img->GetWidth(), img->GetHeight(), width, height, (double)t / iterations, peak >= 0 ? peak / 1024 : -1);
+    }
+    return 0;
+}
+
+/// benchmark of SVG image drawn on each page change: new image source per draw, as documents do
+static int benchSvg( const char * fileName, int width, int iterations )
+{
+    LVStreamRef stream = LVOpenFileStream( fileName, LVOM_READ );
+    LVImageSourceRef img = stream.isNull() ? LVImageSourceRef() : LVCreateStreamImageSource( stream );
+    if ( img.isNull() || img->GetWidth()<=0 || img->GetHeight()<=0 ) {
+        printf("cannot open SVG image %s\n", fileName);
+        return 1;
+    }
+    int height = (int)((lInt64)img->GetHeight() * width / img->GetWidth());
+    if ( height<1 )
+        height = 1;
+    img.Clear();
+    LVColorDrawBuf buf( width, height, 32 );
+    buf.setSmoothScalingImages( true );
+    for ( int pass=0; pass<2; pass++ ) {
+        startTimer();
+        for ( int i=0; i<iterations; i++ ) {
+            // first pass drops parsed images, as on every draw before
+            if ( !pass )
+                CRMemoryGovernor::trim( CRMEM_TRIM_COMPLETE );
+            stream->SetPos( 0 );
+            img = LVCreateStreamImageSource( stream );
+            buf.Draw( img, 0, 0, width, height, false );
+            img.Clear();
+        }
+        lUInt64 t = elapsed();
+        CRMemoryStats stats = CRMemoryGovernor::getStats( CRMEM_SVG_IMAGES );
+        printf("svg: %s  %dx%d  %.2f ms per draw  parsed images %d KB  cache hits %d\n", pass ? "cached  " : "reparsed",
+               width, height, (double)t / iterations, (int)(stats.used / 1024), (int)stats.hits);
+    }
+    return 0;
+}
+
+/// benchmark of full screen draw buffer rotation and area average downscaling
+static int benchRotate( int dx, int dy, int iterations )
+{
+    static const int bpps[] = { 1, 2, 4, 8, 16, 32 };
+    static const cr_rotate_angle_t angles[] = { CR_ROTATE_ANGLE_90, CR_ROTATE_ANGLE_180, CR_ROTATE_ANGLE_270 };
+    for ( int i=0; i<(int)(sizeof(bpps)/sizeof(bpps[0])); i++ ) {
+        int bpp = bpps[i];
+        LVAutoPtr<LVDrawBuf> buf;
+        if ( bpp >= 16 )
+            buf = new LVColorDrawBuf( dx, dy, bpp );
+        else
+            buf = new LVGrayDrawBuf( dx, dy, bpp );
+        buf->FillRect( 0, 0, dx, dy, 0xFFFFFF );
+        buf->FillRect( dx / 4, dy / 4, dx / 2, dy / 2, 0x404040 );
+        printf("rotate: %2d bpp  %dx%d ", bpp, dx, dy);
+        for ( int a=0; a<3; a++ ) {
+            startTimer();
+            // even count of turns keeps buffer size for next angle
+            for ( int n=0; n<iterations * 2; n++ )
+                buf->Rotate( angles[a] );
+            printf(" %3d: %.2f ms", a==0 ? 90 : a==1 ? 180 : 270, (double)elapsed() / (iterations * 2));
+        }
+        printf("\n");
+    }
+    for ( int bpp=8; bpp<=32; bpp+=24 ) {
+        LVColorDrawBuf src( dx * 2, dy * 2, 32 );
+        src.FillRect( 0, 0, dx * 2, dy * 2, 0xFFFFFF );
+        src.FillRect( dx / 2, dy / 2, dx, dy, 0x204080 );
+        LVAutoPtr<LVDrawBuf> dst;
+        if ( bpp >= 16 )
+            dst = new LVColorDrawBuf( dx, dy, bpp );
+        else
+            dst = new LVGrayDrawBuf( dx, dy, bpp );
+        startTimer();
+        for ( int n=0; n<iterations; n++ )
+            dst->DrawRescaled( &src, 0, 0, dx, dy, 0 );
+        printf("rescale: 32 -> %2d bpp  %dx%d -> %dx%d  area average %.2f ms\n", bpp, dx * 2, dy * 2, dx, dy,
+               (double)elapsed() / iterations);
+    }
+    return 0;
+}
+
+/// benchmark of book import, with PDB/MOBI text records unpacked ahead on worker threads or not
+static int benchImport( const char * fileName, int iterations )
+{
+    CRConcurrencyProvider * provider = concurrencyProvider;
+    for ( int pass=0; pass<2; pass++ ) {
+        if ( pass && !provider ) {
+            printf("import: built without CR_CONCURRENT_DOCUMENTS, no worker threads\n");
+            break;
+        }
+        // record prefetching is only enabled when a concurrency provider is set
+        concurrencyProvider = pass ? provider : NULL;
+        lUInt64 t = 0;
+        for ( int i=0; i<iterations; i++ ) {
+            LVDocView view( 4, true );
+            view.Resize( 600, 800 );
+            startTimer();
+            if ( !view.LoadDocument( fileName ) ) {
+                concurrencyProvider = provider;
+                printf("cannot open document %s\n", fileName);
+                return 1;
+            }
+            t += elapsed();
+        }
+        printf("import: %s  %d ms  (%d imports)\n", pass ? "worker unpack" : "sequential   ",
+               (int)(t / iterations), iterations);
+    }
+    concurrencyProvider = provider;
+    return 0;
+}
+
+/// benchmark of code reading render rects: full render, full-page draw and hit-testing
+static int benchRects( const char * fileName, int maxPages )
+{
+    const int dx = 600;
+    const int dy = 800;
+    // points hit-tested on each page
+    const int stepX = 20;
+    const int stepY = 16;
+    LVDocView view( 4, true );
+    view.Resize( dx, dy );
+    if ( !view.LoadDocument( fileName ) ) {
+        printf("cannot open document %s\n", fileName);
+        return 1;
+    }
+    startTimer();
+    view.checkRender();
+    lUInt64 tRender = elapsed();
+    LVGrayDrawBuf buf( dx, dy, 4 );
+    int pages = view.getPageCount();
+    if ( pages > maxPages )
+        pages = maxPages;
+    lUInt64 tDraw = 0;
+    lUInt64 tHit = 0;
+    int hits = 0;
+    int found = 0;
+    for ( int i=0; i<pages; i++ ) {
+        view.goToPage( i );
+        startTimer();
+        view.Draw( buf, false );
+        tDraw += elapsed();
+        startTimer();
+        for ( int y=stepY/2; y<dy; y+=stepY ) {
+            for ( int x=stepX/2; x<dx; x+=stepX ) {
+                if ( !view.getNodeByPoint( lvPoint(x, y) ).isNull() )
+                    found++;
+                hits++;
+            }
+        }
+        tHit += elapsed();
+    }
+    printf("rects: render %d ms  draw %d pages %d ms (%.2f ms/page)  hit-test %d points %d ms (%.1f us/point, %d found)\n",
+           (int)tRender, pages, (int)tDraw, pages ? (double)tDraw / pages : 0,
+           hits, (int)tHit, hits ? (double)tHit * 1000 / hits : 0, found);
+    return 0;
+}
+
+/// returns FB2 with tables nested depth levels deep, as found in converted DOCX files
+static lString8 makeNestedTables( int depth, int rows )
+{
+    // FB2: HTML parser would close outer table rows on nested <tr>
+    lString8 cell("<p>Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor.</p>");
+    lString8 fb2("<?xml version=\"1.0\" encoding=\"utf-8\"?>"
+                 "<FictionBook xmlns=\"http://www.gribuser.ru/xml/fictionbook/2.0\"><body><section>");
+    for ( int level=0; level<depth; level++ ) {
+        fb2 << "<table>";
+        for ( int r=1; r<rows; r++ )
+            fb2 << "<tr><td>" << cell << "</td></tr>";
+        // last row holds next level
+        fb2 << "<tr><td>";
+    }
+    fb2 << cell;
+    for ( int level=0; level<depth; level++ )
+        fb2 << "</td></tr></table>";
+    fb2 << "</section></body></FictionBook>";
+    return fb2;
+}
+
+/// benchmark of rendering nested tables, which measure widths of nested content at each level
+static int benchTables( int maxDepth, int rows )
+{
+    CRTraceMode mode = CRTrace::getMode();
+    CRTrace::setMode( CRTRACE_MODE_COUNTERS );
+    for ( int depth=1; ; depth = depth*2<maxDepth ? depth*2 : maxDepth ) {
+        LVDocView view( 4, true );
+        view.Resize( 600, 800 );
+        view.setStyleSheet( lString8("body, section, p { display: block } table { display: table } "
+                                     "tr { display: table-row } td { display: table-cell; padding: 2px }") );
+        if ( !view.LoadDocument( LVCreateStringStream( makeNestedTables( depth, rows ) ) ) ) {
+            printf("tables: cannot open generated document\n");
+            CRTrace::setMode( mode );
+            return 1;
+        }
+        CRTrace::reset();
+        startTimer();
+        view.checkRender();
+        lUInt64 t = elapsed();
+        printf("tables: depth %2d  %d rows  %5d ms  %d pages  %d widths cache hits\n", depth, rows, (int)t,
+               view.getPageCount(), (int)CRTrace::getStats( CRTRACE_WIDTHS_CACHE_HIT ).count);
+        if ( depth >= maxDepth )
+            break;
+    }
+    CRTrace::setMode( mode );
+    return 0;
+}
+
+/// benchmark of scroll mode frames: direct drawing vs composing cached document strips
+static int benchScroll( const char * fileName, int frames, int step )
+{
+    const int dx = 600;
+    const int dy = 800;
+    // frame time budget of smooth scrolling, 60 fps
+    const int frameBudgetMs = 16;
+    LVDocView view( 4, true );
+    view.setViewMode( DVM_SCROLL );
+    view.Resize( dx, dy );
+    if ( !view.LoadDocument( fileName ) ) {
+        printf("cannot open document %s\n", fileName);
+        return 1;
+    }
+    view.checkRender();
+    LVGrayDrawBuf buf( dx, dy, 4 );
+    buf.setHidePartialGlyphs( false );
+    int fullHeight = view.GetFullHeight();
+#if (CR_CONCURRENT_DOCUMENTS==1)
+    CRBenchConcurrencyProvider * provider = (CRBenchConcurrencyProvider *)concurrencyProvider;
+    provider->setQueueGui( true );
+#endif
+    for ( int tiles=0; tiles<2; tiles++ ) {
+        view.setScrollTileCacheEnabled( tiles!=0 );
+        view.SetPos( 0, false );
+        view.Draw( buf, false );
+        lUInt64 total = 0;
+        int maxMs = 0;
+        int slow = 0;
+        int idleTasks = 0;
+        int pos = 0;
+        for ( int i=0; i<frames; i++ ) {
+            pos += step;
+            if ( pos + dy > fullHeight )
+                pos = 0;
+            view.SetPos( pos, false );
+            startTimer();
+            view.Draw( buf, false );
+            int ms = (int)elapsed();
+            total += ms;
+            if ( ms > maxMs )
+                maxMs = ms;
+            if ( ms > frameBudgetMs )
+                slow++;
+#if (CR_CONCURRENT_DOCUMENTS==1)
+            // GUI loop is idle between frames
+            idleTasks += provider->runGuiTasks();
+#endif
+        }
+        printf("scroll: tiles %-3s  %d frames of %d px  avg %.2f ms  max %d ms  %d frames over %d ms  %d idle tasks\n",
+               tiles ? "on" : "off", frames, step, frames ? (double)total / frames : 0, maxMs, slow,
+               frameBudgetMs, idleTasks);
+    }
+#if (CR_CONCURRENT_DOCUMENTS==1)
+    provider->setQueueGui( false );
+#endif
+    return 0;
+}
+
+/// benchmark of two page mode: both pages of spread drawn one after other vs at once
+static int benchSpread( const char * fileName, int maxSpreads, int bpp )
+{
+    const int dx = 1200;
+    const int dy = 800;
+    LVDocView view( bpp, true );
+    view.setVisiblePageCount( 2 );
+    // no clock: the same header is drawn by both ways
+    view.setPageHeaderInfo( PGHDR_PAGE_NUMBER | PGHDR_PAGE_COUNT | PGHDR_AUTHOR | PGHDR_TITLE | PGHDR_CHAPTER_MARKS );
+    view.Resize( dx, dy );
+    if ( !view.LoadDocument( fileName ) ) {
+        printf("cannot open document %s\n", fileName);
+        return 1;
+    }
+    view.checkRender();
+    LVAutoPtr<LVDrawBuf> serial;
+    LVAutoPtr<LVDrawBuf> spread;
+    if ( bpp >= 16 ) {
+        serial = new LVColorDrawBuf( dx, dy, bpp );
+        spread = new LVColorDrawBuf( dx, dy, bpp );
+    } else {
+        serial = new LVGrayDrawBuf( dx, dy, bpp );
+        spread = new LVGrayDrawBuf( dx, dy, bpp );
+    }
+    int spreads = (view.getPageCount() + 1) / 2;
+    if ( spreads > maxSpreads )
+        spreads = maxSpreads;
+    lUInt64 tSerial = 0;
+    lUInt64 tSpread = 0;
+    int diffs = 0;
+    for ( int i=0; i<spreads; i++ ) {
+        view.goToPage( i * 2 );
+#if (CR_CONCURRENT_DOCUMENTS==1)
+        view.setConcurrentSpreadDrawing( false );
+#endif
+        // formatted blocks are cached by first drawing
+        view.Draw( *serial, false );
+        startTimer();
+        view.Draw( *serial, false );
+        tSerial += elapsed();
+#if (CR_CONCURRENT_DOCUMENTS==1)
+        view.setConcurrentSpreadDrawing( true );
+#endif
+        startTimer();
+        view.Draw( *spread, false );
+        tSpread += elapsed();
+        if ( memcmp( serial->GetScanLine(0), spread->GetScanLine(0), serial->GetRowSize() * dy ) )
+            diffs++;
+    }
+#if (CR_CONCURRENT_DOCUMENTS!=1)
+    printf("spread: built without CR_CONCURRENT_DOCUMENTS, pages are drawn one after other\n");
+#endif
+    printf("spread: %d bpp  %d spreads  one after other %d ms  at once %d ms  %d spreads differ\n",
+           bpp, spreads, (int)tSerial, (int)tSpread, diffs);
+    return diffs ? 1 : 0;
+}
+
+/// benchmark of drawing pages to low bpp buffer: directly vs 8 bit gray quantized by one final pass
+static int benchDither( const char * fileName, int maxPages, int bpp )
+{
+    const int dx = 600;
+    const int dy = 800;
+    static const char * modeNames[] = { "direct", "ordered", "diffusion" };
+    LVDocView view( bpp, true );
+    view.Resize( dx, dy );
+    if ( !view.LoadDocument( fileName ) ) {
+        printf("cannot open document %s\n", fileName);
+        return 1;
+    }
+    view.checkRender();
+    LVGrayDrawBuf buf( dx, dy, bpp );
+    int pages = view.getPageCount();
+    if ( pages > maxPages )
+        pages = maxPages;
+    CRTraceMode mode = CRTrace::getMode();
+    CRTrace::setMode( CRTRACE_MODE_COUNTERS );
+    for ( int m=CR_DITHER_NONE; m<=CR_DITHER_DIFFUSION; m++ ) {
+        view.setPageDitherMode( (cr_dither_mode_t)m );
+        // formatted blocks are cached by first drawing
+        view.goToPage( 0 );
+        view.Draw( buf, false );
+        CRTrace::reset();
+        startTimer();
+        for ( int i=0; i<pages; i++ ) {
+            view.goToPage( i );
+            view.Draw( buf, false );
+        }
+        lUInt64 t = elapsed();
+        CRTraceStats quantize = CRTrace::getStats( CRTRACE_DRAW_QUANTIZE );
+        printf("dither: %d bpp  %-9s  %d pages  %d ms  %.2f ms per page  quantize pass %.2f ms per page\n",
+               bpp, modeNames[m], pages, (int)t, pages ? (double)t / pages : 0,
+               quantize.count ? quantize.totalUs / 1000.0 / quantize.count : 0);
+    }
+    CRTrace::setMode( mode );
+    return 0;
+}
+
+/// scans directory of books into library index, then scans it again: only changed files are read
+static int benchLibrary( const char * dir, const char * indexFile, int threads )
+{
+    LVDeleteFile( lString8(indexFile) );
+    CRLibraryScanner scanner( threads );
+    for ( int pass=0; pass<2; pass++ ) {
+        CRLibraryIndex index;
+        index.open( Utf8ToUnicode(indexFile) );
+        startTimer();
+        CRLibraryScanStats stats = scanner.scan( index, Utf8ToUnicode(dir) );
+        lUInt64 tScan = elapsed();
+        startTimer();
+        if ( !index.save() ) {
+            printf("cannot write library index %s\n", indexFile);
+            return 1;
+        }
+        lUInt64 tSave = elapsed();
+        int covers = 0;
+        for ( int i=0; i<index.length(); i++ ) {
+            LVColorDrawBuf * cover = index.getCover( index.get(i) );
+            if ( cover )
+                covers++;
+            delete cover;
+        }
+        printf("library: %s  %d files  %d unchanged  %d read  %d books  %d covers  scan %d ms  save %d ms\n",
+               pass ? "rescan" : "scan  ", stats.files, stats.unchanged, stats.scanned, stats.books, covers,
+               (int)tScan, (int)tSave);
+        if ( pass && stats.scanned ) {
+            printf("library: rescan read %d unchanged files\n", stats.scanned);
+            return 1;
+        }
+    }
+#if (CR_CONCURRENT_DOCUMENTS!=1)
+    printf("library: built without CR_CONCURRENT_DOCUMENTS, files are read by one thread\n");
+#endif
+    return 0;
+}
+
+static void usage()
+{
+    printf("usage: crbench <command> [options]\n"
+           "commands:\n"
+           "  selftest                    run engine self tests\n"
+           "  glyphs <font.ttf> [pages]   draw full pages of text into 1..32 bpp buffers\n"
+           "  kerning <font.ttf> [iterations]\n"
+           "                              measure and draw paragraph without kerning and with freetype kerning\n"
+           "  docs <book> [threads] [pages]\n"
+           "                              open, render and draw a book on 1..N threads at once\n"
+           "  restyle <book> [element] [renders]\n"
+           "                              toggle a style tweak on one element name, targeted vs full restyle\n"
+           "  reopen <book> <cachedir> [opens]\n"
+           "                              open a book from its cache file vs parsing it\n"
+           "  allocs <book>               count heap allocations of a full render\n"
+           "  import <book> [imports]     import a book with and without PDB records unpacked on worker threads\n"
+           "  corpus <dir> <cachedir> [results.json] [baseline.json]\n"
+           "                              time load phases of each book in directory, compare with baseline results\n"
+           "  trace <book> <cachedir> <trace.json> [pages]\n"
+           "                              print engine phase counters, write Chrome trace of open, paging and reopen\n"
+           "  memory <book> <cachedir> <budgetKB> [pages]\n"
+           "                              page through a book with memory budget of engine caches, then trim them\n"
+           "  rects <book> [pages]        time full render, page drawing and hit-testing of points\n"
+           "  tables [depth] [rows]       render tables nested 1..depth levels deep\n"
+           "  spread <book> [spreads] [bpp]\n"
+           "                              draw both pages of two page mode one after other vs at once\n"
+           "  scroll <book> [frames] [step]\n"
+           "                              scroll frames of step pixels, direct drawing vs cached strips\n"
+           "  library <dir> <index> [threads]\n"
+           "                              read metadata and covers of books in directory into index, then rescan\n"
+           "  images <image> [width] [draws]\n"
+           "                              draw image scaled to width, nearest neighbour vs smooth scaling\n"
+           "  svg <image.svg> [width] [draws]\n"
+           "                              draw SVG image from new image source each time, reparsed vs cached\n"
+           "  rotate [width] [height] [iterations]\n"
+           "                              rotate full screen 1..32 bpp buffers, downscale 2x by area average\n"
+           "  dither <book> [pages] [bpp]\n"
+           "                              draw pages directly vs 8 bit gray quantized by ordered dithering, error diffusion\n");
+}
+
+int main( int argc, char * argv[] )
+{
+    if ( argc<2 ) {
+        usage();
+        return 1;
+    }
+    CRLog::setStdoutLogger();
+    CRLog::setLogLevel( CRLog::LL_ERROR );
+#if (CR_CONCURRENT_DOCUMENTS==1)
+    concurrencyProvider = new CRBenchConcurrencyProvider();
+    CRSetupEngineConcurrency();
+#endif
+    InitFontManager( lString8::empty_str );
+    int res = 0;
+    if ( !strcmp(argv[1], "selftest") ) {
+        CRLog::setLogLevel( CRLog::LL_INFO );
+        runDrawBufUnitTests();
+        runImageUnitTests();
+        runStyleSheetUnitTests();
+        runStyleInvalidationUnitTests();
+        runMemoryGovernorUnitTests();
+        runGuiUnitTests();
+        printf("selftest: ok\n");
+    } else if ( !strcmp(argv[1], "glyphs") && argc>=3 ) {
+        res = benchGlyphs( argv[2], argc>=4 ? atoi(argv[3]) : 100 );
+    } else if ( !strcmp(argv[1], "kerning") && argc>=3 ) {
+        res = benchKerning( argv[2], argc>=4 ? atoi(argv[3]) : 200 );
+    } else if ( !strcmp(argv[1], "docs") && argc>=3 ) {
+        res = benchDocs( argv[2], argc>=4 ? atoi(argv[3]) : 4, argc>=5 ? atoi(argv[4]) : 20 );
+    } else if ( !strcmp(argv[1], "restyle") && argc>=3 ) {
+        res = benchRestyle( argv[2], argc>=4 ? argv[3] : "emphasis", argc>=5 ? atoi(argv[4]) : 10 );
+    } else if ( !strcmp(argv[1], "allocs") && argc>=3 ) {
+        res = benchAllocs( argv[2] );
+    } else if ( !strcmp(argv[1], "import") && argc>=3 ) {
+        res = benchImport( argv[2], argc>=4 ? atoi(argv[3]) : 5 );
+    } else if ( !strcmp(argv[1], "corpus") && argc>=4 ) {
+        res = benchCorpus( argv[2], argv[3], argc>=5 ? argv[4] : NULL, argc>=6 ? argv[5] : NULL );
+    } else if ( !strcmp(argv[1], "trace") && argc>=5 ) {
+        res = benchTrace( argv[2], argv[3], argv[4], argc>=6 ? atoi(argv[5]) : 20 );
+    } else if ( !strcmp(argv[1], "memory") && argc>=5 ) {
+        res = benchMemory( argv[2], argv[3], atoi(argv[4]), argc>=6 ? atoi(argv[5]) : 50 );
+    } else if ( !strcmp(argv[1], "rects") && argc>=3 ) {
+        res = benchRects( argv[2], argc>=4 ? atoi(argv[3]) : 100 );
+    } else if ( !strcmp(argv[1], "tables") ) {
+        res = benchTables( argc>=3 ? atoi(argv[2]) : 32, argc>=4 ? atoi(argv[3]) : 3 );
+    } else if ( !strcmp(argv[1], "spread") && argc>=3 ) {
+        res = benchSpread( argv[2], argc>=4 ? atoi(argv[3]) : 100, argc>=5 ? atoi(argv[4]) : 4 );
+    } else if ( !strcmp(argv[1], "scroll") && argc>=3 ) {
+        res = benchScroll( argv[2], argc>=4 ? atoi(argv[3]) : 300, argc>=5 ? atoi(argv[4]) : 12 );
+    } else if ( !strcmp(argv[1], "library") && argc>=4 ) {
+        res = benchLibrary( argv[2], argv[3], argc>=5 ? atoi(argv[4]) : CR_LIBRARY_SCAN_THREADS );
+    } else if ( !strcmp(argv[1], "images") && argc>=3 ) {
+        res = benchImages( argv[2], argc>=4 ? atoi(argv[3]) : 600, argc>=5 ? atoi(argv[4]) : 10 );
+    } else if ( !strcmp(argv[1], "svg") && argc>=3 ) {
+        res = benchSvg( argv[2], argc>=4 ? atoi(argv[3]) : 600, argc>=5 ? atoi(argv[4]) : 20 );
+    } else if ( !strcmp(argv[1], "rotate") ) {
+        res = benchRotate( argc>=3 ? atoi(argv[2]) : 600, argc>=4 ? atoi(argv[3]) : 800, argc>=5 ? atoi(argv[4]) : 10 );
+    } else if ( !strcmp(argv[1], "dither") && argc>=3 ) {
+        res = benchDither( argv[2], argc>=4 ? atoi(argv[3]) : 50, argc>=5 ? atoi(argv[4]) : 2 );
+    } else if ( !strcmp(argv[1], "reopen") && argc>=4 ) {
+        res = benchReopen( argv[2], argv[3], argc>=5 ? atoi(argv[4]) : 5 );
+    } else {
+        usage();
+        res = 1;
+    }
+    ShutdownFontManager();
+    return res;
+}
@@ -391,7 +391,7 @@ class CRGUIScreen
         virtual void draw( LVDrawBuf * img, int x = 0, int y = 0) = 0;
         /// transfers contents of buffer to device, if full==true, redraws whole screen, otherwise only changed area
         virtual void flush( bool full ) = 0;
-        /// invalidates rectangle: add it to bounding box of next partial update
+        /// invalidates rectangle: add it to damage region of next partial update
         virtual void invalidateRect( const lvRect & rc ) { }
         virtual ~CRGUIScreen() { }
 };
@@ -740,19 +740,54 @@ class CRGUIWindowBase : public CRGUIWindow
         virtual ~CRGUIWindowBase() { }
 };
 
+/// maximum number of rectangles in damage region, closest ones are merged above it
+#define CRGUI_MAX_DAMAGE_RECTS 8
+
+/// Screen area to update, a few separate rectangles instead of their bounding box
+/**
+    Rectangles are widened to multiples of 8 pixels, and overlapping or touching
+    ones are merged, so no byte of a packed 1/2 bpp draw buffer row is shared by
+    two of them (3/4/8 bpp gray buffers take byte per pixel).
+*/
+class CRGUIDamageRegion
+{
+        LVArray<lvRect> _rects;
+    public:
+        /// adds rectangle to region
+        void add( const lvRect & rc );
+        /// removes all rectangles
+        void clear() { _rects.reset(); }
+        /// returns true if region is empty
+        bool isEmpty() const { return _rects.empty(); }
+        /// returns number of rectangles
+        int length() const { return _rects.length(); }
+        /// returns rectangle by index
+        lvRect get( int index ) const { return _rects[index]; }
+        /// returns bounding box of region
+        lvRect getBounds() const;
+};
+
 /// Base Screen class implementation
 class CRGUIScreenBase : public CRGUIScreen
 {
     protected:
         int _width;
         int _height;
-        lvRect _updateRect;
+        CRGUIDamageRegion _damage;
         LVRef<LVDrawBuf> _canvas;
         LVRef<LVDrawBuf> _front;
         int _fullUpdateInterval;
         int _fullUpdateCounter;
+        int _tileSize;
+        int _lastFlushPixels;
+        int _lastFlushRects;
+        lUInt64 _totalFlushPixels;
         /// override in ancessor to transfer image to device
         virtual void update( const lvRect & rc, bool full ) = 0;
+        /// copies changed rows of rectangle to front buffer, returns their bounding box
+        lvRect copyChangedRows( const lvRect & rc );
+        /// passes rectangle to update() and counts its pixels
+        void flushRect( const lvRect & rc, bool full );
     public:
         /// fast update feature parameter setting
         virtual void setFullUpdateInterval( int pagesBeforeFullupdate=1 )
@@ -812,15 +847,27 @@ class CRGUIScreenBase : public CRGUIScreen
         }
         /// transfers contents of buffer to device, if full==true, redraws whole screen, otherwise only changed area
         virtual void flush( bool full );
-        /// invalidates rectangle: add it to bounding box of next partial update
+        /// invalidates rectangle: add it to damage region of next partial update
         virtual void invalidateRect( const lvRect & rc )
         {
-            _updateRect.extend( rc );
+            _damage.add( rc );
         }
+        /// with front buffer, compare damaged area by tiles of this size (multiple of 8) and update changed tiles only; 0 to compare by rows
+        void setTileDiffSize( int tileSize ) { _tileSize = tileSize>0 ? (tileSize + 7) & ~7 : 0; }
+        /// returns number of pixels transferred to device by last flush()
+        int getLastFlushPixels() { return _lastFlushPixels; }
+        /// returns number of update() calls made by last flush()
+        int getLastFlushRects() { return _lastFlushRects; }
+        /// returns number of pixels transferred to device since screen creation
+        lUInt64 getTotalFlushPixels() { return _totalFlushPixels; }
         CRGUIScreenBase( int width, int height, bool doublebuffer  )
         : _width( width ), _height( height ), _canvas(NULL), _front(NULL)
         , _fullUpdateInterval(1)
         , _fullUpdateCounter(1)
+        , _tileSize(0)
+        , _lastFlushPixels(0)
+        , _lastFlushRects(0)
+        , _totalFlushPixels(0)
         {
             if ( width && height ) {
                 _canvas = LVRef<LVDrawBuf>( createCanvas( width, height ) );
@@ -1209,5 +1256,7 @@ public:
     virtual bool isForVisibleOnly() { return true; }
 };
 
+/// self tests of CRGUIScreenBase damage updates at each draw buffer depth
+void runGuiUnitTests();
 
 #endif// CR_GUI_INCLUDED
@@ -0,0 +1,140 @@
+/** \file crlibscan.h
+    \brief metadata and cover index of book library
+
+    This source code is distributed under the terms of
+    GNU General Public License.
+
+    See LICENSE file for details.
+
+*/
+
+#ifndef __CRLIBSCAN_H_INCLUDED__
+#define __CRLIBSCAN_H_INCLUDED__
+
+#include "lvtypes.h"
+#include "lvstring.h"
+#include "lvarray.h"
+#include "lvptrvec.h"
+#include "lvhashtable.h"
+#include "lvstream.h"
+
+class LVColorDrawBuf;
+class CRMutex;
+
+/// default size of cover thumbnails kept in library index
+#define CR_LIBRARY_COVER_WIDTH 96
+#define CR_LIBRARY_COVER_HEIGHT 128
+/// default number of threads reading books, including calling thread
+#define CR_LIBRARY_SCAN_THREADS 4
+
+/// metadata of single book in library index
+class CRBookInfo
+{
+public:
+    lString16 fileName;     ///< file on disk: the book itself, or archive containing it
+    lString16 itemName;     ///< path of book inside archive, empty if book is not in archive
+    lUInt64 fileSize;       ///< size of fileName when scanned
+    lUInt64 fileTime;       ///< modification time of fileName when scanned
+    int format;             ///< doc_format_t, doc_format_none for file which is not a readable book
+    lString16 title;
+    lString16 authors;
+    lString16 series;
+    int seriesNumber;
+    lString16 language;
+    int coverWidth;         ///< size of cover thumbnail, 0 if book has no cover
+    int coverHeight;
+    LVArray<lUInt8> cover;  ///< deflated 16 bpp thumbnail pixels, kept in memory until index is saved
+    lUInt32 coverOffset;    ///< position of deflated thumbnail in covers part of index file
+    lUInt32 coverSize;      ///< size of deflated thumbnail in index file, 0 if not saved yet
+    CRBookInfo( const lString16 & fn, lUInt64 sz, lUInt64 tm )
+        : fileName(fn), fileSize(sz), fileTime(tm), format(0), seriesNumber(0)
+        , coverWidth(0), coverHeight(0), coverOffset(0), coverSize(0) { }
+    /// returns path for LVDocView::LoadDocument(): archive and item joined with @/
+    lString16 getPathName() const;
+};
+
+/// persistent list of scanned books, keyed by path, size and modification time
+/**
+    File keeps all metadata first, then deflated cover thumbnails: open()
+    reads only metadata, getCover() reads thumbnails from file on demand.
+    Files which are not readable books are kept too (with doc_format_none),
+    to not read them again on every scan.
+
+    Index is not thread safe, CRLibraryScanner changes it from calling thread only.
+*/
+class CRLibraryIndex
+{
+    lString16 _fileName;
+    LVStreamRef _stream;
+    lUInt32 _coversStart;
+    LVPtrVector<CRBookInfo> _books;
+    LVHashTable<lString16, CRBookInfo *> _byFile;
+    LVHashTable<lString16, CRBookInfo *> _byPath;
+    bool _changed;
+    void removeFile( const lString16 & fileName );
+    bool readCover( CRBookInfo * book, LVArray<lUInt8> & data );
+public:
+    CRLibraryIndex();
+    ~CRLibraryIndex();
+    /// reads index from file; missing or damaged file gives empty index which will be saved to this file
+    bool open( const lString16 & fileName );
+    /// writes index to file if changed since last open/save
+    bool save();
+    /// returns number of entries, including files which are not books
+    int length() { return _books.length(); }
+    /// returns entry by index
+    CRBookInfo * get( int index ) { return _books[index]; }
+    /// finds book by path, as returned by CRBookInfo::getPathName()
+    CRBookInfo * find( const lString16 & pathName ) { return _byPath.get( pathName ); }
+    /// returns true if file has entries scanned with same size and modification time
+    bool isUpToDate( const lString16 & fileName, lUInt64 fileSize, lUInt64 fileTime );
+    /// replaces entries of file with new ones, takes ownership of books
+    void update( const lString16 & fileName, LVPtrVector<CRBookInfo> & books );
+    /// removes entries of files in directory (and subdirectories) which are not in seen list, returns number of removed files
+    int removeMissing( const lString16 & dir, LVHashTable<lString16, bool> & seen );
+    /// returns new 16 bpp buffer with cover thumbnail of book, NULL if book has no cover
+    LVColorDrawBuf * getCover( CRBookInfo * book );
+};
+
+/// result of CRLibraryScanner::scan()
+struct CRLibraryScanStats {
+    int files;      ///< book and archive files found
+    int unchanged;  ///< files with entries of same size and modification time in index
+    int scanned;    ///< new and changed files read
+    int removed;    ///< files which are gone, their entries are removed from index
+    int books;      ///< readable books in index after scan
+    CRLibraryScanStats() : files(0), unchanged(0), scanned(0), removed(0), books(0) { }
+};
+
+/// reads metadata and covers of books in directories into CRLibraryIndex
+/**
+    Each format is read the cheapest way: EPUB only reads OPF package,
+    FB2 parses description only, PDB/MOBI reads header records without
+    unpacking text. Other formats are loaded by LVDocView with metadataOnly
+    flag, one at a time, since they can use document cache. ZIP archives
+    give entry per book inside.
+
+    In CR_CONCURRENT_DOCUMENTS builds files are read by worker threads
+    of concurrencyProvider, otherwise by calling thread.
+*/
+class CRLibraryScanner
+{
+    int _threads;
+    int _coverWidth;
+    int _coverHeight;
+    CRMutex * _loadMutex;
+    void findFiles( const lString16 & dir, int level, CRLibraryIndex & index, lString16Collection & files,
+                    LVArray<lUInt64> & sizes, LVArray<lUInt64> & times, LVHashTable<lString16, bool> & seen,
+                    CRLibraryScanStats & stats );
+    void scanBook( LVStreamRef stream, const lString16 & pathName, CRBookInfo * book );
+    void makeCover( LVStreamRef imageStream, CRBookInfo * book );
+public:
+    CRLibraryScanner( int threads = CR_LIBRARY_SCAN_THREADS, int coverWidth = CR_LIBRARY_COVER_WIDTH,
+                      int coverHeight = CR_LIBRARY_COVER_HEIGHT );
+    /// finds books in directory and subdirectories, reads new and changed files into index
+    CRLibraryScanStats scan( CRLibraryIndex & index, const lString16 & dir );
+    /// reads single book or archive, adds entry per book to list; may be called from several threads at once
+    void scanFile( const lString16 & fileName, lUInt64 fileSize, lUInt64 fileTime, LVPtrVector<CRBookInfo> & books );
+};
+
+#endif // __CRLIBSCAN_H_INCLUDED__
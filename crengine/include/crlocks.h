@@ -57,6 +57,11 @@ extern CRMutex * _fontManMutex;
 extern CRMutex * _fontGlyphCacheMutex;
 extern CRMutex * _fontLocalGlyphCacheMutex;
 extern CRMutex * _crengineMutex;
+extern CRMutex * _stringMutex;
+extern CRMutex * _documentMutex;
+extern CRMutex * _memoryMutex;
+extern CRMutex * _styleSheetMutex;
+extern CRMutex * _svgImageCacheMutex;
 
 // use REF_GUARD to acquire LVProtectedRef mutex
 #define REF_GUARD CRGuard _refGuard(_refMutex); CR_UNUSED(_refGuard);
@@ -70,8 +75,23 @@ extern CRMutex * _crengineMutex;
 #define FONT_LOCAL_GLYPH_CACHE_GUARD CRGuard _fontLocalGlyphCacheGuard(_fontLocalGlyphCacheMutex); CR_UNUSED(_fontLocalGlyphCacheGuard);
 // use CRENGINE_GUARD to acquire crengine drawing lock
 #define CRENGINE_GUARD CRGuard _crengineGuard(_crengineMutex); CR_UNUSED(_crengineMutex);
+// use STRING_GUARD to acquire constant strings table mutex
+#define STRING_GUARD CRGuard _stringGuard(_stringMutex); CR_UNUSED(_stringGuard);
+// use DOCUMENT_GUARD to acquire document instances list mutex
+#define DOCUMENT_GUARD CRGuard _documentGuard(_documentMutex); CR_UNUSED(_documentGuard);
+// use MEMORY_GUARD to acquire memory governor consumers list mutex
+#define MEMORY_GUARD CRGuard _memoryGuard(_memoryMutex); CR_UNUSED(_memoryGuard);
+// use STYLESHEET_GUARD to acquire parsed stylesheet layers cache mutex
+#define STYLESHEET_GUARD CRGuard _styleSheetGuard(_styleSheetMutex); CR_UNUSED(_styleSheetGuard);
+// use SVG_IMAGE_CACHE_GUARD to acquire parsed SVG images cache mutex
+#define SVG_IMAGE_CACHE_GUARD CRGuard _svgImageCacheGuard(_svgImageCacheMutex); CR_UNUSED(_svgImageCacheGuard);
 
 /// call to create mutexes for different parts of CoolReader engine
+/**
+    Provider mutexes must be recursive. With CR_CONCURRENT_DOCUMENTS=1, call it
+    before starting threads: then each thread may load, render and draw its own documents.
+    Font, hyphenation and rendering settings must be set up before threads are started.
+*/
 void CRSetupEngineConcurrency();
 
 #endif // CRLOCKS_H
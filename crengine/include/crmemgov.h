@@ -0,0 +1,107 @@
+/** \file crmemgov.h
+    \brief memory budget shared by engine caches
+
+    This source code is distributed under the terms of
+    GNU General Public License.
+
+    See LICENSE file for details.
+
+*/
+
+#ifndef __CRMEMGOV_H_INCLUDED__
+#define __CRMEMGOV_H_INCLUDED__
+
+#include "lvtypes.h"
+#include "lvstring.h"
+
+/// engine caches which share memory budget
+enum CRMemorySubsystem {
+    CRMEM_TEXT_STORAGE,       ///< unpacked text nodes chunks of documents
+    CRMEM_ELEM_STORAGE,       ///< unpacked element chunks of documents
+    CRMEM_RECT_STORAGE,       ///< unpacked rendered rects chunks of documents
+    CRMEM_STYLE_STORAGE,      ///< unpacked element style chunks of documents
+    CRMEM_GLYPH_CACHE,        ///< rendered glyphs
+    CRMEM_PAGE_IMAGES,        ///< prepared page images of document views
+    CRMEM_STREAM_BUFFERS,     ///< read buffers of cached streams
+    CRMEM_SVG_IMAGES,         ///< parsed SVG images
+    CRMEM_SUBSYSTEM_COUNT
+};
+
+/// how much memory CRMemoryGovernor::trim() releases
+enum CRMemoryTrimLevel {
+    CRMEM_TRIM_MODERATE,      ///< halve memory held by each cache
+    CRMEM_TRIM_COMPLETE       ///< release everything caches can recreate
+};
+
+/// cache holding memory on behalf of CRMemoryGovernor
+/**
+    Memory used and hit counters are read by governor from any thread without
+    locking: approximate values are fine. setMemoryLimit() must not lock, use
+    CR_ATOMIC_STORE: consumer applies new limit when it allocates next time.
+    Consumer must not call CRMemoryGovernor while holding its own lock.
+*/
+class CRMemoryConsumer {
+public:
+    /// returns subsystem this consumer belongs to
+    virtual CRMemorySubsystem getMemorySubsystem() = 0;
+    /// returns number of bytes held now
+    virtual int getMemoryUsed() = 0;
+    /// returns number of cache hits since creation
+    virtual int getMemoryHits() = 0;
+    /// sets maximum number of bytes to hold, 0 to use built-in limit
+    virtual void setMemoryLimit( int limit ) = 0;
+    /// releases memory down to target number of bytes, now or on next use
+    virtual void trimMemory( int target ) = 0;
+    virtual ~CRMemoryConsumer() { }
+};
+
+/// accumulated statistics of subsystem
+struct CRMemoryStats {
+    int consumers;    ///< number of registered consumers
+    lUInt64 used;     ///< bytes held by consumers
+    lUInt64 limit;    ///< bytes assigned to subsystem by last rebalance, 0 if no budget is set
+    lUInt64 hits;     ///< cache hits of current consumers
+};
+
+/// distributes memory budget between engine caches
+/**
+    Without budget (default) each cache uses its built-in limit: storage
+    factor, GLYPH_CACHE_SIZE, SVG_IMAGE_CACHE_SIZE and stream buffer size. With budget, rebalance()
+    gives each subsystem a minimal share, and splits the rest proportionally
+    to hits since previous rebalances (older hits are worth less), each hit
+    weighted by approximate cost of making its data again. Share is capped
+    by a small multiple of memory subsystem uses, what capped subsystems
+    can't take goes to others. Subsystem share is divided evenly between
+    its consumers. Until first rebalance, the rest is split evenly.
+
+    Document views call rebalance() after drawing. Call trim() on low memory
+    signal of platform, e.g. from Android onTrimMemory(), from the thread
+    which works with documents: in CR_CONCURRENT_DOCUMENTS builds documents
+    of other threads release their chunks on next access.
+*/
+class CRMemoryGovernor {
+public:
+    /// sets total budget of engine caches in bytes, 0 to use built-in limits
+    static void setBudget( int bytes );
+    /// returns total budget, 0 if not set
+    static int getBudget();
+    /// adds consumer to governed caches
+    static void addConsumer( CRMemoryConsumer * consumer );
+    /// removes consumer, call from its destructor
+    static void removeConsumer( CRMemoryConsumer * consumer );
+    /// recalculates limits of consumers from budget and recent hits
+    static void rebalance();
+    /// releases memory of all consumers now
+    static void trim( CRMemoryTrimLevel level );
+    /// returns statistics of subsystem
+    static CRMemoryStats getStats( CRMemorySubsystem subsystem );
+    /// returns name of subsystem, as used in statistics
+    static const char * getName( CRMemorySubsystem subsystem );
+    /// returns statistics as JSON object: { "text": { "consumers": 1, "used": 1234, ... }, ... }
+    static lString8 getStatsJson();
+};
+
+/// self tests of CRMemoryGovernor
+void runMemoryGovernorUnitTests();
+
+#endif // __CRMEMGOV_H_INCLUDED__
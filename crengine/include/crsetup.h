@@ -14,6 +14,22 @@
 #define CRSETUP_H_INCLUDED
 
 
+/// Set to 1 to allow several documents to be loaded, rendered and drawn at once
+/// on separate threads of one process (each document used by one thread at a time)
+#ifndef CR_CONCURRENT_DOCUMENTS
+#define CR_CONCURRENT_DOCUMENTS              0
+#endif
+
+/// Set to 0 to compile out scoped timers and counters of engine phases (see crtrace.h)
+#ifndef CR_TRACE_ENABLED
+#define CR_TRACE_ENABLED                     1
+#endif
+
+#if (CR_CONCURRENT_DOCUMENTS==1)
+// slice allocators of strings and refs are process-global: use malloc arenas instead
+#undef LDOM_USE_OWN_MEM_MAN
+#define LDOM_USE_OWN_MEM_MAN                 0
+#endif
 
 // features set for LBOOK
 #if (LBOOK==1)
@@ -128,6 +144,11 @@
 #define GLYPH_CACHE_SIZE 0x40000
 #endif
 
+#ifndef FONT_KERNING_CACHE_SIZE
+/// glyph pairs of freetype kerning cached by each font face, power of 2
+#define FONT_KERNING_CACHE_SIZE 2048
+#endif
+
 
 // disable some features for SYMBIAN
 #if defined(__SYMBIAN32__)
@@ -259,6 +280,11 @@
 #define MAX_IMAGE_SCALE_MUL 2
 #endif
 
+/// memory for parsed SVG images shared by documents, in bytes
+#ifndef SVG_IMAGE_CACHE_SIZE
+#define SVG_IMAGE_CACHE_SIZE 0x400000
+#endif
+
 // max unpacked size of skin image to hold in cache unpacked
 #ifndef MAX_SKIN_IMAGE_CACHE_ITEM_UNPACKED_SIZE
 #define MAX_SKIN_IMAGE_CACHE_ITEM_UNPACKED_SIZE 80*80*4
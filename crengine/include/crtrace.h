@@ -44,4 +44,96 @@ public:
 
 };
 
+
+/// engine phases timed by CR_TRACE_SCOPE, and events counted by CR_TRACE_COUNT
+/**
+    Style and glyph render points are timed per node and per glyph: they are
+    not recorded as trace events. Style time is included in parse time when
+    styles are set while parsing.
+*/
+enum CRTracePoint {
+    CRTRACE_PARSE,            ///< parsing document
+    CRTRACE_STYLE,            ///< computing style of node
+    CRTRACE_RENDER,           ///< formatting blocks of document
+    CRTRACE_PAGINATE,         ///< splitting formatted document into pages
+    CRTRACE_DRAW,             ///< drawing page or scrolled view
+    CRTRACE_DRAW_QUANTIZE,    ///< quantizing drawn page to gray levels of buffer
+    CRTRACE_CACHE_SAVE,       ///< saving document to cache file
+    CRTRACE_CACHE_LOAD,       ///< opening document from cache file
+    CRTRACE_CHUNK_PACK,       ///< compressing storage chunk
+    CRTRACE_CHUNK_UNPACK,     ///< decompressing storage chunk
+    CRTRACE_GLYPH_RENDER,     ///< rendering glyph not found in glyph cache
+    CRTRACE_IMAGE_DECODE,     ///< decoding image
+    CRTRACE_GLYPH_CACHE_HIT,  ///< counter: glyph found in glyph cache
+    CRTRACE_WIDTHS_CACHE_HIT, ///< counter: intrinsic widths of node found in render pass cache
+    CRTRACE_KERNING_CACHE_HIT, ///< counter: freetype kerning of glyph pair found in face kerning cache
+    CRTRACE_POINT_COUNT
+};
+
+/// trace collection modes
+enum CRTraceMode {
+    CRTRACE_MODE_OFF,         ///< nothing collected, scopes only check mode
+    CRTRACE_MODE_COUNTERS,    ///< accumulate call counts and durations
+    CRTRACE_MODE_EVENTS       ///< counters, and each timed call recorded for trace export
+};
+
+/// accumulated statistics of trace point
+struct CRTraceStats {
+    lUInt64 count;    ///< number of calls or counted events
+    lUInt64 totalUs;  ///< total duration of calls, microseconds
+};
+
+/// low overhead timers and counters of engine phases
+/**
+    Collection is off until setMode() is called; set mode while no traced work
+    is running. Counters are exported as JSON object, recorded events in Chrome
+    trace event format (viewable in chrome://tracing or Perfetto).
+*/
+class CRTrace {
+    static int _mode;
+public:
+    /// returns true if timers and counters are collected
+    static inline bool enabled() { return _mode != CRTRACE_MODE_OFF; }
+    /// sets collection mode, clearing collected data
+    static void setMode( CRTraceMode mode );
+    static CRTraceMode getMode() { return (CRTraceMode)_mode; }
+    /// clears counters and recorded events
+    static void reset();
+    /// returns monotonic time, microseconds
+    static lUInt64 now();
+    /// adds n to counter
+    static void count( CRTracePoint point, int n );
+    /// adds timed call
+    static void add( CRTracePoint point, lUInt64 startUs, lUInt64 endUs );
+    /// returns accumulated statistics of trace point
+    static CRTraceStats getStats( CRTracePoint point );
+    /// returns name of trace point, as used in exports
+    static const char * getName( CRTracePoint point );
+    /// returns counters as JSON object: { "parse": { "count": 1, "us": 1234 }, ... }
+    static lString8 getCountersJson();
+    /// returns recorded events as Chrome trace event JSON
+    static lString8 getChromeTraceJson();
+};
+
+/// times its scope as trace point
+class CRTraceScope {
+    CRTracePoint _point;
+    lUInt64 _start;
+public:
+    explicit CRTraceScope( CRTracePoint point ) : _point( point ), _start( CRTrace::enabled() ? CRTrace::now() : 0 ) { }
+    ~CRTraceScope() { if ( _start ) CRTrace::add( _point, _start, CRTrace::now() ); }
+};
+
+#if (CR_TRACE_ENABLED==1)
+#define CR_TRACE_CONCAT_(a, b) a##b
+#define CR_TRACE_CONCAT(a, b) CR_TRACE_CONCAT_(a, b)
+/// times the rest of enclosing scope as trace point
+#define CR_TRACE_SCOPE(point) CRTraceScope CR_TRACE_CONCAT(crTraceScope, __LINE__)(point)
+/// adds n to trace counter
+#define CR_TRACE_COUNT(point, n) do { if ( CRTrace::enabled() ) CRTrace::count(point, n); } while (0)
+#else
+#define CR_TRACE_SCOPE(point)
+#define CR_TRACE_COUNT(point, n) do { } while (0)
+#endif
+
 #endif
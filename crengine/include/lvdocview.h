@@ -74,7 +74,7 @@ public:
 typedef LVRef<LVDocImageHolder> LVDocImageRef;
 
 /// page image cache
-class LVDocViewImageCache
+class LVDocViewImageCache : public CRMemoryConsumer
 {
     private:
         LVMutex _mutex;
@@ -84,12 +84,34 @@ class LVDocViewImageCache
                 LVRef<LVThread> _thread;
                 int _offset;
                 int _page;
+                int _size;
                 bool _ready;
                 bool _valid;
         };
         Item _items[2];
         int _last;
+        int _hits;
+        int _memoryLimit;
+        int _trimTarget;
+        void invalidate( int i )
+        {
+            if ( _items[i]._valid && !_items[i]._ready ) {
+                _items[i]._thread->join();
+            }
+            _items[i]._thread.Clear();
+            _items[i]._valid = false;
+            _items[i]._drawbuf.Clear();
+            _items[i]._offset = -1;
+            _items[i]._page = -1;
+            _items[i]._size = 0;
+        }
     public:
+        virtual CRMemorySubsystem getMemorySubsystem() { return CRMEM_PAGE_IMAGES; }
+        virtual int getMemoryUsed() { return _items[0]._size + _items[1]._size; }
+        virtual int getMemoryHits() { return _hits; }
+        virtual void setMemoryLimit( int limit ) { CR_ATOMIC_STORE( _memoryLimit, limit ); }
+        /// drops page images on next set(): page shown now may be locked by its holder
+        virtual void trimMemory( int target ) { CR_ATOMIC_STORE( _trimTarget, target ); }
         /// return mutex
         LVMutex & getMutex() { return _mutex; }
         /// set page to cache
@@ -97,11 +119,23 @@ class LVDocViewImageCache
         {
             LVLock lock( _mutex );
             _last = (_last + 1) & 1;
+            int size = drawbuf->GetRowSize() * drawbuf->GetHeight();
+            int limit = CR_ATOMIC_LOAD( _memoryLimit );
+            int trimTarget = CR_ATOMIC_LOAD( _trimTarget );
+            if ( trimTarget >= 0 ) {
+                CR_ATOMIC_STORE( _trimTarget, -1 );
+                if ( !limit || trimTarget < limit )
+                    limit = trimTarget;
+            }
+            // keep previous page only while both fit
+            if ( limit && size + _items[(_last + 1) & 1]._size > limit )
+                invalidate( (_last + 1) & 1 );
             _items[_last]._ready = false;
             _items[_last]._thread = thread;
             _items[_last]._drawbuf = drawbuf;
             _items[_last]._offset = offset;
             _items[_last]._page = page;
+            _items[_last]._size = size;
             _items[_last]._valid = true;
         }
         /// return page image, wait until ready
@@ -117,6 +151,7 @@ class LVDocViewImageCache
                         _items[i]._ready = true;
                     }
                     _last = i;
+                    _hits++;
                     return _items[i]._drawbuf;
                 }
             }
@@ -145,30 +180,107 @@ class LVDocViewImageCache
         void clear()
         {
             LVLock lock( _mutex );
-            for ( int i=0; i<2; i++ ) {
-                if ( _items[i]._valid && !_items[i]._ready ) {
-                    _items[i]._thread->join();
-                }
-                _items[i]._thread.Clear();
-                _items[i]._valid = false;
-                _items[i]._drawbuf.Clear();
-                _items[i]._offset = -1;
-                _items[i]._page = -1;
-            }
+            for ( int i=0; i<2; i++ )
+                invalidate( i );
         }
         LVDocViewImageCache()
-        : _last(0)
+        : _last(0), _hits(0), _memoryLimit(0), _trimTarget(-1)
         {
-            for ( int i=0; i<2; i++ )
+            for ( int i=0; i<2; i++ ) {
                 _items[i]._valid = false;
+                _items[i]._size = 0;
+            }
+            CRMemoryGovernor::addConsumer( this );
         }
         ~LVDocViewImageCache()
         {
+            CRMemoryGovernor::removeConsumer( this );
             clear();
         }
 };
 #endif
 
+#ifndef CR_ENABLE_SCROLL_TILE_CACHE
+#define CR_ENABLE_SCROLL_TILE_CACHE 1
+#endif
+
+#if CR_ENABLE_SCROLL_TILE_CACHE==1
+class LVScrollTilesTask;
+
+/// height of document strips cached in scroll mode
+#define SCROLL_TILE_HEIGHT 256
+/// number of strips drawn ahead of scroll direction while GUI thread is idle
+#define SCROLL_TILE_AHEAD 2
+/// maximal number of cached strips
+#define SCROLL_TILE_MAX_COUNT 16
+
+/// image drawing options of buffer strips are drawn for, see LVDocViewTileCache::setFormat()
+enum {
+    SCROLL_TILE_INVERT_IMAGES = 1,
+    SCROLL_TILE_DITHER_IMAGES = 2,
+    SCROLL_TILE_SMOOTH_IMAGES = 4
+};
+
+/// document strips cache for scroll mode
+/**
+    Strip N shows document from y = N * SCROLL_TILE_HEIGHT, drawn for current
+    view width, height and buffer format. Draw() in scroll mode composes visible
+    area of strips, so scrolling by small steps draws only strips coming into view.
+    Used from GUI thread only.
+*/
+class LVDocViewTileCache : public CRMemoryConsumer
+{
+    private:
+        struct Tile {
+            LVRef<LVDrawBuf> _drawbuf;
+            int _index;
+            lUInt32 _lastUse;
+        };
+        Tile _tiles[SCROLL_TILE_MAX_COUNT];
+        int _count;
+        int _dx;
+        int _dy;
+        int _bpp;
+        int _options;
+        int _tileSize;
+        lUInt32 _useCounter;
+        int _hits;
+        int _memoryLimit;
+        int _trimTarget;
+    public:
+        virtual CRMemorySubsystem getMemorySubsystem() { return CRMEM_PAGE_IMAGES; }
+        virtual int getMemoryUsed() { return _count * _tileSize; }
+        virtual int getMemoryHits() { return _hits; }
+        virtual void setMemoryLimit( int limit ) { CR_ATOMIC_STORE( _memoryLimit, limit ); }
+        /// drops strips on next add()
+        virtual void trimMemory( int target ) { CR_ATOMIC_STORE( _trimTarget, target ); }
+        /// drops strips if view size, buffer bits per pixel or image options (SCROLL_TILE_*) differ from cached
+        void setFormat( int dx, int dy, int bpp, int options );
+        int getWidth() { return _dx; }
+        int getViewHeight() { return _dy; }
+        int getBitsPerPixel() { return _bpp; }
+        int getOptions() { return _options; }
+        /// returns number of strips which may be kept with current memory limit
+        int getCapacity();
+        /// returns strip, NULL if not cached
+        LVDrawBuf * get( int index );
+        /// returns true if strip is cached
+        bool has( int index )
+        {
+            for ( int i=0; i<_count; i++ )
+                if ( _tiles[i]._index == index )
+                    return true;
+            return false;
+        }
+        /// adds strip, dropping least recently used ones above capacity
+        void add( int index, LVRef<LVDrawBuf> drawbuf );
+        /// drops all strips
+        void clear();
+        LVDocViewTileCache();
+        ~LVDocViewTileCache();
+};
+#endif
+
 class LVPageWordSelector {
     LVDocView * _docview;
     ldomWordExList _words;
@@ -246,6 +358,8 @@ typedef LVArray<int> LVBookMarkPercentInfo;
 class LVDocView : public CacheLoadingCallback
 {
     friend class LVDrawThread;
+    friend class LVScrollTilesTask;
+    friend class LVDrawPageTask;
 private:
     int m_bitsPerPixel;
     int m_dx;
@@ -334,6 +448,20 @@ private:
 #if CR_ENABLE_PAGE_IMAGE_CACHE==1
     LVDocViewImageCache m_imageCache;
 #endif
+#if CR_ENABLE_SCROLL_TILE_CACHE==1
+    LVDocViewTileCache m_tileCache;
+    bool m_scrollTilesEnabled;
+    /// position of last view composed of strips, to find scroll direction
+    int m_scrollTilesPos;
+    /// 1 when scrolling down, -1 when scrolling up
+    int m_scrollTilesDir;
+    /// task drawing strips ahead, waiting for GUI thread
+    LVScrollTilesTask * m_scrollTilesTask;
+#endif
+#if (CR_CONCURRENT_DOCUMENTS==1)
+    /// draw both pages of spread at once
+    bool m_concurrentSpreads;
+#endif
 
 
     lString8 m_defaultFontFace;
@@ -357,6 +485,10 @@ private:
     lString16 m_pageHeaderOverride;
 
     int m_drawBufferBits;
+    /// dithering of final pass which quantizes pages drawn with 8 bit gray to buffers of less bits
+    cr_dither_mode_t m_pageDitherMode;
+    /// 8 bit gray page of final quantization pass
+    LVAutoPtr<LVGrayDrawBuf> m_quantizeBuf;
 
     CRPageSkinRef _pageSkin;
 
@@ -378,6 +510,27 @@ private:
 
     void updateDocStyleSheet();
 
+    /// draws page header of drawPageTo()
+    void drawPageHeaderTo( LVDrawBuf * drawBuf, LVRendPageInfo & page, int pageCount, int basePage );
+    /// draws page of drawPageTo() without its header
+    void drawPageContentTo( LVDrawBuf * drawBuf, LVRendPageInfo & page, lvRect * pageRect );
+#if (CR_CONCURRENT_DOCUMENTS==1)
+    /// draws both pages of spread at once, right one on worker thread; returns false if they can't be
+    bool drawSpreadConcurrently( LVDrawBuf & drawbuf, int page );
+#endif
+    /// draws scroll mode view at document position, drawbuf may be a strip of view of viewHeight
+    void drawScrollArea( LVDrawBuf & drawbuf, int position, int viewHeight );
+#if CR_ENABLE_SCROLL_TILE_CACHE==1
+    /// returns strip of scroll mode view, draws it if not cached
+    LVDrawBuf * getScrollTile( int index );
+    /// composes scroll mode view of strips, returns false if they can't be used
+    bool drawScrollTiles( LVDrawBuf & drawbuf, int position );
+    /// draws next missing strip ahead of scroll direction, returns false if there is none
+    bool drawScrollTileAhead();
+    /// schedules drawing of strips ahead on GUI thread
+    void scheduleScrollTiles();
+#endif
+
 protected:
 
 
@@ -413,11 +566,28 @@ public:
 
     /// draw current page to specified buffer
     void Draw( LVDrawBuf & drawbuf, bool autoResize = true);
+#if CR_ENABLE_SCROLL_TILE_CACHE==1
+    /// compose scroll mode view of cached document strips (enabled by default)
+    void setScrollTileCacheEnabled( bool enabled );
+    /// returns true if scroll mode view is composed of cached document strips
+    bool isScrollTileCacheEnabled() { return m_scrollTilesEnabled; }
+#endif
+#if (CR_CONCURRENT_DOCUMENTS==1)
+    /// draw both pages of two page mode at once, the right one on a worker thread (enabled by default)
+    void setConcurrentSpreadDrawing( bool enabled ) { m_concurrentSpreads = enabled; }
+    /// returns true if both pages of two page mode are drawn at once
+    bool isConcurrentSpreadDrawing() { return m_concurrentSpreads; }
+#endif
     
     /// close document
     void close();
     /// set buffer format
     void setDrawBufferBits( int bits ) { m_drawBufferBits = bits; }
+    /// set dithering of pages drawn to gray buffers of less than 8 bpp: with CR_DITHER_NONE pages are drawn
+    /// directly at buffer depth, otherwise drawn with 8 bit gray and quantized to buffer levels by one final pass
+    void setPageDitherMode( cr_dither_mode_t mode ) { m_pageDitherMode = mode; }
+    /// returns dithering of final quantization pass of pages
+    cr_dither_mode_t getPageDitherMode() { return m_pageDitherMode; }
     /// substitute page header with custom text (e.g. to be used while loading)
     void setPageHeaderOverride( lString16 s );
     /// get screen rectangle for current cursor position, returns false if not visible
@@ -934,4 +1104,7 @@ public:
 /// draw book cover, either from image, or generated from title/authors
 void LVDrawBookCover(LVDrawBuf & buf, LVImageSourceRef image, lString8 fontFace, lString16 title, lString16 authors, lString16 seriesName, int seriesNumber);
 
+/// reads FB2 description only, without parsing body; sets title, authors, series and language props
+bool LVReadFB2Properties( LVStreamRef stream, CRPropRef props );
+
 #endif
@@ -35,6 +35,7 @@
 #define PROP_DISPLAY_INVERSE         "crengine.display.inverse"
 #define PROP_DISPLAY_FULL_UPDATE_INTERVAL "crengine.display.full.update.interval"
 #define PROP_DISPLAY_TURBO_UPDATE_MODE "crengine.display.turbo.update"
+#define PROP_DISPLAY_DITHER_MODE     "crengine.display.dither.mode" // 0: direct drawing, 1: ordered, 2: error diffusion
 #define PROP_STATUS_LINE             "window.status.line"
 #define PROP_BOOKMARK_ICONS          "crengine.bookmarks.icons"
 #define PROP_FOOTNOTES               "crengine.footnotes"
@@ -35,6 +35,13 @@ enum cr_rotate_angle_t {
     CR_ROTATE_ANGLE_270
 };
 
+/// dithering of LVQuantizeDrawBuf()
+enum cr_dither_mode_t {
+    CR_DITHER_NONE = 0,     ///< no dithering, upper bits of gray level (as drawing to gray buffer does)
+    CR_DITHER_ORDERED,      ///< ordered dithering by 8x8 threshold tile
+    CR_DITHER_DIFFUSION     ///< Floyd-Steinberg error diffusion, rows scanned in alternating directions
+};
+
 class LVFont;
 class GLDrawBuf; // workaround for no-rtti builds
 
@@ -103,6 +110,14 @@ public:
     virtual void setDitherImages( bool dither ) = 0;
     /// set to true to switch to a more costly smooth scaler instead of nearest neighbor
     virtual void setSmoothScalingImages( bool smooth ) = 0;
+    /// returns true if partially visible glyphs are not drawn
+    virtual bool getHidePartialGlyphs() = 0;
+    /// returns true if images are drawn inverted
+    virtual bool getInvertImages() = 0;
+    /// returns true if dithering of images is enforced
+    virtual bool getDitherImages() = 0;
+    /// returns true if images are scaled with smooth scaler
+    virtual bool getSmoothScalingImages() = 0;
     /// invert image
     virtual void  Invert() = 0;
     /// get buffer width, pixels
@@ -117,6 +132,11 @@ public:
     virtual void Clear( lUInt32 color ) = 0;
     /// get pixel value
     virtual lUInt32 GetPixel( int x, int y ) = 0;
+    /// get values of count pixels of row y starting from x, same as GetPixel() of each
+    virtual void GetPixelRow( int x, int y, int count, lUInt32 * row ) {
+        for ( int i=0; i<count; i++ )
+            row[i] = GetPixel( x + i, y );
+    }
     /// get average pixel value for area (coordinates are fixed floating points *16)
     virtual lUInt32 GetAvgColor(lvRect & rc16) = 0;
     /// get linearly interpolated pixel value (coordinates are fixed floating points *16)
@@ -248,6 +268,10 @@ public:
     virtual void setDitherImages( bool dither ) { _ditherImages = dither; }
     /// set to true to switch to a more costly smooth scaler instead of nearest neighbor
     virtual void setSmoothScalingImages( bool smooth ) { _smoothImages = smooth; }
+    virtual bool getHidePartialGlyphs() { return _hidePartialGlyphs; }
+    virtual bool getInvertImages() { return _invertImages; }
+    virtual bool getDitherImages() { return _ditherImages; }
+    virtual bool getSmoothScalingImages() { return _smoothImages; }
     /// returns current background color
     virtual lUInt32 GetBackgroundColor() { return _backgroundColor; }
     /// sets current background color
@@ -383,6 +407,8 @@ public:
     virtual void Clear( lUInt32 color );
     /// get pixel value
     virtual lUInt32 GetPixel( int x, int y );
+    /// get values of count pixels of row y starting from x, same as GetPixel() of each
+    virtual void GetPixelRow( int x, int y, int count, lUInt32 * row );
     /// fills rectangle with specified color
     virtual void FillRect( int x0, int y0, int x1, int y1, lUInt32 color );
     /// inverts image in specified rectangle
@@ -527,6 +553,8 @@ public:
     virtual void Clear( lUInt32 color );
     /// get pixel value
     virtual lUInt32 GetPixel( int x, int y );
+    /// get values of count pixels of row y starting from x, same as GetPixel() of each
+    virtual void GetPixelRow( int x, int y, int count, lUInt32 * row );
     /// fills rectangle with specified color
     virtual void FillRect( int x0, int y0, int x1, int y1, lUInt32 color );
     /// fills rectangle with pattern
@@ -560,5 +588,11 @@ public:
 
 
 
+/// converts src (gray or color buffer) to gray levels of dst (1, 2, 3, 4 or 8 bpp gray buffer) in one pass
+void LVQuantizeDrawBuf( LVDrawBuf * src, LVDrawBuf * dst, cr_dither_mode_t mode );
+
+/// unit tests for drawing buffers (glyph blending kernels vs. reference implementation)
+void runDrawBufUnitTests();
+
 #endif
 
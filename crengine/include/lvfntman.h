@@ -24,6 +24,7 @@
 #include "lvptrvec.h"
 #include "hyphman.h"
 #include "lvdrawbuf.h"
+#include "crmemgov.h"
 
 #if !defined(__SYMBIAN32__) && defined(_WIN32)
 extern "C" {
@@ -59,24 +60,35 @@ inline bool operator==(GlyphCacheItemData data1, GlyphCacheItemData data2)
 }
 #endif
 
-class LVFontGlobalGlyphCache
+class LVFontGlobalGlyphCache : public CRMemoryConsumer
 {
 private:
     LVFontGlyphCacheItem * head;
     LVFontGlyphCacheItem * tail;
     int size;
     int max_size;
+    int hits;
+    int memory_limit;
     void removeNoLock( LVFontGlyphCacheItem * item );
     void putNoLock( LVFontGlyphCacheItem * item );
 public:
     LVFontGlobalGlyphCache( int maxSize )
-        : head(NULL), tail(NULL), size(0), max_size(maxSize )
+        : head(NULL), tail(NULL), size(0), max_size(maxSize ), hits(0), memory_limit(0)
     {
+        CRMemoryGovernor::addConsumer( this );
     }
     ~LVFontGlobalGlyphCache()
     {
+        CRMemoryGovernor::removeConsumer( this );
         clear();
     }
+    /// counts glyph found in local cache
+    void hit() { hits++; }
+    virtual CRMemorySubsystem getMemorySubsystem() { return CRMEM_GLYPH_CACHE; }
+    virtual int getMemoryUsed() { return size; }
+    virtual int getMemoryHits() { return hits; }
+    virtual void setMemoryLimit( int limit ) { CR_ATOMIC_STORE( memory_limit, limit ); }
+    virtual void trimMemory( int target );
     void put( LVFontGlyphCacheItem * item );
     void remove( LVFontGlyphCacheItem * item );
 #if USE_GLYPHCACHE_HASHTABLE != 1
@@ -426,6 +438,10 @@ public:
     virtual LVFontRef GetFallbackFont(int size, int weight=400, bool italic=false ) { return LVFontRef(); }
     /// registers font by name
     virtual bool RegisterFont( lString8 name ) = 0;
+    /// sets file to keep registered font properties between runs (returns false if catalog file cannot be read)
+    virtual bool SetFontCatalogFile( lString8 fileName ) { CR_UNUSED(fileName); return false; }
+    /// writes font catalog file if changed; font files not registered since SetFontCatalogFile() are dropped from it
+    virtual bool SaveFontCatalog() { return false; }
     /// registers font by name and face
     virtual bool RegisterExternalFont(lString16 /*name*/, lString8 /*face*/, bool /*bold*/, bool /*italic*/) { return false; }
     /// registers document font
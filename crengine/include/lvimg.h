@@ -59,6 +59,10 @@ public:
     virtual void OnStartDecode( LVImageSource * obj ) = 0;
     virtual bool OnLineDecoded( LVImageSource * obj, int y, lUInt32 * data ) = 0;
     virtual void OnEndDecode( LVImageSource * obj, bool errors ) = 0;
+    /// target size hint: returns true and size the image is going to be drawn at, if decoder may provide reduced size image
+    virtual bool GetTargetSize( int & dx, int & dy ) { CR_UNUSED2(dx, dy); return false; }
+    /// called before first OnLineDecoded() if decoder has chosen size different from GetWidth() x GetHeight()
+    virtual void OnDecodedSize( LVImageSource * obj, int dx, int dy ) { CR_UNUSED3(obj, dx, dy); }
 };
 
 struct CR9PatchInfo {
@@ -99,6 +103,44 @@ enum ImageTransform {
 
 
 
+/// streaming resampler: turns decoded rows of source size into rows of target size
+/**
+    Along reduced axes each target pixel is average of source pixels it covers
+    (box filter), along enlarged axes - bilinear interpolation of two nearest
+    pixels. Channels, including inverted alpha, are filtered separately.
+
+    Source rows are added from top to bottom; after each addRow() call
+    getRow() until it returns NULL. Only a few rows of target width are kept,
+    so memory use does not depend on source size.
+*/
+class LVImageResampler
+{
+    int _src_dx;
+    int _src_dy;
+    int _dst_dx;
+    int _dst_dy;
+    int * _xstart;       ///< first source pixel of each target pixel
+    int * _xcount;       ///< number of source pixels of each target pixel
+    lUInt16 * _xweight;  ///< weights of source pixels, sum for target pixel is 1<<14
+    lUInt16 * _row;      ///< last added source row at target width, 8.8 fixed point per channel
+    lUInt16 * _prev;     ///< source row added before _row, used when enlarging vertically
+    lUInt32 * _acc;      ///< vertical sums of channels of target row
+    lUInt32 * _out;      ///< completed target row
+    int _next_src;       ///< index of next source row to add
+    int _next_dst;       ///< index of next target row to return
+    bool _ready;         ///< _out keeps completed row _next_dst which is not returned yet
+    void initFilter( int srclen, int dstlen, int * start, int * count, lUInt16 * weight );
+public:
+    LVImageResampler( int srcdx, int srcdy, int dstdx, int dstdy );
+    ~LVImageResampler();
+    /// returns index of source row expected by next addRow() call
+    int nextSourceRow() { return _next_src; }
+    /// adds next source row
+    void addRow( const lUInt32 * data );
+    /// returns next completed target row and sets y to its index, NULL if more source rows are needed
+    lUInt32 * getRow( int & y );
+};
+
 /// creates image which stretches source image by filling center with pixels at splitX, splitY
 LVImageSourceRef LVCreateStretchFilledTransform( LVImageSourceRef src, int newWidth, int newHeight, ImageTransform hTransform=IMG_TRANSFORM_SPLIT, ImageTransform vTransform=IMG_TRANSFORM_SPLIT, int splitX=-1, int splitY=-1 );
 /// creates image which fills area with tiled copy
@@ -139,6 +181,9 @@ void LVDrawBatteryIcon( LVDrawBuf * drawbuf, const lvRect & batteryRc, int perce
 
 unsigned char * convertSVGtoPNG(unsigned char *svg_data, int svg_data_size, float zoom_factor, int *png_data_len);
 
+/// image decoding self tests
+void runImageUnitTests();
+
 #define IMAGE_SOURCE_FROM_BYTES( imgvar , bufvar ) \
     extern unsigned char bufvar []; \
     extern int bufvar ## _size ; \
@@ -60,9 +60,9 @@ class LVRefCounter
     int refCount;
 public:
     LVRefCounter() : refCount(0) { }
-    void AddRef() { refCount++; }
-    int Release() { return --refCount; }
-    int getRefCount() { return refCount; }
+    void AddRef() { CR_ATOMIC_INC(refCount); }
+    int Release() { return CR_ATOMIC_DEC(refCount); }
+    int getRefCount() { return CR_ATOMIC_LOAD(refCount); }
 };
 
 /// Fast smart pointer with reference counting
@@ -364,11 +364,11 @@ template <class T> class LVRef
 private:
     ref_count_rec_t * _ptr;
     //========================================
-    ref_count_rec_t * AddRef() const { ++_ptr->_refcount; return _ptr; }
+    ref_count_rec_t * AddRef() const { CR_ATOMIC_INC(_ptr->_refcount); return _ptr; }
     //========================================
     void Release()
     { 
-        if (--_ptr->_refcount == 0)
+        if (CR_ATOMIC_DEC(_ptr->_refcount) == 0)
         {
             if (_ptr != &ref_count_rec_t::null_ref)
             {
@@ -391,7 +391,7 @@ public:
 
     /// Default constructor.
     /** Initializes pointer to NULL */
-    LVRef() : _ptr(&ref_count_rec_t::null_ref) { ref_count_rec_t::null_ref._refcount++; }
+    LVRef() : _ptr(&ref_count_rec_t::null_ref) { CR_ATOMIC_INC(ref_count_rec_t::null_ref._refcount); }
 
     /// Constructor by object pointer.
     /** Initializes pointer to given value 
@@ -404,7 +404,7 @@ public:
         }
         else
         {
-            ref_count_rec_t::null_ref._refcount++;
+            CR_ATOMIC_INC(ref_count_rec_t::null_ref._refcount);
             _ptr = &ref_count_rec_t::null_ref;
         }
     }
@@ -421,7 +421,7 @@ public:
 
     /// Clears pointer.
     /** Sets object pointer to NULL. */
-    void Clear() { Release(); _ptr = &ref_count_rec_t::null_ref; ++_ptr->_refcount; }
+    void Clear() { Release(); _ptr = &ref_count_rec_t::null_ref; CR_ATOMIC_INC(_ptr->_refcount); }
 
     /// Copy operator.
     /** Duplicates a pointer from specified reference. 
@@ -481,7 +481,7 @@ public:
     /** It might be useful in some cases. 
         \return reference counter value.
     */
-    int getRefCount() const { return _ptr->_refcount; }
+    int getRefCount() const { return CR_ATOMIC_LOAD(_ptr->_refcount); }
 
     /// Returns stored pointer to object.
     /** Usual way to get pointer value. 
@@ -148,6 +148,39 @@ void getRenderedWidths(ldomNode * node, int &maxWidth, int &minWidth, int direct
 // simpler function for first call:
 void getRenderedWidths(ldomNode * node, int &maxWidth, int &minWidth, int direction=REND_DIRECTION_UNSET, bool ignorePadding=false, int rendFlags=0);
 
+/// widths of block node remembered by RenderedWidthsCache
+struct RenderedWidthsItem
+{
+    int maxWidth;
+    int minWidth;
+    int rendFlags;
+    // text measuring state left for next siblings
+    int curMaxWidth;
+    int curWordWidth;
+    int lastSpaceWidth;
+    bool collapseNextSpace;
+    bool writesState; ///< node content changes text measuring state
+};
+
+/// remembers widths of block nodes computed by getRenderedWidths() on this thread while it exists
+/**
+    Widths depending on text measured before the node (as with text and
+    block siblings in one block) are not remembered.
+    Nested tables, floats and inline-blocks ask for widths of the same
+    content again for each level. Create one on the stack for the time
+    styles and fonts don't change, e.g. a render pass.
+*/
+class RenderedWidthsCache
+{
+    friend void getRenderedWidths(ldomNode * node, int &maxWidth, int &minWidth, int direction, bool ignorePadding, int rendFlags,
+            int &curMaxWidth, int &curWordWidth, bool &collapseNextSpace, int &lastSpaceWidth, int indent, bool isStartNode);
+    LVHashTable<lUInt64, RenderedWidthsItem> _items;
+    RenderedWidthsCache * _prev;
+public:
+    RenderedWidthsCache();
+    ~RenderedWidthsCache();
+};
+
 #define STYLE_FONT_EMBOLD_MODE_NORMAL 0
 #define STYLE_FONT_EMBOLD_MODE_EMBOLD 300
 
@@ -163,15 +196,30 @@ int scaleForRenderDPI( int value );
 #define BASE_CSS_DPI 96 // at 96 dpi, 1 css px = 1 screen px
 #define DEF_RENDER_DPI 96
 #define DEF_RENDER_SCALE_FONT_WITH_DPI 0
-extern int gRenderDPI;
-extern bool gRenderScaleFontWithDPI;
-extern int gRootFontSize;
+extern CR_THREAD_LOCAL int gRenderDPI;
+extern CR_THREAD_LOCAL bool gRenderScaleFontWithDPI;
+extern CR_THREAD_LOCAL int gRootFontSize;
 
 #define INTERLINE_SCALE_FACTOR_NO_SCALE 1024
 #define INTERLINE_SCALE_FACTOR_SHIFT 10
-extern int gInterlineScaleFactor;
+extern CR_THREAD_LOCAL int gInterlineScaleFactor;
 
-extern int gRenderBlockRenderingFlags;
+extern CR_THREAD_LOCAL int gRenderBlockRenderingFlags;
+
+/// per-thread rendering settings of current thread, to draw its document on another thread
+struct LVRendThreadSettings
+{
+    int renderDPI;
+    bool scaleFontWithDPI;
+    int rootFontSize;
+    int interlineScaleFactor;
+    int blockRenderingFlags;
+    bool floatingPunctuation;
+    /// captures settings of current thread
+    LVRendThreadSettings();
+    /// sets captured settings for current thread
+    void apply() const;
+};
 
 // Enhanced rendering flags
 #define BLOCK_RENDERING_ENHANCED                           0x00000001
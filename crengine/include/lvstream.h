@@ -835,6 +835,34 @@ bool LVRenameFile(lString16 oldname, lString16 newname);
 /// rename file
 bool LVRenameFile(lString8 oldname, lString8 newname);
 
+/// advisory lock on a file, to coordinate processes sharing files in one directory
+/**
+    Lock is held per process: threads of the same process are not excluded
+    from each other and must use their own synchronization.
+*/
+class LVFileLock
+{
+#ifdef _WIN32
+    void * _handle;
+#else
+    int _fd;
+#endif
+    bool _locked;
+public:
+    LVFileLock();
+    ~LVFileLock();
+    /// opens lock file, creating it if absent
+    bool open( const lString16 & pathname );
+    /// closes lock file, releasing lock
+    void close();
+    /// returns true if lock file is open
+    bool isOpen() const;
+    /// waits for lock: shared lock may be held by several processes at once, exclusive only by one
+    bool lock( bool exclusive );
+    /// releases lock
+    void unlock();
+};
+
 /// copies content of in stream to out stream
 lvsize_t LVPumpStream( LVStreamRef out, LVStreamRef in );
 /// copies content of in stream to out stream
@@ -899,6 +927,10 @@ bool LVDirectoryExists( const lString16 & pathName );
 bool LVDirectoryExists( const lString8 & pathName );
 /// returns true if directory exists and your app can write to directory
 bool LVDirectoryIsWritable(const lString16 & pathName);
+/// retrieves size and last modification time (seconds since epoch) of file, returns false if file not found
+bool LVGetFileInfo( const lString8 & pathName, lUInt64 & size, lUInt64 & mtime );
+/// retrieves size and last modification time (seconds since epoch) of file, returns false if file not found
+bool LVGetFileInfo( const lString16 & pathName, lUInt64 & size, lUInt64 & mtime );
 
 
 /// factory to handle filesystem access for paths started with ASSET_PATH_PREFIX (@ sign)
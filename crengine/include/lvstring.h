@@ -143,13 +143,24 @@ bool lStr_isWordSeparator( lChar16 ch );
 #define CONST_STRING_BUFFER_MASK (CONST_STRING_BUFFER_SIZE - 1)
 #define CONST_STRING_BUFFER_HASH_MULT 31
 
+#if (CR_CONCURRENT_DOCUMENTS==1)
+// references to shared empty chunk are not counted, to not write it from all threads:
+// it's never freed, and looks referenced by other strings for copy-on-write checks
+#define EMPTY_CHUNK_NREF 2
+#define CHUNK_ADDREF(chunk, empty) if ((chunk)!=(empty)) CR_ATOMIC_INC((chunk)->nref)
+#define CHUNK_RELEASE(chunk, empty) if ((chunk)!=(empty) && CR_ATOMIC_DEC((chunk)->nref)==0) free()
+#else
+#define EMPTY_CHUNK_NREF 1
+#define CHUNK_ADDREF(chunk, empty) ++(chunk)->nref
+#define CHUNK_RELEASE(chunk, empty) if (--(chunk)->nref==0) free()
+#endif
 
 struct lstring8_chunk_t {
     friend class lString8;
     friend class lString16;
     friend struct lstring_chunk_slice_t;
 public:
-    lstring8_chunk_t(lChar8 * _buf8) : buf8(_buf8), size(1), len(0), nref(1) {}
+    lstring8_chunk_t(lChar8 * _buf8) : buf8(_buf8), size(1), len(0), nref(EMPTY_CHUNK_NREF) {}
     const lChar8 * data8() const { return buf8; }
 private:
     lChar8  * buf8; // z-string
@@ -170,7 +181,7 @@ struct lstring16_chunk_t {
     friend class lString16;
     friend struct lstring_chunk_slice_t;
 public:
-    lstring16_chunk_t(lChar16 * _buf16) : buf16(_buf16), size(1), len(0), nref(1) {}
+    lstring16_chunk_t(lChar16 * _buf16) : buf16(_buf16), size(1), len(0), nref(EMPTY_CHUNK_NREF) {}
     const lChar16 * data16() const { return buf16; }
 private:
     lChar16 * buf16; // z-string
@@ -244,8 +255,8 @@ private:
     static lstring_chunk_t * EMPTY_STR_8;
     void alloc(size_type sz);
     void free();
-    inline void addref() const { ++pchunk->nref; }
-    inline void release() { if (--pchunk->nref==0) free(); }
+    inline void addref() const { CHUNK_ADDREF(pchunk, EMPTY_STR_8); }
+    inline void release() { CHUNK_RELEASE(pchunk, EMPTY_STR_8); }
     explicit lString8(lstring_chunk_t * chunk) : pchunk(chunk) { addref(); }
 public:
     /// default constrictor
@@ -384,7 +395,7 @@ public:
     /// ensures that reference count is 1
     void  lock( size_type newsize );
     /// returns pointer to modifable string buffer
-    value_type * modify() { if (pchunk->nref>1) lock(pchunk->len); return pchunk->buf8; }
+    value_type * modify() { if (CR_ATOMIC_LOAD(pchunk->nref)>1) lock(pchunk->len); return pchunk->buf8; }
     /// clear string
     void  clear() { release(); pchunk = EMPTY_STR_8; addref(); }
     /// clear string, set buffer size
@@ -475,8 +486,8 @@ private:
     static lstring_chunk_t * EMPTY_STR_16;
     void alloc(size_type sz);
     void free();
-    inline void addref() const { ++pchunk->nref; }
-    inline void release() { if (--pchunk->nref==0) free(); }
+    inline void addref() const { CHUNK_ADDREF(pchunk, EMPTY_STR_16); }
+    inline void release() { CHUNK_RELEASE(pchunk, EMPTY_STR_16); }
 public:
     explicit lString16(lstring_chunk_t * chunk) : pchunk(chunk) { addref(); }
     /// empty string constructor
@@ -644,7 +655,7 @@ public:
     /// resizes string, copies if several references exist
     void  lock( size_type newsize );
     /// returns writable pointer to string buffer
-    value_type * modify() { if (pchunk->nref>1) lock(pchunk->len); return pchunk->buf16; }
+    value_type * modify() { if (CR_ATOMIC_LOAD(pchunk->nref)>1) lock(pchunk->len); return pchunk->buf16; }
     /// clears string contents
     void  clear() { release(); pchunk = EMPTY_STR_16; addref(); }
     /// resets string, allocates space for specified amount of characters
@@ -1033,6 +1044,50 @@ lString16 Utf8ToUnicode( const char * s );
 lString16 Utf8ToUnicode( const char * s, int sz );
 /// converts utf-8 string fragment to wide unicode string
 void Utf8ToUnicode(const lUInt8 * src,  int &srclen, lChar16 * dst, int &dstlen);
+/// converts utf-8 string fragment to wide unicode string, reusing dst buffer when it's large enough
+void Utf8ToUnicode( const char * s, int sz, lString16 & dst );
+/// returns number of characters in utf-8 string fragment, which may be not zero terminated
+int Utf8FragmentCharCount( const char * s, int sz );
+/// decodes utf-8 character at s and moves s past it, returns 0 and moves s to end at zero byte or truncated sequence
+/// (invalid first byte is returned masked with 0x7F as Utf8ToUnicode() does: 0 for 0x80, with s moved past it only)
+inline lChar16 Utf8NextChar( const char * & s, const char * end )
+{
+    lUInt32 ch = (lUInt8)*s;
+    int n = 0;
+    if ( !ch ) {
+        s = end;
+        return 0;
+    }
+    if ( ch & 0x80 ) {
+        if ( (ch & 0xE0) == 0xC0 )
+            n = 1;
+        else if ( (ch & 0xF0) == 0xE0 )
+            n = 2;
+        else if ( (ch & 0xF8) == 0xF0 )
+            n = 3;
+        else {
+            s++;
+            return (lChar16)(ch & 0x7F);
+        }
+    }
+    if ( s + n >= end ) {
+        s = end;
+        return 0;
+    }
+    switch ( n ) {
+    case 1:
+        ch = ((ch & 0x1F) << 6) | (s[1] & 0x3F);
+        break;
+    case 2:
+        ch = ((ch & 0x0F) << 12) | ((s[1] & 0x3F) << 6) | (s[2] & 0x3F);
+        break;
+    case 3:
+        ch = ((ch & 0x07) << 18) | ((s[1] & 0x3F) << 12) | ((s[2] & 0x3F) << 6) | (s[3] & 0x3F);
+        break;
+    }
+    s += n + 1;
+    return (lChar16)ch;
+}
 /// decodes path like "file%20name" to "file name"
 lString16 DecodeHTMLUrlString( lString16 s );
 /// truncates string by specified size, appends ... if truncated, prefers to wrap whole words
@@ -219,8 +219,43 @@ public:
     LVCssSelector * getNext() { return _next; }
     void setNext(LVCssSelector * next) { _next = next; }
     lUInt32 getHash();
+    /// calculate hash, as if chain continued by selectors with nextHash
+    lUInt32 getHash( lUInt32 nextHash );
 };
 
+/// rules of one parsed CSS text
+/**
+    Not modified after parsing: layers are shared by stylesheet copies, saved
+    stylesheet states and documents which parse the same CSS.
+*/
+class LVStyleSheetLayer : public LVRefCounter {
+    friend class LVStyleSheet;
+    /// selector chains sorted by specificity, indexed by element name id (0 is for universal selectors)
+    LVPtrVector <LVCssSelector> _selectors;
+    // parsed text and parsing options
+    lString8 _css;
+    lUInt32 _cssHash;
+    bool _higherImportance;
+    lString16 _codeBase;
+    int _renderingFlags;
+    int _docFormat;
+    int _domVersion;
+    // element and attribute names resolved by document while parsing
+    lString16Collection _names;
+    LVArray<int> _nameIds;    /// element name id, or attribute name id + 0x10000
+    bool _invalidatesLoadingStyles;
+    LVStyleSheetLayer() : _cssHash(0), _higherImportance(false), _renderingFlags(0), _docFormat(-1), _domVersion(0), _invalidatesLoadingStyles(false) { }
+public:
+    /// records element (attribute if isAttr) name resolved to id while parsing
+    void addName( const lString16 & name, lUInt16 id, bool isAttr );
+    /// set when parsed selectors need document styles checked again after loading
+    void setInvalidatesLoadingStyles() { _invalidatesLoadingStyles = true; }
+    /// returns true if layer parsed for other document can be used by doc
+    bool isValidFor( lxmlDocBase * doc );
+};
+
+typedef LVFastRef<LVStyleSheetLayer> LVStyleSheetLayerRef;
+
 
 /** \brief stylesheet
     
@@ -228,53 +263,43 @@ public:
 
     Currently supports only subset of CSS features.
 
+    Each parse() adds a layer (user agent, user, document, fragment CSS...):
+    push() and pop() only save and restore the number of layers. Layers are
+    looked up in a cache of recently parsed CSS before parsing.
+
     \sa LVCssSelector
     \sa LVCssDeclaration
+    \sa LVStyleSheetLayer
 */
 class LVStyleSheet {
     lxmlDocBase * _doc;
-    LVPtrVector <LVCssSelector> _selectors;
-
-    LVPtrVector <LVPtrVector <LVCssSelector> > _stack;
-    LVPtrVector <LVCssSelector> * dup()
-    {
-        LVPtrVector <LVCssSelector> * res = new LVPtrVector <LVCssSelector>();
-        for ( int i=0; i<_selectors.length(); i++ ) {
-            LVCssSelector * selector = _selectors[i];
-            if ( selector )
-                res->add( new LVCssSelector(*selector) );
-            else
-                res->add(NULL);
-        }
-        return res;
-    }
-
-    void set(LVPtrVector<LVCssSelector> & v );
+    LVArray <LVStyleSheetLayerRef> _layers;
+    /// number of layers saved by each push()
+    LVArray <int> _stack;
+    // chains of all layers merged by specificity: selectors for element name id i
+    // are _merged[_mergedStart[i]] .. _merged[_mergedStart[i+1]-1]
+    LVArray <LVCssSelector*> _merged;
+    LVArray <int> _mergedStart;
+    bool _mergedValid;
+    void merge();
+    LVStyleSheetLayerRef parseLayer( const char * str, bool higher_importance, lString16 codeBase );
 public:
 
 
     // save current state of stylesheet
     void push()
     {
-        _stack.add( dup() );
+        _stack.add( _layers.length() );
     }
     // restore previously saved state
-    bool pop()
-    {
-        LVPtrVector <LVCssSelector> * v = _stack.pop();
-        if ( !v )
-            return false;
-        set( *v );
-        delete v;
-        return true;
-    }
+    bool pop();
 
     /// remove all rules from stylesheet
-    void clear() { _selectors.clear(); _stack.clear();}
+    void clear() { _layers.clear(); _stack.clear(); _mergedValid = false; }
     /// set document to retrieve ID values from
     void setDocument( lxmlDocBase * doc ) { _doc = doc; }
     /// constructor
-    LVStyleSheet( lxmlDocBase * doc = NULL ) : _doc(doc) { }
+    LVStyleSheet( lxmlDocBase * doc = NULL ) : _doc(doc), _mergedValid(false) { }
     /// copy constructor
     LVStyleSheet( LVStyleSheet & sheet );
     /// parse stylesheet, compile and add found rules to sheet
@@ -283,8 +308,15 @@ public:
     void apply( const ldomNode * node, css_style_rec_t * style );
     /// calculate hash
     lUInt32 getHash();
+    /// calculate hash of each selector chain, indexed by element name id (0 is for universal selectors)
+    void getSelectorHashes( LVArray<lUInt32> & hashes );
+    /// drops layers kept for reuse by later parse() calls
+    static void clearLayerCache();
 };
 
+/// self tests of stylesheet parsing
+void runStyleSheetUnitTests();
+
 /// parse color value like #334455, #345 or red
 bool parse_color_value( const char * & str, css_length_t & value );
 
@@ -196,8 +196,9 @@ typedef struct css_style_rec_tag {
         border_width[2] = css_length_t(css_val_unspecified, 0);
         border_width[3] = css_length_t(css_val_unspecified, 0);
     }
-    void AddRef() { refCount++; }
-    int Release() { return --refCount; }
+    // styles are shared by threads reading one document at once
+    void AddRef() { CR_ATOMIC_INC(refCount); }
+    int Release() { return CR_ATOMIC_DEC(refCount); }
     int getRefCount() { return refCount; }
     bool serialize( SerialBuf & buf );
     bool deserialize( SerialBuf & buf );
@@ -262,6 +263,7 @@ enum lvdom_element_render_method
 
 /// node format record
 class lvdomElementFormatRec {
+    friend class RenderRectAccessor;
 protected:
     // Values on the x-axis can be stored in a 16bit int, values
     // on the y-axis should better be stored in a 32bit int.
@@ -387,7 +389,7 @@ public:
     void setWidth( int w ) { _width = w; }
     void setHeight( int h ) { _height = h; }
     // No real need for setters/getters for the other fields, RenderRectAccessor
-    // extends this class and can access them freely.
+    // works on records in place and can access them freely.
 };
 
 /// calculate cache record hash
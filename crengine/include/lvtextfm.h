@@ -428,6 +428,6 @@ public:
 
 #endif
 
-extern bool gFlgFloatingPunctuationEnabled;
+extern CR_THREAD_LOCAL bool gFlgFloatingPunctuationEnabled;
 
 #endif
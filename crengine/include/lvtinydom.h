@@ -26,6 +26,7 @@
 #define __LV_TINYDOM_H_INCLUDED__
 
 #include "lvmemman.h"
+#include "crmemgov.h"
 #include "lvstring.h"
 #include "lstridmap.h"
 #include "lvxml.h"
@@ -63,6 +64,13 @@ extern int gDOMVersionRequested;
 /// default docFlag set
 #define DOC_FLAG_DEFAULTS (DOC_FLAG_ENABLE_INTERNAL_STYLES|DOC_FLAG_ENABLE_FOOTNOTES|DOC_FLAG_ENABLE_DOC_FONTS)
 
+#if (CR_CONCURRENT_DOCUMENTS==1)
+// use DOC_READS_GUARD(doc) around lazy loading and caches of document which may be read by several threads at once
+#define DOC_READS_GUARD(doc) CRGuard _docReadsGuard((doc)->getConcurrentReadsMutex()); CR_UNUSED(_docReadsGuard);
+#else
+#define DOC_READS_GUARD(doc)
+#endif
+
 
 
 #define LXML_NS_NONE 0       ///< no namespace specified
@@ -227,6 +235,7 @@ public:
 
 class ldomTextStorageChunk;
 class ldomTextStorageChunkBuilder;
+class ldomTextRef;
 struct ElementDataStorageItem;
 class CacheFile;
 class tinyNodeCollection;
@@ -255,7 +264,7 @@ public:
     LVStreamRef getBlob( lString16 name );
 };
 
-class ldomDataStorageManager
+class ldomDataStorageManager : public CRMemoryConsumer
 {
     friend class ldomTextStorageChunk;
 protected:
@@ -269,6 +278,9 @@ protected:
     int _chunkSize;
     char _type;       /// type, to show in log
     bool _maxSizeReachedWarned;
+    int _hits;        /// number of switches to already unpacked chunk
+    int _memoryLimit; /// limit set by CRMemoryGovernor, 0 to use _maxUncompressedSize
+    int _trimTarget;  /// size requested by CRMemoryGovernor::trim(), -1 if none
     ldomTextStorageChunk * getChunk( lUInt32 address );
 public:
     /// type
@@ -282,6 +294,12 @@ public:
     /// checks buffer sizes, compacts most unused chunks
     void compact( int reservedSpace );
     int getUncompressedSize() { return _uncompressedSize; }
+
+    virtual CRMemorySubsystem getMemorySubsystem();
+    virtual int getMemoryUsed() { return _uncompressedSize; }
+    virtual int getMemoryHits() { return _hits; }
+    virtual void setMemoryLimit( int limit ) { CR_ATOMIC_STORE( _memoryLimit, limit ); }
+    virtual void trimMemory( int target );
 #if BUILD_LITE!=1
     /// allocates new text node, return its address inside storage
     lUInt32 allocText( lUInt32 dataIndex, lUInt32 parentIndex, const lString8 & text );
@@ -289,6 +307,8 @@ public:
     lUInt32 allocElem( lUInt32 dataIndex, lUInt32 parentIndex, int childCount, int attrCount );
     /// get text by address
     lString8 getText( lUInt32 address );
+    /// get text by address, to read it in place
+    ldomTextRef getTextRef( lUInt32 address );
     /// get pointer to text data
     TextDataStorageItem * getTextItem( lUInt32 addr );
     /// get pointer to element data
@@ -303,6 +323,10 @@ public:
     void modified( lUInt32 addr );
 #endif
     
+    /// get or allocate space for rect data item, returns pointer to item in pinned chunk
+    lvdomElementFormatRec * pinRendRectData( lUInt32 elemDataIndex, ldomTextStorageChunk * & chunk );
+    /// release chunk pinned by pinRendRectData()
+    void unpinRendRectData( ldomTextStorageChunk * chunk );
     /// get or allocate space for rect data item
     void getRendRectData( lUInt32 elemDataIndex, lvdomElementFormatRec * dst );
     /// set rect data item
@@ -314,13 +338,14 @@ public:
     void setStyleData( lUInt32 elemDataIndex, const ldomNodeStyleInfo * src );
 
     ldomDataStorageManager( tinyNodeCollection * owner, char type, int maxUnpackedSize, int chunkSize );
-    ~ldomDataStorageManager();
+    virtual ~ldomDataStorageManager();
 };
 
 /// class to store compressed/uncompressed text nodes chunk
 class ldomTextStorageChunk
 {
     friend class ldomDataStorageManager;
+    friend class ldomTextRef;
     ldomDataStorageManager * _manager;
     ldomTextStorageChunk * _nextRecent;
     ldomTextStorageChunk * _prevRecent;
@@ -330,6 +355,7 @@ class ldomTextStorageChunk
     lUInt16 _index;  /// ? index of chunk in storage
     char _type;       /// type, to show in log
     bool _saved;
+    int _pinCount;   /// number of ldomTextRef reading text in place, chunk is not packed while >0
 
     void setunpacked( const lUInt8 * buf, int bufsize );
     /// pack data, and remove unpacked
@@ -380,6 +406,59 @@ public:
     ~ldomTextStorageChunk();
 };
 
+/// UTF-8 text of a text node, accessed in place without copying it
+/** The storage chunk holding the text is kept unpacked while this object
+    (or a copy of it) exists: keep it only for the time the text is used. */
+class ldomTextRef
+{
+    ldomTextStorageChunk * _chunk;
+    lString8 _str; // text of mutable node
+    const char * _text;
+    int _size;
+    void pin() { if ( _chunk ) CR_ATOMIC_INC( _chunk->_pinCount ); }
+    void unpin() { if ( _chunk ) CR_ATOMIC_DEC( _chunk->_pinCount ); }
+public:
+    ldomTextRef() : _chunk(NULL), _text(""), _size(0) { }
+    /// text stored in chunk
+    ldomTextRef( ldomTextStorageChunk * chunk, const char * text, int size )
+        : _chunk(chunk), _text(text), _size(size) { pin(); }
+    /// text of mutable node
+    ldomTextRef( const lString8 & str )
+        : _chunk(NULL), _str(str), _text(_str.c_str()), _size(_str.length()) { }
+    ldomTextRef( const ldomTextRef & v )
+        : _chunk(v._chunk), _str(v._str), _text(v._text), _size(v._size) { pin(); }
+    ldomTextRef & operator = ( const ldomTextRef & v )
+    {
+        if ( this != &v ) {
+            unpin();
+            _chunk = v._chunk;
+            _str = v._str;
+            _text = v._text;
+            _size = v._size;
+            pin();
+        }
+        return *this;
+    }
+    ~ldomTextRef() { unpin(); }
+    /// pointer to UTF-8 text, not zero terminated
+    const char * data() const { return _text; }
+    /// end of UTF-8 text, to iterate characters with Utf8NextChar()
+    const char * end() const { return _text + _size; }
+    /// text size, bytes
+    int size() const { return _size; }
+    bool empty() const { return _size==0; }
+    /// text length, characters
+    int length() const { return Utf8FragmentCharCount( _text, _size ); }
+    /// returns text as wide string
+    lString16 getText() const { lString16 res; Utf8ToUnicode( _text, _size, res ); return res; }
+    /// converts text to wide string, reusing buffer of dst
+    void getText( lString16 & dst ) const { Utf8ToUnicode( _text, _size, dst ); }
+    /// returns count characters from start character as wide string
+    lString16 substr( int start, int count ) const;
+    /// returns text as utf8 string
+    lString8 getText8() const { return _chunk ? lString8( _text, _size ) : _str; }
+};
+
 // forward declaration
 class ldomNode;
 
@@ -457,6 +536,10 @@ protected:
     lUInt32 _nodeDisplayStyleHashInitial;
     bool _nodeStylesInvalidIfLoading;
 
+    int _lazyElemCount; // element nodes in cache file, read by part on first access
+    int _lazyTextCount; // text nodes in cache file, read by part on first access
+    bool _lazyStylesEnabled; // styles loaded from cache file can be used for lazily read nodes
+
     int calcFinalBlocks();
     void dropStyles();
 #endif
@@ -478,6 +561,13 @@ protected:
     /// checks buffer sizes, compacts most unused chunks
     ldomBlobCache _blobCache;
 
+#if (CR_CONCURRENT_DOCUMENTS==1)
+    /// number of beginConcurrentReads() not ended yet
+    int _concurrentReads;
+    /// serializes lazy loading and caches of document while it's read concurrently
+    CRMutex * _concurrentReadsMutex;
+#endif
+
     /// uniquie id of file format parsing option (usually 0, but 1 for preformatted text files)
     int getPersistenceFlags();
 
@@ -489,7 +579,16 @@ protected:
     bool saveNodeData();
     bool saveNodeData( lUInt16 type, ldomNode ** list, int nodecount );
     bool loadNodeData();
-    bool loadNodeData( lUInt16 type, ldomNode ** list, int nodecount );
+    /// read part of nodes from cache file on first access, returns NULL if it's not in cache file
+    ldomNode * loadNodePart( bool elements, int partIndex );
+    /// set style and font of element read from cache file
+    void initLoadedNodeStyle( lUInt32 dataIndex );
+    /// get part of element nodes, reading it from cache file on first access
+    ldomNode * getElemPart( int partIndex )
+    {
+        ldomNode * part = _elemList[partIndex];
+        return part ? part : loadNodePart( true, partIndex );
+    }
 
 
     bool openCacheFile();
@@ -504,6 +603,10 @@ protected:
     void setNodeFont( lUInt32 dataIndex, font_ref_t & v  );
     void clearNodeStyle( lUInt32 dataIndex );
     virtual void resetNodeNumberingProps() { }
+    /// get node contributions to _nodeStyleHash and _nodeDisplayStyleHash, returns false if they can't be known
+    bool calcNodeStyleHash( lUInt32 dataIndex, const ldomNodeStyleInfo & info, lUInt32 & styleHash, lUInt32 & displayHash );
+    /// replace node contributions to style hashes after its style or font has been changed
+    void updateNodeStyleHash( bool known, lUInt32 dataIndex, const ldomNodeStyleInfo & info, lUInt32 oldStyleHash, lUInt32 oldDisplayHash );
 #endif
 
     tinyNodeCollection( tinyNodeCollection & v );
@@ -602,6 +705,20 @@ public:
 
     /// minimize memory consumption
     void compact();
+#if (CR_CONCURRENT_DOCUMENTS==1)
+    /// document is going to be read by several threads at once, until endConcurrentReads()
+    /**
+        Call on thread owning document before starting readers, and end after joining them.
+        Document must not be changed meanwhile. Nodes not yet read from cache file are read
+        here, so nothing is loaded lazily by readers. Storage access and final block cache
+        are serialized; storage isn't compacted.
+    */
+    void beginConcurrentReads();
+    /// ends beginConcurrentReads(), compacts storage
+    void endConcurrentReads();
+    /// returns mutex serializing document caches while it's read concurrently, NULL otherwise
+    CRMutex * getConcurrentReadsMutex() { return _concurrentReads ? _concurrentReadsMutex : NULL; }
+#endif
     /// dumps memory usage statistics to debug log
     void dumpStatistics();
     /// get memory usage statistics
@@ -635,41 +752,52 @@ class tinyElement;
 struct lxmlAttribute;
 
 #if BUILD_LITE!=1
-class RenderRectAccessor : public lvdomElementFormatRec
+/// reads and modifies render rect of element in place
+/**
+    Record is accessed directly inside rect storage chunk, which is pinned
+    (not packed or swapped out) while accessor exists: all accessors of same
+    node see the same data, and changes are stored at once. Keep accessors
+    for the time of a function call only.
+*/
+class RenderRectAccessor
 {
     ldomNode * _node;
-    bool _modified;
-    bool _dirty;
+    ldomTextStorageChunk * _chunk; /// pinned chunk holding record, NULL for non-element node
+    lvdomElementFormatRec * _rec;  /// record inside chunk, or own empty record for non-element node
+    void attach( ldomNode * node );
+    void detach();
+    /// marks chunk as modified
+    void modified();
 public:
     //RenderRectAccessor & operator -> () { return *this; }
-    int getX();
-    int getY();
-    int getWidth();
-    int getHeight();
-    void getRect( lvRect & rc );
+    int getX() { return _rec->_x; }
+    int getY() { return _rec->_y; }
+    int getWidth() { return _rec->_width; }
+    int getHeight() { return _rec->_height; }
+    void getRect( lvRect & rc ) { _rec->getRect( rc ); }
     void setX( int x );
     void setY( int y );
     void setWidth( int w );
     void setHeight( int h );
 
-    int getInnerWidth();
-    int getInnerX();
-    int getInnerY();
+    int getInnerWidth() { return _rec->_inner_width; }
+    int getInnerX() { return _rec->_inner_x; }
+    int getInnerY() { return _rec->_inner_y; }
     void setInnerX( int x );
     void setInnerY( int y );
     void setInnerWidth( int w );
 
-    int  getTopOverflow();
-    int  getBottomOverflow();
+    int  getTopOverflow() { return _rec->_top_overflow; }
+    int  getBottomOverflow() { return _rec->_bottom_overflow; }
     void setTopOverflow( int dy );
     void setBottomOverflow( int dy );
 
-    int  getBaseline();
+    int  getBaseline() { return _rec->_baseline; }
     void setBaseline( int baseline );
-    int  getListPropNodeIndex();
+    int  getListPropNodeIndex() { return _rec->_listprop_node_idx; }
     void setListPropNodeIndex( int idx );
 
-    unsigned short getFlags();
+    unsigned short getFlags() { return _rec->_flags; }
     void setFlags( unsigned short flags );
 
     void getTopRectsExcluded( int & lw, int & lh, int & rw, int & rh );
@@ -679,9 +807,12 @@ public:
     void getInvolvedFloatIds( int & float_count, lUInt32 * float_ids );
     void setInvolvedFloatIds( int float_count, lUInt32 * float_ids );
 
-    void push();
+    /// not needed anymore: changes are stored at once
+    void push() { }
     void clear();
     RenderRectAccessor( ldomNode * node );
+    RenderRectAccessor( const RenderRectAccessor & v );
+    RenderRectAccessor & operator = ( const RenderRectAccessor & v );
     ~RenderRectAccessor();
 };
 #endif
@@ -774,6 +905,10 @@ private:
     void getRenderData( lvdomElementFormatRec & dst);
     /// sets new value for render data structure
     void setRenderData( lvdomElementFormatRec & newData);
+    /// returns render data structure in place, pinning its storage chunk; NULL for non-element node
+    lvdomElementFormatRec * pinRenderData( ldomTextStorageChunk * & chunk );
+    /// releases storage chunk pinned by pinRenderData()
+    void unpinRenderData( ldomTextStorageChunk * chunk );
 
     void autoboxChildren( int startIndex, int endIndex, bool handleFloating=false );
     void removeChildren( int startIndex, int endIndex );
@@ -792,8 +927,8 @@ public:
     void initNodeRendMethod();
     /// init render method for the whole subtree
     void initNodeRendMethodRecursive();
-    /// init render method for the whole subtree
-    void initNodeStyleRecursive( LVDocViewCallback * progressCallback );
+    /// init node styles for the whole subtree, returns number of elements styled
+    int initNodeStyleRecursive( LVDocViewCallback * progressCallback );
 #endif
 
 
@@ -901,6 +1036,8 @@ public:
     lString16 getText( lChar16 blockDelimiter = 0, int maxSize=0 ) const;
     /// returns text node text as utf8 string
     lString8 getText8( lChar8 blockDelimiter = 0, int maxSize=0 ) const;
+    /// returns text node text as utf8, accessed in place (empty for elements)
+    ldomTextRef getTextRef() const;
     /// sets text node text as wide string
     void setText( lString16 );
     /// sets text node text as utf8 string
@@ -2178,6 +2315,9 @@ private:
     bool _just_rendered_from_cache;
     bool _toc_from_cache_valid;
     ldomXRangeList _selections;
+    LVArray<lUInt32> _renderedSelectorHashes; // main stylesheet rules hashes by element name id, as last rendered
+    lUInt32 _renderedStyleSheetHash;
+    int _lastRestyledNodeCount;
 #endif
 
     lString16 _docStylesheetFileName;
@@ -2203,6 +2343,11 @@ protected:
 
 #if BUILD_LITE!=1
     void applyDocumentStyleSheet();
+    /// remember main stylesheet rules the document styles are computed with
+    void saveRenderedStyleSheet();
+    /// recompute styles of only the elements matched by main stylesheet rules changed since last rendering,
+    /// returns false if a full styles recomputation is needed
+    bool restyleChangedElements( LVDocViewCallback * callback );
 #endif
 
 public:
@@ -2253,6 +2398,8 @@ public:
     void updateRenderContext();
     /// check document formatting parameters before render - whether we need to reformat; returns false if render is necessary
     bool checkRenderContext();
+    /// returns number of elements whose style was recomputed by the last styles update, -1 if none happened yet
+    int getLastRestyledNodeCount() { return _lastRestyledNodeCount; }
 #endif
 
 #if BUILD_LITE!=1
@@ -2605,6 +2752,16 @@ ldomDocument * LVParseHTMLStream( LVStreamRef stream,
                               const attr_def_t * attr_table=NULL,
                               const ns_def_t * ns_table=NULL );
 
+/// document cache counters
+struct ldomDocCacheStats
+{
+    int hits;       ///< cache files found and opened by this process
+    int misses;     ///< documents not found in cache by this process
+    int evictions;  ///< files removed by this process to keep cache size within limit
+    int files;      ///< number of files in cache
+    lvsize_t size;  ///< total size of files in cache
+};
+
 /// document cache
 class ldomDocCache
 {
@@ -2621,12 +2778,17 @@ public:
     static bool clear();
     /// returns true if cache is enabled (successfully initialized)
     static bool enabled();
+    /// returns cache counters
+    static ldomDocCacheStats getStats();
 };
 
 
 /// unit test for DOM
 void runTinyDomUnitTests();
 
+/// unit test for targeted restyle on stylesheet change
+void runStyleInvalidationUnitTests();
+
 /// pass true to enable CRC check for
 void enableCacheFileContentsValidation(bool enable);
 
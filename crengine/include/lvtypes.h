@@ -44,6 +44,50 @@ typedef long long int lInt64;       ///< signed 64 bit int
 typedef unsigned long long int lUInt64; ///< unsigned 64 bit int
 #endif
 
+#if (CR_CONCURRENT_DOCUMENTS==1)
+#if defined(_MSC_VER)
+#include <intrin.h>
+/// atomically increments int counter, returns new value
+#define CR_ATOMIC_INC(v) _InterlockedIncrement((volatile long*)&(v))
+/// atomically decrements int counter, returns new value
+#define CR_ATOMIC_DEC(v) _InterlockedDecrement((volatile long*)&(v))
+/// atomically adds to 64 bit counter
+#define CR_ATOMIC_ADD64(v, n) _InterlockedExchangeAdd64((volatile __int64*)&(v), (__int64)(n))
+// _ReadWriteBarrier() is compiler fence only, it does not order memory accesses on ARM;
+// interlocked intrinsics are full barriers on all targets (load is compare-exchange of 0 with 0)
+inline int crAtomicLoad( const volatile int & v ) { return (int)_InterlockedCompareExchange((volatile long*)&v, 0, 0); }
+template <class T> inline T * crAtomicLoad( T * const volatile & v ) { return (T*)_InterlockedCompareExchangePointer((void * volatile *)&v, 0, 0); }
+inline void crAtomicStore( volatile int & v, int x ) { _InterlockedExchange((volatile long*)&v, (long)x); }
+template <class T, class U> inline void crAtomicStore( T * volatile & v, U * x ) { _InterlockedExchangePointer((void * volatile *)&v, (void*)x); }
+/// reads value published by CR_ATOMIC_STORE of another thread
+#define CR_ATOMIC_LOAD(v) crAtomicLoad(v)
+/// publishes value after all preceding writes
+#define CR_ATOMIC_STORE(v, x) crAtomicStore((v), (x))
+/// storage class of per-thread variables
+#define CR_THREAD_LOCAL __declspec(thread)
+#else
+/// atomically increments int counter, returns new value
+#define CR_ATOMIC_INC(v) __atomic_add_fetch(&(v), 1, __ATOMIC_RELAXED)
+/// atomically decrements int counter, returns new value
+#define CR_ATOMIC_DEC(v) __atomic_sub_fetch(&(v), 1, __ATOMIC_ACQ_REL)
+/// atomically adds to 64 bit counter
+#define CR_ATOMIC_ADD64(v, n) __atomic_add_fetch(&(v), (n), __ATOMIC_RELAXED)
+/// reads value published by CR_ATOMIC_STORE of another thread
+#define CR_ATOMIC_LOAD(v) __atomic_load_n(&(v), __ATOMIC_ACQUIRE)
+/// publishes value after all preceding writes
+#define CR_ATOMIC_STORE(v, x) __atomic_store_n(&(v), (x), __ATOMIC_RELEASE)
+/// storage class of per-thread variables
+#define CR_THREAD_LOCAL __thread
+#endif
+#else
+#define CR_ATOMIC_INC(v) (++(v))
+#define CR_ATOMIC_DEC(v) (--(v))
+#define CR_ATOMIC_ADD64(v, n) ((v) += (n))
+#define CR_ATOMIC_LOAD(v) (v)
+#define CR_ATOMIC_STORE(v, x) ((v) = (x))
+#define CR_THREAD_LOCAL
+#endif
+
 /// platform-dependent path separator
 #if defined(_WIN32) && !defined(__WINE__)
 #define PATH_SEPARATOR_CHAR '\\'
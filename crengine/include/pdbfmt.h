@@ -9,7 +9,8 @@
 
 bool DetectPDBFormat( LVStreamRef stream, doc_format_t & contentFormat );
 bool ImportPDBDocument( LVStreamRef & stream, ldomDocument * doc, LVDocViewCallback * progressCallback, CacheLoadingCallback * formatCallback, doc_format_t & contentFormat );
-LVStreamRef GetPDBCoverpage(LVStreamRef stream);
+/// returns cover image of PDB/MOBI book, copies title and authors to props when not NULL
+LVStreamRef GetPDBCoverpage(LVStreamRef stream, CRPropRef props = CRPropRef());
 
 
 #endif // PDBFMT_H
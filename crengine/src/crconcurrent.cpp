@@ -9,6 +9,11 @@ CRMutex * _fontManMutex = NULL;
 CRMutex * _fontGlyphCacheMutex = NULL;
 CRMutex * _fontLocalGlyphCacheMutex = NULL;
 CRMutex * _crengineMutex = NULL;
+CRMutex * _stringMutex = NULL;
+CRMutex * _documentMutex = NULL;
+CRMutex * _memoryMutex = NULL;
+CRMutex * _styleSheetMutex = NULL;
+CRMutex * _svgImageCacheMutex = NULL;
 
 void CRSetupEngineConcurrency() {
     if (!concurrencyProvider) {
@@ -27,6 +32,16 @@ void CRSetupEngineConcurrency() {
         _fontLocalGlyphCacheMutex = concurrencyProvider->createMutex();
     if (!_crengineMutex)
     	_crengineMutex = concurrencyProvider->createMutex();
+    if (!_stringMutex)
+        _stringMutex = concurrencyProvider->createMutex();
+    if (!_documentMutex)
+        _documentMutex = concurrencyProvider->createMutex();
+    if (!_memoryMutex)
+        _memoryMutex = concurrencyProvider->createMutex();
+    if (!_styleSheetMutex)
+        _styleSheetMutex = concurrencyProvider->createMutex();
+    if (!_svgImageCacheMutex)
+        _svgImageCacheMutex = concurrencyProvider->createMutex();
 }
 
 CRConcurrencyProvider * concurrencyProvider = NULL;
@@ -14,6 +14,7 @@
 //include <unistd.h>      /* pause() */
 #include "../include/crgui.h"
 #include "../include/crtrace.h"
+#include "../include/crtest.h"
 
 //TODO: place to skin file
 #define ITEM_MARGIN 8
@@ -263,7 +264,6 @@ void CRGUIWindowManager::updateWindow( CRGUIWindow * window )
             _screen->invalidateRect( w->getRect() );
         }
     }
-/// invalidates rectangle: add it to bounding box of next partial update
     _screen->flush( false );
 }
 
@@ -479,49 +479,156 @@ void CRGUIWindowManager::showProgress( lString16 filename, int progressPercent )
     _lastProgressPercent = progressPercent;
 }
 
-void CRGUIScreenBase::flush( bool full )
+/// returns true if rectangles overlap or touch
+static bool rectsTouch( const lvRect & a, const lvRect & b )
+{
+    return a.left <= b.right && b.left <= a.right && a.top <= b.bottom && b.top <= a.bottom;
+}
+
+static int rectArea( const lvRect & rc )
+{
+    return rc.width() * rc.height();
+}
+
+void CRGUIDamageRegion::add( const lvRect & rect )
 {
-    if ( _updateRect.isEmpty() && !full && !getTurboUpdateEnabled() ) {
-        CRLog::trace("CRGUIScreenBase::flush() - update rectangle is empty");
+    if ( rect.isEmpty() )
         return;
+    lvRect rc( rect.left & ~7, rect.top, (rect.right + 7) & ~7, rect.bottom );
+    for ( int i=0; i<_rects.length(); ) {
+        if ( rectsTouch( _rects[i], rc ) ) {
+            // merged rectangle may now touch ones already checked
+            rc.extend( _rects[i] );
+            _rects.erase( i, 1 );
+            i = 0;
+        } else {
+            i++;
+        }
     }
-    if ( !_front.isNull() && !_updateRect.isEmpty() && !full ) {
-        // calculate really changed area
-        lvRect rc;
-        lvRect lineRect(_updateRect);
-        int sz = _canvas->GetRowSize();
-        for ( int y = _updateRect.top; y < _updateRect.bottom; y++ ) {
-            if ( y>=0 && y<_height ) {
-                void * line1 = _canvas->GetScanLine( y );
-                void * line2 = _front->GetScanLine( y );
-                if (memcmp( line1, line2, sz ) != 0) {
-                    // line content is different
-                    lineRect.top = y;
-                    lineRect.bottom = y+1;
-                    rc.extend( lineRect );
-                    // copy line to front buffer
-                    memcpy( line2, line1, sz );
+    _rects.add( rc );
+    if ( _rects.length() > CRGUI_MAX_DAMAGE_RECTS ) {
+        // merge the pair which adds least area to update
+        int best = -1;
+        int bestI = 0;
+        int bestJ = 1;
+        for ( int i=0; i<_rects.length(); i++ ) {
+            for ( int j=i+1; j<_rects.length(); j++ ) {
+                lvRect u = _rects[i];
+                u.extend( _rects[j] );
+                int growth = rectArea( u ) - rectArea( _rects[i] ) - rectArea( _rects[j] );
+                if ( best<0 || growth<best ) {
+                    best = growth;
+                    bestI = i;
+                    bestJ = j;
                 }
             }
         }
-        if ( rc.isEmpty() ) {
-            // no actual changes
-            _updateRect.clear();
-            return;
+        lvRect u = _rects[bestI];
+        u.extend( _rects[bestJ] );
+        _rects.erase( bestJ, 1 );
+        _rects.erase( bestI, 1 );
+        add( u );
+    }
+}
+
+lvRect CRGUIDamageRegion::getBounds() const
+{
+    lvRect rc;
+    for ( int i=0; i<_rects.length(); i++ )
+        rc.extend( _rects[i] );
+    return rc;
+}
+
+lvRect CRGUIScreenBase::copyChangedRows( const lvRect & rc )
+{
+    lvRect changed;
+    // row layout of draw buffers: 1 and 2 bpp are packed,
+    // other gray depths take byte per pixel, color bpp/8 bytes
+    int bpp = _canvas->GetBitsPerPixel();
+    int start, len;
+    if ( bpp <= 2 ) {
+        start = rc.left * bpp / 8;
+        len = (rc.right * bpp + 7) / 8 - start;
+    } else {
+        int bytes = bpp < 8 ? 1 : bpp / 8;
+        start = rc.left * bytes;
+        len = (rc.right - rc.left) * bytes;
+    }
+    for ( int y = rc.top; y < rc.bottom; y++ ) {
+        lUInt8 * line1 = _canvas->GetScanLine( y ) + start;
+        lUInt8 * line2 = _front->GetScanLine( y ) + start;
+        if ( memcmp( line1, line2, len ) != 0 ) {
+            // row content is different: copy it to front buffer
+            memcpy( line2, line1, len );
+            if ( changed.isEmpty() ) {
+                changed = rc;
+                changed.top = y;
+            }
+            changed.bottom = y + 1;
         }
-        _updateRect.top = rc.top;
-        _updateRect.bottom = rc.bottom;
     }
+    return changed;
+}
+
+void CRGUIScreenBase::flushRect( const lvRect & rc, bool full )
+{
+    if ( rc.isEmpty() )
+        return;
+    update( rc, full );
+    _lastFlushRects++;
+    _lastFlushPixels += rc.width() * rc.height();
+}
+
+void CRGUIScreenBase::flush( bool full )
+{
+    if ( _damage.isEmpty() && !full && !getTurboUpdateEnabled() ) {
+        CRLog::trace("CRGUIScreenBase::flush() - update region is empty");
+        return;
+    }
+    _lastFlushPixels = 0;
+    _lastFlushRects = 0;
     //if ( !full && !checkFullUpdateCounter() )
     //    full = false;
-    if ( full && !_front.isNull() ) {
-        // copy full screen to front buffer
-        _canvas->DrawTo( _front.get(), 0, 0, 0, NULL );
+    if ( full ) {
+        if ( !_front.isNull() ) {
+            // copy full screen to front buffer
+            _canvas->DrawTo( _front.get(), 0, 0, 0, NULL );
+        }
+        flushRect( getRect(), true );
+    } else if ( _damage.isEmpty() ) {
+        // turbo update
+        update( lvRect(), false );
+    } else {
+        // calculate really changed area
+        lvRect screen = getRect();
+        CRGUIDamageRegion changed;
+        for ( int i=0; i<_damage.length(); i++ ) {
+            lvRect rc = _damage.get( i );
+            if ( !rc.intersect( screen ) )
+                continue;
+            if ( _front.isNull() ) {
+                changed.add( rc );
+            } else if ( _tileSize<=0 ) {
+                changed.add( copyChangedRows( rc ) );
+            } else {
+                for ( int y = rc.top / _tileSize * _tileSize; y < rc.bottom; y += _tileSize ) {
+                    for ( int x = rc.left / _tileSize * _tileSize; x < rc.right; x += _tileSize ) {
+                        lvRect tile( x, y, x + _tileSize, y + _tileSize );
+                        tile.intersect( rc );
+                        changed.add( copyChangedRows( tile ) );
+                    }
+                }
+            }
+        }
+        for ( int i=0; i<changed.length(); i++ ) {
+            lvRect rc = changed.get( i );
+            if ( rc.intersect( screen ) )
+                flushRect( rc, false );
+        }
     }
-    if ( full )
-        _updateRect = getRect();
-    update( _updateRect, full );
-    _updateRect.clear();
+    _damage.clear();
+    _totalFlushPixels += _lastFlushPixels;
+    CRLog::trace("CRGUIScreenBase::flush() - %d pixels in %d rectangles", _lastFlushPixels, _lastFlushRects);
 }
 
 /// calculates title rectangle for specified window rectangle
@@ -2093,3 +2200,55 @@ bool CRGUICommandEvent::handle( CRGUIWindow * window )
         wm->postEvent( new CRGUIUpdateEvent(false) );
     return res;
 }
+
+/// screen with front buffer of given depth, which counts updated pixels only
+class CRGUITestScreen : public CRGUIScreenBase
+{
+    int _bpp;
+protected:
+    virtual void update( const lvRect &, bool ) { }
+public:
+    CRGUITestScreen( int dx, int dy, int bpp )
+        : CRGUIScreenBase( 0, 0, true ), _bpp( bpp )
+    {
+        _front = LVRef<LVDrawBuf>( createCanvas( 1, 1 ) );
+        setSize( dx, dy );
+    }
+    virtual LVDrawBuf * createCanvas( int dx, int dy )
+    {
+        if ( _bpp > 8 )
+            return new LVColorDrawBuf( dx, dy, _bpp );
+        return new LVGrayDrawBuf( dx, dy, _bpp );
+    }
+    bool frontMatches()
+    {
+        for ( int y=0; y<_height; y++ )
+            if ( memcmp( _canvas->GetScanLine( y ), _front->GetScanLine( y ), _canvas->GetRowSize() ) )
+                return false;
+        return true;
+    }
+};
+
+void runGuiUnitTests()
+{
+    CRLog::info("runGuiUnitTests()");
+    static const int depths[] = { 1, 2, 3, 4, 8, 16, 32 };
+    for ( int i=0; i<(int)(sizeof(depths)/sizeof(depths[0])); i++ ) {
+        for ( int tile=0; tile<=16; tile+=16 ) {
+            CRGUITestScreen screen( 96, 40, depths[i] );
+            screen.setTileDiffSize( tile );
+            screen.getCanvas()->Clear( 0xFFFFFF );
+            screen.flush( true );
+            // pixels over the whole width of rectangle, right half too
+            lvRect rc( 8, 4, 88, 20 );
+            screen.getCanvas()->FillRect( 8, 4, 88, 20, 0x000000 );
+            screen.getCanvas()->FillRect( 80, 30, 88, 36, 0x000000 );
+            screen.invalidateRect( rc );
+            screen.invalidateRect( lvRect( 80, 30, 88, 36 ) );
+            screen.flush( false );
+            MYASSERT( screen.frontMatches(), "damaged pixels copied to front buffer" );
+            MYASSERT( screen.getLastFlushPixels() >= 80 * 16 + 8 * 6, "damaged pixels flushed" );
+        }
+    }
+    CRLog::info("runGuiUnitTests() finished");
+}
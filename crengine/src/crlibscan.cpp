@@ -0,0 +1,504 @@
+/** \file crlibscan.cpp
+    \brief metadata and cover index of book library
+
+    This source code is distributed under the terms of
+    GNU General Public License.
+
+    See LICENSE file for details.
+
+*/
+
+#include "../include/crlibscan.h"
+#include "../include/crconcurrent.h"
+#include "../include/lvdocview.h"
+#include "../include/lvdrawbuf.h"
+#include "../include/lvimg.h"
+#include "../include/epubfmt.h"
+#include "../include/pdbfmt.h"
+
+bool ldomPack( const lUInt8 * buf, int bufsize, lUInt8 * &dstbuf, lUInt32 & dstsize );
+bool ldomUnpack( const lUInt8 * compbuf, int compsize, lUInt8 * &dstbuf, lUInt32 & dstsize  );
+
+#define LIBRARY_INDEX_MAGIC "CR3LIB01"
+/// symbolic links may loop directories
+#define LIBRARY_MAX_DIR_LEVEL 32
+
+lString16 CRBookInfo::getPathName() const
+{
+    if ( itemName.empty() )
+        return fileName;
+    return fileName + "@/" + itemName;
+}
+
+CRLibraryIndex::CRLibraryIndex() : _coversStart(0), _byFile(1024), _byPath(1024), _changed(false)
+{
+}
+
+CRLibraryIndex::~CRLibraryIndex()
+{
+    save();
+}
+
+bool CRLibraryIndex::open( const lString16 & fileName )
+{
+    _books.clear();
+    _byFile.clear();
+    _byPath.clear();
+    _stream.Clear();
+    _changed = false;
+    _fileName = fileName;
+    LVStreamRef stream = LVOpenFileStream( fileName.c_str(), LVOM_READ );
+    if ( stream.isNull() )
+        return false;
+    // magic, size of metadata part
+    lUInt8 hdr[12];
+    lvsize_t bytesRead = 0;
+    if ( stream->Read( hdr, sizeof(hdr), &bytesRead ) != LVERR_OK || bytesRead != sizeof(hdr) )
+        return false;
+    SerialBuf hbuf( hdr, sizeof(hdr) );
+    lUInt32 metaSize = 0;
+    if ( !hbuf.checkMagic( LIBRARY_INDEX_MAGIC ) || (hbuf >> metaSize).error()
+            || metaSize > stream->GetSize() - sizeof(hdr) ) {
+        CRLog::error("wrong library index file format: %s", LCSTR(fileName));
+        return false;
+    }
+    LVArray<lUInt8> meta( metaSize, 0 );
+    if ( stream->Read( meta.get(), metaSize, &bytesRead ) != LVERR_OK || bytesRead != metaSize )
+        return false;
+    SerialBuf buf( meta.get(), metaSize );
+    lUInt32 count = 0;
+    buf >> count;
+    for ( lUInt32 i=0; i < count && !buf.error(); i++ ) {
+        lString16 fn;
+        lUInt32 sizeLo, sizeHi, timeLo, timeHi, format, seriesNumber, coverWidth, coverHeight;
+        buf >> fn >> sizeLo >> sizeHi >> timeLo >> timeHi;
+        CRBookInfo * book = new CRBookInfo( fn, ((lUInt64)sizeHi << 32) | sizeLo, ((lUInt64)timeHi << 32) | timeLo );
+        buf >> book->itemName >> format >> book->title >> book->authors >> book->series >> seriesNumber
+            >> book->language >> coverWidth >> coverHeight >> book->coverOffset >> book->coverSize;
+        book->format = (int)format;
+        book->seriesNumber = (int)seriesNumber;
+        book->coverWidth = (int)coverWidth;
+        book->coverHeight = (int)coverHeight;
+        _books.add( book );
+        if ( !_byFile.get( fn ) )
+            _byFile.set( fn, book );
+        _byPath.set( book->getPathName(), book );
+    }
+    if ( buf.error() || !buf.checkCRC( buf.pos() ) ) {
+        CRLog::error("library index file is damaged: %s", LCSTR(fileName));
+        _books.clear();
+        _byFile.clear();
+        _byPath.clear();
+        return false;
+    }
+    _stream = stream;
+    _coversStart = sizeof(hdr) + metaSize;
+    CRLog::info("Library index %s read ok, %d entries", LCSTR(fileName), _books.length());
+    return true;
+}
+
+bool CRLibraryIndex::readCover( CRBookInfo * book, LVArray<lUInt8> & data )
+{
+    if ( book->cover.length() ) {
+        data = book->cover;
+        return true;
+    }
+    if ( !book->coverSize || _stream.isNull() )
+        return false;
+    data.clear();
+    data.addSpace( book->coverSize );
+    lvsize_t bytesRead = 0;
+    return _stream->SetPos( _coversStart + book->coverOffset ) == _coversStart + book->coverOffset
+        && _stream->Read( data.get(), book->coverSize, &bytesRead ) == LVERR_OK && bytesRead == book->coverSize;
+}
+
+bool CRLibraryIndex::save()
+{
+    if ( !_changed || _fileName.empty() )
+        return true;
+    SerialBuf buf( 65536, true );
+    buf.putMagic( LIBRARY_INDEX_MAGIC );
+    buf << (lUInt32)0;
+    lUInt32 start = buf.pos();
+    buf << (lUInt32)_books.length();
+    // offsets of covers in new file, written in the same order
+    LVArray<lUInt32> offsets( _books.length(), 0 );
+    LVArray<lUInt32> sizes( _books.length(), 0 );
+    lUInt32 offset = 0;
+    for ( int i=0; i < _books.length(); i++ ) {
+        CRBookInfo * book = _books[i];
+        lUInt32 size = book->cover.length() ? (lUInt32)book->cover.length() : book->coverSize;
+        if ( !book->coverWidth )
+            size = 0;
+        offsets[i] = offset;
+        sizes[i] = size;
+        offset += size;
+        buf << book->fileName
+            << (lUInt32)(book->fileSize & 0xFFFFFFFF) << (lUInt32)(book->fileSize >> 32)
+            << (lUInt32)(book->fileTime & 0xFFFFFFFF) << (lUInt32)(book->fileTime >> 32)
+            << book->itemName << (lUInt32)book->format << book->title << book->authors << book->series
+            << (lUInt32)book->seriesNumber << book->language
+            << (lUInt32)book->coverWidth << (lUInt32)book->coverHeight << offsets[i] << size;
+    }
+    buf.putCRC( buf.pos() - start );
+    int end = buf.pos();
+    buf.setPos( start - 4 );
+    buf << (lUInt32)(end - start);
+    buf.setPos( end );
+    if ( buf.error() )
+        return false;
+    // covers of unchanged books are copied from current file, so new file is written aside
+    lString16 tmpName = _fileName + ".tmp";
+    {
+        LVStreamRef out = LVOpenFileStream( tmpName.c_str(), LVOM_WRITE );
+        if ( out.isNull() ) {
+            CRLog::error("cannot write library index %s", LCSTR(_fileName));
+            return false;
+        }
+        if ( out->Write( buf.buf(), buf.pos(), NULL ) != LVERR_OK )
+            return false;
+        LVArray<lUInt8> data;
+        for ( int i=0; i < _books.length(); i++ ) {
+            if ( !sizes[i] )
+                continue;
+            if ( !readCover( _books[i], data ) || out->Write( data.get(), data.length(), NULL ) != LVERR_OK ) {
+                CRLog::error("cannot copy cover to library index %s", LCSTR(_fileName));
+                out.Clear();
+                LVDeleteFile( tmpName );
+                return false;
+            }
+        }
+    }
+    _stream.Clear();
+    LVDeleteFile( _fileName );
+    if ( !LVRenameFile( tmpName, _fileName ) ) {
+        CRLog::error("cannot replace library index %s", LCSTR(_fileName));
+        return false;
+    }
+    _stream = LVOpenFileStream( _fileName.c_str(), LVOM_READ );
+    _coversStart = end;
+    for ( int i=0; i < _books.length(); i++ ) {
+        _books[i]->coverOffset = offsets[i];
+        _books[i]->coverSize = sizes[i];
+        _books[i]->cover.clear();
+    }
+    _changed = false;
+    return true;
+}
+
+bool CRLibraryIndex::isUpToDate( const lString16 & fileName, lUInt64 fileSize, lUInt64 fileTime )
+{
+    CRBookInfo * book = _byFile.get( fileName );
+    return book && book->fileSize == fileSize && book->fileTime == fileTime;
+}
+
+void CRLibraryIndex::removeFile( const lString16 & fileName )
+{
+    if ( !_byFile.get( fileName ) )
+        return;
+    for ( int i=_books.length() - 1; i >= 0; i-- ) {
+        if ( _books[i]->fileName == fileName ) {
+            CRBookInfo * book = _books.remove( i );
+            _byPath.remove( book->getPathName() );
+            delete book;
+        }
+    }
+    _byFile.remove( fileName );
+    _changed = true;
+}
+
+void CRLibraryIndex::update( const lString16 & fileName, LVPtrVector<CRBookInfo> & books )
+{
+    removeFile( fileName );
+    for ( int i=0; i < books.length(); i++ ) {
+        CRBookInfo * book = books[i];
+        _books.add( book );
+        if ( !i )
+            _byFile.set( fileName, book );
+        _byPath.set( book->getPathName(), book );
+    }
+    // index owns books now
+    while ( books.length() )
+        books.remove( books.length() - 1 );
+    _changed = true;
+}
+
+int CRLibraryIndex::removeMissing( const lString16 & dir, LVHashTable<lString16, bool> & seen )
+{
+    lString16 prefix = dir;
+    LVAppendPathDelimiter( prefix );
+    lString16Collection gone;
+    for ( int i=0; i < _books.length(); i++ ) {
+        const lString16 & fn = _books[i]->fileName;
+        if ( fn.startsWith( prefix ) && !seen.get( fn ) && _byFile.get( fn ) == _books[i] )
+            gone.add( fn );
+    }
+    for ( int i=0; i < gone.length(); i++ )
+        removeFile( gone[i] );
+    return gone.length();
+}
+
+LVColorDrawBuf * CRLibraryIndex::getCover( CRBookInfo * book )
+{
+    LVArray<lUInt8> data;
+    if ( !book->coverWidth || !readCover( book, data ) )
+        return NULL;
+    lUInt8 * pixels = NULL;
+    lUInt32 size = 0;
+    if ( !ldomUnpack( data.get(), data.length(), pixels, size ) )
+        return NULL;
+    int rowSize = book->coverWidth * 2;
+    LVColorDrawBuf * buf = NULL;
+    if ( size == (lUInt32)(rowSize * book->coverHeight) ) {
+        buf = new LVColorDrawBuf( book->coverWidth, book->coverHeight, 16 );
+        for ( int y=0; y < book->coverHeight; y++ )
+            memcpy( buf->GetScanLine( y ), pixels + y * rowSize, rowSize );
+    }
+    free( pixels );
+    return buf;
+}
+
+/// reads files of one scan: each thread takes next file in turn, results are kept by file index
+class CRLibraryScanTask : public CRRunnable
+{
+    CRLibraryScanner * _scanner;
+    lString16Collection & _files;
+    LVArray<lUInt64> & _sizes;
+    LVArray<lUInt64> & _times;
+    int _next;
+public:
+    LVPtrVector< LVPtrVector<CRBookInfo> > results;
+    CRLibraryScanTask( CRLibraryScanner * scanner, lString16Collection & files, LVArray<lUInt64> & sizes, LVArray<lUInt64> & times )
+        : _scanner(scanner), _files(files), _sizes(sizes), _times(times), _next(0)
+    {
+        for ( int i=0; i < files.length(); i++ )
+            results.add( new LVPtrVector<CRBookInfo>() );
+    }
+    virtual void run()
+    {
+        for ( ;; ) {
+            int i = CR_ATOMIC_INC( _next ) - 1;
+            if ( i >= _files.length() )
+                break;
+            _scanner->scanFile( _files[i], _sizes[i], _times[i], *results[i] );
+        }
+    }
+};
+
+CRLibraryScanner::CRLibraryScanner( int threads, int coverWidth, int coverHeight )
+    : _threads(threads), _coverWidth(coverWidth), _coverHeight(coverHeight), _loadMutex(NULL)
+{
+}
+
+static const char * libraryBookExtensions[] = {
+    ".fb2", ".fb3", ".epub", ".txt", ".tcr", ".pml", ".rtf", ".doc", ".docx", ".chm",
+    ".htm", ".html", ".shtml", ".xhtml", ".pdb", ".prc", ".mobi", ".azw", ".azw3", NULL
+};
+
+/// 0 for other files, 1 for books, 2 for archives of books
+static int libraryFileKind( const lString16 & fileName )
+{
+    lString16 name = fileName;
+    name.lowercase();
+    if ( name.endsWith(".zip") )
+        return 2;
+    for ( int i=0; libraryBookExtensions[i]; i++ )
+        if ( name.endsWith( libraryBookExtensions[i] ) )
+            return 1;
+    return 0;
+}
+
+void CRLibraryScanner::findFiles( const lString16 & dir, int level, CRLibraryIndex & index, lString16Collection & files,
+                                  LVArray<lUInt64> & sizes, LVArray<lUInt64> & times, LVHashTable<lString16, bool> & seen,
+                                  CRLibraryScanStats & stats )
+{
+    LVContainerRef container = LVOpenDirectory( dir.c_str() );
+    if ( container.isNull() )
+        return;
+    lString16 path = dir;
+    LVAppendPathDelimiter( path );
+    for ( int i=0; i < container->GetObjectCount(); i++ ) {
+        const LVContainerItemInfo * item = container->GetObjectInfo( i );
+        lString16 fileName = path + item->GetName();
+        if ( item->IsContainer() ) {
+            if ( level < LIBRARY_MAX_DIR_LEVEL )
+                findFiles( fileName, level + 1, index, files, sizes, times, seen, stats );
+            continue;
+        }
+        lUInt64 size, time;
+        if ( !libraryFileKind( fileName ) || !LVGetFileInfo( fileName, size, time ) )
+            continue;
+        stats.files++;
+        seen.set( fileName, true );
+        if ( index.isUpToDate( fileName, size, time ) ) {
+            stats.unchanged++;
+            continue;
+        }
+        files.add( fileName );
+        sizes.add( size );
+        times.add( time );
+    }
+}
+
+CRLibraryScanStats CRLibraryScanner::scan( CRLibraryIndex & index, const lString16 & dir )
+{
+    CRLibraryScanStats stats;
+    lString16Collection files;
+    LVArray<lUInt64> sizes;
+    LVArray<lUInt64> times;
+    LVHashTable<lString16, bool> seen( 1024 );
+    lString16 path = dir;
+    LVRemovePathDelimiter( path );
+    findFiles( path, 0, index, files, sizes, times, seen, stats );
+    stats.removed = index.removeMissing( path, seen );
+    stats.scanned = files.length();
+    CRLibraryScanTask task( this, files, sizes, times );
+#if (CR_CONCURRENT_DOCUMENTS==1)
+    LVPtrVector<CRThread> threads;
+    if ( concurrencyProvider && files.length() > 1 ) {
+        _loadMutex = concurrencyProvider->createMutex();
+        for ( int i=1; i < _threads && i < files.length(); i++ ) {
+            CRThread * thread = concurrencyProvider->createThread( &task );
+            thread->start();
+            threads.add( thread );
+        }
+    }
+    task.run();
+    for ( int i=0; i < threads.length(); i++ )
+        threads[i]->join();
+    threads.clear();
+    delete _loadMutex;
+    _loadMutex = NULL;
+#else
+    task.run();
+#endif
+    for ( int i=0; i < files.length(); i++ )
+        index.update( files[i], *task.results[i] );
+    for ( int i=0; i < index.length(); i++ )
+        if ( index.get(i)->format != doc_format_none )
+            stats.books++;
+    return stats;
+}
+
+void CRLibraryScanner::scanFile( const lString16 & fileName, lUInt64 fileSize, lUInt64 fileTime, LVPtrVector<CRBookInfo> & books )
+{
+    LVStreamRef stream = LVOpenFileStream( fileName.c_str(), LVOM_READ );
+    if ( !stream.isNull() && libraryFileKind( fileName ) == 2 && !DetectEpubFormat( stream ) ) {
+        LVContainerRef arc = LVOpenArchieve( stream );
+        for ( int i=0; !arc.isNull() && i < arc->GetObjectCount(); i++ ) {
+            const LVContainerItemInfo * item = arc->GetObjectInfo( i );
+            if ( item->IsContainer() || libraryFileKind( item->GetName() ) != 1 )
+                continue;
+            LVStreamRef itemStream = arc->OpenStream( item->GetName(), LVOM_READ );
+            if ( itemStream.isNull() )
+                continue;
+            CRBookInfo * book = new CRBookInfo( fileName, fileSize, fileTime );
+            book->itemName = item->GetName();
+            scanBook( itemStream, book->getPathName(), book );
+            books.add( book );
+        }
+    } else if ( !stream.isNull() ) {
+        CRBookInfo * book = new CRBookInfo( fileName, fileSize, fileTime );
+        scanBook( stream, fileName, book );
+        books.add( book );
+    }
+    // remember files without books too, to not read them on next scan
+    if ( !books.length() )
+        books.add( new CRBookInfo( fileName, fileSize, fileTime ) );
+}
+
+void CRLibraryScanner::scanBook( LVStreamRef stream, const lString16 & pathName, CRBookInfo * book )
+{
+    CRPropRef props = LVCreatePropsContainer();
+    LVStreamRef cover;
+    doc_format_t format = doc_format_none;
+    stream->SetPos( 0 );
+    if ( DetectEpubFormat( stream ) ) {
+        // OPF package only, cover file name is found in manifest
+        ldomDocument doc;
+        stream->SetPos( 0 );
+        if ( ImportEpubDocument( stream, &doc, NULL, NULL, true ) ) {
+            format = doc_format_epub;
+            props = doc.getProps();
+            lString16 coverFile = props->getStringDef( DOC_PROP_COVER_FILE );
+            if ( !coverFile.empty() && !doc.getContainer().isNull() )
+                cover = doc.getContainer()->OpenStream( coverFile.c_str(), LVOM_READ );
+        }
+    } else if ( (stream->SetPos( 0 ), DetectPDBFormat( stream, format )) ) {
+        stream->SetPos( 0 );
+        cover = GetPDBCoverpage( stream, props );
+        format = doc_format_pdb;
+    } else if ( lString16(pathName).lowercase().endsWith(".fb2") ) {
+        stream->SetPos( 0 );
+        if ( LVReadFB2Properties( stream, props ) ) {
+            format = doc_format_fb2;
+            stream->SetPos( 0 );
+            cover = GetFB2Coverpage( stream );
+        }
+    }
+    if ( format == doc_format_none ) {
+        // document cache is shared by documents of all threads
+        CRGuard guard( _loadMutex );
+        CR_UNUSED( guard );
+        LVDocView view( 32, true );
+        if ( view.LoadDocument( pathName.c_str(), true ) ) {
+            format = view.getDocFormat();
+            props = view.getDocProps();
+            cover = view.getCoverPageImageStream();
+            if ( !cover.isNull() )
+                cover = LVCreateMemoryStream( cover );
+        }
+    }
+    if ( format == doc_format_none )
+        return;
+    book->format = format;
+    book->title = props->getStringDef( DOC_PROP_TITLE ).trim();
+    book->authors = props->getStringDef( DOC_PROP_AUTHORS ).trim();
+    book->language = props->getStringDef( DOC_PROP_LANGUAGE ).trim();
+    book->series = props->getStringDef( DOC_PROP_SERIES_NAME ).trim();
+    book->seriesNumber = props->getIntDef( DOC_PROP_SERIES_NUMBER, 0 );
+    if ( !cover.isNull() )
+        makeCover( cover, book );
+}
+
+void CRLibraryScanner::makeCover( LVStreamRef imageStream, CRBookInfo * book )
+{
+    // GetFB2Coverpage() gives empty stream when coverpage binary is not found
+    if ( !imageStream->GetSize() )
+        return;
+    LVImageSourceRef image = LVCreateStreamImageSource( imageStream );
+    if ( image.isNull() || image->GetWidth() <= 0 || image->GetHeight() <= 0 )
+        return;
+    // fit into thumbnail size keeping aspect ratio, never enlarge
+    int dx = image->GetWidth();
+    int dy = image->GetHeight();
+    if ( dx > _coverWidth ) {
+        dy = dy * _coverWidth / dx;
+        dx = _coverWidth;
+    }
+    if ( dy > _coverHeight ) {
+        dx = dx * _coverHeight / dy;
+        dy = _coverHeight;
+    }
+    if ( dx < 1 )
+        dx = 1;
+    if ( dy < 1 )
+        dy = 1;
+    LVColorDrawBuf buf( dx, dy, 16 );
+    buf.setSmoothScalingImages( true );
+    buf.FillRect( 0, 0, dx, dy, 0xFFFFFF );
+    buf.Draw( image, 0, 0, dx, dy, false );
+    int rowSize = dx * 2;
+    LVArray<lUInt8> pixels( rowSize * dy, 0 );
+    for ( int y=0; y < dy; y++ )
+        memcpy( pixels.get() + y * rowSize, buf.GetScanLine( y ), rowSize );
+    lUInt8 * packed = NULL;
+    lUInt32 packedSize = 0;
+    if ( !ldomPack( pixels.get(), pixels.length(), packed, packedSize ) )
+        return;
+    book->cover.clear();
+    book->cover.add( packed, packedSize );
+    free( packed );
+    book->coverWidth = dx;
+    book->coverHeight = dy;
+}
@@ -0,0 +1,288 @@
+/** \file crmemgov.cpp
+    \brief memory budget shared by engine caches
+
+    This source code is distributed under the terms of
+    GNU General Public License.
+
+    See LICENSE file for details.
+
+*/
+
+#include "../include/crmemgov.h"
+#include "../include/lvarray.h"
+#include "../include/crlocks.h"
+#include "../include/crtest.h"
+#include <stdio.h>
+
+/// part of budget given to each active subsystem regardless of its hits, 1/N
+#define CRMEM_MIN_SHARE_DIVISOR 4
+/// share of subsystem above minimal one is capped by this multiple of memory it uses
+#define CRMEM_DEMAND_FACTOR 2
+
+struct CRMemoryEntry {
+    CRMemoryConsumer * consumer;
+    int lastHits;
+    CRMemoryEntry() : consumer(NULL), lastHits(0) { }
+    CRMemoryEntry( CRMemoryConsumer * c ) : consumer(c), lastHits(c->getMemoryHits()) { }
+};
+
+static const char * crmem_names[CRMEM_SUBSYSTEM_COUNT] = {
+    "text",
+    "elements",
+    "rects",
+    "styles",
+    "glyphs",
+    "page_images",
+    "stream_buffers",
+    "svg_images",
+};
+
+/// approximate cost of one hit in microseconds, i.e. of making again data hit
+/// in cache: makes hit counts of subsystems comparable
+static const int crmem_hitCost[CRMEM_SUBSYSTEM_COUNT] = {
+    50,     // text: storage chunk unpacked again on chunk switch
+    50,     // elements
+    50,     // rects
+    50,     // styles
+    2,      // glyphs: one glyph rendered again on lookup
+    20000,  // page_images: page drawn again
+    20,     // stream_buffers: buffer read again
+    1000,   // svg_images: SVG parsed again
+};
+
+static int crmem_budget = 0;
+static LVArray<CRMemoryEntry> crmem_consumers;
+/// decayed hits of subsystems
+static lUInt64 crmem_value[CRMEM_SUBSYSTEM_COUNT];
+/// bytes assigned to subsystems by last rebalance
+static lUInt64 crmem_share[CRMEM_SUBSYSTEM_COUNT];
+
+static void crmemApplyLimits( bool countHits )
+{
+    int count[CRMEM_SUBSYSTEM_COUNT];
+    lUInt64 recent[CRMEM_SUBSYSTEM_COUNT];
+    lUInt64 used[CRMEM_SUBSYSTEM_COUNT];
+    for ( int s=0; s<CRMEM_SUBSYSTEM_COUNT; s++ ) {
+        count[s] = 0;
+        recent[s] = 0;
+        used[s] = 0;
+        crmem_share[s] = 0;
+    }
+    for ( int i=0; i<crmem_consumers.length(); i++ ) {
+        CRMemoryEntry & e = crmem_consumers[i];
+        int s = e.consumer->getMemorySubsystem();
+        count[s]++;
+        used[s] += e.consumer->getMemoryUsed();
+        if ( countHits ) {
+            int hits = e.consumer->getMemoryHits();
+            recent[s] += (lUInt32)(hits - e.lastHits);
+            e.lastHits = hits;
+        }
+    }
+    if ( !crmem_budget ) {
+        for ( int i=0; i<crmem_consumers.length(); i++ )
+            crmem_consumers[i].consumer->setMemoryLimit( 0 );
+        return;
+    }
+    int active = 0;
+    for ( int s=0; s<CRMEM_SUBSYSTEM_COUNT; s++ ) {
+        if ( countHits )
+            crmem_value[s] = crmem_value[s] / 2 + recent[s];
+        if ( count[s] )
+            active++;
+    }
+    if ( !active )
+        return;
+    // each subsystem gets minimal share, the rest is split by cost of hits
+    // between subsystems which did not reach demand cap; what capped ones
+    // can't take goes to others, and stays unassigned if all are capped
+    lUInt64 minShare = (lUInt64)crmem_budget / (CRMEM_MIN_SHARE_DIVISOR * active);
+    lUInt64 rest = (lUInt64)crmem_budget - minShare * active;
+    lUInt64 cap[CRMEM_SUBSYSTEM_COUNT];
+    bool open[CRMEM_SUBSYSTEM_COUNT];
+    for ( int s=0; s<CRMEM_SUBSYSTEM_COUNT; s++ ) {
+        open[s] = count[s] > 0;
+        if ( !open[s] )
+            continue;
+        crmem_share[s] = minShare;
+        cap[s] = countHits ? used[s] * CRMEM_DEMAND_FACTOR : crmem_budget;
+        if ( cap[s] <= minShare )
+            open[s] = false;
+    }
+    while ( rest ) {
+        int openCount = 0;
+        double total = 0;
+        for ( int s=0; s<CRMEM_SUBSYSTEM_COUNT; s++ ) {
+            if ( open[s] ) {
+                openCount++;
+                total += (double)crmem_value[s] * crmem_hitCost[s];
+            }
+        }
+        if ( !openCount )
+            break;
+        bool capped = false;
+        lUInt64 given = 0;
+        for ( int s=0; s<CRMEM_SUBSYSTEM_COUNT; s++ ) {
+            if ( !open[s] )
+                continue;
+            lUInt64 add = total > 0 ? (lUInt64)( rest * ( (double)crmem_value[s] * crmem_hitCost[s] / total ) ) : rest / openCount;
+            if ( crmem_share[s] + add >= cap[s] ) {
+                add = cap[s] - crmem_share[s];
+                open[s] = false;
+                capped = true;
+            }
+            crmem_share[s] += add;
+            given += add;
+        }
+        rest -= given < rest ? given : rest;
+        if ( !capped )
+            break;
+    }
+    for ( int i=0; i<crmem_consumers.length(); i++ ) {
+        CRMemoryConsumer * c = crmem_consumers[i].consumer;
+        int s = c->getMemorySubsystem();
+        int limit = (int)(crmem_share[s] / count[s]);
+        c->setMemoryLimit( limit > 0 ? limit : 1 );
+    }
+}
+
+void CRMemoryGovernor::setBudget( int bytes )
+{
+    MEMORY_GUARD
+    crmem_budget = bytes > 0 ? bytes : 0;
+    crmemApplyLimits( false );
+}
+
+int CRMemoryGovernor::getBudget()
+{
+    MEMORY_GUARD
+    return crmem_budget;
+}
+
+void CRMemoryGovernor::addConsumer( CRMemoryConsumer * consumer )
+{
+    MEMORY_GUARD
+    crmem_consumers.add( CRMemoryEntry(consumer) );
+    if ( crmem_budget )
+        crmemApplyLimits( false );
+}
+
+void CRMemoryGovernor::removeConsumer( CRMemoryConsumer * consumer )
+{
+    MEMORY_GUARD
+    for ( int i=0; i<crmem_consumers.length(); i++ ) {
+        if ( crmem_consumers[i].consumer == consumer ) {
+            crmem_consumers.erase( i, 1 );
+            break;
+        }
+    }
+}
+
+void CRMemoryGovernor::rebalance()
+{
+    MEMORY_GUARD
+    if ( crmem_budget )
+        crmemApplyLimits( true );
+}
+
+void CRMemoryGovernor::trim( CRMemoryTrimLevel level )
+{
+    MEMORY_GUARD
+    for ( int i=0; i<crmem_consumers.length(); i++ ) {
+        CRMemoryConsumer * c = crmem_consumers[i].consumer;
+        c->trimMemory( level == CRMEM_TRIM_MODERATE ? c->getMemoryUsed() / 2 : 0 );
+    }
+}
+
+CRMemoryStats CRMemoryGovernor::getStats( CRMemorySubsystem subsystem )
+{
+    MEMORY_GUARD
+    CRMemoryStats res;
+    res.consumers = 0;
+    res.used = 0;
+    res.limit = crmem_share[subsystem];
+    res.hits = 0;
+    for ( int i=0; i<crmem_consumers.length(); i++ ) {
+        CRMemoryConsumer * c = crmem_consumers[i].consumer;
+        if ( c->getMemorySubsystem() != subsystem )
+            continue;
+        res.consumers++;
+        res.used += c->getMemoryUsed();
+        res.hits += c->getMemoryHits();
+    }
+    return res;
+}
+
+const char * CRMemoryGovernor::getName( CRMemorySubsystem subsystem )
+{
+    return crmem_names[subsystem];
+}
+
+lString8 CRMemoryGovernor::getStatsJson()
+{
+    lString8 res("{");
+    char buf[256];
+    for ( int s=0; s<CRMEM_SUBSYSTEM_COUNT; s++ ) {
+        CRMemoryStats stats = getStats( (CRMemorySubsystem)s );
+        sprintf( buf, "%s\n  \"%s\": { \"consumers\": %d, \"used\": %llu, \"limit\": %llu, \"hits\": %llu }",
+                 s ? "," : "", crmem_names[s], stats.consumers, (unsigned long long)stats.used,
+                 (unsigned long long)stats.limit, (unsigned long long)stats.hits );
+        res << buf;
+    }
+    res << "\n}\n";
+    return res;
+}
+
+class CRTestMemoryConsumer : public CRMemoryConsumer {
+public:
+    CRMemorySubsystem subsystem;
+    int used;
+    int hits;
+    int limit;
+    CRTestMemoryConsumer( CRMemorySubsystem s, int u ) : subsystem(s), used(u), hits(0), limit(0) { }
+    virtual CRMemorySubsystem getMemorySubsystem() { return subsystem; }
+    virtual int getMemoryUsed() { return used; }
+    virtual int getMemoryHits() { return hits; }
+    virtual void setMemoryLimit( int l ) { limit = l; }
+    virtual void trimMemory( int target ) { if ( used > target ) used = target; }
+};
+
+void runMemoryGovernorUnitTests()
+{
+    CRLog::info("runMemoryGovernorUnitTests()");
+    int oldBudget = CRMemoryGovernor::getBudget();
+    CRTestMemoryConsumer a( CRMEM_TEXT_STORAGE, 300000 );
+    CRTestMemoryConsumer b( CRMEM_STREAM_BUFFERS, 300000 );
+    CRMemoryGovernor::addConsumer( &a );
+    CRMemoryGovernor::addConsumer( &b );
+    CRMemoryGovernor::setBudget( 0 );
+    MYASSERT( a.limit == 0 && b.limit == 0, "no budget: built-in limits" );
+    CRMemoryGovernor::setBudget( 1000000 );
+    MYASSERT( a.limit > 0 && a.limit == b.limit, "budget without hits: even shares" );
+    a.hits += 1000;
+    b.hits += 1000;
+    CRMemoryGovernor::rebalance();
+    MYASSERT( a.limit > b.limit, "rebalance: hits weighted by their cost" );
+    MYASSERT( a.limit + b.limit <= 1000000, "rebalance: shares fit budget" );
+    b.hits += 5000;
+    CRMemoryGovernor::rebalance();
+    MYASSERT( b.limit > a.limit, "rebalance: recent hits outweigh older ones" );
+    // many hits of small cache don't take memory which other cache needs
+    b.used = 1000;
+    b.hits += 10000000;
+    a.hits += 100000;
+    CRMemoryGovernor::rebalance();
+    MYASSERT( b.limit >= 1000000 / (CRMEM_MIN_SHARE_DIVISOR * CRMEM_SUBSYSTEM_COUNT), "rebalance: minimal share" );
+    MYASSERT( b.limit <= 1000000 / (CRMEM_MIN_SHARE_DIVISOR * 2), "rebalance: share capped by demand" );
+    MYASSERT( a.limit > 4 * b.limit && a.limit <= 300000 * CRMEM_DEMAND_FACTOR, "rebalance: surplus goes to other caches" );
+    CRMemoryStats stats = CRMemoryGovernor::getStats( CRMEM_TEXT_STORAGE );
+    MYASSERT( stats.consumers >= 1 && stats.used >= 300000 && stats.limit >= (lUInt64)a.limit, "statistics" );
+    CRMemoryGovernor::trim( CRMEM_TRIM_MODERATE );
+    MYASSERT( a.used == 150000 && b.used == 500, "moderate trim halves caches" );
+    CRMemoryGovernor::trim( CRMEM_TRIM_COMPLETE );
+    MYASSERT( a.used == 0 && b.used == 0, "complete trim empties caches" );
+    CRMemoryGovernor::removeConsumer( &a );
+    CRMemoryGovernor::removeConsumer( &b );
+    CRMemoryGovernor::setBudget( oldBudget );
+    CRLog::info("runMemoryGovernorUnitTests() finished");
+}
@@ -1,6 +1,7 @@
 #include "../include/crtest.h"
 #include "../include/lvtinydom.h"
 #include "../include/chmfmt.h"
+#include "../include/lvdrawbuf.h"
 
 #ifdef _DEBUG
 
@@ -178,6 +179,9 @@ void runCRUnitTests()
 #if 0 && defined(_DEBUG)
     //runCHMUnitTest();
     runTinyDomUnitTests();
+    runStyleInvalidationUnitTests();
     testTxtSelector();
+    runDrawBufUnitTests();
+    runImageUnitTests();
 #endif
 }
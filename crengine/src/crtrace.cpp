@@ -0,0 +1,167 @@
+/** \file crtrace.cpp
+    \brief timers and counters of engine phases
+
+    This source code is distributed under the terms of
+    GNU General Public License.
+
+    See LICENSE file for details.
+
+*/
+
+#include "../include/crtrace.h"
+#include <stdio.h>
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+/// maximum number of events recorded in CRTRACE_MODE_EVENTS, later ones are dropped
+#define CRTRACE_MAX_EVENTS 65536
+
+struct CRTraceEvent {
+    lUInt64 start;
+    lUInt32 duration;
+    lUInt16 point;
+    lUInt16 thread;
+};
+
+static const char * crtrace_names[CRTRACE_POINT_COUNT] = {
+    "parse",
+    "style",
+    "render",
+    "paginate",
+    "draw",
+    "draw_quantize",
+    "cache_save",
+    "cache_load",
+    "chunk_pack",
+    "chunk_unpack",
+    "glyph_render",
+    "image_decode",
+    "glyph_cache_hit",
+    "widths_cache_hit",
+    "kerning_cache_hit",
+};
+
+int CRTrace::_mode = CRTRACE_MODE_OFF;
+
+static CRTraceStats crtrace_stats[CRTRACE_POINT_COUNT];
+static CRTraceEvent * crtrace_events = NULL;
+static int crtrace_eventCount = 0;
+static int crtrace_threadCount = 0;
+static lUInt64 crtrace_startTime = 0;
+
+static int crtraceThreadId()
+{
+    static CR_THREAD_LOCAL int id = 0;
+    if ( !id )
+        id = CR_ATOMIC_INC( crtrace_threadCount );
+    return id;
+}
+
+lUInt64 CRTrace::now()
+{
+#if defined(_WIN32)
+    static LARGE_INTEGER freq;
+    if ( !freq.QuadPart )
+        QueryPerformanceFrequency( &freq );
+    LARGE_INTEGER t;
+    QueryPerformanceCounter( &t );
+    return (lUInt64)(t.QuadPart / freq.QuadPart * 1000000 + t.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart) + 1;
+#else
+    timespec t;
+    clock_gettime( CLOCK_MONOTONIC, &t );
+    return (lUInt64)t.tv_sec * 1000000 + t.tv_nsec / 1000 + 1;
+#endif
+}
+
+void CRTrace::setMode( CRTraceMode mode )
+{
+    _mode = CRTRACE_MODE_OFF;
+    if ( mode == CRTRACE_MODE_EVENTS && !crtrace_events )
+        crtrace_events = (CRTraceEvent *)malloc( sizeof(CRTraceEvent) * CRTRACE_MAX_EVENTS );
+    if ( mode != CRTRACE_MODE_EVENTS && crtrace_events ) {
+        free( crtrace_events );
+        crtrace_events = NULL;
+    }
+    reset();
+    _mode = mode;
+}
+
+void CRTrace::reset()
+{
+    memset( crtrace_stats, 0, sizeof(crtrace_stats) );
+    crtrace_eventCount = 0;
+    crtrace_startTime = now();
+}
+
+void CRTrace::count( CRTracePoint point, int n )
+{
+    CR_ATOMIC_ADD64( crtrace_stats[point].count, n );
+}
+
+void CRTrace::add( CRTracePoint point, lUInt64 startUs, lUInt64 endUs )
+{
+    CR_ATOMIC_ADD64( crtrace_stats[point].count, 1 );
+    CR_ATOMIC_ADD64( crtrace_stats[point].totalUs, endUs - startUs );
+    if ( !crtrace_events || point == CRTRACE_STYLE || point == CRTRACE_GLYPH_RENDER )
+        return;
+    // counter stops once buffer is full (exceeded by concurrent threads at most), so it can't wrap
+    if ( CR_ATOMIC_LOAD( crtrace_eventCount ) >= CRTRACE_MAX_EVENTS )
+        return;
+    int index = CR_ATOMIC_INC( crtrace_eventCount ) - 1;
+    if ( index >= CRTRACE_MAX_EVENTS )
+        return;
+    CRTraceEvent & e = crtrace_events[index];
+    e.start = startUs;
+    e.duration = (lUInt32)(endUs - startUs);
+    e.point = (lUInt16)point;
+    e.thread = (lUInt16)crtraceThreadId();
+}
+
+CRTraceStats CRTrace::getStats( CRTracePoint point )
+{
+    return crtrace_stats[point];
+}
+
+const char * CRTrace::getName( CRTracePoint point )
+{
+    return crtrace_names[point];
+}
+
+lString8 CRTrace::getCountersJson()
+{
+    lString8 res("{");
+    char buf[128];
+    for ( int i=0; i<CRTRACE_POINT_COUNT; i++ ) {
+        if ( i >= CRTRACE_GLYPH_CACHE_HIT ) // counters only
+            sprintf( buf, "%s\n  \"%s\": { \"count\": %llu }", i ? "," : "", crtrace_names[i],
+                     (unsigned long long)crtrace_stats[i].count );
+        else
+            sprintf( buf, "%s\n  \"%s\": { \"count\": %llu, \"us\": %llu }", i ? "," : "", crtrace_names[i],
+                     (unsigned long long)crtrace_stats[i].count, (unsigned long long)crtrace_stats[i].totalUs );
+        res << buf;
+    }
+    res << "\n}\n";
+    return res;
+}
+
+lString8 CRTrace::getChromeTraceJson()
+{
+    int count = crtrace_eventCount < CRTRACE_MAX_EVENTS ? crtrace_eventCount : CRTRACE_MAX_EVENTS;
+    lString8 res;
+    res.reserve( 100 * count + 64 );
+    res << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+    char buf[160];
+    for ( int i=0; crtrace_events && i<count; i++ ) {
+        const CRTraceEvent & e = crtrace_events[i];
+        lUInt64 ts = e.start > crtrace_startTime ? e.start - crtrace_startTime : 0;
+        sprintf( buf, "%s\n{\"name\": \"%s\", \"cat\": \"crengine\", \"ph\": \"X\", \"ts\": %llu, \"dur\": %u, \"pid\": 1, \"tid\": %d}",
+                 i ? "," : "", crtrace_names[e.point], (unsigned long long)ts,
+                 (unsigned)e.duration, (int)e.thread );
+        res << buf;
+    }
+    res << "\n]}\n";
+    return res;
+}
@@ -23,6 +23,7 @@
 #include "../include/wolutil.h"
 #include "../include/crtxtenc.h"
 #include "../include/crtrace.h"
+#include "../include/crconcurrent.h"
 #include "../include/epubfmt.h"
 #include "../include/chmfmt.h"
 #include "../include/wordfmt.h"
@@ -166,9 +167,16 @@ LVDocView::LVDocView(int bitsPerPixel, bool noDefaultDocument) :
 #if CR_INTERNAL_PAGE_ORIENTATION==1
 			, m_rotateAngle(CR_ROTATE_ANGLE_0)
 #endif
-			, m_section_bounds_valid(false), m_doc_format(doc_format_none),
+			, m_section_bounds_valid(false)
+#if CR_ENABLE_SCROLL_TILE_CACHE==1
+			, m_scrollTilesEnabled(true), m_scrollTilesPos(-1), m_scrollTilesDir(1), m_scrollTilesTask(NULL)
+#endif
+#if (CR_CONCURRENT_DOCUMENTS==1)
+			, m_concurrentSpreads(true)
+#endif
+			, m_doc_format(doc_format_none),
 			m_callback(NULL), m_swapDone(false), m_drawBufferBits(
-					GRAY_BACKBUFFER_BITS) {
+					GRAY_BACKBUFFER_BITS), m_pageDitherMode(CR_DITHER_NONE) {
 #if (COLOR_BACKBUFFER==1)
 	m_backgroundColor = 0xFFFFFF;
 	m_textColor = 0x000000;
@@ -207,6 +215,10 @@ LVDocView::LVDocView(int bitsPerPixel, bool noDefaultDocument) :
 }
 
 LVDocView::~LVDocView() {
+#if CR_ENABLE_SCROLL_TILE_CACHE==1
+	// unlink strips task still waiting for GUI thread
+	setScrollTileCacheEnabled(false);
+#endif
 	Clear();
 }
 
@@ -542,6 +554,9 @@ void LVDocView::Clear() {
 void LVDocView::clearImageCache() {
 #if CR_ENABLE_PAGE_IMAGE_CACHE==1
 	m_imageCache.clear();
+#endif
+#if CR_ENABLE_SCROLL_TILE_CACHE==1
+	m_tileCache.clear();
 #endif
     m_section_bounds_valid = false;
 	if (m_callback != NULL)
@@ -756,6 +771,219 @@ void LVDocView::cachePageImage( int delta )
 }
 #endif
 
+#if CR_ENABLE_SCROLL_TILE_CACHE==1
+LVDocViewTileCache::LVDocViewTileCache()
+: _count(0), _dx(0), _dy(0), _bpp(0), _options(0), _tileSize(0), _useCounter(0), _hits(0),
+  _memoryLimit(0), _trimTarget(-1)
+{
+	CRMemoryGovernor::addConsumer( this );
+}
+
+LVDocViewTileCache::~LVDocViewTileCache()
+{
+	CRMemoryGovernor::removeConsumer( this );
+	clear();
+}
+
+void LVDocViewTileCache::setFormat( int dx, int dy, int bpp, int options )
+{
+	if ( dx==_dx && dy==_dy && bpp==_bpp && options==_options )
+		return;
+	clear();
+	_dx = dx;
+	_dy = dy;
+	_bpp = bpp;
+	_options = options;
+	// row size as in LVGrayDrawBuf and LVColorDrawBuf: only 1 and 2 bpp are packed
+	int rowSize = bpp<=2 ? (dx * bpp + 7) / 8 : ( bpp<=8 ? dx : dx * (bpp >> 3) );
+	_tileSize = rowSize * SCROLL_TILE_HEIGHT;
+}
+
+int LVDocViewTileCache::getCapacity()
+{
+	int capacity = SCROLL_TILE_MAX_COUNT;
+	int limit = CR_ATOMIC_LOAD( _memoryLimit );
+	if ( limit && _tileSize && limit / _tileSize < capacity )
+		capacity = limit / _tileSize;
+	return capacity;
+}
+
+LVDrawBuf * LVDocViewTileCache::get( int index )
+{
+	for ( int i=0; i<_count; i++ ) {
+		if ( _tiles[i]._index == index ) {
+			_tiles[i]._lastUse = ++_useCounter;
+			_hits++;
+			return _tiles[i]._drawbuf.get();
+		}
+	}
+	return NULL;
+}
+
+void LVDocViewTileCache::add( int index, LVRef<LVDrawBuf> drawbuf )
+{
+	int capacity = getCapacity();
+	int trimTarget = CR_ATOMIC_LOAD( _trimTarget );
+	if ( trimTarget >= 0 ) {
+		CR_ATOMIC_STORE( _trimTarget, -1 );
+		if ( _tileSize && trimTarget / _tileSize < capacity )
+			capacity = trimTarget / _tileSize;
+	}
+	// new strip is kept anyway: it's going to be shown
+	if ( capacity < 1 )
+		capacity = 1;
+	while ( _count >= capacity ) {
+		int lru = 0;
+		for ( int i=1; i<_count; i++ )
+			if ( _tiles[i]._lastUse < _tiles[lru]._lastUse )
+				lru = i;
+		_count--;
+		_tiles[lru] = _tiles[_count];
+		_tiles[_count]._drawbuf.Clear();
+	}
+	_tiles[_count]._drawbuf = drawbuf;
+	_tiles[_count]._index = index;
+	_tiles[_count]._lastUse = ++_useCounter;
+	_count++;
+}
+
+void LVDocViewTileCache::clear()
+{
+	for ( int i=0; i<_count; i++ )
+		_tiles[i]._drawbuf.Clear();
+	_count = 0;
+}
+
+/// draws strips ahead of scroll direction on GUI thread, one strip per run
+class LVScrollTilesTask : public CRRunnable {
+public:
+	LVDocView * _view;
+	LVScrollTilesTask( LVDocView * view ) : _view(view) { }
+	virtual ~LVScrollTilesTask()
+	{
+		// deleted by provider without running
+		if ( _view )
+			_view->m_scrollTilesTask = NULL;
+	}
+	virtual void run()
+	{
+		LVDocView * view = _view;
+		if ( !view )
+			return;
+		_view = NULL;
+		view->m_scrollTilesTask = NULL;
+		if ( view->drawScrollTileAhead() )
+			view->scheduleScrollTiles();
+	}
+};
+
+/// compose scroll mode view of cached document strips (enabled by default)
+void LVDocView::setScrollTileCacheEnabled( bool enabled )
+{
+	m_scrollTilesEnabled = enabled;
+	if ( !enabled ) {
+		if ( m_scrollTilesTask ) {
+			m_scrollTilesTask->_view = NULL;
+			m_scrollTilesTask = NULL;
+		}
+		m_tileCache.clear();
+		m_scrollTilesPos = -1;
+	}
+}
+
+/// returns strip of scroll mode view, draws it if not cached
+LVDrawBuf * LVDocView::getScrollTile( int index )
+{
+	LVDrawBuf * tile = m_tileCache.get( index );
+	if ( tile )
+		return tile;
+	int dx = m_tileCache.getWidth();
+	int bpp = m_tileCache.getBitsPerPixel();
+	int options = m_tileCache.getOptions();
+	if ( bpp>=16 )
+		tile = new LVColorDrawBuf( dx, SCROLL_TILE_HEIGHT, bpp );
+	else
+		tile = new LVGrayDrawBuf( dx, SCROLL_TILE_HEIGHT, bpp );
+	LVRef<LVDrawBuf> drawbuf( tile );
+	// glyphs crossing edge of strips are drawn in both
+	tile->setHidePartialGlyphs( false );
+	tile->setInvertImages( (options & SCROLL_TILE_INVERT_IMAGES)!=0 );
+	tile->setDitherImages( (options & SCROLL_TILE_DITHER_IMAGES)!=0 );
+	tile->setSmoothScalingImages( (options & SCROLL_TILE_SMOOTH_IMAGES)!=0 );
+	tile->SetBackgroundColor( m_backgroundColor );
+	tile->SetTextColor( m_textColor );
+	drawScrollArea( *tile, index * SCROLL_TILE_HEIGHT, m_tileCache.getViewHeight() );
+	m_tileCache.add( index, drawbuf );
+	return tile;
+}
+
+/// composes scroll mode view of strips, returns false if they can't be used
+bool LVDocView::drawScrollTiles( LVDrawBuf & drawbuf, int position )
+{
+	int dy = drawbuf.GetHeight();
+	if ( !m_scrollTilesEnabled || position<0 || dy<=0 )
+		return false;
+	int options = ( drawbuf.getInvertImages() ? SCROLL_TILE_INVERT_IMAGES : 0 )
+			| ( drawbuf.getDitherImages() ? SCROLL_TILE_DITHER_IMAGES : 0 )
+			| ( drawbuf.getSmoothScalingImages() ? SCROLL_TILE_SMOOTH_IMAGES : 0 );
+	m_tileCache.setFormat( drawbuf.GetWidth(), dy, drawbuf.GetBitsPerPixel(), options );
+	int first = position / SCROLL_TILE_HEIGHT;
+	int last = (position + dy - 1) / SCROLL_TILE_HEIGHT;
+	// not worth drawing strips which won't stay in cache
+	if ( last - first + 1 > m_tileCache.getCapacity() )
+		return false;
+	int rowSize = drawbuf.GetRowSize();
+	for ( int i=first; i<=last; i++ ) {
+		LVDrawBuf * tile = getScrollTile( i );
+		if ( tile->GetRowSize()!=rowSize )
+			return false; // buffer with own row alignment
+		int y0 = i * SCROLL_TILE_HEIGHT;
+		int top = y0 > position ? y0 : position;
+		int bottom = y0 + SCROLL_TILE_HEIGHT < position + dy ? y0 + SCROLL_TILE_HEIGHT : position + dy;
+		for ( int y=top; y<bottom; y++ )
+			memcpy( drawbuf.GetScanLine( y - position ), tile->GetScanLine( y - y0 ), rowSize );
+	}
+	drawbuf.SetClipRect(NULL);
+	if ( position!=m_scrollTilesPos && m_scrollTilesPos>=0 )
+		m_scrollTilesDir = position > m_scrollTilesPos ? 1 : -1;
+	m_scrollTilesPos = position;
+	scheduleScrollTiles();
+	return true;
+}
+
+/// draws next missing strip ahead of scroll direction, returns false if there is none
+bool LVDocView::drawScrollTileAhead()
+{
+	if ( !m_scrollTilesEnabled || !isScrollMode() || !m_is_rendered || !m_doc || m_scrollTilesPos<0 )
+		return false;
+	int first = m_scrollTilesPos / SCROLL_TILE_HEIGHT;
+	int last = (m_scrollTilesPos + m_tileCache.getViewHeight() - 1) / SCROLL_TILE_HEIGHT;
+	// strips ahead must not push visible ones out
+	if ( last - first + 1 + SCROLL_TILE_AHEAD > m_tileCache.getCapacity() )
+		return false;
+	int lastIndex = (GetFullHeight() - 1) / SCROLL_TILE_HEIGHT;
+	for ( int i=1; i<=SCROLL_TILE_AHEAD; i++ ) {
+		int index = m_scrollTilesDir>0 ? last + i : first - i;
+		if ( index<0 || index>lastIndex )
+			break;
+		if ( !m_tileCache.has( index ) ) {
+			getScrollTile( index );
+			return true;
+		}
+	}
+	return false;
+}
+
+/// schedules drawing of strips ahead on GUI thread
+void LVDocView::scheduleScrollTiles()
+{
+	if ( m_scrollTilesTask || !concurrencyProvider )
+		return;
+	m_scrollTilesTask = new LVScrollTilesTask( this );
+	concurrencyProvider->executeGui( m_scrollTilesTask );
+}
+#endif
+
 bool LVDocView::exportWolFile(const char * fname, bool flgGray, int levels) {
 	LVStreamRef stream = LVOpenFileStream(fname, LVOM_WRITE);
 	if (!stream)
@@ -1271,7 +1499,12 @@ void LVDocView::getPageHeaderRectangle(int pageIndex, lvRect & headerRc) {
 /// returns current time representation string
 lString16 LVDocView::getTimeString() {
 	time_t t = (time_t) time(0);
+#if (CR_CONCURRENT_DOCUMENTS==1) && !defined(_WIN32)
+	tm btbuf;
+	tm * bt = localtime_r(&t, &btbuf);
+#else
 	tm * bt = localtime(&t);
+#endif
 	char str[12];
 	sprintf(str, "%02d:%02d", bt->tm_hour, bt->tm_min);
 	return Utf8ToUnicode(lString8(str));
@@ -1848,6 +2081,42 @@ void LVDocView::drawPageHeader(LVDrawBuf * drawbuf, const lvRect & headerRc,
 
 void LVDocView::drawPageTo(LVDrawBuf * drawbuf, LVRendPageInfo & page,
 		lvRect * pageRect, int pageCount, int basePage) {
+    drawbuf->setHidePartialGlyphs(getViewMode() == DVM_PAGES);
+	drawPageHeaderTo(drawbuf, page, pageCount, basePage);
+	drawPageContentTo(drawbuf, page, pageRect);
+}
+
+/// draws page header of drawPageTo()
+void LVDocView::drawPageHeaderTo(LVDrawBuf * drawbuf, LVRendPageInfo & page,
+		int pageCount, int basePage) {
+	if ( ( (m_pageHeaderInfo || !m_pageHeaderOverride.empty()) && (page.flags & RN_PAGE_TYPE_NORMAL) )
+				&& getViewMode() == DVM_PAGES ) {
+		int phi = m_pageHeaderInfo;
+		if (getVisiblePageCount() == 2) {
+			if (page.index & 1) {
+				// right
+				phi &= ~PGHDR_AUTHOR;
+            } else {
+				// left
+				phi &= ~PGHDR_TITLE;
+                phi &= ~PGHDR_PERCENT;
+                phi &= ~PGHDR_PAGE_NUMBER;
+				phi &= ~PGHDR_PAGE_COUNT;
+				phi &= ~PGHDR_BATTERY;
+				phi &= ~PGHDR_CLOCK;
+			}
+		}
+		lvRect info;
+		getPageHeaderRectangle(page.index, info);
+		drawPageHeader(drawbuf, info, page.index - 1 + basePage, phi, pageCount
+				- 1 + basePage);
+		//clip.top = info.bottom;
+	}
+}
+
+/// draws page of drawPageTo() without its header
+void LVDocView::drawPageContentTo(LVDrawBuf * drawbuf, LVRendPageInfo & page,
+		lvRect * pageRect) {
 	int start = page.start;
 	int height = page.height;
 	int headerHeight = getPageHeaderHeight();
@@ -1855,7 +2124,6 @@ void LVDocView::drawPageTo(LVDrawBuf * drawbuf, LVRendPageInfo & page,
 	lvRect fullRect(0, 0, drawbuf->GetWidth(), drawbuf->GetHeight());
 	if (!pageRect)
 		pageRect = &fullRect;
-    drawbuf->setHidePartialGlyphs(getViewMode() == DVM_PAGES);
 	//int offset = (pageRect->height() - m_pageMargins.top - m_pageMargins.bottom - height) / 3;
 	//if (offset>16)
 	//    offset = 16;
@@ -1874,29 +2142,6 @@ void LVDocView::drawPageTo(LVDrawBuf * drawbuf, LVRendPageInfo & page,
 	clip.right = pageRect->left + pageRect->width();
 	if (page.flags & RN_PAGE_TYPE_COVER)
 		clip.top = pageRect->top + m_pageMargins.top;
-	if ( ( (m_pageHeaderInfo || !m_pageHeaderOverride.empty()) && (page.flags & RN_PAGE_TYPE_NORMAL) )
-				&& getViewMode() == DVM_PAGES ) {
-		int phi = m_pageHeaderInfo;
-		if (getVisiblePageCount() == 2) {
-			if (page.index & 1) {
-				// right
-				phi &= ~PGHDR_AUTHOR;
-            } else {
-				// left
-				phi &= ~PGHDR_TITLE;
-                phi &= ~PGHDR_PERCENT;
-                phi &= ~PGHDR_PAGE_NUMBER;
-				phi &= ~PGHDR_PAGE_COUNT;
-				phi &= ~PGHDR_BATTERY;
-				phi &= ~PGHDR_CLOCK;
-			}
-		}
-		lvRect info;
-		getPageHeaderRectangle(page.index, info);
-		drawPageHeader(drawbuf, info, page.index - 1 + basePage, phi, pageCount
-				- 1 + basePage);
-		//clip.top = info.bottom;
-	}
 	drawbuf->SetClipRect(&clip);
 	if (m_doc) {
 		if (page.flags & RN_PAGE_TYPE_COVER) {
@@ -2001,6 +2246,63 @@ void LVDocView::drawPageTo(LVDrawBuf * drawbuf, LVRendPageInfo & page,
 #endif
 }
 
+#if (CR_CONCURRENT_DOCUMENTS==1)
+/// draws page of spread on worker thread
+class LVDrawPageTask : public CRRunnable {
+	LVDocView * _view;
+	LVDrawBuf * _drawbuf;
+	LVRendPageInfo * _page;
+	lvRect * _pageRect;
+	/// settings of thread owning document
+	LVRendThreadSettings _settings;
+public:
+	LVDrawPageTask(LVDocView * view, LVDrawBuf * drawbuf, LVRendPageInfo * page, lvRect * pageRect)
+		: _view(view), _drawbuf(drawbuf), _page(page), _pageRect(pageRect) { }
+	virtual void run() {
+		_settings.apply();
+		_view->drawPageContentTo(_drawbuf, *_page, _pageRect);
+	}
+};
+
+/// draws both pages of spread at once, right one on worker thread; returns false if they can't be
+bool LVDocView::drawSpreadConcurrently(LVDrawBuf & drawbuf, int page) {
+	if (!m_concurrentSpreads || !concurrencyProvider || !m_doc)
+		return false;
+	int bpp = drawbuf.GetBitsPerPixel();
+	lUInt8 * data = drawbuf.GetScanLine(0);
+	// pages may overlap, and must not share bytes of packed pixels
+	int pixelsPerByte = bpp <= 2 ? 8 / bpp : 1;
+	if (!data || (m_pageRects[0].right - 1) / pixelsPerByte >= m_pageRects[1].left / pixelsPerByte)
+		return false;
+	// right page is drawn through another buffer over the same pixels, with its own clip rect
+	LVAutoPtr<LVDrawBuf> right;
+	if (bpp >= 16)
+		right = new LVColorDrawBuf(drawbuf.GetWidth(), drawbuf.GetHeight(), data, bpp);
+	else
+		right = new LVGrayDrawBuf(drawbuf.GetWidth(), drawbuf.GetHeight(), bpp, data);
+	if (right->GetRowSize() != drawbuf.GetRowSize())
+		return false;
+	right->setInvertImages(drawbuf.getInvertImages());
+	right->setDitherImages(drawbuf.getDitherImages());
+	right->setSmoothScalingImages(drawbuf.getSmoothScalingImages());
+	right->SetBackgroundColor(drawbuf.GetBackgroundColor());
+	right->SetTextColor(drawbuf.GetTextColor());
+	right->setHidePartialGlyphs(getViewMode() == DVM_PAGES);
+	drawbuf.setHidePartialGlyphs(getViewMode() == DVM_PAGES);
+	m_doc->beginConcurrentReads();
+	LVDrawPageTask task(this, right.get(), m_pages[page + 1], &m_pageRects[1]);
+	CRThreadRef thread(concurrencyProvider->createThread(&task));
+	thread->start();
+	drawPageContentTo(&drawbuf, *m_pages[page], &m_pageRects[0]);
+	thread->join();
+	m_doc->endConcurrentReads();
+	// headers read document state which isn't safe to share, like section bounds
+	drawPageHeaderTo(&drawbuf, *m_pages[page], m_pages.length(), 1);
+	drawPageHeaderTo(&drawbuf, *m_pages[page + 1], m_pages.length(), 1);
+	return true;
+}
+#endif
+
 /// returns page count
 int LVDocView::getPageCount() {
 	return m_pages.length();
@@ -2251,6 +2553,9 @@ void LVDocView::drawPageBackground( LVDrawBuf & drawbuf, int offsetX, int offset
 /// draw to specified buffer
 void LVDocView::Draw(LVDrawBuf & drawbuf, int position, int page, bool rotate, bool autoresize) {
 	LVLock lock(getMutex());
+	// cache limits follow hits of previously drawn pages
+	CRMemoryGovernor::rebalance();
+	CR_TRACE_SCOPE(CRTRACE_DRAW);
 	//CRLog::trace("Draw() : calling checkPos()");
 	checkPos();
 	//CRLog::trace("Draw() : calling drawbuf.resize(%d, %d)", m_dx, m_dy);
@@ -2266,26 +2571,26 @@ void LVDocView::Draw(LVDrawBuf & drawbuf, int position, int page, bool rotate, b
 		return;
 	if (m_font.isNull())
 		return;
+	LVDrawBuf * target = &drawbuf;
+	if (m_pageDitherMode != CR_DITHER_NONE && drawbuf.GetBitsPerPixel() < 8) {
+		// draw with 8 bit gray, then quantize whole page to buffer levels at once
+		if (m_quantizeBuf.isNull() || m_quantizeBuf->GetWidth() != drawbuf.GetWidth()
+				|| m_quantizeBuf->GetHeight() != drawbuf.GetHeight())
+			m_quantizeBuf = new LVGrayDrawBuf(drawbuf.GetWidth(), drawbuf.GetHeight(), 8);
+		target = m_quantizeBuf.get();
+		target->SetBackgroundColor(m_backgroundColor);
+		target->SetTextColor(m_textColor);
+		target->setHidePartialGlyphs(drawbuf.getHidePartialGlyphs());
+		target->setInvertImages(drawbuf.getInvertImages());
+		target->setSmoothScalingImages(drawbuf.getSmoothScalingImages());
+		// images are dithered by final pass with the rest of page
+		target->setDitherImages(false);
+	}
 	if (isScrollMode()) {
-		drawbuf.SetClipRect(NULL);
-        drawPageBackground(drawbuf, 0, position);
-        int cover_height = 0;
-		if (m_pages.length() > 0 && (m_pages[0]->flags & RN_PAGE_TYPE_COVER))
-			cover_height = m_pages[0]->height;
-		if (position < cover_height) {
-			lvRect rc;
-			drawbuf.GetClipRect(&rc);
-			rc.top -= position;
-			rc.bottom -= position;
-			rc.top += m_pageMargins.top;
-			rc.bottom -= m_pageMargins.bottom;
-			rc.left += m_pageMargins.left;
-			rc.right -= m_pageMargins.right;
-			drawCoverTo(&drawbuf, rc);
-		}
-		DrawDocument(drawbuf, m_doc->getRootNode(), m_pageMargins.left, 0, drawbuf.GetWidth()
-				- m_pageMargins.left - m_pageMargins.right, drawbuf.GetHeight(), 0, -position,
-				drawbuf.GetHeight(), &m_markRanges, &m_bmkRanges);
+#if CR_ENABLE_SCROLL_TILE_CACHE==1
+		if (!drawScrollTiles(*target, position))
+#endif
+			drawScrollArea(*target, position, target->GetHeight());
 	} else {
 		int pc = getVisiblePageCount();
 		//CRLog::trace("searching for page with offset=%d", position);
@@ -2294,15 +2599,24 @@ void LVDocView::Draw(LVDrawBuf & drawbuf, int position, int page, bool rotate, b
 		//CRLog::trace("found page #%d", page);
 
         //drawPageBackground(drawbuf, (page * 1356) & 0xFFF, 0x1000 - (page * 1356) & 0xFFF);
-        drawPageBackground(drawbuf, 0, 0);
+        drawPageBackground(*target, 0, 0);
 
-        if (page >= 0 && page < m_pages.length())
-			drawPageTo(&drawbuf, *m_pages[page], &m_pageRects[0],
-					m_pages.length(), 1);
+		bool spreadDrawn = false;
+#if (CR_CONCURRENT_DOCUMENTS==1)
 		if (pc == 2 && page >= 0 && page + 1 < m_pages.length())
-			drawPageTo(&drawbuf, *m_pages[page + 1], &m_pageRects[1],
+			spreadDrawn = drawSpreadConcurrently(*target, page);
+#endif
+        if (!spreadDrawn && page >= 0 && page < m_pages.length())
+			drawPageTo(target, *m_pages[page], &m_pageRects[0],
+					m_pages.length(), 1);
+		if (!spreadDrawn && pc == 2 && page >= 0 && page + 1 < m_pages.length())
+			drawPageTo(target, *m_pages[page + 1], &m_pageRects[1],
 					m_pages.length(), 1);
 	}
+	if (target != &drawbuf) {
+		CR_TRACE_SCOPE(CRTRACE_DRAW_QUANTIZE);
+		LVQuantizeDrawBuf(target, &drawbuf, m_pageDitherMode);
+	}
 #if CR_INTERNAL_PAGE_ORIENTATION==1
 	if ( rotate ) {
 		//CRLog::trace("Rotate drawing buffer. Src size=(%d, %d), angle=%d, buf(%d, %d)", m_dx, m_dy, m_rotateAngle, drawbuf.GetWidth(), drawbuf.GetHeight() );
@@ -2312,6 +2626,28 @@ void LVDocView::Draw(LVDrawBuf & drawbuf, int position, int page, bool rotate, b
 #endif
 }
 
+/// draws scroll mode view at document position, drawbuf may be a strip of view of viewHeight
+void LVDocView::drawScrollArea(LVDrawBuf & drawbuf, int position, int viewHeight) {
+	drawbuf.SetClipRect(NULL);
+    drawPageBackground(drawbuf, 0, position);
+    int cover_height = 0;
+	if (m_pages.length() > 0 && (m_pages[0]->flags & RN_PAGE_TYPE_COVER))
+		cover_height = m_pages[0]->height;
+	if (position < cover_height) {
+		lvRect rc(0, 0, drawbuf.GetWidth(), viewHeight);
+		rc.top -= position;
+		rc.bottom -= position;
+		rc.top += m_pageMargins.top;
+		rc.bottom -= m_pageMargins.bottom;
+		rc.left += m_pageMargins.left;
+		rc.right -= m_pageMargins.right;
+		drawCoverTo(&drawbuf, rc);
+	}
+	DrawDocument(drawbuf, m_doc->getRootNode(), m_pageMargins.left, 0, drawbuf.GetWidth()
+			- m_pageMargins.left - m_pageMargins.right, drawbuf.GetHeight(), 0, -position,
+			viewHeight, &m_markRanges, &m_bmkRanges);
+}
+
 //void LVDocView::Draw()
 //{
 //Draw( m_drawbuf, m_pos, true );
@@ -3575,6 +3911,28 @@ void LVDocView::Resize(int dx, int dy) {
 #define XS_IMPLEMENT_SCHEME 1
 #include "../include/fb2def.h"
 
+/// reads FB2 description only, without parsing body; sets title, authors, series and language props
+bool LVReadFB2Properties( LVStreamRef stream, CRPropRef props )
+{
+    ldomDocument doc;
+    doc.setNodeTypes( fb2_elem_table );
+    doc.setAttributeTypes( fb2_attr_table );
+    doc.setNameSpaceTypes( fb2_ns_table );
+    ldomDocumentWriter writer( &doc, true );
+    LVXMLParser parser( stream, &writer );
+    if ( !parser.CheckFormat() || !parser.Parse() )
+        return false;
+    int seriesNumber = 0;
+    lString16 series = extractDocSeries( &doc, &seriesNumber );
+    props->setString( DOC_PROP_TITLE, extractDocTitle( &doc ) );
+    props->setString( DOC_PROP_AUTHORS, extractDocAuthors( &doc, lString16("|"), false ) );
+    props->setString( DOC_PROP_LANGUAGE, extractDocLanguage( &doc ) );
+    props->setString( DOC_PROP_SERIES_NAME, series );
+    if ( !series.empty() )
+        props->setInt( DOC_PROP_SERIES_NUMBER, seriesNumber );
+    return true;
+}
+
 #if 0
 void SaveBase64Objects( ldomNode * node )
 {
@@ -3976,7 +4334,11 @@ bool LVDocView::LoadDocument(LVStreamRef stream, bool metadataOnly) {
                 m_callback->OnLoadFileFormatDetected(pdbFormat);
             updateDocStyleSheet();
             doc_format_t contentFormat = doc_format_none;
-            bool res = ImportPDBDocument( m_stream, m_doc, m_callback, this, contentFormat );
+            bool res;
+            {
+                CR_TRACE_SCOPE(CRTRACE_PARSE);
+                res = ImportPDBDocument( m_stream, m_doc, m_callback, this, contentFormat );
+            }
             if ( !res ) {
                 setDocFormat( doc_format_none );
                 createDefaultDocument( cs16("ERROR: Error reading PDB format"), cs16("Cannot open document") );
@@ -4007,7 +4369,11 @@ bool LVDocView::LoadDocument(LVStreamRef stream, bool metadataOnly) {
 			if ( m_callback )
                 m_callback->OnLoadFileFormatDetected(doc_format_epub);
             updateDocStyleSheet();
-            bool res = ImportEpubDocument( m_stream, m_doc, m_callback, this, metadataOnly );
+            bool res;
+            {
+                CR_TRACE_SCOPE(CRTRACE_PARSE);
+                res = ImportEpubDocument( m_stream, m_doc, m_callback, this, metadataOnly );
+            }
 			if ( !res ) {
 				setDocFormat( doc_format_none );
                 createDefaultDocument( cs16("ERROR: Error reading EPUB format"), cs16("Cannot open document") );
@@ -4045,7 +4411,11 @@ bool LVDocView::LoadDocument(LVStreamRef stream, bool metadataOnly) {
             if ( m_callback )
                 m_callback->OnLoadFileFormatDetected(doc_format_fb3);
             updateDocStyleSheet();
-            bool res = ImportFb3Document( m_stream, m_doc, m_callback, this );
+            bool res;
+            {
+                CR_TRACE_SCOPE(CRTRACE_PARSE);
+                res = ImportFb3Document( m_stream, m_doc, m_callback, this );
+            }
             if ( !res ) {
                 setDocFormat( doc_format_none );
                 createDefaultDocument( cs16("ERROR: Error reading FB3 format"), cs16("Cannot open document") );
@@ -4077,7 +4447,11 @@ bool LVDocView::LoadDocument(LVStreamRef stream, bool metadataOnly) {
             if ( m_callback )
                 m_callback->OnLoadFileFormatDetected(doc_format_docx);
             updateDocStyleSheet();
-            bool res = ImportDocXDocument( m_stream, m_doc, m_callback, this );
+            bool res;
+            {
+                CR_TRACE_SCOPE(CRTRACE_PARSE);
+                res = ImportDocXDocument( m_stream, m_doc, m_callback, this );
+            }
             if ( !res ) {
                 setDocFormat( doc_format_none );
                 createDefaultDocument( cs16("ERROR: Error reading DOCX format"), cs16("Cannot open document") );
@@ -4111,7 +4485,11 @@ bool LVDocView::LoadDocument(LVStreamRef stream, bool metadataOnly) {
 			if ( m_callback )
 			m_callback->OnLoadFileFormatDetected(doc_format_chm);
             updateDocStyleSheet();
-            bool res = ImportCHMDocument( m_stream, m_doc, m_callback, this );
+            bool res;
+            {
+                CR_TRACE_SCOPE(CRTRACE_PARSE);
+                res = ImportCHMDocument( m_stream, m_doc, m_callback, this );
+            }
 			if ( !res ) {
 				setDocFormat( doc_format_none );
                 createDefaultDocument( cs16("ERROR: Error reading CHM format"), cs16("Cannot open document") );
@@ -4144,7 +4522,11 @@ bool LVDocView::LoadDocument(LVStreamRef stream, bool metadataOnly) {
             if ( m_callback )
                 m_callback->OnLoadFileFormatDetected(doc_format_doc);
             updateDocStyleSheet();
-            bool res = ImportWordDocument( m_stream, m_doc, m_callback, this );
+            bool res;
+            {
+                CR_TRACE_SCOPE(CRTRACE_PARSE);
+                res = ImportWordDocument( m_stream, m_doc, m_callback, this );
+            }
             if ( !res ) {
                 setDocFormat( doc_format_none );
                 createDefaultDocument( cs16("ERROR: Error reading DOC format"), cs16("Cannot open document") );
@@ -4568,7 +4950,12 @@ bool LVDocView::ParseDocument() {
 
 		// parse
 		parser->setProgressCallback(m_callback);
-		if (!parser->Parse()) {
+		bool parsed;
+		{
+			CR_TRACE_SCOPE(CRTRACE_PARSE);
+			parsed = parser->Parse();
+		}
+		if (!parsed) {
 			delete parser;
 			if (m_callback) {
                 m_callback->OnLoadFileError(cs16("Bad document format"));
@@ -5957,6 +6344,8 @@ void LVDocView::propsUpdateDefaults(CRPropRef props) {
 	props->setIntDef(PROP_AUTOSAVE_BOOKMARKS, 1);
 	props->setIntDef(PROP_DISPLAY_FULL_UPDATE_INTERVAL, 1);
 	props->setIntDef(PROP_DISPLAY_TURBO_UPDATE_MODE, 0);
+	static int int_options_dither[] = { 0, 1, 2 };
+	props->limitValueList(PROP_DISPLAY_DITHER_MODE, int_options_dither, 3);
 
 	lString8 defFontFace;
 	static const char * goodFonts[] = { "DejaVu Sans", "FreeSans",
@@ -6397,6 +6786,10 @@ CRPropRef LVDocView::propsApply(CRPropRef props) {
                 updateBookMarksRanges();
             }
             REQUEST_RENDER("propsApply - PROP_HIGHLIGHT_COMMENT_BOOKMARKS")
+        } else if (name == PROP_DISPLAY_DITHER_MODE) {
+            int mode = props->getIntDef(PROP_DISPLAY_DITHER_MODE, CR_DITHER_NONE);
+            if (mode >= CR_DITHER_NONE && mode <= CR_DITHER_DIFFUSION)
+                setPageDitherMode((cr_dither_mode_t)mode);
         } else if (name == PROP_PAGE_VIEW_MODE) {
             LVDocViewMode m =
                     props->getIntDef(PROP_PAGE_VIEW_MODE, 1) ? DVM_PAGES
@@ -16,6 +16,15 @@
 #include <stdio.h>
 #include <string.h>
 #include "../include/lvdrawbuf.h"
+#include "../include/crtest.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CR_DRAWBUF_SSE2 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define CR_DRAWBUF_NEON 1
+#endif
 
 #define GUARD_BYTE 0xa5
 #define CHECK_GUARD_BYTE \
@@ -234,6 +243,376 @@ lUInt8 revByteBits2( lUInt8 b )
         |  ( (b&0xC0)>>6 );
 }
 
+// Rotation kernels.
+// 90 and 270 degrees rotation is a transpose of pixel matrix with rows or columns
+// taken in reverse order. rotatePixels() goes by tiles of ROTATE_TILE x ROTATE_TILE
+// pixels, so source and destination rows of a tile stay in cache, and transposes
+// blocks of 8x8 (8, 16 bpp) or 4x4 (32 bpp) pixels inside tiles in SSE2/NEON registers.
+// 1 and 2 bpp blocks of 8x8 or 4x4 pixels are whole bytes, transposed in 64 or 32 bit
+// integer. The *Ref variants are the original per-pixel implementations: they are used
+// for edges which are not whole blocks, and vectorized versions must give exactly
+// the same pixels (see runDrawBufUnitTests()).
+
+#define ROTATE_TILE 64
+
+/// copies w x h block: dst[k*dstpitch + j] = src[j*srcpitch + k], pitches may be negative
+template <class T> static void transposeBlockRef( const T * src, int srcpitch, T * dst, int dstpitch, int w, int h )
+{
+    for ( int j=0; j<h; j++ )
+        for ( int k=0; k<w; k++ )
+            dst[k*dstpitch + j] = src[j*srcpitch + k];
+}
+
+/// 8 bit pixels, 8x8 block
+static inline void transposeBlock( const lUInt8 * src, int srcpitch, lUInt8 * dst, int dstpitch )
+{
+#if (CR_DRAWBUF_SSE2==1)
+    __m128i a0 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)src), _mm_loadl_epi64((const __m128i*)(src + srcpitch)));
+    __m128i a1 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(src + 2*srcpitch)), _mm_loadl_epi64((const __m128i*)(src + 3*srcpitch)));
+    __m128i a2 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(src + 4*srcpitch)), _mm_loadl_epi64((const __m128i*)(src + 5*srcpitch)));
+    __m128i a3 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(src + 6*srcpitch)), _mm_loadl_epi64((const __m128i*)(src + 7*srcpitch)));
+    // columns 0..3 and 4..7 of rows 0..3 and 4..7
+    __m128i b0 = _mm_unpacklo_epi16(a0, a1);
+    __m128i b1 = _mm_unpackhi_epi16(a0, a1);
+    __m128i b2 = _mm_unpacklo_epi16(a2, a3);
+    __m128i b3 = _mm_unpackhi_epi16(a2, a3);
+    // two columns in each register
+    __m128i c0 = _mm_unpacklo_epi32(b0, b2);
+    __m128i c1 = _mm_unpackhi_epi32(b0, b2);
+    __m128i c2 = _mm_unpacklo_epi32(b1, b3);
+    __m128i c3 = _mm_unpackhi_epi32(b1, b3);
+    _mm_storel_epi64((__m128i*)dst, c0);
+    _mm_storel_epi64((__m128i*)(dst + dstpitch), _mm_unpackhi_epi64(c0, c0));
+    _mm_storel_epi64((__m128i*)(dst + 2*dstpitch), c1);
+    _mm_storel_epi64((__m128i*)(dst + 3*dstpitch), _mm_unpackhi_epi64(c1, c1));
+    _mm_storel_epi64((__m128i*)(dst + 4*dstpitch), c2);
+    _mm_storel_epi64((__m128i*)(dst + 5*dstpitch), _mm_unpackhi_epi64(c2, c2));
+    _mm_storel_epi64((__m128i*)(dst + 6*dstpitch), c3);
+    _mm_storel_epi64((__m128i*)(dst + 7*dstpitch), _mm_unpackhi_epi64(c3, c3));
+#elif (CR_DRAWBUF_NEON==1)
+    uint8x8x2_t t0 = vtrn_u8(vld1_u8(src), vld1_u8(src + srcpitch));
+    uint8x8x2_t t1 = vtrn_u8(vld1_u8(src + 2*srcpitch), vld1_u8(src + 3*srcpitch));
+    uint8x8x2_t t2 = vtrn_u8(vld1_u8(src + 4*srcpitch), vld1_u8(src + 5*srcpitch));
+    uint8x8x2_t t3 = vtrn_u8(vld1_u8(src + 6*srcpitch), vld1_u8(src + 7*srcpitch));
+    // columns 0,4 / 2,6 and 1,5 / 3,7 of rows 0..3 and 4..7
+    uint16x4x2_t u0 = vtrn_u16(vreinterpret_u16_u8(t0.val[0]), vreinterpret_u16_u8(t1.val[0]));
+    uint16x4x2_t u1 = vtrn_u16(vreinterpret_u16_u8(t0.val[1]), vreinterpret_u16_u8(t1.val[1]));
+    uint16x4x2_t u2 = vtrn_u16(vreinterpret_u16_u8(t2.val[0]), vreinterpret_u16_u8(t3.val[0]));
+    uint16x4x2_t u3 = vtrn_u16(vreinterpret_u16_u8(t2.val[1]), vreinterpret_u16_u8(t3.val[1]));
+    uint32x2x2_t v0 = vtrn_u32(vreinterpret_u32_u16(u0.val[0]), vreinterpret_u32_u16(u2.val[0]));
+    uint32x2x2_t v1 = vtrn_u32(vreinterpret_u32_u16(u1.val[0]), vreinterpret_u32_u16(u3.val[0]));
+    uint32x2x2_t v2 = vtrn_u32(vreinterpret_u32_u16(u0.val[1]), vreinterpret_u32_u16(u2.val[1]));
+    uint32x2x2_t v3 = vtrn_u32(vreinterpret_u32_u16(u1.val[1]), vreinterpret_u32_u16(u3.val[1]));
+    vst1_u8(dst, vreinterpret_u8_u32(v0.val[0]));
+    vst1_u8(dst + dstpitch, vreinterpret_u8_u32(v1.val[0]));
+    vst1_u8(dst + 2*dstpitch, vreinterpret_u8_u32(v2.val[0]));
+    vst1_u8(dst + 3*dstpitch, vreinterpret_u8_u32(v3.val[0]));
+    vst1_u8(dst + 4*dstpitch, vreinterpret_u8_u32(v0.val[1]));
+    vst1_u8(dst + 5*dstpitch, vreinterpret_u8_u32(v1.val[1]));
+    vst1_u8(dst + 6*dstpitch, vreinterpret_u8_u32(v2.val[1]));
+    vst1_u8(dst + 7*dstpitch, vreinterpret_u8_u32(v3.val[1]));
+#else
+    transposeBlockRef( src, srcpitch, dst, dstpitch, 8, 8 );
+#endif
+}
+
+/// 16 bit pixels, 8x8 block
+static inline void transposeBlock( const lUInt16 * src, int srcpitch, lUInt16 * dst, int dstpitch )
+{
+#if (CR_DRAWBUF_SSE2==1)
+    __m128i r0 = _mm_loadu_si128((const __m128i*)src);
+    __m128i r1 = _mm_loadu_si128((const __m128i*)(src + srcpitch));
+    __m128i r2 = _mm_loadu_si128((const __m128i*)(src + 2*srcpitch));
+    __m128i r3 = _mm_loadu_si128((const __m128i*)(src + 3*srcpitch));
+    __m128i r4 = _mm_loadu_si128((const __m128i*)(src + 4*srcpitch));
+    __m128i r5 = _mm_loadu_si128((const __m128i*)(src + 5*srcpitch));
+    __m128i r6 = _mm_loadu_si128((const __m128i*)(src + 6*srcpitch));
+    __m128i r7 = _mm_loadu_si128((const __m128i*)(src + 7*srcpitch));
+    __m128i a0 = _mm_unpacklo_epi16(r0, r1);
+    __m128i a1 = _mm_unpackhi_epi16(r0, r1);
+    __m128i a2 = _mm_unpacklo_epi16(r2, r3);
+    __m128i a3 = _mm_unpackhi_epi16(r2, r3);
+    __m128i a4 = _mm_unpacklo_epi16(r4, r5);
+    __m128i a5 = _mm_unpackhi_epi16(r4, r5);
+    __m128i a6 = _mm_unpacklo_epi16(r6, r7);
+    __m128i a7 = _mm_unpackhi_epi16(r6, r7);
+    // columns 0,1 / 2,3 / 4,5 / 6,7 of rows 0..3 and 4..7
+    __m128i b0 = _mm_unpacklo_epi32(a0, a2);
+    __m128i b1 = _mm_unpackhi_epi32(a0, a2);
+    __m128i b2 = _mm_unpacklo_epi32(a1, a3);
+    __m128i b3 = _mm_unpackhi_epi32(a1, a3);
+    __m128i b4 = _mm_unpacklo_epi32(a4, a6);
+    __m128i b5 = _mm_unpackhi_epi32(a4, a6);
+    __m128i b6 = _mm_unpacklo_epi32(a5, a7);
+    __m128i b7 = _mm_unpackhi_epi32(a5, a7);
+    _mm_storeu_si128((__m128i*)dst, _mm_unpacklo_epi64(b0, b4));
+    _mm_storeu_si128((__m128i*)(dst + dstpitch), _mm_unpackhi_epi64(b0, b4));
+    _mm_storeu_si128((__m128i*)(dst + 2*dstpitch), _mm_unpacklo_epi64(b1, b5));
+    _mm_storeu_si128((__m128i*)(dst + 3*dstpitch), _mm_unpackhi_epi64(b1, b5));
+    _mm_storeu_si128((__m128i*)(dst + 4*dstpitch), _mm_unpacklo_epi64(b2, b6));
+    _mm_storeu_si128((__m128i*)(dst + 5*dstpitch), _mm_unpackhi_epi64(b2, b6));
+    _mm_storeu_si128((__m128i*)(dst + 6*dstpitch), _mm_unpacklo_epi64(b3, b7));
+    _mm_storeu_si128((__m128i*)(dst + 7*dstpitch), _mm_unpackhi_epi64(b3, b7));
+#elif (CR_DRAWBUF_NEON==1)
+    uint16x8x2_t t0 = vtrnq_u16(vld1q_u16(src), vld1q_u16(src + srcpitch));
+    uint16x8x2_t t1 = vtrnq_u16(vld1q_u16(src + 2*srcpitch), vld1q_u16(src + 3*srcpitch));
+    uint16x8x2_t t2 = vtrnq_u16(vld1q_u16(src + 4*srcpitch), vld1q_u16(src + 5*srcpitch));
+    uint16x8x2_t t3 = vtrnq_u16(vld1q_u16(src + 6*srcpitch), vld1q_u16(src + 7*srcpitch));
+    // columns 0,4 / 2,6 and 1,5 / 3,7 of rows 0..3 and 4..7
+    uint32x4x2_t u0 = vtrnq_u32(vreinterpretq_u32_u16(t0.val[0]), vreinterpretq_u32_u16(t1.val[0]));
+    uint32x4x2_t u1 = vtrnq_u32(vreinterpretq_u32_u16(t0.val[1]), vreinterpretq_u32_u16(t1.val[1]));
+    uint32x4x2_t u2 = vtrnq_u32(vreinterpretq_u32_u16(t2.val[0]), vreinterpretq_u32_u16(t3.val[0]));
+    uint32x4x2_t u3 = vtrnq_u32(vreinterpretq_u32_u16(t2.val[1]), vreinterpretq_u32_u16(t3.val[1]));
+    vst1q_u16(dst, vreinterpretq_u16_u32(vcombine_u32(vget_low_u32(u0.val[0]), vget_low_u32(u2.val[0]))));
+    vst1q_u16(dst + dstpitch, vreinterpretq_u16_u32(vcombine_u32(vget_low_u32(u1.val[0]), vget_low_u32(u3.val[0]))));
+    vst1q_u16(dst + 2*dstpitch, vreinterpretq_u16_u32(vcombine_u32(vget_low_u32(u0.val[1]), vget_low_u32(u2.val[1]))));
+    vst1q_u16(dst + 3*dstpitch, vreinterpretq_u16_u32(vcombine_u32(vget_low_u32(u1.val[1]), vget_low_u32(u3.val[1]))));
+    vst1q_u16(dst + 4*dstpitch, vreinterpretq_u16_u32(vcombine_u32(vget_high_u32(u0.val[0]), vget_high_u32(u2.val[0]))));
+    vst1q_u16(dst + 5*dstpitch, vreinterpretq_u16_u32(vcombine_u32(vget_high_u32(u1.val[0]), vget_high_u32(u3.val[0]))));
+    vst1q_u16(dst + 6*dstpitch, vreinterpretq_u16_u32(vcombine_u32(vget_high_u32(u0.val[1]), vget_high_u32(u2.val[1]))));
+    vst1q_u16(dst + 7*dstpitch, vreinterpretq_u16_u32(vcombine_u32(vget_high_u32(u1.val[1]), vget_high_u32(u3.val[1]))));
+#else
+    transposeBlockRef( src, srcpitch, dst, dstpitch, 8, 8 );
+#endif
+}
+
+/// 32 bit pixels, 4x4 block
+static inline void transposeBlock( const lUInt32 * src, int srcpitch, lUInt32 * dst, int dstpitch )
+{
+#if (CR_DRAWBUF_SSE2==1)
+    __m128i r0 = _mm_loadu_si128((const __m128i*)src);
+    __m128i r1 = _mm_loadu_si128((const __m128i*)(src + srcpitch));
+    __m128i r2 = _mm_loadu_si128((const __m128i*)(src + 2*srcpitch));
+    __m128i r3 = _mm_loadu_si128((const __m128i*)(src + 3*srcpitch));
+    __m128i a0 = _mm_unpacklo_epi32(r0, r1);
+    __m128i a1 = _mm_unpackhi_epi32(r0, r1);
+    __m128i a2 = _mm_unpacklo_epi32(r2, r3);
+    __m128i a3 = _mm_unpackhi_epi32(r2, r3);
+    _mm_storeu_si128((__m128i*)dst, _mm_unpacklo_epi64(a0, a2));
+    _mm_storeu_si128((__m128i*)(dst + dstpitch), _mm_unpackhi_epi64(a0, a2));
+    _mm_storeu_si128((__m128i*)(dst + 2*dstpitch), _mm_unpacklo_epi64(a1, a3));
+    _mm_storeu_si128((__m128i*)(dst + 3*dstpitch), _mm_unpackhi_epi64(a1, a3));
+#elif (CR_DRAWBUF_NEON==1)
+    uint32x4x2_t t0 = vtrnq_u32(vld1q_u32(src), vld1q_u32(src + srcpitch));
+    uint32x4x2_t t1 = vtrnq_u32(vld1q_u32(src + 2*srcpitch), vld1q_u32(src + 3*srcpitch));
+    vst1q_u32(dst, vcombine_u32(vget_low_u32(t0.val[0]), vget_low_u32(t1.val[0])));
+    vst1q_u32(dst + dstpitch, vcombine_u32(vget_low_u32(t0.val[1]), vget_low_u32(t1.val[1])));
+    vst1q_u32(dst + 2*dstpitch, vcombine_u32(vget_high_u32(t0.val[0]), vget_high_u32(t1.val[0])));
+    vst1q_u32(dst + 3*dstpitch, vcombine_u32(vget_high_u32(t0.val[1]), vget_high_u32(t1.val[1])));
+#else
+    transposeBlockRef( src, srcpitch, dst, dstpitch, 4, 4 );
+#endif
+}
+
+/// original per-pixel rotation of 8, 16, 32 bit pixels by 90 degrees clockwise (cw) or counterclockwise
+template <class T> static void rotatePixelsRef( const T * src, int srcpitch, int dx, int dy, T * dst, int dstpitch, bool cw )
+{
+    for ( int y=0; y<dy; y++ ) {
+        const T * row = src + srcpitch*y;
+        for ( int x=0; x<dx; x++ ) {
+            if ( cw )
+                dst[ dstpitch*x + dy - 1 - y ] = row[ x ];
+            else
+                dst[ dstpitch*(dx - 1 - x) + y ] = row[ x ];
+        }
+    }
+}
+
+/// rotates 8, 16, 32 bit pixels by 90 degrees clockwise (cw) or counterclockwise, by tiles of BxB blocks
+template <class T, int B> static void rotatePixels( const T * src, int srcpitch, int dx, int dy, T * dst, int dstpitch, bool cw )
+{
+    for ( int ty=0; ty<dy; ty+=ROTATE_TILE ) {
+        int ty1 = ty + ROTATE_TILE < dy ? ty + ROTATE_TILE : dy;
+        for ( int tx=0; tx<dx; tx+=ROTATE_TILE ) {
+            int tx1 = tx + ROTATE_TILE < dx ? tx + ROTATE_TILE : dx;
+            for ( int y=ty; y<ty1; y+=B ) {
+                int h = y + B <= ty1 ? B : ty1 - y;
+                for ( int x=tx; x<tx1; x+=B ) {
+                    int w = x + B <= tx1 ? B : tx1 - x;
+                    // clockwise: source rows are taken from bottom to top, counterclockwise: destination rows
+                    const T * s;
+                    T * d;
+                    int sp, dp;
+                    if ( cw ) {
+                        s = src + srcpitch*(y + h - 1) + x;
+                        sp = -srcpitch;
+                        d = dst + dstpitch*x + dy - y - h;
+                        dp = dstpitch;
+                    } else {
+                        s = src + srcpitch*y + x;
+                        sp = srcpitch;
+                        d = dst + dstpitch*(dx - 1 - x) + y;
+                        dp = -dstpitch;
+                    }
+                    if ( w==B && h==B )
+                        transposeBlock( s, sp, d, dp );
+                    else
+                        transposeBlockRef( s, sp, d, dp, w, h );
+                }
+            }
+        }
+    }
+}
+
+/// original per-pixel rotation of 1, 2 bpp pixels of rectangle x0..x1, y0..y1, destination must be zeroed
+static void rotatePackedPixelsRef( const lUInt8 * src, int srcpitch, int dx, int dy, lUInt8 * dst, int dstpitch, bool cw, int bpp,
+                                   int x0, int y0, int x1, int y1 )
+{
+    for ( int y=y0; y<y1; y++ ) {
+        const lUInt8 * row = src + srcpitch*y;
+        int dstx, dsty;
+        for ( int x=x0; x<x1; x++ ) {
+            if ( cw ) {
+                dstx = dy-1-y;
+                dsty = x;
+            } else {
+                dstx = y;
+                dsty = dx-1-x;
+            }
+            lUInt8 * dstrow = dst + dstpitch * dsty;
+            if ( bpp==1 ) {
+                lUInt8 px = (row[ x >> 3 ] << (x&7)) & 0x80;
+                dstrow[ dstx >> 3 ] |= (px >> (dstx&7));
+            } else {
+                lUInt8 px = (row[ x >> 2 ] << ((x&3)<<1)) & 0xC0;
+                dstrow[ dstx >> 2 ] |= (px >> ((dstx&3)<<1));
+            }
+        }
+    }
+}
+
+/// transposes 8x8 matrix of bits, first row in highest byte, first column in highest bit of byte
+static inline lUInt64 transposeBits1( lUInt64 x )
+{
+    x = (x & 0xAA55AA55AA55AA55ULL) | ((x & 0x00AA00AA00AA00AAULL) << 7) | ((x >> 7) & 0x00AA00AA00AA00AAULL);
+    x = (x & 0xCCCC3333CCCC3333ULL) | ((x & 0x0000CCCC0000CCCCULL) << 14) | ((x >> 14) & 0x0000CCCC0000CCCCULL);
+    x = (x & 0xF0F0F0F00F0F0F0FULL) | ((x & 0x00000000F0F0F0F0ULL) << 28) | ((x >> 28) & 0x00000000F0F0F0F0ULL);
+    return x;
+}
+
+/// transposes 4x4 matrix of 2 bit pixels, first row in highest byte
+static inline lUInt32 transposeBits2( lUInt32 x )
+{
+    x = (x & 0xCC33CC33) | ((x & 0x00CC00CC) << 6) | ((x >> 6) & 0x00CC00CC);
+    x = (x & 0xF0F00F0F) | ((x & 0x0000F0F0) << 12) | ((x >> 12) & 0x0000F0F0);
+    return x;
+}
+
+/// rotates 1, 2 bpp pixels by 90 degrees clockwise (cw) or counterclockwise, destination must be zeroed
+static void rotatePackedPixels( const lUInt8 * src, int srcpitch, int dx, int dy, lUInt8 * dst, int dstpitch, bool cw, int bpp )
+{
+    // block is n source bytes of n rows, it gives n destination bytes of n rows
+    int n = 8 / bpp;
+    int xbytes = dx / n;
+    int yblocks = dy / n;
+    // rows which are not whole destination bytes: at top for clockwise rotation, at bottom otherwise
+    int ytail = dy - yblocks * n;
+    int yfirst = cw ? ytail : 0;
+    for ( int tx=0; tx<xbytes; tx+=ROTATE_TILE/8 ) {
+        int tx1 = tx + ROTATE_TILE/8 < xbytes ? tx + ROTATE_TILE/8 : xbytes;
+        for ( int k=0; k<yblocks; k++ ) {
+            int y = yfirst + k*n;
+            // destination byte of block
+            int dstbyte = cw ? (dy - y - n) / n : y / n;
+            for ( int xb=tx; xb<tx1; xb++ ) {
+                const lUInt8 * s = src + srcpitch*y + xb;
+                lUInt8 * d;
+                int dp;
+                if ( cw ) {
+                    d = dst + dstpitch*(xb*n) + dstbyte;
+                    dp = dstpitch;
+                } else {
+                    d = dst + dstpitch*(dx - 1 - xb*n) + dstbyte;
+                    dp = -dstpitch;
+                }
+                if ( bpp==1 ) {
+                    lUInt64 m = 0;
+                    // clockwise: source rows are taken from bottom to top
+                    for ( int i=0; i<8; i++ )
+                        m = (m << 8) | s[srcpitch*(cw ? 7-i : i)];
+                    m = transposeBits1( m );
+                    for ( int i=0; i<8; i++ )
+                        d[dp*i] = (lUInt8)(m >> (56 - 8*i));
+                } else {
+                    lUInt32 m = 0;
+                    for ( int i=0; i<4; i++ )
+                        m = (m << 8) | s[srcpitch*(cw ? 3-i : i)];
+                    m = transposeBits2( m );
+                    for ( int i=0; i<4; i++ )
+                        d[dp*i] = (lUInt8)(m >> (24 - 8*i));
+                }
+            }
+        }
+    }
+    // columns of last partial source byte, rows which are not whole destination bytes
+    rotatePackedPixelsRef( src, srcpitch, dx, dy, dst, dstpitch, cw, bpp, xbytes*n, 0, dx, dy );
+    rotatePackedPixelsRef( src, srcpitch, dx, dy, dst, dstpitch, cw, bpp, 0, cw ? 0 : dy - ytail, xbytes*n, cw ? ytail : dy );
+}
+
+/// original reversing of pixel order, for 180 degrees rotation
+template <class T> static void reversePixelsRef( T * buf, int count )
+{
+    for ( int i=count/2-1; i>=0; i-- ) {
+        T tmp = buf[i];
+        buf[i] = buf[count-i-1];
+        buf[count-i-1] = tmp;
+    }
+}
+
+#if (CR_DRAWBUF_SSE2==1)
+static inline __m128i reverseVector( __m128i v, lUInt32 * ) {
+    return _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3));
+}
+static inline __m128i reverseVector( __m128i v, lUInt16 * ) {
+    v = reverseVector( v, (lUInt32*)NULL );
+    return _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1)), _MM_SHUFFLE(2, 3, 0, 1));
+}
+static inline __m128i reverseVector( __m128i v, lUInt8 * ) {
+    v = reverseVector( v, (lUInt16*)NULL );
+    return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+#elif (CR_DRAWBUF_NEON==1)
+static inline uint8x16_t reverseVector( uint8x16_t v, lUInt32 * ) {
+    v = vreinterpretq_u8_u32(vrev64q_u32(vreinterpretq_u32_u8(v)));
+    return vcombine_u8(vget_high_u8(v), vget_low_u8(v));
+}
+static inline uint8x16_t reverseVector( uint8x16_t v, lUInt16 * ) {
+    v = vreinterpretq_u8_u16(vrev64q_u16(vreinterpretq_u16_u8(v)));
+    return vcombine_u8(vget_high_u8(v), vget_low_u8(v));
+}
+static inline uint8x16_t reverseVector( uint8x16_t v, lUInt8 * ) {
+    v = vrev64q_u8(v);
+    return vcombine_u8(vget_high_u8(v), vget_low_u8(v));
+}
+#endif
+
+/// reverses order of 8, 16, 32 bit pixels, for 180 degrees rotation
+template <class T> static void reversePixels( T * buf, int count )
+{
+    T * p = buf;
+    T * q = buf + count;
+#if (CR_DRAWBUF_SSE2==1) || (CR_DRAWBUF_NEON==1)
+    // swap reversed vectors from both ends
+    const int n = 16 / sizeof(T);
+    while ( q - p >= 2*n ) {
+        q -= n;
+#if (CR_DRAWBUF_SSE2==1)
+        __m128i a = _mm_loadu_si128((const __m128i*)p);
+        __m128i b = _mm_loadu_si128((const __m128i*)q);
+        _mm_storeu_si128((__m128i*)p, reverseVector( b, (T*)NULL ));
+        _mm_storeu_si128((__m128i*)q, reverseVector( a, (T*)NULL ));
+#else
+        uint8x16_t a = vld1q_u8((const lUInt8*)p);
+        uint8x16_t b = vld1q_u8((const lUInt8*)q);
+        vst1q_u8((lUInt8*)p, reverseVector( b, (T*)NULL ));
+        vst1q_u8((lUInt8*)q, reverseVector( a, (T*)NULL ));
+#endif
+        p += n;
+    }
+#endif
+    reversePixelsRef( p, (int)(q - p) );
+}
+
 /// rotates buffer contents by specified angle
 void LVGrayDrawBuf::Rotate( cr_rotate_angle_t angle )
 {
@@ -254,43 +633,19 @@ void LVGrayDrawBuf::Rotate( cr_rotate_angle_t angle )
                 _data[sz-i-1] = tmp;
             }
         } else { // DRAW_BUF_3_BPP, DRAW_BUF_4_BPP, DRAW_BUF_8_BPP
-            lUInt8 * buf = (lUInt8 *) _data;
-            for ( int i=sz/2-1; i>=0; i-- ) {
-                lUInt8 tmp = buf[i];
-                buf[i] = buf[sz-i-1];
-                buf[sz-i-1] = tmp;
-            }
+            reversePixels( (lUInt8 *)_data, sz );
         }
         return;
     }
     int newrowsize = _bpp<=2 ? (_dy * _bpp + 7) / 8 : _dy;
     sz = (newrowsize * _dx);
-    lUInt8 * dst = (lUInt8 *)calloc(sz, sizeof(*dst));
-    for ( int y=0; y<_dy; y++ ) {
-        lUInt8 * src = _data + _rowsize*y;
-        int dstx, dsty;
-        for ( int x=0; x<_dx; x++ ) {
-            if ( angle==CR_ROTATE_ANGLE_90 ) {
-                dstx = _dy-1-y;
-                dsty = x;
-            } else {
-                dstx = y;
-                dsty = _dx-1-x;
-            }
-            if ( _bpp==DRAW_BUF_1_BPP ) {
-                lUInt8 px = (src[ x >> 3 ] << (x&7)) & 0x80;
-                lUInt8 * dstrow = dst + newrowsize * dsty;
-                dstrow[ dstx >> 3 ] |= (px >> (dstx&7));
-            } else if (_bpp==DRAW_BUF_2_BPP ) {
-                lUInt8 px = (src[ x >> 2 ] << ((x&3)<<1)) & 0xC0;
-                lUInt8 * dstrow = dst + newrowsize * dsty;
-                dstrow[ dstx >> 2 ] |= (px >> ((dstx&3)<<1));
-            } else { // DRAW_BUF_3_BPP, DRAW_BUF_4_BPP, DRAW_BUF_8_BPP
-                lUInt8 * dstrow = dst + newrowsize * dsty;
-                dstrow[ dstx ] = src[ x ];
-            }
-        }
-    }
+    lUInt8 * dst = (lUInt8 *)calloc(sz + 1, sizeof(*dst));
+    dst[sz] = GUARD_BYTE;
+    bool cw = angle==CR_ROTATE_ANGLE_90;
+    if ( _bpp<=2 )
+        rotatePackedPixels( _data, _rowsize, _dx, _dy, dst, newrowsize, cw, _bpp );
+    else // DRAW_BUF_3_BPP, DRAW_BUF_4_BPP, DRAW_BUF_8_BPP
+        rotatePixels<lUInt8, 8>( _data, _rowsize, _dx, _dy, dst, newrowsize, cw );
     free( _data );
     _data = dst;
     int tmp = _dx;
@@ -304,101 +659,37 @@ void LVColorDrawBuf::Rotate( cr_rotate_angle_t angle )
 {
     if ( angle==CR_ROTATE_ANGLE_0 )
         return;
-    if ( _bpp==16 ) {
-        int sz = (_dx * _dy);
-        if ( angle==CR_ROTATE_ANGLE_180 ) {
-            lUInt16 * buf = (lUInt16 *) _data;
-            for ( int i=sz/2-1; i>=0; i-- ) {
-                lUInt16 tmp = buf[i];
-                buf[i] = buf[sz-i-1];
-                buf[sz-i-1] = tmp;
-            }
-            return;
-        }
-        int newrowsize = _dy * 2;
-        sz = (_dx * newrowsize);
-        lUInt16 * dst = (lUInt16*) malloc( sz );
-    #if !defined(__SYMBIAN32__) && defined(_WIN32) && !defined(QT_GL)
-        bool cw = angle!=CR_ROTATE_ANGLE_90;
-    #else
-        bool cw = angle==CR_ROTATE_ANGLE_90;
-    #endif
-        for ( int y=0; y<_dy; y++ ) {
-            lUInt16 * src = (lUInt16*)_data + _dx*y;
-            int nx, ny;
-            if ( cw ) {
-                nx = _dy - 1 - y;
-            } else {
-                nx = y;
-            }
-            for ( int x=0; x<_dx; x++ ) {
-                if ( cw ) {
-                    ny = x;
-                } else {
-                    ny = _dx - 1 - x;
-                }
-                dst[ _dy*ny + nx ] = src[ x ];
-            }
-        }
-    #if !defined(__SYMBIAN32__) && defined(_WIN32) && !defined(QT_GL)
-        memcpy( _data, dst, sz );
-        free( dst );
-    #else
-        free( _data );
-        _data = (lUInt8*)dst;
-    #endif
-        int tmp = _dx;
-        _dx = _dy;
-        _dy = tmp;
-        _rowsize = newrowsize;
-    } else {
-        int sz = (_dx * _dy);
-        if ( angle==CR_ROTATE_ANGLE_180 ) {
-            lUInt32 * buf = (lUInt32 *) _data;
-            for ( int i=sz/2-1; i>=0; i-- ) {
-                lUInt32 tmp = buf[i];
-                buf[i] = buf[sz-i-1];
-                buf[sz-i-1] = tmp;
-            }
-            return;
-        }
-        int newrowsize = _dy * 4;
-        sz = (_dx * newrowsize);
-        lUInt32 * dst = (lUInt32*) malloc( sz );
-    #if !defined(__SYMBIAN32__) && defined(_WIN32) && !defined(QT_GL)
-        bool cw = angle!=CR_ROTATE_ANGLE_90;
-    #else
-        bool cw = angle==CR_ROTATE_ANGLE_90;
-    #endif
-        for ( int y=0; y<_dy; y++ ) {
-            lUInt32 * src = (lUInt32*)_data + _dx*y;
-            int nx, ny;
-            if ( cw ) {
-                nx = _dy - 1 - y;
-            } else {
-                nx = y;
-            }
-            for ( int x=0; x<_dx; x++ ) {
-                if ( cw ) {
-                    ny = x;
-                } else {
-                    ny = _dx - 1 - x;
-                }
-                dst[ _dy*ny + nx ] = src[ x ];
-            }
-        }
-    #if !defined(__SYMBIAN32__) && defined(_WIN32) && !defined(QT_GL)
-        memcpy( _data, dst, sz );
-        free( dst );
-    #else
-        free( _data );
-        _data = (lUInt8*)dst;
-    #endif
-        int tmp = _dx;
-        _dx = _dy;
-        _dy = tmp;
-        _rowsize = newrowsize;
+    int sz = (_dx * _dy);
+    if ( angle==CR_ROTATE_ANGLE_180 ) {
+        if ( _bpp==16 )
+            reversePixels( (lUInt16 *)_data, sz );
+        else
+            reversePixels( (lUInt32 *)_data, sz );
+        return;
     }
+    int newrowsize = _dy * (_bpp >> 3);
+    sz = (_dx * newrowsize);
+    lUInt8 * dst = (lUInt8*) malloc( sz );
+#if !defined(__SYMBIAN32__) && defined(_WIN32) && !defined(QT_GL)
+    bool cw = angle!=CR_ROTATE_ANGLE_90;
+#else
+    bool cw = angle==CR_ROTATE_ANGLE_90;
+#endif
+    if ( _bpp==16 )
+        rotatePixels<lUInt16, 8>( (lUInt16*)_data, _dx, _dx, _dy, (lUInt16*)dst, _dy, cw );
+    else
+        rotatePixels<lUInt32, 4>( (lUInt32*)_data, _dx, _dx, _dy, (lUInt32*)dst, _dy, cw );
+#if !defined(__SYMBIAN32__) && defined(_WIN32) && !defined(QT_GL)
+    memcpy( _data, dst, sz );
+    free( dst );
+#else
+    free( _data );
+    _data = dst;
+#endif
+    int tmp = _dx;
+    _dx = _dy;
+    _dy = tmp;
+    _rowsize = newrowsize;
 }
 
 class LVImageScaledDrawCallback : public LVImageDecoderCallback
@@ -417,8 +708,9 @@ private:
     bool dither;
     bool invert;
     bool smoothscale;
-    lUInt8 * decoded;
+    LVImageResampler * resampler;
     bool isNinePatch;
+    lvRect ninePatch;
 public:
     static int * GenMap( int src_len, int dst_len )
     {
@@ -465,17 +757,32 @@ public:
         return map;
     }
     LVImageScaledDrawCallback(LVBaseDrawBuf * dstbuf, LVImageSourceRef img, int x, int y, int width, int height, bool dith, bool inv, bool smooth )
-    : src(img), dst(dstbuf), dst_x(x), dst_y(y), dst_dx(width), dst_dy(height), xmap(0), ymap(0), dither(dith), invert(inv), smoothscale(smooth), decoded(0)
+    : src(img), dst(dstbuf), dst_x(x), dst_y(y), dst_dx(width), dst_dy(height), xmap(0), ymap(0), dither(dith), invert(inv), smoothscale(smooth), resampler(0)
     {
-        src_dx = img->GetWidth();
-        src_dy = img->GetHeight();
         const CR9PatchInfo * np = img->GetNinePatchInfo();
         isNinePatch = false;
-        lvRect ninePatch;
         if (np) {
             isNinePatch = true;
             ninePatch = np->frame;
+            // frames of nine-patch images must be kept pixel-exact
+            smoothscale = false;
         }
+        setSourceSize( img->GetWidth(), img->GetHeight() );
+    }
+    /// (re)creates scaling maps and buffers for decoded image size
+    void setSourceSize( int dx, int dy )
+    {
+        if (xmap)
+            delete[] xmap;
+        if (ymap)
+            delete[] ymap;
+        if (resampler)
+            delete resampler;
+        xmap = NULL;
+        ymap = NULL;
+        resampler = NULL;
+        src_dx = dx;
+        src_dy = dy;
         // If smoothscaling was requested, but no scaling was needed, disable the post-processing pass
         if (smoothscale && src_dx == dst_dx && src_dy == dst_dy) {
             smoothscale = false;
@@ -493,11 +800,9 @@ public:
             else if (!smoothscale)
                 ymap = GenMap( src_dy, dst_dy );
         }
-        // If we have a smoothscale post-processing pass, we'll need to build a buffer of the *full* decoded image.
-        if (smoothscale) {
-            // Byte-sized buffer, we're 32bpp, so, 4 bytes per pixel.
-            decoded = new lUInt8[src_dy * (src_dx * 4)];
-        }
+        // Smooth scaling resamples decoded rows to target size as they come, w/o buffer of full image
+        if (smoothscale)
+            resampler = new LVImageResampler( src_dx, src_dy, dst_dx, dst_dy );
     }
     virtual ~LVImageScaledDrawCallback()
     {
@@ -505,8 +810,22 @@ public:
             delete[] xmap;
         if (ymap)
             delete[] ymap;
-        if (decoded)
-            delete[] decoded;
+        if (resampler)
+            delete resampler;
+    }
+    virtual bool GetTargetSize( int & dx, int & dy )
+    {
+        // nine-patch frames must be kept pixel-exact
+        if ( isNinePatch )
+            return false;
+        dx = dst_dx;
+        dy = dst_dy;
+        return true;
+    }
+    virtual void OnDecodedSize( LVImageSource *, int dx, int dy )
+    {
+        if ( dx != src_dx || dy != src_dy )
+            setSourceSize( dx, dy );
     }
     virtual void OnStartDecode( LVImageSource * )
     {
@@ -518,12 +837,24 @@ public:
             if (y == 0 || y == src_dy-1) // ignore first and last lines
                 return true;
         }
-        // Defer everything to the post-process pass for smooth scaling, we just have to store the line in our decoded buffer
-        if (smoothscale) {
-            //fprintf( stderr, "Smoothscale l_%d pass\n", y );
-            memcpy(decoded + (y * (src_dx * 4)), data, (src_dx * 4));
+        if (resampler) {
+            // Rows skipped by decoder are filled with the next decoded one, rows coming twice are ignored
+            while ( resampler->nextSourceRow() <= y && resampler->nextSourceRow() < src_dy ) {
+                resampler->addRow( data );
+                int yy;
+                lUInt32 * row;
+                while ( (row = resampler->getRow( yy )) != NULL ) {
+                    if ( !drawRow( yy, row ) )
+                        return false;
+                }
+            }
             return true;
         }
+        return drawRow( y, data );
+    }
+    /// draws row y of decoded image, or row y of target when it's already resampled to target size
+    bool drawRow( int y, lUInt32 * data )
+    {
         int yy = -1;
         int yy2 = -1;
         const lUInt32 rgba_invert = invert ? 0x00FFFFFF : 0;
@@ -796,41 +1127,9 @@ public:
         }
         return true;
     }
-    virtual void OnEndDecode( LVImageSource * obj, bool )
+    virtual void OnEndDecode( LVImageSource *, bool )
     {
-        // If we're not smooth scaling, we're done!
-        if (!smoothscale) {
-            return;
-        }
-
-        // Scale our decoded data...
-        lUInt8 * sdata = nullptr;
-        //fprintf( stderr, "Requesting smooth scaling (%dx%d -> %dx%d)\n", src_dx, src_dy, dst_dx, dst_dy );
-        sdata = CRe::qSmoothScaleImage(decoded, src_dx, src_dy, false, dst_dx, dst_dy);
-        if (sdata == nullptr) {
-                // Hu oh... Scaling failed! Return *without* drawing anything!
-                // We skipped map generation, so we can't easily fallback to nearest-neighbor...
-                //fprintf( stderr, "Smooth scaling failed :(\n" );
-                return;
-        }
-
-        // Process as usual, with a bit of a hack to avoid code duplication...
-        smoothscale = false;
-        for (int y=0; y < dst_dy; y++) {
-            lUInt8 * row = sdata + (y * (dst_dx * 4));
-            this->OnLineDecoded( obj, y, (lUInt32 *) row );
-        }
-
-        // This prints the unscaled decoded buffer, for debugging purposes ;).
-        /*
-        for (int y=0; y < src_dy; y++) {
-            lUInt8 * row = decoded + (y * (src_dx * 4));
-            this->OnLineDecoded( obj, y, (lUInt32 *) row );
-        }
-        */
-
-        // And now that it's been rendered we can free the scaled buffer (it was allocated by CRe::qSmoothScaleImage).
-        free(sdata);
+        // Rows are drawn as they are decoded; rows missing in truncated image are left undrawn
     }
 };
 
@@ -882,6 +1181,26 @@ lUInt32 LVGrayDrawBuf::GetPixel( int x, int y )
     }
 }
 
+/// get values of count pixels of row y starting from x, same as GetPixel() of each
+void LVGrayDrawBuf::GetPixelRow( int x, int y, int count, lUInt32 * row )
+{
+    if (!_data || y<0 || x<0 || y>=_dy || x+count>_dx) {
+        LVBaseDrawBuf::GetPixelRow( x, y, count, row );
+        return;
+    }
+    lUInt8 * line = GetScanLine(y);
+    if (_bpp==1) {
+        for ( int i=0; i<count; i++, x++ )
+            row[i] = (line[x>>3] >> (7-(x&7))) & 1;
+    } else if (_bpp==2) {
+        for ( int i=0; i<count; i++, x++ )
+            row[i] = (line[x>>2] >> (6-((x&3)<<1))) & 3;
+    } else { // 3, 4, 8
+        for ( int i=0; i<count; i++ )
+            row[i] = line[x + i];
+    }
+}
+
 void LVGrayDrawBuf::Clear( lUInt32 color )
 {
     if (!_data)
@@ -1180,15 +1499,19 @@ void LVGrayDrawBuf::DrawLine(int x0, int y0, int x1, int y1, lUInt32 color0,int
             for (int x=x0; x<x1; x++)
             {
                 lUInt8 * line = GetScanLine(y);
-                if (direction==0 &&x%(length1+length2)<length1)line[x] = color;
-                if (direction==1 &&y%(length1+length2)<length1)line[x] = color;
+                lUInt8 mask = 0x80 >> (x&7);
+                int index = x >> 3;
+                if ((direction==0 &&x%(length1+length2)<length1) || (direction==1 &&y%(length1+length2)<length1))
+                    line[index] = (lUInt8)((line[index] & ~mask) | (color & mask));
             }
         } else if (_bpp==2) {
             for (int x=x0; x<x1; x++)
             {
                 lUInt8 * line = GetScanLine(y);
-                if (direction==0 &&x%(length1+length2)<length1)line[x] = color;
-                if (direction==1 &&y%(length1+length2)<length1)line[x] = color;
+                lUInt8 mask = 0xC0 >> ((x&3)<<1);
+                int index = x >> 2;
+                if ((direction==0 &&x%(length1+length2)<length1) || (direction==1 &&y%(length1+length2)<length1))
+                    line[index] = (lUInt8)((line[index] & ~mask) | (color & mask));
             }
         } else { // 3, 4, 8
             for (int x=x0; x<x1; x++)
@@ -1200,18 +1523,363 @@ void LVGrayDrawBuf::DrawLine(int x0, int y0, int x1, int y1, lUInt32 color0,int
         }
     }
 }
+// Glyph blending row kernels.
+// Each blendGlyphRowXXX() blends one row of 8 bit glyph coverage (as produced
+// by the font manager, already gamma corrected) into a destination scanline.
+// The *Ref variants are the original per-pixel implementations: they are used
+// for row tails and on platforms without SSE2/NEON, and the vectorized versions
+// must give exactly the same pixels (see runDrawBufUnitTests()).
+
+static void blendGlyphRowGray1Ref( lUInt8 * dst, int shift, const lUInt8 * src, int width )
+{
+    for (int xx = width; xx>0; --xx)
+    {
+#if (GRAY_INVERSE==1)
+        *dst |= (( (*src++) & 0x80 ) >> ( shift ));
+#else
+        *dst &= ~(( ((*src++) & 0x80) ) >> ( shift ));
+#endif
+        /* next pixel */
+        if (!(++shift & 7))
+        {
+            shift = 0;
+            dst++;
+        }
+    }
+}
+
+static void blendGlyphRowGray2Ref( lUInt8 * dst, int shift, const lUInt8 * src, int width, lUInt8 cl )
+{
+    for (int xx = width; xx>0; --xx)
+    {
+        lUInt8 opaque = (*src >> 4) & 0x0F; // 0..15
+        if ( opaque>0x3 ) {
+            int shift2 = shift<<1;
+            int shift2i = 6-shift2;
+            lUInt8 mask = 0xC0 >> shift2;
+            lUInt8 dstcolor;
+            if ( opaque>=0xC ) {
+                dstcolor = cl;
+            } else {
+                lUInt8 bgcolor = ((*dst)>>shift2i)&3; // 0..3
+                dstcolor = ((opaque*cl + (15-opaque)*bgcolor)>>4)&3;
+            }
+            *dst = (*dst & ~mask) | (dstcolor<<shift2i);
+        }
+        src++;
+        /* next pixel */
+        if (!(++shift & 3))
+        {
+            shift = 0;
+            dst++;
+        }
+    }
+}
+
+static void blendGlyphRowGray8Ref( lUInt8 * dst, const lUInt8 * src, int width, lUInt8 color, int bpp )
+{
+    int mask = ((1<<bpp)-1)<<(8-bpp);
+    for (int xx = width; xx>0; --xx)
+    {
+        lUInt8 b = (*src++);
+        if ( b ) {
+            if ( b>=mask )
+                *dst = color;
+            else {
+                int alpha = b ^ 0xFF;
+                ApplyAlphaGray( *dst, color, alpha, bpp );
+            }
+        }
+        dst++;
+    }
+}
+
+static void blendGlyphRow16Ref( lUInt16 * dst, const lUInt8 * src, int width, lUInt16 bmpcl16 )
+{
+    for (int xx = width; xx>0; --xx)
+    {
+        lUInt32 opaque = ((*(src++))>>4)&0x0F;
+        if ( opaque>=0xF )
+            *dst = bmpcl16;
+        else if ( opaque>0 ) {
+            lUInt32 alpha = 0xF-opaque;
+            lUInt16 cl1 = (lUInt16)(((alpha*((*dst)&0xF81F) + opaque*(bmpcl16&0xF81F))>>4) & 0xF81F);
+            lUInt16 cl2 = (lUInt16)(((alpha*((*dst)&0x07E0) + opaque*(bmpcl16&0x07E0))>>4) & 0x07E0);
+            *dst = cl1 | cl2;
+        }
+        /* next pixel */
+        dst++;
+    }
+}
+
+static void blendGlyphRow32Ref( lUInt32 * dst, const lUInt8 * src, int width, lUInt32 bmpcl32 )
+{
+    for (int xx = width; xx>0; --xx)
+    {
+        lUInt32 opaque = ((*(src++))>>1)&0x7F;
+        if ( opaque>=0x78 )
+            *dst = bmpcl32;
+        else if ( opaque>0 ) {
+            lUInt32 alpha = 0x7F-opaque;
+            lUInt32 cl1 = ((alpha*((*dst)&0xFF00FF) + opaque*(bmpcl32&0xFF00FF))>>7) & 0xFF00FF;
+            lUInt32 cl2 = ((alpha*((*dst)&0x00FF00) + opaque*(bmpcl32&0x00FF00))>>7) & 0x00FF00;
+            *dst = cl1 | cl2;
+        }
+        /* next pixel */
+        dst++;
+    }
+}
+
+static inline lUInt32 loadGlyphQuad( const lUInt8 * src )
+{
+    lUInt32 v;
+    memcpy( &v, src, 4 );
+    return v;
+}
+
+/// reverses bit order of byte
+static inline lUInt8 reverseBits8( lUInt32 b )
+{
+    b = ((b & 0xF0) >> 4) | ((b & 0x0F) << 4);
+    b = ((b & 0xCC) >> 2) | ((b & 0x33) << 2);
+    b = ((b & 0xAA) >> 1) | ((b & 0x55) << 1);
+    return (lUInt8)b;
+}
+
+/// 1bpp: glyph pixels are thresholded at 0x80, 8 source pixels are packed into one mask byte
+static void blendGlyphRowGray1( lUInt8 * dst, int shift, const lUInt8 * src, int width )
+{
+    while ( width>=8 ) {
+        lUInt32 bits;
+#if (CR_DRAWBUF_SSE2==1)
+        bits = reverseBits8( _mm_movemask_epi8( _mm_loadl_epi64((const __m128i*)src) ) & 0xFF );
+#else
+        bits = 0;
+        for ( int i=0; i<8; i++ )
+            bits |= (src[i] & 0x80) >> i;
+#endif
+        if ( bits ) {
+#if (GRAY_INVERSE==1)
+            dst[0] |= (lUInt8)(bits >> shift);
+            if ( shift )
+                dst[1] |= (lUInt8)(bits << (8-shift));
+#else
+            dst[0] &= (lUInt8)~(bits >> shift);
+            if ( shift )
+                dst[1] &= (lUInt8)~(bits << (8-shift));
+#endif
+        }
+        src += 8;
+        dst++;
+        width -= 8;
+    }
+    if ( width>0 )
+        blendGlyphRowGray1Ref( dst, shift, src, width );
+}
+
+/// 2bpp: whole destination bytes (4 pixels) are skipped or filled at once when possible
+static void blendGlyphRowGray2( lUInt8 * dst, int shift, const lUInt8 * src, int width, lUInt8 cl )
+{
+    if ( shift ) {
+        // process head pixels up to byte boundary
+        int head = 4 - shift;
+        if ( head>width )
+            head = width;
+        blendGlyphRowGray2Ref( dst, shift, src, head, cl );
+        src += head;
+        width -= head;
+        dst++;
+    }
+    lUInt8 fill = (lUInt8)((cl<<6) | (cl<<4) | (cl<<2) | cl);
+    while ( width>=4 ) {
+        lUInt32 quad = loadGlyphQuad( src );
+        if ( (quad & 0xC0C0C0C0) == 0 ) {
+            // all 4 pixels have opaque<=3: nothing to draw
+        } else if ( (quad & 0xC0C0C0C0) == 0xC0C0C0C0 ) {
+            // all 4 pixels have opaque>=0xC: solid foreground
+            *dst = fill;
+        } else {
+            blendGlyphRowGray2Ref( dst, 0, src, 4, cl );
+        }
+        src += 4;
+        dst++;
+        width -= 4;
+    }
+    if ( width>0 )
+        blendGlyphRowGray2Ref( dst, 0, src, width, cl );
+}
+
+/// 3, 4, 8 bpp: one byte per pixel
+static void blendGlyphRowGray8( lUInt8 * dst, const lUInt8 * src, int width, lUInt8 color, int bpp )
+{
+    int mask = ((1<<bpp)-1)<<(8-bpp);
+#if (CR_DRAWBUF_SSE2==1)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i vmask = _mm_set1_epi8((char)mask);
+    const __m128i vcolor = _mm_set1_epi8((char)color);
+    const __m128i vcolor16 = _mm_set1_epi16(color);
+    const __m128i v255 = _mm_set1_epi16(255);
+    while ( width>=16 ) {
+        __m128i b = _mm_loadu_si128((const __m128i*)src);
+        __m128i none = _mm_cmpeq_epi8(b, zero);
+        if ( _mm_movemask_epi8(none) != 0xFFFF ) {
+            __m128i d = _mm_loadu_si128((const __m128i*)dst);
+            __m128i full = _mm_cmpeq_epi8(_mm_max_epu8(b, vmask), b); // b >= mask
+            __m128i blo = _mm_unpacklo_epi8(b, zero);
+            __m128i bhi = _mm_unpackhi_epi8(b, zero);
+            __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_sub_epi16(v255, blo)),
+                                       _mm_mullo_epi16(vcolor16, blo));
+            __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_sub_epi16(v255, bhi)),
+                                       _mm_mullo_epi16(vcolor16, bhi));
+            __m128i r = _mm_and_si128(_mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8)), vmask);
+            r = _mm_or_si128(_mm_and_si128(full, vcolor), _mm_andnot_si128(full, r));
+            r = _mm_or_si128(_mm_and_si128(none, d), _mm_andnot_si128(none, r));
+            _mm_storeu_si128((__m128i*)dst, r);
+        }
+        src += 16;
+        dst += 16;
+        width -= 16;
+    }
+#elif (CR_DRAWBUF_NEON==1)
+    const uint8x16_t vmask = vdupq_n_u8((lUInt8)mask);
+    const uint8x16_t vcolor = vdupq_n_u8(color);
+    const uint8x8_t vcolor8 = vdup_n_u8(color);
+    const uint8x16_t v255 = vdupq_n_u8(255);
+    while ( width>=16 ) {
+        uint8x16_t b = vld1q_u8(src);
+        uint8x16_t none = vceqq_u8(b, vdupq_n_u8(0));
+        uint8x16_t full = vcgeq_u8(b, vmask);
+        uint8x16_t d = vld1q_u8(dst);
+        uint8x16_t ib = vsubq_u8(v255, b);
+        uint16x8_t lo = vmlal_u8(vmull_u8(vget_low_u8(d), vget_low_u8(ib)), vcolor8, vget_low_u8(b));
+        uint16x8_t hi = vmlal_u8(vmull_u8(vget_high_u8(d), vget_high_u8(ib)), vcolor8, vget_high_u8(b));
+        uint8x16_t r = vandq_u8(vcombine_u8(vshrn_n_u16(lo, 8), vshrn_n_u16(hi, 8)), vmask);
+        r = vbslq_u8(full, vcolor, r);
+        r = vbslq_u8(none, d, r);
+        vst1q_u8(dst, r);
+        src += 16;
+        dst += 16;
+        width -= 16;
+    }
+#endif
+    if ( width>0 )
+        blendGlyphRowGray8Ref( dst, src, width, color, bpp );
+}
+
+/// 16bpp RGB565: 16 levels of opacity
+static void blendGlyphRow16( lUInt16 * dst, const lUInt8 * src, int width, lUInt16 bmpcl16 )
+{
+#if (CR_DRAWBUF_SSE2==1)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i v15 = _mm_set1_epi16(15);
+    const __m128i m5 = _mm_set1_epi16(0x1F);
+    const __m128i m6 = _mm_set1_epi16(0x3F);
+    const __m128i vcolor = _mm_set1_epi16((short)bmpcl16);
+    const __m128i cr = _mm_set1_epi16((bmpcl16 >> 11) & 0x1F);
+    const __m128i cg = _mm_set1_epi16((bmpcl16 >> 5) & 0x3F);
+    const __m128i cb = _mm_set1_epi16(bmpcl16 & 0x1F);
+    while ( width>=8 ) {
+        __m128i o = _mm_srli_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)src), zero), 4);
+        __m128i none = _mm_cmpeq_epi16(o, zero);
+        if ( _mm_movemask_epi8(none) != 0xFFFF ) {
+            __m128i d = _mm_loadu_si128((const __m128i*)dst);
+            __m128i full = _mm_cmpeq_epi16(o, v15);
+            __m128i a = _mm_sub_epi16(v15, o);
+            __m128i r = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_and_si128(_mm_srli_epi16(d, 11), m5), a), _mm_mullo_epi16(cr, o)), 4);
+            __m128i g = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_and_si128(_mm_srli_epi16(d, 5), m6), a), _mm_mullo_epi16(cg, o)), 4);
+            __m128i b = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_and_si128(d, m5), a), _mm_mullo_epi16(cb, o)), 4);
+            __m128i res = _mm_or_si128(_mm_or_si128(_mm_slli_epi16(r, 11), _mm_slli_epi16(g, 5)), b);
+            res = _mm_or_si128(_mm_and_si128(full, vcolor), _mm_andnot_si128(full, res));
+            res = _mm_or_si128(_mm_and_si128(none, d), _mm_andnot_si128(none, res));
+            _mm_storeu_si128((__m128i*)dst, res);
+        }
+        src += 8;
+        dst += 8;
+        width -= 8;
+    }
+#endif
+    if ( width>0 )
+        blendGlyphRow16Ref( dst, src, width, bmpcl16 );
+}
+
+/// 32bpp: 128 levels of opacity, alpha byte of blended pixels is cleared
+static void blendGlyphRow32( lUInt32 * dst, const lUInt8 * src, int width, lUInt32 bmpcl32 )
+{
+#if (CR_DRAWBUF_SSE2==1)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i v127 = _mm_set1_epi16(0x7F);
+    const __m128i vfull = _mm_set1_epi32(0x77);
+    const __m128i rgbmask = _mm_set1_epi32(0x00FFFFFF);
+    const __m128i vcolor = _mm_set1_epi32((int)bmpcl32);
+    const __m128i vcolor16 = _mm_unpacklo_epi8(vcolor, zero);
+    while ( width>=4 ) {
+        lUInt32 quad = loadGlyphQuad( src );
+        if ( (quad & 0xFEFEFEFE) == 0 ) {
+            // all 4 pixels are transparent
+        } else if ( (quad & 0xF0F0F0F0) == 0xF0F0F0F0 ) {
+            _mm_storeu_si128((__m128i*)dst, vcolor);
+        } else {
+            __m128i o16 = _mm_srli_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128((int)quad), zero), 1); // o0..o3
+            __m128i o32 = _mm_unpacklo_epi16(o16, zero);
+            __m128i oo = _mm_unpacklo_epi16(o16, o16);   // o0 o0 o1 o1 o2 o2 o3 o3
+            __m128i olo = _mm_unpacklo_epi32(oo, oo);    // o0 x4, o1 x4
+            __m128i ohi = _mm_unpackhi_epi32(oo, oo);    // o2 x4, o3 x4
+            __m128i d = _mm_loadu_si128((const __m128i*)dst);
+            __m128i lo = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_sub_epi16(v127, olo)),
+                                                      _mm_mullo_epi16(vcolor16, olo)), 7);
+            __m128i hi = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_sub_epi16(v127, ohi)),
+                                                      _mm_mullo_epi16(vcolor16, ohi)), 7);
+            __m128i r = _mm_and_si128(_mm_packus_epi16(lo, hi), rgbmask);
+            __m128i full = _mm_cmpgt_epi32(o32, vfull);
+            __m128i none = _mm_cmpeq_epi32(o32, zero);
+            r = _mm_or_si128(_mm_and_si128(full, vcolor), _mm_andnot_si128(full, r));
+            r = _mm_or_si128(_mm_and_si128(none, d), _mm_andnot_si128(none, r));
+            _mm_storeu_si128((__m128i*)dst, r);
+        }
+        src += 4;
+        dst += 4;
+        width -= 4;
+    }
+#elif (CR_DRAWBUF_NEON==1)
+    const uint8x8_t v127 = vdup_n_u8(0x7F);
+    const uint8x8_t vfull = vdup_n_u8(0x78);
+    uint8x8x4_t c;
+    c.val[0] = vdup_n_u8((lUInt8)(bmpcl32 & 0xFF));
+    c.val[1] = vdup_n_u8((lUInt8)((bmpcl32 >> 8) & 0xFF));
+    c.val[2] = vdup_n_u8((lUInt8)((bmpcl32 >> 16) & 0xFF));
+    c.val[3] = vdup_n_u8((lUInt8)((bmpcl32 >> 24) & 0xFF));
+    while ( width>=8 ) {
+        uint8x8_t o = vshr_n_u8(vld1_u8(src), 1);
+        uint8x8_t none = vceq_u8(o, vdup_n_u8(0));
+        uint8x8_t full = vcge_u8(o, vfull);
+        uint8x8_t a = vsub_u8(v127, o);
+        uint8x8x4_t d = vld4_u8((const lUInt8*)dst);
+        uint8x8x4_t r;
+        for ( int ch=0; ch<3; ch++ ) {
+            uint8x8_t v = vshrn_n_u16(vmlal_u8(vmull_u8(d.val[ch], a), c.val[ch], o), 7);
+            v = vbsl_u8(full, c.val[ch], v);
+            r.val[ch] = vbsl_u8(none, d.val[ch], v);
+        }
+        r.val[3] = vbsl_u8(none, d.val[3], vand_u8(full, c.val[3]));
+        vst4_u8((lUInt8*)dst, r);
+        src += 8;
+        dst += 8;
+        width -= 8;
+    }
+#endif
+    if ( width>0 )
+        blendGlyphRow32Ref( dst, src, width, bmpcl32 );
+}
+
 void LVGrayDrawBuf::Draw( int x, int y, const lUInt8 * bitmap, int width, int height, lUInt32 * )
 {
     //int buf_width = _dx; /* 2bpp */
     int initial_height = height;
     int bx = 0;
     int by = 0;
-    int xx;
     int bmp_width = width;
-    lUInt8 * dst;
     lUInt8 * dstline;
-    const lUInt8 * src;
-    int      shift, shift0;
+    int      shift0;
 
     if (x<_clip.left)
     {
@@ -1261,88 +1929,23 @@ void LVGrayDrawBuf::Draw( int x, int y, const lUInt8 * bitmap, int width, int he
         dstline = _data + bytesPerRow*y + x;
         shift0 = 0;// not used
     }
-    dst = dstline;
-    xx = width;
 
     bitmap += bx + by*bmp_width;
-    shift = shift0;
-
 
     lUInt8 color = rgbToGrayMask(GetTextColor(), _bpp);
-//    bool white = (color & 0x80) ?
-//#if (GRAY_INVERSE==1)
-//            false : true;
-//#else
-//            true : false;
-//#endif
+    // foreground color for 2bpp
+    lUInt8 cl = (lUInt8)(rgbToGray(GetTextColor()) >> 6); // 0..3
     for (;height;height--)
     {
-        src = bitmap;
-
-        if ( _bpp==2 ) {
-            // foreground color
-            lUInt8 cl = (lUInt8)(rgbToGray(GetTextColor()) >> 6); // 0..3
-            //cl ^= 0x03;
-            for (xx = width; xx>0; --xx)
-            {
-                lUInt8 opaque = (*src >> 4) & 0x0F; // 0..15
-                if ( opaque>0x3 ) {
-                    int shift2 = shift<<1;
-                    int shift2i = 6-shift2;
-                    lUInt8 mask = 0xC0 >> shift2;
-                    lUInt8 dstcolor;
-                    if ( opaque>=0xC ) {
-                        dstcolor = cl;
-                    } else {
-                        lUInt8 bgcolor = ((*dst)>>shift2i)&3; // 0..3
-                        dstcolor = ((opaque*cl + (15-opaque)*bgcolor)>>4)&3;
-                    }
-                    *dst = (*dst & ~mask) | (dstcolor<<shift2i);
-                }
-                src++;
-                /* next pixel */
-                if (!(++shift & 3))
-                {
-                    shift = 0;
-                    dst++;
-                }
-            }
-        } else if ( _bpp==1 ) {
-            for (xx = width; xx>0; --xx)
-            {
-#if (GRAY_INVERSE==1)
-                *dst |= (( (*src++) & 0x80 ) >> ( shift ));
-#else
-                *dst &= ~(( ((*src++) & 0x80) ) >> ( shift ));
-#endif
-                /* next pixel */
-                if (!(++shift & 7))
-                {
-                    shift = 0;
-                    dst++;
-                }
-            }
-        } else { // 3,4,8
-            int mask = ((1<<_bpp)-1)<<(8-_bpp);
-            for (xx = width; xx>0; --xx)
-            {
-                lUInt8 b = (*src++);
-                if ( b ) {
-                    if ( b>=mask )
-                        *dst = color;
-                    else {
-                        int alpha = b ^ 0xFF;
-                        ApplyAlphaGray( *dst, color, alpha, _bpp );
-                    }
-                }
-                dst++;
-            }
-        }
+        if ( _bpp==2 )
+            blendGlyphRowGray2( dstline, shift0, bitmap, width, cl );
+        else if ( _bpp==1 )
+            blendGlyphRowGray1( dstline, shift0, bitmap, width );
+        else // 3,4,8
+            blendGlyphRowGray8( dstline, bitmap, width, color, _bpp );
         /* new dest line */
         bitmap += bmp_width;
         dstline += bytesPerRow;
-        dst = dstline;
-        shift = shift0;
     }
 	CHECK_GUARD_BYTE;
 }
@@ -1375,6 +1978,194 @@ lUInt8 * LVGrayDrawBuf::GetScanLine( int y )
     return _data + _rowsize*y;
 }
 
+// Final quantization pass: page is drawn with 8 bit gray levels, then LVQuantizeDrawBuf()
+// converts it to gray levels of device buffer. Ordered dithering of level count n:
+// level = (gray * (n - 1) + threshold) / 255, thresholds are dither_2bpp_8x8 spread to 1..253.
+static const lUInt8 dither_thresholds_8x8[] = {
+      1, 129,  49, 177,   9, 137,  57, 185,
+    193,  65, 241, 113, 201,  73, 249, 121,
+     33, 161,  17, 145,  41, 169,  25, 153,
+    225,  97, 209,  81, 233, 105, 217,  89,
+     13, 141,  61, 189,   5, 133,  53, 181,
+    205,  77, 253, 125, 197,  69, 245, 117,
+     45, 173,  29, 157,  37, 165,  21, 149,
+    237, 109, 221,  93, 229, 101, 213,  85,
+};
+
+/// ordered dithering of gray row starting at x multiple of 8, thresholds is row of 8x8 tile
+static void quantizeRowOrderedRef( const lUInt8 * gray, int count, int levels, const lUInt8 * thresholds, lUInt8 * out )
+{
+    for ( int i=0; i<count; i++ )
+        out[i] = (lUInt8)((gray[i] * (levels - 1) + thresholds[i & 7]) / 255);
+}
+
+static void quantizeRowOrdered( const lUInt8 * gray, int count, int levels, const lUInt8 * thresholds, lUInt8 * out )
+{
+    int i = 0;
+#if (CR_DRAWBUF_SSE2==1)
+    // x / 255 == (x + 1 + (x >> 8)) >> 8 for x < 65280
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi16(1);
+    const __m128i mul = _mm_set1_epi16((short)(levels - 1));
+    __m128i thr = _mm_loadl_epi64((const __m128i*)thresholds);
+    thr = _mm_unpacklo_epi8(thr, zero);
+    for ( ; i + 16 <= count; i += 16 ) {
+        __m128i g = _mm_loadu_si128((const __m128i*)(gray + i));
+        __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(g, zero), mul), thr);
+        __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(g, zero), mul), thr);
+        lo = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(lo, one), _mm_srli_epi16(lo, 8)), 8);
+        hi = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(hi, one), _mm_srli_epi16(hi, 8)), 8);
+        _mm_storeu_si128((__m128i*)(out + i), _mm_packus_epi16(lo, hi));
+    }
+#elif (CR_DRAWBUF_NEON==1)
+    const uint8x8_t mul = vdup_n_u8((lUInt8)(levels - 1));
+    const uint16x8_t one = vdupq_n_u16(1);
+    const uint16x8_t thr = vmovl_u8(vld1_u8(thresholds));
+    for ( ; i + 16 <= count; i += 16 ) {
+        uint8x16_t g = vld1q_u8(gray + i);
+        uint16x8_t lo = vaddq_u16(vmull_u8(vget_low_u8(g), mul), thr);
+        uint16x8_t hi = vaddq_u16(vmull_u8(vget_high_u8(g), mul), thr);
+        lo = vshrq_n_u16(vaddq_u16(vaddq_u16(lo, one), vshrq_n_u16(lo, 8)), 8);
+        hi = vshrq_n_u16(vaddq_u16(vaddq_u16(hi, one), vshrq_n_u16(hi, 8)), 8);
+        vst1q_u8(out + i, vcombine_u8(vmovn_u16(lo), vmovn_u16(hi)));
+    }
+#endif
+    if ( i < count )
+        quantizeRowOrderedRef( gray + i, count - i, levels, thresholds, out + i );
+}
+
+// range of gray with diffused error, index of error diffusion tables is gray + QUANTIZE_ERROR_RANGE
+#define QUANTIZE_ERROR_RANGE 256
+
+/// Floyd-Steinberg error diffusion of one row; nearest and error are level nearest to gray with error added
+/// and its error, indexed by gray + QUANTIZE_ERROR_RANGE; errors of pixels are in 1/16 of gray level,
+/// err is error of this row, nextErr - of next row (all written here), both of count + 2 items
+static void quantizeRowDiffusion( const lUInt8 * gray, int count, const lUInt8 * nearest, const short * error,
+                                  bool backward, const int * err, int * nextErr, lUInt8 * out )
+{
+    int step = backward ? -1 : 1;
+    int x = backward ? count - 1 : 0;
+    // error of next pixel, and errors of next row below and after current pixel are kept in registers
+    int ahead = 0;
+    int below = 0;
+    int after = 0;
+    for ( int i=0; i<count; i++, x += step ) {
+        // pixel x has error item x + 1
+        // error of pixel is at most half of level step, diffused error is weighted average of such errors,
+        // so index is within tables without clamping
+        int v = gray[x] + QUANTIZE_ERROR_RANGE + ((err[x + 1] + ahead + 8) >> 4);
+        out[x] = nearest[v];
+        int e = error[v];
+        ahead = e * 7;
+        // pixel before x in next row gets nothing more
+        nextErr[x + 1 - step] = below + e * 3;
+        below = after + e * 5;
+        after = e;
+    }
+    nextErr[x + 1 - step] = below;
+    nextErr[x + 1] = after;
+}
+
+/// reads row of buffer as 8 bit gray levels
+static void getGrayRow( LVDrawBuf * buf, int y, int count, lUInt8 * gray, lUInt32 * pixels )
+{
+    int bpp = buf->GetBitsPerPixel();
+    if ( bpp == 8 ) {
+        memcpy( gray, buf->GetScanLine(y), count );
+        return;
+    }
+    buf->GetPixelRow( 0, y, count, pixels );
+    if ( bpp > 8 ) {
+        for ( int i=0; i<count; i++ )
+            gray[i] = (lUInt8)rgbToGray( pixels[i] );
+    } else if ( bpp > 2 ) {
+        // upper bits of byte, repeated to lower bits
+        for ( int i=0; i<count; i++ ) {
+            lUInt32 v = pixels[i] & (0xFF00 >> bpp);
+            gray[i] = (lUInt8)(v | (v >> bpp) | (v >> (bpp * 2)));
+        }
+    } else {
+        int white = (1 << bpp) - 1;
+        for ( int i=0; i<count; i++ )
+            gray[i] = (lUInt8)(pixels[i] * 255 / white);
+    }
+}
+
+/// writes levels 0..(1<<bpp)-1 to row of gray buffer
+static void putLevelRow( lUInt8 * dst, int bpp, const lUInt8 * levels, int count )
+{
+    if ( bpp == 1 ) {
+        for ( int i=0; i<count; i+=8 ) {
+            lUInt8 b = 0;
+            for ( int j=0; j<8 && i+j<count; j++ )
+                b |= levels[i + j] << (7 - j);
+            *dst++ = b;
+        }
+    } else if ( bpp == 2 ) {
+        for ( int i=0; i<count; i+=4 ) {
+            lUInt8 b = 0;
+            for ( int j=0; j<4 && i+j<count; j++ )
+                b |= levels[i + j] << (6 - j * 2);
+            *dst++ = b;
+        }
+    } else {
+        int shift = 8 - bpp;
+        for ( int i=0; i<count; i++ )
+            dst[i] = (lUInt8)(levels[i] << shift);
+    }
+}
+
+void LVQuantizeDrawBuf( LVDrawBuf * src, LVDrawBuf * dst, cr_dither_mode_t mode )
+{
+    int bpp = dst->GetBitsPerPixel();
+    if ( bpp > 8 )
+        return; // gray buffers only
+    int dx = src->GetWidth() < dst->GetWidth() ? src->GetWidth() : dst->GetWidth();
+    int dy = src->GetHeight() < dst->GetHeight() ? src->GetHeight() : dst->GetHeight();
+    if ( dx <= 0 || dy <= 0 )
+        return;
+    int levels = 1 << bpp;
+    lUInt8 * gray = new lUInt8[dx];
+    lUInt8 * out = new lUInt8[dx];
+    lUInt32 * pixels = new lUInt32[dx];
+    int * err = NULL;
+    int * nextErr = NULL;
+    lUInt8 nearest[256 + QUANTIZE_ERROR_RANGE * 2];
+    short error[256 + QUANTIZE_ERROR_RANGE * 2];
+    if ( mode == CR_DITHER_DIFFUSION ) {
+        for ( int i=0; i<256 + QUANTIZE_ERROR_RANGE * 2; i++ ) {
+            int v = i - QUANTIZE_ERROR_RANGE;
+            int cl = v < 0 ? 0 : (v > 255 ? 255 : v);
+            int level = (cl * (levels - 1) + 127) / 255;
+            nearest[i] = (lUInt8)level;
+            error[i] = (short)(cl - level * 255 / (levels - 1));
+        }
+        err = new int[dx + 2];
+        nextErr = new int[dx + 2];
+        memset( err, 0, sizeof(int) * (dx + 2) );
+    }
+    for ( int y=0; y<dy; y++ ) {
+        getGrayRow( src, y, dx, gray, pixels );
+        if ( mode == CR_DITHER_ORDERED ) {
+            quantizeRowOrdered( gray, dx, levels, dither_thresholds_8x8 + (y & 7) * 8, out );
+        } else if ( mode == CR_DITHER_DIFFUSION ) {
+            quantizeRowDiffusion( gray, dx, nearest, error, (y & 1) != 0, err, nextErr, out );
+            int * tmp = err;
+            err = nextErr;
+            nextErr = tmp;
+        } else {
+            for ( int i=0; i<dx; i++ )
+                out[i] = gray[i] >> (8 - bpp);
+        }
+        putLevelRow( dst->GetScanLine(y), bpp, out, dx );
+    }
+    delete[] gray;
+    delete[] out;
+    delete[] pixels;
+    delete[] err;
+    delete[] nextErr;
+}
+
 void LVGrayDrawBuf::Invert()
 {
     int sz = _rowsize * _dy;
@@ -1386,46 +2177,15 @@ void LVGrayDrawBuf::ConvertToBitmap(bool flgDither)
 {
     if (_bpp==1)
         return;
-    // TODO: implement for byte per pixel mode
-    int sz = GetRowSize();
-    lUInt8 * bitmap = (lUInt8*) calloc(sz, sizeof(*bitmap));
-    if (flgDither)
-    {
-        static const lUInt8 cmap[4][4] = {
-            { 0, 0, 0, 0},
-            { 0, 0, 1, 0},
-            { 0, 1, 0, 1},
-            { 1, 1, 1, 1},
-        };
-        for (int y=0; y<_dy; y++)
-        {
-            lUInt8 * src = GetScanLine(y);
-            lUInt8 * dst = bitmap + ((_dx+7)/8)*y;
-            for (int x=0; x<_dx; x++) {
-                int cl = (src[x>>2] >> (6-((x&3)*2)))&3;
-                cl = cmap[cl][ (x&1) + ((y&1)<<1) ];
-                if (cmap[cl][ (x&1) + ((y&1)<<1) ])
-                    dst[x>>3] |= 0x80>>(x&7);
-            }
-        }
-    }
-    else
-    {
-        for (int y=0; y<_dy; y++)
-        {
-            lUInt8 * src = GetScanLine(y);
-            lUInt8 * dst = bitmap + ((_dx+7)/8)*y;
-            for (int x=0; x<_dx; x++) {
-                int cl = (src[x>>2] >> (7-((x&3)*2)))&1;
-                if (cl)
-                    dst[x>>3] |= 0x80>>(x&7);
-            }
-        }
-    }
-    free( _data );
-    _data = bitmap;
+    LVGrayDrawBuf bitmap( _dx, _dy, 1 );
+    LVQuantizeDrawBuf( this, &bitmap, flgDither ? CR_DITHER_ORDERED : CR_DITHER_NONE );
+    if ( _ownData )
+        free( _data );
+    _data = bitmap._data;
+    _ownData = true;
+    bitmap._data = NULL;
     _bpp = 1;
-    _rowsize = (_dx+7)/8;
+    _rowsize = bitmap._rowsize;
 	CHECK_GUARD_BYTE;
 }
 
@@ -1489,6 +2249,22 @@ lUInt32 LVColorDrawBuf::GetPixel( int x, int y )
     return ((lUInt32*)GetScanLine(y))[x];
 }
 
+/// get values of count pixels of row y starting from x, same as GetPixel() of each
+void LVColorDrawBuf::GetPixelRow( int x, int y, int count, lUInt32 * row )
+{
+    if (!_data || y<0 || x<0 || y>=_dy || x+count>_dx) {
+        LVBaseDrawBuf::GetPixelRow( x, y, count, row );
+        return;
+    }
+    if ( _bpp==16 ) {
+        lUInt16 * line = (lUInt16*)GetScanLine(y) + x;
+        for ( int i=0; i<count; i++ )
+            row[i] = rgb565to888(line[i]);
+    } else {
+        memcpy( row, (lUInt32*)GetScanLine(y) + x, sizeof(lUInt32) * count );
+    }
+}
+
 inline static lUInt32 AA(lUInt32 color) {
     return (color >> 24) & 0xFF;
 }
@@ -1833,10 +2609,8 @@ void LVColorDrawBuf::Draw( int x, int y, const lUInt8 * bitmap, int width, int h
     int initial_height = height;
     int bx = 0;
     int by = 0;
-    int xx;
     int bmp_width = width;
     lUInt32 bmpcl = palette?palette[0]:GetTextColor();
-    const lUInt8 * src;
 
     if (x<_clip.left)
     {
@@ -1875,71 +2649,21 @@ void LVColorDrawBuf::Draw( int x, int y, const lUInt8 * bitmap, int width, int h
     if (height<=0)
         return;
 
-    xx = width;
-
     bitmap += bx + by*bmp_width;
 
     if ( _bpp==16 ) {
-
         lUInt16 bmpcl16 = rgb888to565(bmpcl);
-
-        lUInt16 * dst;
-        lUInt16 * dstline;
-
-
         for (;height;height--)
         {
-            src = bitmap;
-            dstline = ((lUInt16*)GetScanLine(y++)) + x;
-            dst = dstline;
-
-            for (xx = width; xx>0; --xx)
-            {
-                lUInt32 opaque = ((*(src++))>>4)&0x0F;
-                if ( opaque>=0xF )
-                    *dst = bmpcl16;
-                else if ( opaque>0 ) {
-                    lUInt32 alpha = 0xF-opaque;
-                    lUInt16 cl1 = (lUInt16)(((alpha*((*dst)&0xF81F) + opaque*(bmpcl16&0xF81F))>>4) & 0xF81F);
-                    lUInt16 cl2 = (lUInt16)(((alpha*((*dst)&0x07E0) + opaque*(bmpcl16&0x07E0))>>4) & 0x07E0);
-                    *dst = cl1 | cl2;
-                }
-                /* next pixel */
-                dst++;
-            }
+            blendGlyphRow16( ((lUInt16*)GetScanLine(y++)) + x, bitmap, width, bmpcl16 );
             /* new dest line */
             bitmap += bmp_width;
         }
-
     } else {
-
-
         lUInt32 bmpcl32 = RevRGBA(bmpcl);
-
-        lUInt32 * dst;
-        lUInt32 * dstline;
-
-
         for (;height;height--)
         {
-            src = bitmap;
-            dstline = ((lUInt32*)GetScanLine(y++)) + x;
-            dst = dstline;
-
-            for (xx = width; xx>0; --xx)
-            {
-                lUInt32 opaque = ((*(src++))>>1)&0x7F;
-                if ( opaque>=0x78 )
-                    *dst = bmpcl32;
-                else if ( opaque>0 ) {
-                    lUInt32 alpha = 0x7F-opaque;
-                    lUInt32 cl1 = ((alpha*((*dst)&0xFF00FF) + opaque*(bmpcl32&0xFF00FF))>>7) & 0xFF00FF;
-                    lUInt32 cl2 = ((alpha*((*dst)&0x00FF00) + opaque*(bmpcl32&0x00FF00))>>7) & 0x00FF00;
-                    *dst = cl1 | cl2;
-                }
-                /* next pixel */
-                dst++;
-            }
+            blendGlyphRow32( ((lUInt32*)GetScanLine(y++)) + x, bitmap, width, bmpcl32 );
             /* new dest line */
             bitmap += bmp_width;
         }
@@ -2747,6 +3471,153 @@ void LVColorDrawBuf::DrawOnTop( LVDrawBuf * buf, int x, int y)
         }
     }
 }
+// Area average downscaling for DrawRescaled().
+// GetAvgColor() of each target pixel rectangle sums r*xs*ys over covered source pixels,
+// where xs, ys are covered parts of pixel (in 1/16). It's the same as sum of xs * (column sum
+// of r*ys), so each source row is read once per target row: accumulateAreaRow() adds
+// channels of source row multiplied by ys to column sums, then target pixels are sums
+// of few columns. accumulateAreaRowRef() is per-pixel reference for row tails and tests.
+
+static void accumulateAreaRowRef( const lUInt32 * pixels, int count, int weight, lUInt32 * sums )
+{
+    for ( int i=0; i<count; i++ ) {
+        lUInt32 cl = pixels[i];
+        sums[0] += (cl & 0xFF) * weight;
+        sums[1] += ((cl >> 8) & 0xFF) * weight;
+        sums[2] += ((cl >> 16) & 0xFF) * weight;
+        sums[3] += ((cl >> 24) & 0xFF) * weight;
+        sums += 4;
+    }
+}
+
+static void accumulateAreaRow( const lUInt32 * pixels, int count, int weight, lUInt32 * sums )
+{
+#if (CR_DRAWBUF_SSE2==1)
+    // channel * weight (up to 16) fits in 16 bits
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i w = _mm_set1_epi16((short)weight);
+    while ( count>=4 ) {
+        __m128i v = _mm_loadu_si128((const __m128i*)pixels);
+        __m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(v, zero), w);
+        __m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(v, zero), w);
+        __m128i * s = (__m128i*)sums;
+        _mm_storeu_si128(s, _mm_add_epi32(_mm_loadu_si128(s), _mm_unpacklo_epi16(lo, zero)));
+        _mm_storeu_si128(s + 1, _mm_add_epi32(_mm_loadu_si128(s + 1), _mm_unpackhi_epi16(lo, zero)));
+        _mm_storeu_si128(s + 2, _mm_add_epi32(_mm_loadu_si128(s + 2), _mm_unpacklo_epi16(hi, zero)));
+        _mm_storeu_si128(s + 3, _mm_add_epi32(_mm_loadu_si128(s + 3), _mm_unpackhi_epi16(hi, zero)));
+        pixels += 4;
+        sums += 16;
+        count -= 4;
+    }
+#elif (CR_DRAWBUF_NEON==1)
+    const uint8x8_t w = vdup_n_u8((lUInt8)weight);
+    while ( count>=4 ) {
+        uint8x16_t v = vld1q_u8((const lUInt8*)pixels);
+        uint16x8_t lo = vmull_u8(vget_low_u8(v), w);
+        uint16x8_t hi = vmull_u8(vget_high_u8(v), w);
+        vst1q_u32(sums, vaddw_u16(vld1q_u32(sums), vget_low_u16(lo)));
+        vst1q_u32(sums + 4, vaddw_u16(vld1q_u32(sums + 4), vget_high_u16(lo)));
+        vst1q_u32(sums + 8, vaddw_u16(vld1q_u32(sums + 8), vget_low_u16(hi)));
+        vst1q_u32(sums + 12, vaddw_u16(vld1q_u32(sums + 12), vget_high_u16(hi)));
+        pixels += 4;
+        sums += 16;
+        count -= 4;
+    }
+#endif
+    if ( count>0 )
+        accumulateAreaRowRef( pixels, count, weight, sums );
+}
+
+/// colors of target row for area average downscaling, same as GetAvgColor() of each target pixel
+class LVAreaAverageRow
+{
+    LVDrawBuf * _src;
+    int _srcdx;
+    int _srcdy;
+    int _dx;
+    int _dy;
+    lUInt32 * _pixels;  ///< source row
+    lUInt32 * _sums;    ///< channel sums of source columns, 4 per column
+public:
+    LVAreaAverageRow( LVDrawBuf * src, int dx, int dy )
+        : _src(src), _srcdx(src->GetWidth()), _srcdy(src->GetHeight()), _dx(dx), _dy(dy)
+    {
+        _pixels = new lUInt32[_srcdx + 1];
+        _sums = new lUInt32[(_srcdx + 1) * 4];
+    }
+    ~LVAreaAverageRow()
+    {
+        delete[] _pixels;
+        delete[] _sums;
+    }
+    /// puts colors of target pixels xx0..xx1-1 of row yy to out[0..xx1-xx0-1]
+    void getRow( int yy, int xx0, int xx1, lUInt32 * out )
+    {
+        // rectangles in 1/16 of pixel, as in DrawRescaled() and GetAvgColor()
+        int y0 = _srcdy * yy * 16 / _dy;
+        int y1 = _srcdy * (yy + 1) * 16 / _dy;
+        if ( y0 < 0 )
+            y0 = 0;
+        if ( y1 > (_srcdy << 4) )
+            y1 = _srcdy << 4;
+        int sx0 = (_srcdx * xx0 * 16 / _dx) >> 4;
+        int sx1 = (((_srcdx * xx1 * 16 / _dx) - 1) >> 4) + 1;
+        if ( sx0 < 0 )
+            sx0 = 0;
+        if ( sx1 > _srcdx )
+            sx1 = _srcdx;
+        int count = sx1 - sx0;
+        if ( count > 0 ) {
+            memset( _sums, 0, sizeof(lUInt32) * 4 * count );
+            int maxy = (y1 - 1) >> 4;
+            for ( int y = (y0 >> 4); y <= maxy; y++ ) {
+                int py0 = y << 4;
+                int py1 = (y + 1) << 4;
+                if ( py0 < y0 )
+                    py0 = y0;
+                if ( py1 > y1 )
+                    py1 = y1;
+                int ys = py1 - py0; // 0..16
+                if ( ys < 1 )
+                    continue;
+                _src->GetPixelRow( sx0, y, count, _pixels );
+                accumulateAreaRow( _pixels, count, ys, _sums );
+            }
+        }
+        for ( int xx=xx0; xx<xx1; xx++ ) {
+            int x0 = _srcdx * xx * 16 / _dx;
+            int x1 = _srcdx * (xx + 1) * 16 / _dx;
+            if ( x0 < 0 )
+                x0 = 0;
+            if ( x1 > (_srcdx << 4) )
+                x1 = _srcdx << 4;
+            lUInt32 s = (lUInt32)(x1 - x0) * (lUInt32)(y1 - y0);
+            if ( x0 > x1 || y0 > y1 || s == 0 ) {
+                out[xx - xx0] = 0; // invalid rectangle
+                continue;
+            }
+            lUInt32 rs = 0;
+            lUInt32 gs = 0;
+            lUInt32 bs = 0;
+            int maxx = (x1 - 1) >> 4;
+            for ( int x = (x0 >> 4); x <= maxx; x++ ) {
+                int px0 = x << 4;
+                int px1 = (x + 1) << 4;
+                if ( px0 < x0 )
+                    px0 = x0;
+                if ( px1 > x1 )
+                    px1 = x1;
+                lUInt32 xs = px1 - px0; // 0..16
+                const lUInt32 * sum = _sums + (x - sx0) * 4;
+                bs += sum[0] * xs;
+                gs += sum[1] * xs;
+                rs += sum[2] * xs;
+            }
+            out[xx - xx0] = (((rs / s) & 0xFF) << 16) | (((gs / s) & 0xFF) << 8) | ((bs / s) & 0xFF);
+        }
+    }
+};
+
 /// draws rescaled buffer content to another buffer doing color conversion if necessary
 void LVGrayDrawBuf::DrawRescaled(LVDrawBuf * src, int x, int y, int dx, int dy, int options)
 {
@@ -2760,6 +3631,11 @@ void LVGrayDrawBuf::DrawRescaled(LVDrawBuf * src, int x, int y, int dx, int dy,
     bool linearInterpolation = (srcdx <= dx || srcdy <= dy);
     //CRLog::trace("LVGrayDrawBuf::DrawRescaled bpp=%d %dx%d srcbpp=%d (%d,%d) (%d,%d)", _bpp, GetWidth(), GetHeight(), src->GetBitsPerPixel(), x, y, dx, dy);
 	CHECK_GUARD_BYTE;
+    LVAreaAverageRow * avg = linearInterpolation ? NULL : new LVAreaAverageRow( src, dx, dy );
+    lUInt32 * colors = linearInterpolation ? NULL : new lUInt32[dx];
+    // visible part of target row
+    int xx0 = clip.left > x ? clip.left - x : 0;
+    int xx1 = clip.right - x < dx ? clip.right - x : dx;
     for (int yy=0; yy<dy; yy++)
     {
         if (y+yy >= clip.top && y+yy < clip.bottom)
@@ -2827,16 +3703,13 @@ void LVGrayDrawBuf::DrawRescaled(LVDrawBuf * src, int x, int y, int dx, int dy,
 #endif
             } else {
                 // area average
-                lvRect srcRect;
-                srcRect.top = srcdy * yy * 16 / dy;
-                srcRect.bottom = srcdy * (yy + 1) * 16 / dy;
+                if ( xx0 < xx1 )
+                    avg->getRow( yy, xx0, xx1, colors + xx0 );
                 for (int xx=0; xx<dx; xx++)
                 {
                     if ( x+xx >= clip.left && x+xx < clip.right )
                     {
-                        srcRect.left = srcdx * xx * 16 / dx;
-                        srcRect.right = srcdx * (xx + 1) * 16 / dx;
-                        lUInt32 cl = src->GetAvgColor(srcRect);
+                        lUInt32 cl = colors[xx];
                         if (_bpp==1)
                         {
                             int shift = (x + xx) & 7;
@@ -2878,6 +3751,8 @@ void LVGrayDrawBuf::DrawRescaled(LVDrawBuf * src, int x, int y, int dx, int dy,
             }
         }
     }
+    delete avg;
+    delete[] colors;
 	CHECK_GUARD_BYTE;
 }
 
@@ -2894,6 +3769,11 @@ void LVColorDrawBuf::DrawRescaled(LVDrawBuf * src, int x, int y, int dx, int dy,
     int srcdx = src->GetWidth();
     int srcdy = src->GetHeight();
     bool linearInterpolation = (srcdx <= dx || srcdy <= dy);
+    LVAreaAverageRow * avg = linearInterpolation ? NULL : new LVAreaAverageRow( src, dx, dy );
+    lUInt32 * colors = linearInterpolation ? NULL : new lUInt32[dx];
+    // visible part of target row
+    int xx0 = clip.left > x ? clip.left - x : 0;
+    int xx1 = clip.right - x < dx ? clip.right - x : dx;
 	for (int yy=0; yy<dy; yy++) {
 		if (y+yy >= clip.top && y+yy < clip.bottom)	{
 			if (linearInterpolation) {
@@ -2914,14 +3794,11 @@ void LVColorDrawBuf::DrawRescaled(LVDrawBuf * src, int x, int y, int dx, int dy,
 				}
 			} else {
 				// area average
-				lvRect srcRect;
-				srcRect.top = srcdy * yy * 16 / dy;
-				srcRect.bottom = srcdy * (yy + 1) * 16 / dy;
+				if ( xx0 < xx1 )
+					avg->getRow( yy, xx0, xx1, colors + xx0 );
 				for (int xx=0; xx<dx; xx++)	{
 					if ( x+xx >= clip.left && x+xx < clip.right ) {
-						srcRect.left = srcdx * xx * 16 / dx;
-						srcRect.right = srcdx * (xx + 1) * 16 / dx;
-						lUInt32 cl = src->GetAvgColor(srcRect);
+						lUInt32 cl = colors[xx];
                         if (_bpp == 16) {
 							lUInt16 * dst = (lUInt16 *)GetScanLine(y + yy);
 							dst[x + xx] = rgb888to565(cl);
@@ -2934,6 +3811,8 @@ void LVColorDrawBuf::DrawRescaled(LVDrawBuf * src, int x, int y, int dx, int dy,
 			}
 		}
 	}
+    delete avg;
+    delete[] colors;
 }
 
 /// returns scanline pointer
@@ -3014,3 +3893,297 @@ void LVColorDrawBuf::ConvertToBitmap(bool flgDither)
     CR_UNUSED(flgDither);
 }
 
+
+static lUInt32 drawBufTestRandom( lUInt32 & seed )
+{
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 8) & 0xFFFFFF;
+}
+
+/// checks that glyph blending kernels give exactly the same pixels as original per-pixel code
+static void runGlyphBlendingUnitTests()
+{
+    CRLog::info("runGlyphBlendingUnitTests()");
+    lUInt32 seed = 1;
+    const int maxw = 77;
+    lUInt8 src[maxw];
+    lUInt8 dst1[maxw*4 + 8];
+    lUInt8 dst2[maxw*4 + 8];
+    for ( int pass=0; pass<2000; pass++ ) {
+        int width = 1 + drawBufTestRandom(seed) % maxw;
+        int shift = drawBufTestRandom(seed) % 8;
+        lUInt32 color = drawBufTestRandom(seed) | (drawBufTestRandom(seed) << 24);
+        for ( int i=0; i<width; i++ ) {
+            // mix of transparent, solid and antialiased pixels
+            switch ( drawBufTestRandom(seed) % 4 ) {
+            case 0: src[i] = 0; break;
+            case 1: src[i] = 0xFF; break;
+            default: src[i] = (lUInt8)drawBufTestRandom(seed); break;
+            }
+        }
+        for ( int i=0; i<(int)sizeof(dst1); i++ )
+            dst1[i] = dst2[i] = (lUInt8)drawBufTestRandom(seed);
+
+        blendGlyphRowGray1Ref( dst1, shift, src, width );
+        blendGlyphRowGray1( dst2, shift, src, width );
+        MYASSERT( !memcmp(dst1, dst2, sizeof(dst1)), "1bpp glyph blending" );
+
+        blendGlyphRowGray2Ref( dst1, shift & 3, src, width, (lUInt8)(color & 3) );
+        blendGlyphRowGray2( dst2, shift & 3, src, width, (lUInt8)(color & 3) );
+        MYASSERT( !memcmp(dst1, dst2, sizeof(dst1)), "2bpp glyph blending" );
+
+        static const int bpps[] = { 3, 4, 8 };
+        for ( int i=0; i<3; i++ ) {
+            lUInt8 cl = rgbToGrayMask( color, bpps[i] );
+            blendGlyphRowGray8Ref( dst1, src, width, cl, bpps[i] );
+            blendGlyphRowGray8( dst2, src, width, cl, bpps[i] );
+            MYASSERT( !memcmp(dst1, dst2, sizeof(dst1)), "3,4,8bpp glyph blending" );
+        }
+
+        lUInt16 d16a[maxw], d16b[maxw];
+        memcpy( d16a, dst1, sizeof(d16a) );
+        memcpy( d16b, dst1, sizeof(d16b) );
+        blendGlyphRow16Ref( d16a, src, width, rgb888to565(color) );
+        blendGlyphRow16( d16b, src, width, rgb888to565(color) );
+        MYASSERT( !memcmp(d16a, d16b, sizeof(d16a)), "16bpp glyph blending" );
+
+        lUInt32 d32a[maxw], d32b[maxw];
+        memcpy( d32a, dst1, sizeof(d32a) );
+        memcpy( d32b, dst1, sizeof(d32b) );
+        blendGlyphRow32Ref( d32a, src, width, color );
+        blendGlyphRow32( d32b, src, width, color );
+        MYASSERT( !memcmp(d32a, d32b, sizeof(d32a)), "32bpp glyph blending" );
+    }
+    CRLog::info("runGlyphBlendingUnitTests() finished");
+}
+
+/// returns start of pixel data of color buffer
+static lUInt8 * drawBufTestData( LVColorDrawBuf & buf )
+{
+#if !defined(__SYMBIAN32__) && defined(_WIN32) && !defined(QT_GL)
+    return buf.GetScanLine( buf.GetHeight() - 1 );
+#else
+    return buf.GetScanLine( 0 );
+#endif
+}
+
+/// checks that tiled rotation gives exactly the same pixels as original per-pixel code
+static void runRotationUnitTests()
+{
+    CRLog::info("runRotationUnitTests()");
+    lUInt32 seed = 1;
+    static const int bpps[] = { 1, 2, 3, 4, 8, 16, 32 };
+    static const cr_rotate_angle_t angles[] = { CR_ROTATE_ANGLE_90, CR_ROTATE_ANGLE_180, CR_ROTATE_ANGLE_270 };
+    for ( int pass=0; pass<300; pass++ ) {
+        // sizes around tile and block boundaries
+        int dx = 1 + drawBufTestRandom(seed) % (pass < 20 ? 200 : 75);
+        int dy = 1 + drawBufTestRandom(seed) % (pass < 20 ? 200 : 75);
+        int bpp = bpps[pass % 7];
+        cr_rotate_angle_t angle = angles[(pass / 7) % 3];
+        bool cw = angle==CR_ROTATE_ANGLE_90;
+        if ( bpp<=8 ) {
+            LVGrayDrawBuf buf( dx, dy, bpp );
+            int rowsize = buf.GetRowSize();
+            lUInt8 * data = buf.GetScanLine(0);
+            for ( int i=0; i<rowsize*dy; i++ )
+                data[i] = (lUInt8)drawBufTestRandom(seed);
+            if ( angle==CR_ROTATE_ANGLE_180 && bpp<=2 )
+                continue; // not changed
+            int newrowsize = bpp<=2 ? (dy * bpp + 7) / 8 : dy;
+            lUInt8 * expected = (lUInt8 *)calloc( angle==CR_ROTATE_ANGLE_180 ? rowsize*dy : newrowsize*dx, 1 );
+            if ( angle==CR_ROTATE_ANGLE_180 ) {
+                memcpy( expected, data, rowsize*dy );
+                reversePixelsRef( expected, rowsize*dy );
+            } else if ( bpp<=2 ) {
+                rotatePackedPixelsRef( data, rowsize, dx, dy, expected, newrowsize, cw, bpp, 0, 0, dx, dy );
+            } else {
+                rotatePixelsRef( data, rowsize, dx, dy, expected, newrowsize, cw );
+            }
+            buf.Rotate( angle );
+            MYASSERT( buf.GetRowSize() * buf.GetHeight() == (angle==CR_ROTATE_ANGLE_180 ? rowsize*dy : newrowsize*dx), "gray rotated size" );
+            MYASSERT( !memcmp( buf.GetScanLine(0), expected, buf.GetRowSize() * buf.GetHeight() ), "gray rotation" );
+            free( expected );
+        } else {
+            LVColorDrawBuf buf( dx, dy, bpp );
+            int size = dx * dy * (bpp >> 3);
+            lUInt8 * data = drawBufTestData( buf );
+            for ( int i=0; i<size; i++ )
+                data[i] = (lUInt8)drawBufTestRandom(seed);
+#if !defined(__SYMBIAN32__) && defined(_WIN32) && !defined(QT_GL)
+            cw = !cw;
+#endif
+            lUInt8 * expected = (lUInt8 *)malloc( size );
+            if ( angle==CR_ROTATE_ANGLE_180 ) {
+                memcpy( expected, data, size );
+                if ( bpp==16 )
+                    reversePixelsRef( (lUInt16*)expected, dx * dy );
+                else
+                    reversePixelsRef( (lUInt32*)expected, dx * dy );
+            } else if ( bpp==16 ) {
+                rotatePixelsRef( (lUInt16*)data, dx, dx, dy, (lUInt16*)expected, dy, cw );
+            } else {
+                rotatePixelsRef( (lUInt32*)data, dx, dx, dy, (lUInt32*)expected, dy, cw );
+            }
+            buf.Rotate( angle );
+            MYASSERT( !memcmp( drawBufTestData( buf ), expected, size ), "color rotation" );
+            free( expected );
+        }
+    }
+    CRLog::info("runRotationUnitTests() finished");
+}
+
+/// checks that area average downscaling by rows gives the same colors as GetAvgColor()
+static void runRescaleUnitTests()
+{
+    CRLog::info("runRescaleUnitTests()");
+    lUInt32 seed = 1;
+    static const int bpps[] = { 1, 2, 4, 8, 16, 32 };
+    lUInt32 sums1[16 * 4];
+    lUInt32 sums2[16 * 4];
+    lUInt32 pixels[16];
+    for ( int pass=0; pass<200; pass++ ) {
+        int count = 1 + drawBufTestRandom(seed) % 16;
+        int weight = 1 + drawBufTestRandom(seed) % 16;
+        for ( int i=0; i<16; i++ )
+            pixels[i] = drawBufTestRandom(seed) | (drawBufTestRandom(seed) << 24);
+        for ( int i=0; i<16 * 4; i++ )
+            sums1[i] = sums2[i] = drawBufTestRandom(seed);
+        accumulateAreaRowRef( pixels, count, weight, sums1 );
+        accumulateAreaRow( pixels, count, weight, sums2 );
+        MYASSERT( !memcmp( sums1, sums2, sizeof(sums1) ), "area average accumulation" );
+    }
+    for ( int pass=0; pass<60; pass++ ) {
+        int srcdx = 2 + drawBufTestRandom(seed) % 150;
+        int srcdy = 2 + drawBufTestRandom(seed) % 150;
+        int dx = 1 + drawBufTestRandom(seed) % (srcdx - 1);
+        int dy = 1 + drawBufTestRandom(seed) % (srcdy - 1);
+        int bpp = bpps[pass % 6];
+        LVDrawBuf * src;
+        if ( bpp<=8 )
+            src = new LVGrayDrawBuf( srcdx, srcdy, bpp );
+        else
+            src = new LVColorDrawBuf( srcdx, srcdy, bpp );
+        for ( int y=0; y<srcdy; y++ ) {
+            lUInt8 * line = src->GetScanLine(y);
+            for ( int i=0; i<src->GetRowSize(); i++ )
+                line[i] = (lUInt8)drawBufTestRandom(seed);
+        }
+        // whole rows and random visible parts
+        LVAreaAverageRow avg( src, dx, dy );
+        lUInt32 * row = new lUInt32[dx];
+        for ( int yy=0; yy<dy; yy++ ) {
+            int xx0 = yy & 1 ? drawBufTestRandom(seed) % dx : 0;
+            int xx1 = yy & 1 ? xx0 + 1 + drawBufTestRandom(seed) % (dx - xx0) : dx;
+            avg.getRow( yy, xx0, xx1, row );
+            lvRect srcRect;
+            srcRect.top = srcdy * yy * 16 / dy;
+            srcRect.bottom = srcdy * (yy + 1) * 16 / dy;
+            for ( int xx=xx0; xx<xx1; xx++ ) {
+                srcRect.left = srcdx * xx * 16 / dx;
+                srcRect.right = srcdx * (xx + 1) * 16 / dx;
+                MYASSERT( row[xx - xx0] == src->GetAvgColor( srcRect ), "area average downscaling" );
+            }
+        }
+        delete[] row;
+        // clipped drawing
+        LVColorDrawBuf dst( dx + 4, dy + 4, 32 );
+        dst.Clear( 0x123456 );
+        lvRect clip( 1, 3, dx + 1, dy + 2 );
+        dst.SetClipRect( &clip );
+        dst.DrawRescaled( src, 2, 2, dx, dy, 0 );
+        for ( int y=0; y<dy+4; y++ ) {
+            for ( int x=0; x<dx+4; x++ ) {
+                lUInt32 expected = 0x123456;
+                if ( x>=2 && y>=2 && x<dx+2 && y<dy+2 && clip.isPointInside( lvPoint(x, y) ) ) {
+                    lvRect srcRect( srcdx * (x-2) * 16 / dx, srcdy * (y-2) * 16 / dy,
+                                    srcdx * (x-1) * 16 / dx, srcdy * (y-1) * 16 / dy );
+                    expected = src->GetAvgColor( srcRect );
+                }
+                MYASSERT( (dst.GetPixel( x, y ) & 0xFFFFFF) == (RevRGBA(expected) & 0xFFFFFF), "area average drawing" );
+            }
+        }
+        delete src;
+    }
+    CRLog::info("runRescaleUnitTests() finished");
+}
+
+/// checks ordered dithering kernel against reference code, and gray levels of quantized buffers
+static void runQuantizeUnitTests()
+{
+    CRLog::info("runQuantizeUnitTests()");
+    lUInt32 seed = 1;
+    lUInt8 gray[100];
+    lUInt8 out1[100];
+    lUInt8 out2[100];
+    static const int bpps[] = { 1, 2, 3, 4, 8 };
+    for ( int pass=0; pass<500; pass++ ) {
+        int count = 1 + drawBufTestRandom(seed) % 100;
+        int levels = 1 << bpps[pass % 5];
+        const lUInt8 * thresholds = dither_thresholds_8x8 + (pass & 7) * 8;
+        for ( int i=0; i<count; i++ )
+            gray[i] = (lUInt8)drawBufTestRandom(seed);
+        quantizeRowOrderedRef( gray, count, levels, thresholds, out1 );
+        quantizeRowOrdered( gray, count, levels, thresholds, out2 );
+        MYASSERT( !memcmp( out1, out2, count ), "ordered dithering" );
+    }
+    for ( int pass=0; pass<30; pass++ ) {
+        int dx = 1 + drawBufTestRandom(seed) % 90;
+        int dy = 1 + drawBufTestRandom(seed) % 30;
+        int bpp = bpps[pass % 5];
+        LVGrayDrawBuf src( dx, dy, 8 );
+        LVGrayDrawBuf dst( dx, dy, bpp );
+        for ( int y=0; y<dy; y++ )
+            for ( int x=0; x<dx; x++ )
+                src.GetScanLine(y)[x] = (lUInt8)drawBufTestRandom(seed);
+        // no dithering: upper bits, as gray buffers keep drawn colors
+        LVQuantizeDrawBuf( &src, &dst, CR_DITHER_NONE );
+        for ( int y=0; y<dy; y++ ) {
+            for ( int x=0; x<dx; x++ ) {
+                lUInt32 g = src.GetScanLine(y)[x];
+                lUInt32 expected = bpp <= 2 ? g >> (8 - bpp) : g & (0xFF00 >> bpp);
+                MYASSERT( dst.GetPixel( x, y ) == expected, "quantization without dithering" );
+            }
+        }
+        if ( bpp == 8 ) {
+            LVQuantizeDrawBuf( &src, &dst, CR_DITHER_ORDERED );
+            MYASSERT( !memcmp( src.GetScanLine(0), dst.GetScanLine(0), dx * dy ), "ordered dithering to 8 bits" );
+        }
+    }
+    // dithered flat areas keep their gray level in average
+    for ( int bpp=1; bpp<=2; bpp++ ) {
+        for ( int mode=CR_DITHER_ORDERED; mode<=CR_DITHER_DIFFUSION; mode++ ) {
+            for ( int g=0; g<256; g+=15 ) {
+                LVGrayDrawBuf src( 64, 64, 8 );
+                LVGrayDrawBuf dst( 64, 64, bpp );
+                memset( src.GetScanLine(0), g, 64 * 64 );
+                LVQuantizeDrawBuf( &src, &dst, (cr_dither_mode_t)mode );
+                int sum = 0;
+                for ( int y=0; y<64; y++ )
+                    for ( int x=0; x<64; x++ )
+                        sum += dst.GetPixel( x, y ) * 255 / ((1 << bpp) - 1);
+                int avg = (sum + 2048) / 4096;
+                MYASSERT( avg >= g - 3 && avg <= g + 3, "average level of dithered area" );
+            }
+        }
+    }
+    // 2 bpp to 1 bpp bitmap: upper bit of level
+    LVGrayDrawBuf buf( 37, 5, 2 );
+    for ( int i=0; i<buf.GetRowSize() * 5; i++ )
+        buf.GetScanLine(0)[i] = (lUInt8)drawBufTestRandom(seed);
+    LVGrayDrawBuf copy( 37, 5, 2 );
+    memcpy( copy.GetScanLine(0), buf.GetScanLine(0), buf.GetRowSize() * 5 );
+    buf.ConvertToBitmap( false );
+    MYASSERT( buf.GetBitsPerPixel() == 1 && buf.GetRowSize() == 5, "bitmap format" );
+    for ( int y=0; y<5; y++ )
+        for ( int x=0; x<37; x++ )
+            MYASSERT( buf.GetPixel( x, y ) == copy.GetPixel( x, y ) >> 1, "bitmap conversion" );
+    CRLog::info("runQuantizeUnitTests() finished");
+}
+
+void runDrawBufUnitTests()
+{
+    runGlyphBlendingUnitTests();
+    runRotationUnitTests();
+    runRescaleUnitTests();
+    runQuantizeUnitTests();
+}
@@ -23,6 +23,8 @@
 #include "../include/lvdrawbuf.h"
 #include "../include/lvstyles.h"
 #include "../include/lvthread.h"
+#include "../include/crconcurrent.h"
+#include "../include/crtrace.h"
 
 // Uncomment for debugging text measurement or drawing
 // #define DEBUG_MEASURE_TEXT
@@ -48,6 +50,7 @@
 #include FT_FREETYPE_H
 #include FT_OUTLINE_H   // for FT_Outline_Embolden()
 #include FT_SYNTHESIS_H // for FT_GlyphSlot_Embolden()
+#include "lvhashtable.h"
 
 // Use Freetype embolden API instead of LVFontBoldTransform to
 // make fake bold (for fonts that do not provide a bold face).
@@ -58,7 +61,6 @@
 #if USE_HARFBUZZ==1
 #include <hb.h>
 #include <hb-ft.h>
-#include "lvhashtable.h"
 #endif
 
 #if (USE_FONTCONFIG==1)
@@ -366,6 +368,29 @@ bool isScriptCursive( hb_script_t script ) {
             script == HB_SCRIPT_TIRHUTA ||
             script == HB_SCRIPT_OGHAM;
 }
+
+// Chars that must stay in the same font run as the char before them
+// (combining marks, joiners, variation selectors)
+static bool isRunContinuationChar( lChar16 ch ) {
+    if ( ch == 0x200C || ch == 0x200D || (ch >= 0xFE00 && ch <= 0xFE0F) )
+        return true;
+    hb_unicode_general_category_t cat = hb_unicode_general_category(hb_unicode_funcs_get_default(), ch);
+    return cat == HB_UNICODE_GENERAL_CATEGORY_NON_SPACING_MARK ||
+           cat == HB_UNICODE_GENERAL_CATEGORY_SPACING_MARK ||
+           cat == HB_UNICODE_GENERAL_CATEGORY_ENCLOSING_MARK;
+}
+
+// Direction HarfBuzz would guess (hb_buffer_guess_segment_properties())
+// for the whole text: the one of the first char with a real script
+static bool guessTextIsRTL( const lChar16 * text, int len ) {
+    hb_unicode_funcs_t * funcs = hb_unicode_funcs_get_default();
+    for ( int i=0; i<len; i++ ) {
+        hb_script_t script = hb_unicode_script(funcs, text[i]);
+        if ( script != HB_SCRIPT_COMMON && script != HB_SCRIPT_INHERITED && script != HB_SCRIPT_UNKNOWN )
+            return hb_script_get_horizontal_direction(script) == HB_DIRECTION_RTL;
+    }
+    return false;
+}
 #endif
 
 // LVFontDef carries a font definition, and can be used to identify:
@@ -584,8 +609,9 @@ public:
     lUInt16 get( lChar16 ch )
     {
         FONT_GLYPH_CACHE_GUARD
-        int inx = (ch>>9) & 0x1ff;
-        if (inx >= COUNT) return CACHED_UNSIGNED_METRIC_NOT_SET;
+        // no masking: codepoints above COUNT*512 must not alias lower pages
+        lUInt32 inx = (lUInt32)ch >> 9;
+        if (inx >= (lUInt32)COUNT) return CACHED_UNSIGNED_METRIC_NOT_SET;
         lUInt16 * ptr = ptrs[inx];
         if ( !ptr )
             return CACHED_UNSIGNED_METRIC_NOT_SET;
@@ -594,8 +620,8 @@ public:
     void put( lChar16 ch, lUInt16 m )
     {
         FONT_GLYPH_CACHE_GUARD
-        int inx = (ch>>9) & 0x1ff;
-        if (inx >= COUNT) return;
+        lUInt32 inx = (lUInt32)ch >> 9;
+        if (inx >= (lUInt32)COUNT) return;
         lUInt16 * ptr = ptrs[inx];
         if ( !ptr ) {
             ptr = new lUInt16[512];
@@ -638,6 +664,115 @@ public:
     }
 };
 
+#define FALLBACK_CHAR_NOT_SET   0
+#define FALLBACK_CHAR_OWN       1 // glyph found in this font
+#define FALLBACK_CHAR_FALLBACK  2 // glyph is to be taken from fallback font
+/// per codepoint resolution of the font to take glyph from
+class LVFontFallbackCharCache
+{
+private:
+    static const int COUNT = 360;
+    lUInt8 * ptrs[COUNT]; //support up to 0X2CFFF=360*512-1
+public:
+    int get( lChar16 ch )
+    {
+        FONT_GLYPH_CACHE_GUARD
+        lUInt32 inx = (lUInt32)ch >> 9;
+        if (inx >= (lUInt32)COUNT) return FALLBACK_CHAR_NOT_SET;
+        lUInt8 * ptr = ptrs[inx];
+        if ( !ptr )
+            return FALLBACK_CHAR_NOT_SET;
+        return ptr[ch & 0x1FF ];
+    }
+    void put( lChar16 ch, int res )
+    {
+        FONT_GLYPH_CACHE_GUARD
+        lUInt32 inx = (lUInt32)ch >> 9;
+        if (inx >= (lUInt32)COUNT) return;
+        lUInt8 * ptr = ptrs[inx];
+        if ( !ptr ) {
+            ptr = new lUInt8[512];
+            ptrs[inx] = ptr;
+            memset( ptr, FALLBACK_CHAR_NOT_SET, 512 );
+        }
+        ptr[ ch & 0x1FF ] = (lUInt8)res;
+    }
+    void clear()
+    {
+        FONT_GLYPH_CACHE_GUARD
+        for ( int i=0; i<COUNT; i++ ) {
+            if ( ptrs[i] )
+                delete [] ptrs[i];
+            ptrs[i] = NULL;
+        }
+    }
+    LVFontFallbackCharCache()
+    {
+        memset( ptrs, 0, COUNT*sizeof(lUInt8*) );
+    }
+    ~LVFontFallbackCharCache()
+    {
+        clear();
+    }
+};
+
+/// freetype kerning of glyph pairs of face, filled by FT_Get_Kerning() results as pairs are met
+/**
+    Direct mapped table of FONT_KERNING_CACHE_SIZE pairs, allocated on first
+    use; pair met later replaces pair of the same slot. Glyph indexes of
+    TrueType and CFF fonts are 16 bit, pairs of larger indexes are not cached.
+    Used by face methods holding face mutex, so there is no guard of its own.
+*/
+class LVFontKerningCache
+{
+private:
+    struct Item {
+        lUInt32 pair;   ///< left glyph << 16 | right glyph, 0 for empty slot
+        int kerning;    ///< 26.6 font units
+    };
+    Item * _items;
+    static int slot( lUInt32 pair )
+    {
+        return (int)((pair * 2654435761U) >> 16) & (FONT_KERNING_CACHE_SIZE - 1);
+    }
+public:
+    /// returns true and sets kerning if pair is found
+    bool get( lUInt32 left, lUInt32 right, int & kerning )
+    {
+        if ( !_items || (left | right) > 0xFFFF )
+            return false;
+        lUInt32 pair = (left << 16) | right;
+        Item & item = _items[slot(pair)];
+        if ( item.pair != pair || !pair )
+            return false;
+        kerning = item.kerning;
+        return true;
+    }
+    void put( lUInt32 left, lUInt32 right, int kerning )
+    {
+        if ( (left | right) > 0xFFFF )
+            return;
+        if ( !_items ) {
+            _items = new Item[FONT_KERNING_CACHE_SIZE];
+            memset( _items, 0, sizeof(Item) * FONT_KERNING_CACHE_SIZE );
+        }
+        lUInt32 pair = (left << 16) | right;
+        Item & item = _items[slot(pair)];
+        item.pair = pair;
+        item.kerning = kerning;
+    }
+    void clear()
+    {
+        delete[] _items;
+        _items = NULL;
+    }
+    LVFontKerningCache() : _items(NULL) { }
+    ~LVFontKerningCache()
+    {
+        clear();
+    }
+};
+
 class LVFreeTypeFace;
 
 static LVFontGlyphCacheItem * newItem( LVFontLocalGlyphCache * local_cache, lChar16 ch, FT_GlyphSlot slot ) // , bool drawMonochrome
@@ -782,13 +917,16 @@ LVFontGlyphCacheItem * LVFontLocalGlyphCache::getByChar(lChar16 ch)
     LVFontGlyphCacheItem *ptr = 0;
     GlyphCacheItemData data;
     data.ch = ch;
-    if (hashTable.get(data, ptr))
+    if (hashTable.get(data, ptr)) {
+        global_cache->hit();
         return ptr;
+    }
 #else
     LVFontGlyphCacheItem * ptr = head;
     for ( ; ptr; ptr = ptr->next_local ) {
         if ( ptr->data.ch == ch ) {
             global_cache->refresh( ptr );
+            global_cache->hit();
             return ptr;
         }
     }
@@ -804,13 +942,16 @@ LVFontGlyphCacheItem * LVFontLocalGlyphCache::getByIndex(lUInt32 index)
     LVFontGlyphCacheItem *ptr = 0;
     GlyphCacheItemData data;
     data.gindex = index;
-    if (hashTable.get(data, ptr))
+    if (hashTable.get(data, ptr)) {
+        global_cache->hit();
         return ptr;
+    }
 #else
     LVFontGlyphCacheItem *ptr = head;
     for (; ptr; ptr = ptr->next_local) {
         if (ptr->data.gindex == index) {
             global_cache->refresh( ptr );
+            global_cache->hit();
             return ptr;
         }
     }
@@ -878,8 +1019,11 @@ void LVFontGlobalGlyphCache::put( LVFontGlyphCacheItem * item )
 void LVFontGlobalGlyphCache::putNoLock( LVFontGlyphCacheItem * item )
 {
     int sz = item->getSize();
+    int limit = CR_ATOMIC_LOAD( memory_limit );
+    if ( !limit )
+        limit = max_size;
     // remove extra items from tail
-    while ( sz + size > max_size ) {
+    while ( sz + size > limit ) {
         LVFontGlyphCacheItem * removed_item = tail;
         if ( !removed_item )
             break;
@@ -909,6 +1053,7 @@ void LVFontGlobalGlyphCache::removeNoLock( LVFontGlyphCacheItem * item )
         head = item->next_global;
     if ( item==tail )
         tail = item->prev_global;
+    size -= item->getSize();
     if ( !head || !tail )
         return;
     if ( item->prev_global )
@@ -917,11 +1062,25 @@ void LVFontGlobalGlyphCache::removeNoLock( LVFontGlyphCacheItem * item )
         item->next_global->prev_global = item->prev_global;
     item->next_global = NULL;
     item->prev_global = NULL;
-    size -= item->getSize();
+}
+
+void LVFontGlobalGlyphCache::trimMemory( int target )
+{
+    // same locking order as in LVFontLocalGlyphCache::put()
+    FONT_LOCAL_GLYPH_CACHE_GUARD
+    FONT_GLYPH_CACHE_GUARD
+    while ( tail && size > target ) {
+        LVFontGlyphCacheItem * ptr = tail;
+        removeNoLock( ptr );
+        ptr->local_cache->remove( ptr );
+        LVFontGlyphCacheItem::freeItem( ptr );
+    }
 }
 
 void LVFontGlobalGlyphCache::clear()
 {
+    // same locking order as in LVFontLocalGlyphCache::put()
+    FONT_LOCAL_GLYPH_CACHE_GUARD
     FONT_GLYPH_CACHE_GUARD
     while ( head ) {
         LVFontGlyphCacheItem * ptr = head;
@@ -1003,10 +1162,14 @@ inline lUInt32 getHash( const struct LVCharTriplet& triplet )
 }
 #endif
 
+// use FACE_GUARD to acquire mutex of FreeType face: fonts are shared by documents of all threads
+#define FACE_GUARD CRGuard _faceGuard(_faceMutex); CR_UNUSED(_faceGuard);
+
 class LVFreeTypeFace : public LVFont
 {
 protected:
     LVMutex &     _mutex;
+    CRMutexRef    _faceMutex; // NULL if concurrency is not set up
     lString8      _fileName;
     lString8      _faceName;
     css_font_family_t _fontFamily;
@@ -1024,6 +1187,10 @@ protected:
     LVFontGlyphSignedMetricCache     _lsbcache; // glyph left side bearing cache
     LVFontGlyphSignedMetricCache     _rsbcache; // glyph right side bearing cache
     LVFontLocalGlyphCache            _glyph_cache;
+    LVFontFallbackCharCache          _fallback_chars; // chars without glyph in this font
+#if (ALLOW_KERNING==1)
+    LVFontKerningCache               _kerning_cache;  // freetype kerning of glyph pairs
+#endif
     bool           _drawMonochrome;
     hinting_mode_t _hintingMode;
     kerning_mode_t _kerningMode;
@@ -1067,6 +1234,39 @@ public:
         return _fallbackFont.get();
     }
 
+    /// returns true if char has no glyph in this font (resolved once per codepoint)
+    bool isFallbackChar( lChar16 code ) {
+        int res = _fallback_chars.get( code );
+        if ( res == FALLBACK_CHAR_NOT_SET ) {
+            res = getCharIndex( code, 0 ) ? FALLBACK_CHAR_OWN : FALLBACK_CHAR_FALLBACK;
+            _fallback_chars.put( code, res );
+        }
+        return res == FALLBACK_CHAR_FALLBACK;
+    }
+
+#if USE_HARFBUZZ==1
+    /// returns length of the run at start of text to be shaped with a single font: this one,
+    /// or the fallback one if useFallback is set
+    int getFontRunLength( const lChar16 * text, int len, bool & useFallback ) {
+        useFallback = isFallbackChar( text[0] );
+        int n = 1;
+        while ( n < len ) {
+            if ( isFallbackChar( text[n] ) != useFallback && !isRunContinuationChar( text[n] ) )
+                break;
+            n++;
+        }
+        return n;
+    }
+
+    /// returns true if text has chars to be taken from fallback font
+    bool hasFallbackRuns( const lChar16 * text, int len ) {
+        if ( !getFallbackFont() )
+            return false;
+        bool useFallback;
+        return getFontRunLength( text, len, useFallback ) < len || useFallback;
+    }
+#endif
+
     /// returns font weight
     virtual int getWeight() const { return _weight; }
     /// returns italic flag
@@ -1095,6 +1295,8 @@ public:
         _matrix.xy = 0;
         _matrix.yx = 0;
         _hintingMode = fontMan->GetHintingMode();
+        if ( concurrencyProvider )
+            _faceMutex = concurrencyProvider->createMutex();
 
         #if USE_HARFBUZZ==1
         _hb_font = 0;
@@ -1161,14 +1363,37 @@ public:
         _wcache.clear();
         _lsbcache.clear();
         _rsbcache.clear();
+        #if (ALLOW_KERNING==1)
+        _kerning_cache.clear();
+        #endif
         #if USE_HARFBUZZ==1
         _glyph_cache2.clear();
         _width_cache2.clear();
         #endif
     }
 
+#if (ALLOW_KERNING==1)
+    /// returns freetype kerning of glyph pair in 26.6 font units, caller holds face mutex
+    int getKerning( FT_UInt left, FT_UInt right ) {
+        int kerning;
+        if ( _kerning_cache.get( left, right, kerning ) ) {
+            CR_TRACE_COUNT(CRTRACE_KERNING_CACHE_HIT, 1);
+            return kerning;
+        }
+        FT_Vector delta;
+        int error = FT_Get_Kerning( _face,          /* handle to face object */
+                      left,                /* left glyph index      */
+                      right,               /* right glyph index     */
+                      FT_KERNING_DEFAULT,  /* kerning mode          */
+                      &delta );            /* target vector         */
+        kerning = error ? 0 : (int)delta.x;
+        _kerning_cache.put( left, right, kerning );
+        return kerning;
+    }
+#endif
+
     virtual int getHyphenWidth() {
-        FONT_GUARD
+        FACE_GUARD
         if ( !_hyphen_width ) {
             _hyphen_width = getCharWidth( UNICODE_SOFT_HYPHEN_CODE );
         }
@@ -1277,7 +1502,7 @@ public:
     // Used when an embedded font (registered by RegisterDocumentFont()) is intantiated
     bool loadFromBuffer(LVByteArrayRef buf, int index, int size, css_font_family_t fontFamily,
                                             bool monochrome, bool italicize ) {
-        FONT_GUARD
+        FONT_MAN_GUARD
         _hintingMode = fontMan->GetHintingMode();
         _drawMonochrome = monochrome;
         _fontFamily = fontFamily;
@@ -1383,7 +1608,7 @@ public:
     // Load font from file path
     bool loadFromFile( const char * fname, int index, int size, css_font_family_t fontFamily,
                                            bool monochrome, bool italicize ) {
-        FONT_GUARD
+        FONT_MAN_GUARD
         _hintingMode = fontMan->GetHintingMode();
         _drawMonochrome = monochrome;
         _fontFamily = fontFamily;
@@ -1612,8 +1837,8 @@ public:
         \return true if glyh was found
     */
     virtual bool getGlyphInfo( lUInt32 code, glyph_info_t * glyph, lChar16 def_char=0 ) {
-        //FONT_GUARD
-        int glyph_index = getCharIndex( code, 0 );
+        FACE_GUARD
+        int glyph_index = isFallbackChar( code ) ? 0 : getCharIndex( code, 0 );
         if ( glyph_index==0 ) {
             LVFont * fallback = getFallbackFont();
             if ( !fallback ) {
@@ -1728,7 +1953,7 @@ public:
                         lUInt32 hints=0
                      )
     {
-        FONT_GUARD
+        FACE_GUARD
         if ( len <= 0 || _face==NULL )
             return 0;
         if ( letter_spacing < 0 ) {
@@ -1746,7 +1971,42 @@ public:
         // measure character widths
 
     #if USE_HARFBUZZ==1
-        if (_kerningMode == KERNING_MODE_HARFBUZZ) {
+        if (_kerningMode == KERNING_MODE_HARFBUZZ && hasFallbackRuns(text, len)) {
+            // Chars without glyph in this font are resolved to the fallback font
+            // before shaping: split text into runs of chars from the same font,
+            // and measure each run with its own font, instead of shaping it all
+            // here and then measuring again the .notdef segments.
+            LVFont *fallback = getFallbackFont();
+            int cur_width = 0;
+            int t = 0;
+            while ( t < len ) {
+                bool run_is_fallback;
+                int run_len = getFontRunLength( text + t, len - t, run_is_fallback );
+                // Drop BOT/EOT flags if this run is not at start/end
+                lUInt32 run_hints = hints;
+                if ( t > 0 )
+                    run_hints &= ~LFNT_HINT_BEGINS_PARAGRAPH;
+                if ( t + run_len < len )
+                    run_hints &= ~LFNT_HINT_ENDS_PARAGRAPH;
+                LVFont *run_font = run_is_fallback ? fallback : this;
+                // (hyphenation is done below on the whole text)
+                int chars_measured = run_font->measureText( text + t, run_len,
+                                widths + t, flags + t, max_width - cur_width, def_char,
+                                letter_spacing, false, run_hints );
+                for (int tn = t; tn < t + chars_measured; tn++) {
+                    widths[tn] += cur_width;
+                }
+                lastFitChar = t + chars_measured;
+                if ( chars_measured < run_len )
+                    break; // max_width reached
+                cur_width = widths[t + run_len - 1];
+                t += run_len;
+            }
+            // i is used below to "fill props for rest of chars"
+            i = lastFitChar;
+        } // KERNING_MODE_HARFBUZZ with fallback runs
+
+        else if (_kerningMode == KERNING_MODE_HARFBUZZ) {
 
             /** from harfbuzz/src/hb-buffer.h
              * hb_glyph_info_t:
@@ -2124,7 +2384,6 @@ public:
     #endif // USE_HARFBUZZ
 
         FT_UInt previous = 0;
-        int error;
         #if (ALLOW_KERNING==1)
         int use_kerning = _kerningMode != KERNING_MODE_DISABLED && FT_HAS_KERNING( _face );
         #endif
@@ -2145,16 +2404,8 @@ public:
             if ( use_kerning && previous>0  ) {
                 if ( ch_glyph_index==(FT_UInt)-1 )
                     ch_glyph_index = getCharIndex( ch, def_char );
-                if ( ch_glyph_index != 0 ) {
-                    FT_Vector delta;
-                    error = FT_Get_Kerning( _face,          /* handle to face object */
-                                  previous,          /* left glyph index      */
-                                  ch_glyph_index,         /* right glyph index     */
-                                  FT_KERNING_DEFAULT,  /* kerning mode          */
-                                  &delta );    /* target vector         */
-                    if ( !error )
-                        kerning = delta.x;
-                }
+                if ( ch_glyph_index != 0 )
+                    kerning = getKerning( previous, ch_glyph_index );
             }
             #endif
 
@@ -2231,8 +2482,8 @@ public:
         \return width of specified string
     */
     virtual lUInt32 getTextWidth( const lChar16 * text, int len) {
-        static lUInt16 widths[MAX_LINE_CHARS+1];
-        static lUInt8 flags[MAX_LINE_CHARS+1];
+        static CR_THREAD_LOCAL lUInt16 widths[MAX_LINE_CHARS+1];
+        static CR_THREAD_LOCAL lUInt8 flags[MAX_LINE_CHARS+1];
         if ( len>MAX_LINE_CHARS )
             len = MAX_LINE_CHARS;
         if ( len<=0 )
@@ -2263,8 +2514,8 @@ public:
         \return glyph pointer if glyph was found, NULL otherwise
     */
     virtual LVFontGlyphCacheItem * getGlyph(lUInt32 ch, lChar16 def_char=0) {
-        //FONT_GUARD
-        FT_UInt ch_glyph_index = getCharIndex( ch, 0 );
+        FACE_GUARD
+        FT_UInt ch_glyph_index = isFallbackChar( ch ) ? 0 : getCharIndex( ch, 0 );
         if ( ch_glyph_index==0 ) {
             LVFont * fallback = getFallbackFont();
             if ( !fallback ) {
@@ -2282,7 +2533,10 @@ public:
             }
         }
         LVFontGlyphCacheItem * item = _glyph_cache.getByChar( ch );
-        if ( !item ) {
+        if ( item ) {
+            CR_TRACE_COUNT(CRTRACE_GLYPH_CACHE_HIT, 1);
+        } else {
+            CR_TRACE_SCOPE(CRTRACE_GLYPH_RENDER);
             int rend_flags = FT_LOAD_RENDER | ( !_drawMonochrome ? FT_LOAD_TARGET_LIGHT : FT_LOAD_TARGET_MONO );
                                                     //|FT_LOAD_MONOCHROME|FT_LOAD_FORCE_AUTOHINT
             if (_hintingMode == HINTING_MODE_BYTECODE_INTERPRETOR) {
@@ -2329,10 +2583,13 @@ public:
 
 #if USE_HARFBUZZ==1
     LVFontGlyphCacheItem * getGlyphByIndex(lUInt32 index) {
-        //FONT_GUARD
+        FACE_GUARD
         LVFontGlyphCacheItem *item = _glyph_cache2.getByIndex(index);
-        if (!item) {
+        if (item) {
+            CR_TRACE_COUNT(CRTRACE_GLYPH_CACHE_HIT, 1);
+        } else {
             // glyph not found in cache, rendering...
+            CR_TRACE_SCOPE(CRTRACE_GLYPH_RENDER);
             int rend_flags = FT_LOAD_RENDER | ( !_drawMonochrome ? FT_LOAD_TARGET_LIGHT : FT_LOAD_TARGET_MONO );
                                                     //|FT_LOAD_MONOCHROME|FT_LOAD_FORCE_AUTOHINT
             if (_hintingMode == HINTING_MODE_BYTECODE_INTERPRETOR) {
@@ -2416,6 +2673,7 @@ public:
     /// returns char glyph advance width
     virtual int getCharWidth( lChar16 ch, lChar16 def_char='?' )
     {
+        FACE_GUARD
         int w = _wcache.get(ch);
         if ( w == CACHED_UNSIGNED_METRIC_NOT_SET ) {
             glyph_info_t glyph;
@@ -2433,6 +2691,7 @@ public:
     /// returns char glyph left side bearing
     virtual int getLeftSideBearing( lChar16 ch, bool negative_only=false, bool italic_only=false )
     {
+        FACE_GUARD
         if ( italic_only && !getItalic() )
             return 0;
         int b = _lsbcache.get(ch);
@@ -2454,6 +2713,7 @@ public:
     /// returns char glyph right side bearing
     virtual int getRightSideBearing( lChar16 ch, bool negative_only=false, bool italic_only=false )
     {
+        FACE_GUARD
         if ( italic_only && !getItalic() )
             return 0;
         int b = _rsbcache.get(ch);
@@ -2510,7 +2770,7 @@ public:
                        lUInt32 flags, int letter_spacing, int width,
                        int text_decoration_back_gap )
     {
-        FONT_GUARD
+        FACE_GUARD
         if ( len <= 0 || _face==NULL )
             return 0;
         if ( letter_spacing < 0 ) {
@@ -2533,7 +2793,68 @@ public:
         int x0 = x;
 
     #if USE_HARFBUZZ==1
-        if (_kerningMode == KERNING_MODE_HARFBUZZ) {
+        if (_kerningMode == KERNING_MODE_HARFBUZZ && hasFallbackRuns(text, len)) {
+            // See measureText(): text is drawn as runs of chars from the same font.
+            // All runs get the direction of the whole text (the known one, or the
+            // one HarfBuzz would have guessed), and are drawn in visual order.
+            LVFont *fallback = getFallbackFont();
+            bool is_rtl;
+            if ( flags & LFNT_HINT_DIRECTION_KNOWN )
+                is_rtl = (flags & LFNT_HINT_DIRECTION_IS_RTL) != 0;
+            else
+                is_rtl = guessTextIsRTL( text, len );
+            lUInt32 runs_flags = flags | LFNT_HINT_DIRECTION_KNOWN;
+            if ( is_rtl )
+                runs_flags |= LFNT_HINT_DIRECTION_IS_RTL;
+            else
+                runs_flags &= ~LFNT_HINT_DIRECTION_IS_RTL;
+            runs_flags &= ~LFNT_DRAW_DECORATION_MASK; // text decoration is done below for the whole text
+            LVArray<int> run_starts;
+            for ( int t = 0; t < len; ) {
+                bool run_is_fallback;
+                run_starts.add( t );
+                t += getFontRunLength( text + t, len - t, run_is_fallback );
+            }
+            run_starts.add( len );
+            int run_count = run_starts.length() - 1;
+            for ( int r = 0; r < run_count; r++ ) {
+                int k = is_rtl ? run_count - 1 - r : r;
+                int run_start = run_starts[k];
+                int run_len = run_starts[k+1] - run_start;
+                // Drop BOT/EOT flags if this run is not at start/end
+                lUInt32 run_flags = runs_flags;
+                if ( run_start > 0 )
+                    run_flags &= ~LFNT_HINT_BEGINS_PARAGRAPH;
+                if ( run_start + run_len < len )
+                    run_flags &= ~LFNT_HINT_ENDS_PARAGRAPH;
+                if ( isFallbackChar( text[run_start] ) ) {
+                    // Adjust fallback y so baselines of both fonts match
+                    int fb_y = y + _baseline - fallback->getBaseline();
+                    x += fallback->DrawTextString( buf, x, fb_y, text + run_start, run_len,
+                            def_char, palette, false, run_flags, letter_spacing,
+                            width, text_decoration_back_gap );
+                }
+                else {
+                    x += DrawTextString( buf, x, y, text + run_start, run_len,
+                            def_char, palette, false, run_flags, letter_spacing,
+                            width, text_decoration_back_gap );
+                }
+            }
+            if (addHyphen) {
+                LVFontGlyphCacheItem *item = getGlyph(UNICODE_SOFT_HYPHEN_CODE, def_char);
+                if (item) {
+                    buf->Draw( x + item->origin_x,
+                               y + _baseline - item->origin_y,
+                               item->bmp,
+                               item->bmp_width,
+                               item->bmp_height,
+                               palette);
+                    x += item->advance;
+                }
+            }
+        } // KERNING_MODE_HARFBUZZ with fallback runs
+
+        else if (_kerningMode == KERNING_MODE_HARFBUZZ) {
             // See measureText() for more comments on how to work with Harfbuzz,
             // as we do and must work the same way here.
             unsigned int glyph_count;
@@ -2864,7 +3185,6 @@ public:
     #endif // USE_HARFBUZZ
 
         FT_UInt previous = 0;
-        int error;
         #if (ALLOW_KERNING==1)
         int use_kerning = _kerningMode != KERNING_MODE_DISABLED && FT_HAS_KERNING( _face );
         #endif
@@ -2897,16 +3217,8 @@ public:
             FT_UInt ch_glyph_index = getCharIndex( ch, def_char );
             int kerning = 0;
             #if (ALLOW_KERNING==1)
-            if ( use_kerning && previous>0 && ch_glyph_index>0 ) {
-                FT_Vector delta;
-                error = FT_Get_Kerning( _face,          /* handle to face object */
-                              previous,          /* left glyph index      */
-                              ch_glyph_index,         /* right glyph index     */
-                              FT_KERNING_DEFAULT,  /* kerning mode          */
-                              &delta );    /* target vector         */
-                if ( !error )
-                    kerning = delta.x;
-            }
+            if ( use_kerning && previous>0 && ch_glyph_index>0 )
+                kerning = getKerning( previous, ch_glyph_index );
             #endif
             LVFontGlyphCacheItem * item = getGlyph(ch, def_char);
             if ( !item )
@@ -2976,6 +3288,7 @@ public:
     virtual void Clear()
     {
         LVLock lock(_mutex);
+        FONT_MAN_GUARD // FT_Done_Face() changes FT_Library shared by all faces
         clearCache();
         #if USE_HARFBUZZ==1
         if (_hb_font) {
@@ -3098,8 +3411,8 @@ public:
         \return width of specified string
     */
     virtual lUInt32 getTextWidth( const lChar16 * text, int len) {
-        static lUInt16 widths[MAX_LINE_CHARS+1];
-        static lUInt8 flags[MAX_LINE_CHARS+1];
+        static CR_THREAD_LOCAL lUInt16 widths[MAX_LINE_CHARS+1];
+        static CR_THREAD_LOCAL lUInt8 flags[MAX_LINE_CHARS+1];
         if ( len>MAX_LINE_CHARS )
             len = MAX_LINE_CHARS;
         if ( len<=0 )
@@ -3426,6 +3739,172 @@ static LVFontRef dumpFontRef( LVFontRef fnt ) {
 }
 #endif
 
+#define FONT_CATALOG_MAGIC "CR3FCAT1"
+
+/// face properties read from font file by FT_New_Face
+struct LVFontCatalogFace
+{
+    int index;
+    int weight;
+    bool italic;
+    bool monospace;
+    lString8 familyName;
+};
+
+/// result of scanning single font file; empty face list means font file was rejected
+class LVFontCatalogItem
+{
+public:
+    lString8 fileName;
+    lUInt64 fileSize;
+    lUInt64 fileTime;
+    bool seen; ///< file was registered since catalog was opened
+    LVPtrVector<LVFontCatalogFace> faces;
+    LVFontCatalogItem( lString8 fn, lUInt64 sz, lUInt64 tm ) : fileName(fn), fileSize(sz), fileTime(tm), seen(false) { }
+};
+
+/// persistent list of scanned font files, keyed by path, size and modification time
+class LVFontCatalog
+{
+    lString8 _fileName;
+    LVPtrVector<LVFontCatalogItem> _items;
+    LVHashTable<lString8, LVFontCatalogItem *> _index;
+    bool _changed;
+public:
+    LVFontCatalog() : _index(256), _changed(false) { }
+
+    bool isOpened() { return !_fileName.empty(); }
+
+    /// returns item for file only if size and mtime are unchanged since the scan
+    LVFontCatalogItem * find( const lString8 & fileName, lUInt64 fileSize, lUInt64 fileTime )
+    {
+        LVFontCatalogItem * item = _index.get(fileName);
+        if ( item && item->fileSize == fileSize && item->fileTime == fileTime ) {
+            item->seen = true;
+            return item;
+        }
+        return NULL;
+    }
+
+    /// adds or replaces item, takes ownership
+    void add( LVFontCatalogItem * item )
+    {
+        LVFontCatalogItem * old = _index.get(item->fileName);
+        if ( old ) {
+            int p = _items.indexOf(old);
+            if ( p >= 0 )
+                _items.remove(p);
+            delete old;
+        }
+        item->seen = true;
+        _items.add(item);
+        _index.set(item->fileName, item);
+        _changed = true;
+    }
+
+    /// removes items of font files which were not registered since catalog was opened
+    void removeUnseen()
+    {
+        int seenCount = 0;
+        for ( int i=0; i < _items.length(); i++ )
+            if ( _items[i]->seen )
+                seenCount++;
+        // nothing registered yet: keep catalog as is
+        if ( seenCount == 0 || seenCount == _items.length() )
+            return;
+        for ( int i=_items.length() - 1; i >= 0; i-- ) {
+            if ( !_items[i]->seen ) {
+                _index.remove( _items[i]->fileName );
+                delete _items.remove(i);
+            }
+        }
+        _changed = true;
+    }
+
+    /// reads catalog from file; missing or damaged file gives empty catalog
+    bool open( lString8 fileName )
+    {
+        _items.clear();
+        _index.clear();
+        _changed = false;
+        _fileName = fileName;
+        LVStreamRef stream = LVOpenFileStream( Utf8ToUnicode(fileName).c_str(), LVOM_READ );
+        if ( stream.isNull() )
+            return false;
+        LVStreamBufferRef sb = stream->GetReadBuffer(0, stream->GetSize());
+        if ( !sb )
+            return false;
+        SerialBuf buf( sb->getReadOnly(), sb->getSize() );
+        if ( !buf.checkMagic( FONT_CATALOG_MAGIC ) ) {
+            CRLog::error("wrong font catalog file format: %s", fileName.c_str());
+            return false;
+        }
+        lUInt32 start = buf.pos();
+        lUInt32 count = 0;
+        buf >> count;
+        for ( lUInt32 i=0; i < count && !buf.error(); i++ ) {
+            lString8 fn;
+            lUInt32 sizeLo, sizeHi, timeLo, timeHi, faceCount;
+            buf >> fn >> sizeLo >> sizeHi >> timeLo >> timeHi >> faceCount;
+            LVFontCatalogItem * item = new LVFontCatalogItem( fn,
+                ((lUInt64)sizeHi << 32) | sizeLo, ((lUInt64)timeHi << 32) | timeLo );
+            for ( lUInt32 j=0; j < faceCount && !buf.error(); j++ ) {
+                LVFontCatalogFace * face = new LVFontCatalogFace();
+                lUInt32 index, weight;
+                buf >> index >> weight >> face->italic >> face->monospace >> face->familyName;
+                face->index = (int)index;
+                face->weight = (int)weight;
+                item->faces.add(face);
+            }
+            _items.add(item);
+            _index.set(fn, item);
+        }
+        if ( buf.error() || !buf.checkCRC( buf.pos() - start ) ) {
+            CRLog::error("font catalog file is damaged: %s", fileName.c_str());
+            _items.clear();
+            _index.clear();
+            return false;
+        }
+        CRLog::info("Font catalog %s read ok, %d font files", fileName.c_str(), _items.length());
+        return true;
+    }
+
+    /// writes catalog to file if changed since last open/save, dropping files which were not registered
+    bool save()
+    {
+        removeUnseen();
+        if ( !_changed || _fileName.empty() )
+            return true;
+        SerialBuf buf( 16384, true );
+        buf.putMagic( FONT_CATALOG_MAGIC );
+        lUInt32 start = buf.pos();
+        buf << (lUInt32)_items.length();
+        for ( int i=0; i < _items.length(); i++ ) {
+            LVFontCatalogItem * item = _items[i];
+            buf << item->fileName
+                << (lUInt32)(item->fileSize & 0xFFFFFFFF) << (lUInt32)(item->fileSize >> 32)
+                << (lUInt32)(item->fileTime & 0xFFFFFFFF) << (lUInt32)(item->fileTime >> 32)
+                << (lUInt32)item->faces.length();
+            for ( int j=0; j < item->faces.length(); j++ ) {
+                LVFontCatalogFace * face = item->faces[j];
+                buf << (lUInt32)face->index << (lUInt32)face->weight << face->italic << face->monospace << face->familyName;
+            }
+        }
+        buf.putCRC( buf.pos() - start );
+        if ( buf.error() )
+            return false;
+        LVStreamRef stream = LVOpenFileStream( Utf8ToUnicode(_fileName).c_str(), LVOM_WRITE );
+        if ( stream.isNull() ) {
+            CRLog::error("cannot write font catalog %s", _fileName.c_str());
+            return false;
+        }
+        if ( stream->Write( buf.buf(), buf.pos(), NULL ) != LVERR_OK )
+            return false;
+        _changed = false;
+        return true;
+    }
+};
+
 class LVFreeTypeFontManager : public LVFontManager
 {
 private:
@@ -3435,6 +3914,7 @@ private:
     FT_Library  _library;
     LVFontGlobalGlyphCache _globalCache;
     lString16 _requiredChars;
+    LVFontCatalog _catalog;
     #if (DEBUG_FONT_MAN==1)
     FILE * _log;
     #endif
@@ -3829,6 +4309,7 @@ public:
     virtual ~LVFreeTypeFontManager()
     {
         FONT_MAN_GUARD
+        _catalog.save();
         _globalCache.clear();
         _cache.clear();
         if ( _library )
@@ -4293,6 +4774,7 @@ public:
 
     /// unregisters all document fonts
     virtual void UnregisterDocumentFonts(int documentId) {
+        FONT_MAN_GUARD
         _cache.removeDocumentFonts(documentId);
     }
 
@@ -4392,23 +4874,10 @@ public:
     // Font instances will be created as need from the LVFontDef name or buf.
     // (The similar functions do most of the same work, and some code
     // could be factorized between them.)
-    virtual bool RegisterFont( lString8 name )
+    /// reads properties of all faces in font file; empty face list means font cannot be used
+    LVFontCatalogItem * scanFontFile( const lString8 & name, const lString8 & fname, lUInt64 fileSize, lUInt64 fileTime )
     {
-        FONT_MAN_GUARD
-        #ifdef LOAD_TTF_FONTS_ONLY
-        if ( name.pos( cs8(".ttf") ) < 0 && name.pos( cs8(".TTF") ) < 0 )
-            return false; // load ttf fonts only
-        #endif
-        //CRLog::trace("RegisterFont(%s)", name.c_str());
-        lString8 fname = makeFontFileName( name );
-        //CRLog::trace("font file name : %s", fname.c_str());
-        #if (DEBUG_FONT_MAN==1)
-            if ( _log ) {
-                fprintf(_log, "RegisterFont( %s ) path=%s\n", name.c_str(), fname.c_str());
-            }
-        #endif
-
-        bool res = false;
+        LVFontCatalogItem * item = new LVFontCatalogItem( fname, fileSize, fileTime );
         int index = 0;
         FT_Face face = NULL;
 
@@ -4443,10 +4912,73 @@ public:
             }
             int num_faces = face->num_faces;
 
-            css_font_family_t fontFamily = css_ff_sans_serif;
-            if ( face->face_flags & FT_FACE_FLAG_FIXED_WIDTH )
-                fontFamily = css_ff_monospace;
-            lString8 familyName( ::familyName(face) );
+            LVFontCatalogFace * info = new LVFontCatalogFace();
+            info->index = index;
+            info->weight = ( face->style_flags & FT_STYLE_FLAG_BOLD ) ? 700 : 400;
+            info->italic = ( face->style_flags & FT_STYLE_FLAG_ITALIC ) ? true : false;
+            info->monospace = ( face->face_flags & FT_FACE_FLAG_FIXED_WIDTH ) ? true : false;
+            info->familyName = lString8( ::familyName(face) );
+            item->faces.add( info );
+
+            if ( face ) {
+                FT_Done_Face( face );
+                face = NULL;
+            }
+
+            if ( index>=num_faces-1 )
+                break;
+        }
+        return item;
+    }
+
+    /// set file to keep scanned font properties between runs, so unchanged font files are not opened by RegisterFont
+    virtual bool SetFontCatalogFile( lString8 fileName )
+    {
+        FONT_MAN_GUARD
+        return _catalog.open( fileName );
+    }
+
+    /// write font catalog if it was changed by RegisterFont calls
+    virtual bool SaveFontCatalog()
+    {
+        FONT_MAN_GUARD
+        return _catalog.save();
+    }
+
+    virtual bool RegisterFont( lString8 name )
+    {
+        FONT_MAN_GUARD
+        #ifdef LOAD_TTF_FONTS_ONLY
+        if ( name.pos( cs8(".ttf") ) < 0 && name.pos( cs8(".TTF") ) < 0 )
+            return false; // load ttf fonts only
+        #endif
+        //CRLog::trace("RegisterFont(%s)", name.c_str());
+        lString8 fname = makeFontFileName( name );
+        //CRLog::trace("font file name : %s", fname.c_str());
+        #if (DEBUG_FONT_MAN==1)
+            if ( _log ) {
+                fprintf(_log, "RegisterFont( %s ) path=%s\n", name.c_str(), fname.c_str());
+            }
+        #endif
+
+        // font file is opened only when it's not in catalog, or was changed since catalog was written
+        lUInt64 fileSize = 0;
+        lUInt64 fileTime = 0;
+        bool useCatalog = _catalog.isOpened() && LVGetFileInfo( fname, fileSize, fileTime );
+        LVFontCatalogItem * item = useCatalog ? _catalog.find( fname, fileSize, fileTime ) : NULL;
+        LVAutoPtr<LVFontCatalogItem> scanned;
+        if ( !item ) {
+            item = scanFontFile( name, fname, fileSize, fileTime );
+            if ( useCatalog )
+                _catalog.add( item );
+            else
+                scanned = item;
+        }
+
+        bool res = false;
+        for ( int i=0; i<item->faces.length(); i++ ) {
+            LVFontCatalogFace * info = item->faces[i];
+            css_font_family_t fontFamily = info->monospace ? css_ff_monospace : css_ff_sans_serif;
             /*
             if ( familyName=="Times" || familyName=="Times New Roman" )
                 fontFamily = css_ff_serif;
@@ -4455,11 +4987,11 @@ public:
             LVFontDef def(
                 name,
                 -1, // height==-1 for scalable fonts
-                ( face->style_flags & FT_STYLE_FLAG_BOLD ) ? 700 : 400,
-                ( face->style_flags & FT_STYLE_FLAG_ITALIC ) ? true : false,
+                info->weight,
+                info->italic,
                 fontFamily,
-                familyName,
-                index
+                info->familyName,
+                info->index
             );
             #if (DEBUG_FONT_MAN==1)
                 if ( _log ) {
@@ -4470,17 +5002,13 @@ public:
                 }
             #endif
 
-            if ( face ) {
-                FT_Done_Face( face );
-                face = NULL;
-            }
-
             if ( _cache.findDuplicate( &def ) ) {
                 CRLog::trace("font definition is duplicate");
                 return false;
             }
             _cache.update( &def, LVFontRef(NULL) );
-            if ( scal && !def.getItalic() ) {
+            // (catalog items contain scalable faces only)
+            if ( !def.getItalic() ) {
                 // If this font is not italic, create another definition
                 // with italic=2 (=fake italic) as we can italicize it.
                 // A real italic font (italic=1) will be found first
@@ -4493,9 +5021,6 @@ public:
                     _cache.update( &newDef, LVFontRef(NULL) );
             }
             res = true;
-
-            if ( index>=num_faces-1 )
-                break;
         }
         return res;
     }
@@ -5100,8 +5625,8 @@ lUInt16 LBitmapFont::measureText(
 
 lUInt32 LBitmapFont::getTextWidth( const lChar16 * text, int len )
 {
-    static lUInt16 widths[MAX_LINE_CHARS+1];
-    static lUInt8 flags[MAX_LINE_CHARS+1];
+    static CR_THREAD_LOCAL lUInt16 widths[MAX_LINE_CHARS+1];
+    static CR_THREAD_LOCAL lUInt8 flags[MAX_LINE_CHARS+1];
     if ( len>MAX_LINE_CHARS )
         len = MAX_LINE_CHARS;
     if ( len<=0 )
@@ -5473,8 +5998,8 @@ int LVWin32DrawFont::getCharWidth( lChar16 ch, lChar16 def_char )
 lUInt32 LVWin32DrawFont::getTextWidth( const lChar16 * text, int len )
 {
     //
-    static lUInt16 widths[MAX_LINE_CHARS+1];
-    static lUInt8 flags[MAX_LINE_CHARS+1];
+    static CR_THREAD_LOCAL lUInt16 widths[MAX_LINE_CHARS+1];
+    static CR_THREAD_LOCAL lUInt8 flags[MAX_LINE_CHARS+1];
     if ( len>MAX_LINE_CHARS )
         len = MAX_LINE_CHARS;
     if ( len<=0 )
@@ -5835,8 +6360,8 @@ bool LVWin32Font::getGlyphInfo( lUInt16 code, glyph_info_t * glyph, lChar16 def_
 lUInt32 LVWin32Font::getTextWidth( const lChar16 * text, int len )
 {
     //
-    static lUInt16 widths[MAX_LINE_CHARS+1];
-    static lUInt8 flags[MAX_LINE_CHARS+1];
+    static CR_THREAD_LOCAL lUInt16 widths[MAX_LINE_CHARS+1];
+    static CR_THREAD_LOCAL lUInt8 flags[MAX_LINE_CHARS+1];
     if ( len>MAX_LINE_CHARS )
         len = MAX_LINE_CHARS;
     if ( len<=0 )
@@ -20,6 +20,18 @@
 
 #include "../include/lvimg.h"
 #include "../include/lvtinydom.h"
+#include "../include/crtrace.h"
+#include "../include/crtest.h"
+#include "../include/crmemgov.h"
+#include "../include/crlocks.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CR_RESAMPLE_SSE2 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define CR_RESAMPLE_NEON 1
+#endif
 
 #if (USE_LIBPNG==1)
 #include <png.h>
@@ -53,7 +65,7 @@ typedef boolean wxjpeg_boolean;
 static lUInt32 NEXT_CACHEABLE_OBJECT_ID = 1;
 CacheableObject::CacheableObject() : _callback(NULL), _cache(NULL)
 {
-	_objectId = ++NEXT_CACHEABLE_OBJECT_ID;
+	_objectId = CR_ATOMIC_INC(NEXT_CACHEABLE_OBJECT_ID);
 }
 
 void CR9PatchInfo::applyPadding(lvRect & dstPadding) const
@@ -721,6 +733,7 @@ public:
     virtual bool   Decode( LVImageDecoderCallback * callback )
     {
     	//CRLog::trace("LVJpegImageSource::decode called");
+        CR_TRACE_SCOPE(CRTRACE_IMAGE_DECODE);
         memset(&cinfo, 0, sizeof(jpeg_decompress_struct));
         /* Step 1: allocate and initialize JPEG decompression object */
 
@@ -780,12 +793,26 @@ public:
                  */
                 cinfo.out_color_space = JCS_RGB;
 
+                int target_dx, target_dy;
+                if ( callback->GetTargetSize( target_dx, target_dy ) && target_dx > 0 && target_dy > 0 ) {
+                    // Use DCT scaling (1/2, 1/4, 1/8) when reduced image still covers target size:
+                    // it's much cheaper than decoding full image and dropping most of pixels
+                    int denom = 1;
+                    while ( denom < 8 && (_width + denom*2 - 1) / (denom*2) >= target_dx
+                                      && (_height + denom*2 - 1) / (denom*2) >= target_dy )
+                        denom *= 2;
+                    cinfo.scale_num = 1;
+                    cinfo.scale_denom = denom;
+                }
+
                 /* Step 5: Start decompressor */
 
                 (void) jpeg_start_decompress(&cinfo);
                 /* We can ignore the return value since suspension is not possible
                  * with the stdio data source.
                  */
+                if ( (int)cinfo.output_width != _width || (int)cinfo.output_height != _height )
+                    callback->OnDecodedSize( this, cinfo.output_width, cinfo.output_height );
                 buffer = new lUInt8 [ cinfo.output_width * cinfo.output_components ];
                 row = new lUInt32 [ cinfo.output_width ];
                 /* Step 6: while (scan lines remain to be read) */
@@ -841,6 +868,7 @@ LVPngImageSource::~LVPngImageSource() {}
 void LVPngImageSource::Compact() { }
 bool LVPngImageSource::Decode( LVImageDecoderCallback * callback )
 {
+    CR_TRACE_SCOPE(CRTRACE_IMAGE_DECODE);
     png_structp png_ptr = NULL;
     png_infop info_ptr = NULL;
     _stream->SetPos( 0 );
@@ -928,23 +956,36 @@ bool LVPngImageSource::Decode( LVImageDecoderCallback * callback )
         //    color_type == PNG_COLOR_TYPE_RGB_ALPHA)
         png_set_bgr(png_ptr);
 
-        png_set_interlace_handling(png_ptr);
+        int passes = png_set_interlace_handling(png_ptr);
         png_read_update_info(png_ptr,info_ptr);//update after set
-        png_bytep *image=NULL;
-        image =  new png_bytep[height];
-        for (lUInt32 i=0; i<height; i++)
-            image[i] =  new png_byte[png_get_rowbytes(png_ptr,info_ptr)];
-        png_read_image(png_ptr,image);
-        for (lUInt32 y = 0; y < height; y++)
-        {
-            callback->OnLineDecoded( this, y,  (lUInt32*) image[y] );
-        }
-        png_read_end(png_ptr, info_ptr);
+        if ( passes==1 ) {
+            // not interlaced: pass rows on as they are decoded, w/o buffer of whole image
+            png_bytep row = new png_byte[png_get_rowbytes(png_ptr,info_ptr)];
+            for (lUInt32 y = 0; y < height; y++)
+            {
+                png_read_row(png_ptr, row, NULL);
+                callback->OnLineDecoded( this, y,  (lUInt32*) row );
+            }
+            png_read_end(png_ptr, info_ptr);
+            callback->OnEndDecode(this, false);
+            delete [] row;
+        } else {
+            png_bytep *image=NULL;
+            image =  new png_bytep[height];
+            for (lUInt32 i=0; i<height; i++)
+                image[i] =  new png_byte[png_get_rowbytes(png_ptr,info_ptr)];
+            png_read_image(png_ptr,image);
+            for (lUInt32 y = 0; y < height; y++)
+            {
+                callback->OnLineDecoded( this, y,  (lUInt32*) image[y] );
+            }
+            png_read_end(png_ptr, info_ptr);
 
-        callback->OnEndDecode(this, false);
-        for (lUInt32 i=0; i<height; i++)
-            delete [] image[i];
-        delete [] image;
+            callback->OnEndDecode(this, false);
+            for (lUInt32 i=0; i<height; i++)
+                delete [] image[i];
+            delete [] image;
+        }
     }
     png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
 
@@ -1055,11 +1096,33 @@ public:
         int transparent_color = m_pImage->m_transparent_color;
         bool defined_transparent = m_pImage->defined_transparent_color;
         lUInt32 * pColorTable = GetColorTable();
+        // rows of interlaced image are stored pass by pass: find stored row of each image row
+        // to pass rows on from top to bottom, as resampling callbacks expect
+        int * storedRow = new int[h];
+        for ( int y=0; y<h; y++ )
+            storedRow[y] = -1;
         int interlacePos = 0;
         int interlaceTable[] = {8, 0, 8, 4, 4, 2, 2, 1, 1, 1}; // pairs: step, offset
         int dy = interlaceTable[interlacePos];
         int y = 0;
         for ( int i=0; i<h; i++ ) {
+            if ( y>=0 && y<h )
+                storedRow[y] = i;
+            if ( m_flg_interlaced ) {
+                y += dy;
+                if ( y>=m_cy && interlacePos<8 ) {
+                    interlacePos += 2;
+                    dy = interlaceTable[interlacePos];
+                    y = interlaceTable[interlacePos+1];
+                }
+            } else {
+                y++;
+            }
+        }
+        for ( y=0; y<h; y++ ) {
+            int i = storedRow[y];
+            if ( i<0 )
+                continue;
             for ( int j=0; j<w; j++ ) {
                 line[j] = pColorTable[background_color];
             }
@@ -1078,17 +1141,8 @@ public:
                 }
             }
             callback->OnLineDecoded( m_pImage, y, line );
-            if ( m_flg_interlaced ) {
-                y += dy;
-                if ( y>=m_cy ) {
-                    interlacePos += 2;
-                    dy = interlaceTable[interlacePos];
-                    y = interlaceTable[interlacePos+1];
-                }
-            } else {
-                y++;
-            }
         }
+        delete[] storedRow;
         delete[] line;
         callback->OnEndDecode( m_pImage, false );
     }
@@ -1460,6 +1514,7 @@ public:
 
 bool LVGifImageSource::Decode( LVImageDecoderCallback * callback )
 {
+    CR_TRACE_SCOPE(CRTRACE_IMAGE_DECODE);
     if ( _stream.isNull() )
         return false;
     lvsize_t sz = _stream->GetSize();
@@ -1629,15 +1684,160 @@ void LVGifFrame::Clear()
 
 // SVG support
 
+/// parsed SVG image, shared by image sources with same SVG text
+class LVSvgParsedImage : public LVRefCounter
+{
+public:
+    NSVGimage * image;
+    lString8 text;   ///< SVG text as it was before parsing
+    lUInt32 crc;     ///< crc32 of SVG text
+    lUInt32 lastUse; ///< cache use counter value of last access
+    int memSize;     ///< estimated size of parsed image and its text
+    LVSvgParsedImage( NSVGimage * img, const lString8 & svgText, lUInt32 textCrc )
+        : image(img), text(svgText), crc(textCrc), lastUse(0), memSize(sizeof(NSVGimage) + svgText.length())
+    {
+        for ( NSVGshape * shape = image->shapes; shape; shape = shape->next ) {
+            memSize += sizeof(NSVGshape);
+            for ( NSVGpath * path = shape->paths; path; path = path->next )
+                memSize += sizeof(NSVGpath) + path->npts * 2 * sizeof(float);
+        }
+    }
+    ~LVSvgParsedImage() { nsvgDelete( image ); }
+    bool matches( const char * svgText, int size, lUInt32 textCrc )
+    {
+        return crc == textCrc && text.length() == size && !memcmp( text.c_str(), svgText, size );
+    }
+};
+
+typedef LVFastRef<LVSvgParsedImage> LVSvgParsedImageRef;
+
+/// parsed SVG images of all documents, least recently used are dropped first
+/**
+    EPUB covers, formulas and ornaments are drawn again on every page
+    change, and each draw creates new image source: parsing is done once
+    per SVG text. Items are looked up by crc32 of text, and then text
+    itself is compared.
+*/
+class LVSvgImageCache : public CRMemoryConsumer
+{
+    LVArray<LVSvgParsedImageRef> _items;
+    int _size;
+    int _hits;
+    int _memoryLimit;
+    lUInt32 _useCount;
+    void trimNoLock( int target )
+    {
+        while ( _items.length() && _size > target ) {
+            int oldest = 0;
+            for ( int i=1; i<_items.length(); i++ )
+                if ( _items[i]->lastUse < _items[oldest]->lastUse )
+                    oldest = i;
+            int last = _items.length() - 1;
+            _size -= _items[oldest]->memSize;
+            if ( oldest != last )
+                _items[oldest] = _items[last];
+            _items[last].Clear();
+            _items.erase( last, 1 );
+        }
+    }
+public:
+    LVSvgImageCache() : _size(0), _hits(0), _memoryLimit(0), _useCount(0)
+    {
+        CRMemoryGovernor::addConsumer( this );
+    }
+    ~LVSvgImageCache()
+    {
+        CRMemoryGovernor::removeConsumer( this );
+    }
+    virtual CRMemorySubsystem getMemorySubsystem() { return CRMEM_SVG_IMAGES; }
+    virtual int getMemoryUsed() { return _size; }
+    virtual int getMemoryHits() { return _hits; }
+    virtual void setMemoryLimit( int limit ) { CR_ATOMIC_STORE( _memoryLimit, limit ); }
+    virtual void trimMemory( int target )
+    {
+        SVG_IMAGE_CACHE_GUARD
+        trimNoLock( target );
+    }
+    /// returns parsed image of SVG text, parses text if not found; text is modified by parser
+    LVSvgParsedImageRef get( char * text, int size )
+    {
+        lUInt32 crc = lStr_crc32( 0, text, size );
+        {
+            SVG_IMAGE_CACHE_GUARD
+            for ( int i=_items.length()-1; i>=0; i-- ) {
+                if ( !_items[i]->matches( text, size, crc ) )
+                    continue;
+                _items[i]->lastUse = ++_useCount;
+                _hits++;
+                return _items[i];
+            }
+        }
+        lString8 source( text, size );
+        NSVGimage * image = nsvgParse( text, "px", 96.0f );
+        if ( !image ) {
+            printf("SVG: could not parse SVG stream.\n");
+            return LVSvgParsedImageRef();
+        }
+        LVSvgParsedImageRef item( new LVSvgParsedImage( image, source, crc ) );
+        int limit = CR_ATOMIC_LOAD( _memoryLimit );
+        if ( !limit )
+            limit = SVG_IMAGE_CACHE_SIZE;
+        if ( item->memSize > limit )
+            return item; // used by caller only
+        SVG_IMAGE_CACHE_GUARD
+        trimNoLock( limit - item->memSize );
+        item->lastUse = ++_useCount;
+        *_items.addSpace( 1 ) = item;
+        _size += item->memSize;
+        return item;
+    }
+};
+
+static LVSvgImageCache & svgImageCache()
+{
+    static LVSvgImageCache cache;
+    return cache;
+}
+
+/// blends rasterized RGBA row over white background, to opaque pixels of draw buffer format
+static void svgBlendRow( const lUInt8 * p, lUInt32 * row, int width )
+{
+    for (int x=0; x<width; x++) {
+        // We mostly get full white or full black when using alpha channel like this:
+        //   row[x] = (((lUInt32)p[3])<<24) | (((lUInt32)p[0])<<16) | (((lUInt32)p[1])<<8) | (((lUInt32)p[2])<<0);
+        // We can ignore the alpha channel but we get a black background for transparent pixels with:
+        //   row[x] = (((lUInt32)p[0])<<16) | (((lUInt32)p[1])<<8) | (((lUInt32)p[2])<<0);
+        // It's better to use alpha channel here to blend pixels over a white background and set opacity to full
+        // """ To perform a source-over blend between two colors that use straight alpha format:
+        //           result = (source.RGB * source.A) + (dest.RGB * (1 - source.A))        """
+        lUInt8 r = p[0];
+        lUInt8 g = p[1];
+        lUInt8 b = p[2];
+        lUInt8 a = p[3];
+        lUInt8 ia = a ^ 0xFF;
+        lUInt32 ro = (lUInt32)( r*a + 0xff*ia );
+        lUInt32 go = (lUInt32)( g*a + 0xff*ia );
+        lUInt32 bo = (lUInt32)( b*a + 0xff*ia );
+        // More accurate divide by 256 than just >> 8 (255 becomes 254 with just >> 8)
+        ro = (ro+1 + (ro >> 8)) >> 8;
+        go = (go+1 + (go >> 8)) >> 8;
+        bo = (bo+1 + (bo >> 8)) >> 8;
+        row[x] = ro<<16|go<<8|bo;
+        p += 4;
+    }
+}
+
 class LVSvgImageSource : public LVNodeImageSource
 {
 protected:
+    LVSvgParsedImageRef _parsed;
 public:
     LVSvgImageSource( ldomNode * node, LVStreamRef stream );
     virtual ~LVSvgImageSource();
     virtual void   Compact();
     virtual bool   Decode( LVImageDecoderCallback * callback );
     int DecodeFromBuffer(unsigned char *buf, int buf_size, LVImageDecoderCallback * callback);
+    int DecodeParsed( LVImageDecoderCallback * callback );
     static bool CheckPattern( const lUInt8 * buf, int len );
 };
 
@@ -1647,7 +1847,7 @@ LVSvgImageSource::LVSvgImageSource( ldomNode * node, LVStreamRef stream )
 }
 LVSvgImageSource::~LVSvgImageSource() {}
 
-void LVSvgImageSource::Compact() { }
+void LVSvgImageSource::Compact() { _parsed.Clear(); }
 
 bool LVSvgImageSource::CheckPattern( const lUInt8 * buf, int len)
 {
@@ -1667,6 +1867,10 @@ bool LVSvgImageSource::CheckPattern( const lUInt8 * buf, int len)
 
 bool LVSvgImageSource::Decode( LVImageDecoderCallback * callback )
 {
+    CR_TRACE_SCOPE(CRTRACE_IMAGE_DECODE);
+    // size query made by LVCreateStreamImageSource() has already parsed the image
+    if ( !_parsed.isNull() )
+        return DecodeParsed( callback );
     if ( _stream.isNull() )
         return false;
     lvsize_t sz = _stream->GetSize();
@@ -1688,20 +1892,20 @@ bool LVSvgImageSource::Decode( LVImageDecoderCallback * callback )
 
 int LVSvgImageSource::DecodeFromBuffer(unsigned char *buf, int buf_size, LVImageDecoderCallback * callback)
 {
-    NSVGimage *image = NULL;
+    _parsed = svgImageCache().get( (char*)buf, buf_size );
+    if ( _parsed.isNull() )
+        return false;
+    return DecodeParsed( callback );
+}
+
+int LVSvgImageSource::DecodeParsed( LVImageDecoderCallback * callback )
+{
+    NSVGimage *image = _parsed->image;
     NSVGrasterizer *rast = NULL;
     unsigned char* img = NULL;
     int w, h;
     bool res = false;
 
-    // printf("SVG: parsing...\n");
-    image = nsvgParse((char*)buf, "px", 96.0f);
-    if (image == NULL) {
-        printf("SVG: could not parse SVG stream.\n");
-        nsvgDelete(image);
-        return res;
-    }
-
     w = (int)image->width;
     h = (int)image->height;
     // The rasterizer (while antialiasing?) has a tendency to eat the last
@@ -1723,7 +1927,6 @@ int LVSvgImageSource::DecodeFromBuffer(unsigned char *buf, int buf_size, LVImage
         // But commented to not flood koreader's log for books with many such
         // svg images (crengine would log this at each page change)
         // printf("SVG: got image with zero supported shape.\n");
-        nsvgDelete(image);
         return res;
     }
 
@@ -1731,6 +1934,23 @@ int LVSvgImageSource::DecodeFromBuffer(unsigned char *buf, int buf_size, LVImage
         res = true;
     }
     else {
+        // Rasterize at the size image is going to be drawn at (zoom included) instead
+        // of scaling pixels: one scale for both axes, big enough to cover target size,
+        // so drawing only has to reduce other axis a bit if aspect ratio differs.
+        // Frame of 1 pixel is scaled too.
+        float scale = 1.0f;
+        int target_dx, target_dy;
+        if ( callback->GetTargetSize( target_dx, target_dy ) && target_dx > 0 && target_dy > 0 ) {
+            float sx = (float)target_dx / _width;
+            float sy = (float)target_dy / _height;
+            scale = sx > sy ? sx : sy;
+            w = (int)(_width * scale + 0.5f);
+            h = (int)(_height * scale + 0.5f);
+            if ( w < target_dx )
+                w = target_dx;
+            if ( h < target_dy )
+                h = target_dy;
+        }
         rast = nsvgCreateRasterizer();
         if (rast == NULL) {
             printf("SVG: could not init rasterizer.\n");
@@ -1742,50 +1962,25 @@ int LVSvgImageSource::DecodeFromBuffer(unsigned char *buf, int buf_size, LVImage
             }
             else {
                 // printf("SVG: rasterizing image %d x %d\n", w, h);
-                nsvgRasterize(rast, image, 1, 1, 1, img, w, h, w*4); // offsets of 1 pixel, scale = 1
+                nsvgRasterize(rast, image, scale, scale, scale, img, w, h, w*4); // frame of 1 pixel at intrinsic size
                 // stbi_write_png("/tmp/svg.png", w, h, 4, img, w*4); // for debug
                 callback->OnStartDecode(this);
-                lUInt32 * row = new lUInt32 [ _width ];
-                lUInt8 * p = img;
-                lUInt8 r, g, b, a, ia, blend, iblend;
-                lUInt32 ro, go, bo;
-                for (int y=0; y<_height; y++) {
-                    for (int x=0; x<_width; x++) {
-                        // We mostly get full white or full black when using alpha channel like this:
-                        //   row[x] = (((lUInt32)p[3])<<24) | (((lUInt32)p[0])<<16) | (((lUInt32)p[1])<<8) | (((lUInt32)p[2])<<0);
-                        // We can ignore the alpha channel but we get a black background for transparent pixels with:
-                        //   row[x] = (((lUInt32)p[0])<<16) | (((lUInt32)p[1])<<8) | (((lUInt32)p[2])<<0);
-                        // It's better to use alpha channel here to blend pixels over a white background and set opacity to full
-                        // """ To perform a source-over blend between two colors that use straight alpha format:
-                        //           result = (source.RGB * source.A) + (dest.RGB * (1 - source.A))        """
-                        r = (lUInt8)p[0];
-                        g = (lUInt8)p[1];
-                        b = (lUInt8)p[2];
-                        a = (lUInt8)p[3];
-                        ia = a ^ 0xFF;
-                        ro = (lUInt32)( r*a + 0xff*ia );
-                        go = (lUInt32)( g*a + 0xff*ia );
-                        bo = (lUInt32)( b*a + 0xff*ia );
-                        // More accurate divide by 256 than just >> 8 (255 becomes 254 with just >> 8)
-                        ro = (ro+1 + (ro >> 8)) >> 8;
-                        go = (go+1 + (go >> 8)) >> 8;
-                        bo = (bo+1 + (bo >> 8)) >> 8;
-                        row[x] = ro<<16|go<<8|bo;
-                        // if (y == 80) // output bytes for a single row
-                        // printf("SVG: byte colors %d %d %d %d > %d %d %d\n", (int)a, (int)r, (int)g, (int)b, (int)ro, (int)go, (int)bo);
-                        p += 4;
-                    }
-                    callback->OnLineDecoded( this, y, row );
+                if ( w != _width || h != _height )
+                    callback->OnDecodedSize( this, w, h );
+                lUInt32 * row = new lUInt32 [ w ];
+                for (int y=0; y<h; y++) {
+                    svgBlendRow( img + y*w*4, row, w );
+                    if ( !callback->OnLineDecoded( this, y, row ) )
+                        break;
                 }
                 delete[] row;
                 callback->OnEndDecode(this, false);
                 res = true;
                 free(img);
             }
+            nsvgDeleteRasterizer(rast);
         }
     }
-    nsvgDeleteRasterizer(rast);
-    nsvgDelete(image);
     return res;
 }
 
@@ -1799,16 +1994,13 @@ unsigned char * convertSVGtoPNG(unsigned char *svg_data, int svg_data_size, floa
     unsigned char *png = NULL;
 
     // printf("SVG: converting to PNG...\n");
-    image = nsvgParse((char*)svg_data, "px", 96.0f);
-    if (image == NULL) {
-        printf("SVG: could not parse SVG stream.\n");
-        nsvgDelete(image);
+    LVSvgParsedImageRef parsed = svgImageCache().get( (char*)svg_data, svg_data_size );
+    if ( parsed.isNull() )
         return png;
-    }
+    image = parsed->image;
 
     if (! image->shapes) {
         printf("SVG: got image with zero supported shape.\n");
-        nsvgDelete(image);
         return png;
     }
 
@@ -1838,7 +2030,6 @@ unsigned char * convertSVGtoPNG(unsigned char *svg_data, int svg_data_size, floa
         }
     }
     nsvgDeleteRasterizer(rast);
-    nsvgDelete(image);
     return png;
 }
 
@@ -2102,6 +2293,299 @@ LVImageSourceRef LVCreateTileTransform( LVImageSourceRef src, int newWidth, int
                                                      offsetX, offsetY ) );
 }
 
+// Resampling works in fixed point: weights of source pixels of one target pixel sum to
+// RESAMPLE_ONE, horizontally resampled channels are kept as 8.8, vertical sums as 8.22.
+#define RESAMPLE_BITS 14
+#define RESAMPLE_ONE (1<<RESAMPLE_BITS)
+
+// Reference implementations of resampling kernels. They are used for row tails
+// and on platforms without SSE2/NEON; vectorized versions must give the same
+// values (see runImageUnitTests()).
+
+/// resamples one source row to target width: 4 channels per target pixel, 8.8 fixed point
+static void resampleRowRef( lUInt16 * dst, const lUInt32 * src, int dstdx, const int * start, const int * count,
+                            const lUInt16 * weight )
+{
+    for ( int x=0; x<dstdx; x++ ) {
+        const lUInt32 * p = src + start[x];
+        int n = count[x];
+        lUInt32 s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+        for ( int k=0; k<n; k++ ) {
+            lUInt32 cl = p[k];
+            lUInt32 w = weight[k];
+            s0 += (cl & 0xFF) * w;
+            s1 += ((cl >> 8) & 0xFF) * w;
+            s2 += ((cl >> 16) & 0xFF) * w;
+            s3 += ((cl >> 24) & 0xFF) * w;
+        }
+        weight += n;
+        dst[0] = (lUInt16)((s0 + 32) >> 6);
+        dst[1] = (lUInt16)((s1 + 32) >> 6);
+        dst[2] = (lUInt16)((s2 + 32) >> 6);
+        dst[3] = (lUInt16)((s3 + 32) >> 6);
+        dst += 4;
+    }
+}
+
+/// adds weighted channels of resampled row to vertical sums
+static void accumulateRowRef( lUInt32 * acc, const lUInt16 * row, int len, lUInt32 weight )
+{
+    for ( int i=0; i<len; i++ )
+        acc[i] += row[i] * weight;
+}
+
+/// converts vertical sums of channels to pixels
+static void packRowRef( lUInt32 * dst, const lUInt32 * acc, int dx )
+{
+    const lUInt32 round = 1 << (RESAMPLE_BITS + 8 - 1);
+    for ( int x=0; x<dx; x++ ) {
+        dst[x] = ((acc[0] + round) >> (RESAMPLE_BITS + 8))
+                | (((acc[1] + round) >> (RESAMPLE_BITS + 8)) << 8)
+                | (((acc[2] + round) >> (RESAMPLE_BITS + 8)) << 16)
+                | (((acc[3] + round) >> (RESAMPLE_BITS + 8)) << 24);
+        acc += 4;
+    }
+}
+
+static void resampleRow( lUInt16 * dst, const lUInt32 * src, int dstdx, const int * start, const int * count,
+                         const lUInt16 * weight )
+{
+#if (CR_RESAMPLE_SSE2==1)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi32( 32 );
+    const __m128i bias = _mm_set1_epi32( 32768 );
+    const __m128i sign = _mm_set1_epi16( (short)0x8000 );
+    for ( int x=0; x<dstdx; x++ ) {
+        const lUInt32 * p = src + start[x];
+        int n = count[x];
+        __m128i sum = zero;
+        int k = 0;
+        // two source pixels at once: channels interleaved, multiplied and added pairwise
+        for ( ; k+1<n; k+=2 ) {
+            __m128i a = _mm_cvtsi32_si128( (int)p[k] );
+            __m128i b = _mm_cvtsi32_si128( (int)p[k+1] );
+            __m128i ab = _mm_unpacklo_epi8( _mm_unpacklo_epi8( a, b ), zero );
+            __m128i w = _mm_set1_epi32( (int)(weight[k] | ((lUInt32)weight[k+1] << 16)) );
+            sum = _mm_add_epi32( sum, _mm_madd_epi16( ab, w ) );
+        }
+        if ( k<n ) {
+            __m128i a = _mm_unpacklo_epi16( _mm_unpacklo_epi8( _mm_cvtsi32_si128( (int)p[k] ), zero ), zero );
+            sum = _mm_add_epi32( sum, _mm_madd_epi16( a, _mm_set1_epi32( weight[k] ) ) );
+        }
+        weight += n;
+        // unsigned 16 bit pack using signed saturation of biased values
+        sum = _mm_sub_epi32( _mm_srli_epi32( _mm_add_epi32( sum, round ), 6 ), bias );
+        __m128i res = _mm_xor_si128( _mm_packs_epi32( sum, sum ), sign );
+        _mm_storel_epi64( (__m128i *)(dst + x*4), res );
+    }
+#elif (CR_RESAMPLE_NEON==1)
+    for ( int x=0; x<dstdx; x++ ) {
+        const lUInt32 * p = src + start[x];
+        int n = count[x];
+        uint32x4_t sum = vdupq_n_u32( 32 );
+        for ( int k=0; k<n; k++ ) {
+            uint16x4_t c = vget_low_u16( vmovl_u8( vreinterpret_u8_u32( vdup_n_u32( p[k] ) ) ) );
+            sum = vmlal_n_u16( sum, c, weight[k] );
+        }
+        weight += n;
+        vst1_u16( dst + x*4, vshrn_n_u32( sum, 6 ) );
+    }
+#else
+    resampleRowRef( dst, src, dstdx, start, count, weight );
+#endif
+}
+
+static void accumulateRow( lUInt32 * acc, const lUInt16 * row, int len, lUInt32 weight )
+{
+    int i = 0;
+#if (CR_RESAMPLE_SSE2==1)
+    const __m128i w = _mm_set1_epi16( (short)weight );
+    for ( ; i+8<=len; i+=8 ) {
+        __m128i r = _mm_loadu_si128( (const __m128i *)(row + i) );
+        __m128i lo = _mm_mullo_epi16( r, w );
+        __m128i hi = _mm_mulhi_epu16( r, w );
+        __m128i * a = (__m128i *)(acc + i);
+        _mm_storeu_si128( a, _mm_add_epi32( _mm_loadu_si128( a ), _mm_unpacklo_epi16( lo, hi ) ) );
+        _mm_storeu_si128( a + 1, _mm_add_epi32( _mm_loadu_si128( a + 1 ), _mm_unpackhi_epi16( lo, hi ) ) );
+    }
+#elif (CR_RESAMPLE_NEON==1)
+    for ( ; i+8<=len; i+=8 ) {
+        uint16x8_t r = vld1q_u16( row + i );
+        vst1q_u32( acc + i, vmlal_n_u16( vld1q_u32( acc + i ), vget_low_u16( r ), (lUInt16)weight ) );
+        vst1q_u32( acc + i + 4, vmlal_n_u16( vld1q_u32( acc + i + 4 ), vget_high_u16( r ), (lUInt16)weight ) );
+    }
+#endif
+    accumulateRowRef( acc + i, row + i, len - i, weight );
+}
+
+static void packRow( lUInt32 * dst, const lUInt32 * acc, int dx )
+{
+    int x = 0;
+#if (CR_RESAMPLE_SSE2==1)
+    const __m128i round = _mm_set1_epi32( 1 << (RESAMPLE_BITS + 8 - 1) );
+    for ( ; x+4<=dx; x+=4 ) {
+        const __m128i * a = (const __m128i *)(acc + x*4);
+        __m128i p0 = _mm_srli_epi32( _mm_add_epi32( _mm_loadu_si128( a ), round ), RESAMPLE_BITS + 8 );
+        __m128i p1 = _mm_srli_epi32( _mm_add_epi32( _mm_loadu_si128( a + 1 ), round ), RESAMPLE_BITS + 8 );
+        __m128i p2 = _mm_srli_epi32( _mm_add_epi32( _mm_loadu_si128( a + 2 ), round ), RESAMPLE_BITS + 8 );
+        __m128i p3 = _mm_srli_epi32( _mm_add_epi32( _mm_loadu_si128( a + 3 ), round ), RESAMPLE_BITS + 8 );
+        __m128i res = _mm_packus_epi16( _mm_packs_epi32( p0, p1 ), _mm_packs_epi32( p2, p3 ) );
+        _mm_storeu_si128( (__m128i *)(dst + x), res );
+    }
+#elif (CR_RESAMPLE_NEON==1)
+    const uint32x4_t round = vdupq_n_u32( 1 << (RESAMPLE_BITS + 8 - 1) );
+    for ( ; x+4<=dx; x+=4 ) {
+        const lUInt32 * a = acc + x*4;
+        uint16x4_t p0 = vmovn_u32( vshrq_n_u32( vaddq_u32( vld1q_u32( a ), round ), RESAMPLE_BITS + 8 ) );
+        uint16x4_t p1 = vmovn_u32( vshrq_n_u32( vaddq_u32( vld1q_u32( a + 4 ), round ), RESAMPLE_BITS + 8 ) );
+        uint16x4_t p2 = vmovn_u32( vshrq_n_u32( vaddq_u32( vld1q_u32( a + 8 ), round ), RESAMPLE_BITS + 8 ) );
+        uint16x4_t p3 = vmovn_u32( vshrq_n_u32( vaddq_u32( vld1q_u32( a + 12 ), round ), RESAMPLE_BITS + 8 ) );
+        uint8x16_t res = vcombine_u8( vmovn_u16( vcombine_u16( p0, p1 ) ), vmovn_u16( vcombine_u16( p2, p3 ) ) );
+        vst1q_u8( (lUInt8 *)(dst + x), res );
+    }
+#endif
+    packRowRef( dst + x, acc + x*4, dx - x );
+}
+
+/// weight of source pixel src in target pixel dst when reducing srclen pixels to dstlen, box filter
+static lUInt32 resampleBoxWeight( lInt64 dst, lInt64 src, lInt64 srclen, lInt64 dstlen )
+{
+    // target pixel covers [dst*srclen, (dst+1)*srclen), source pixel [src*dstlen, (src+1)*dstlen);
+    // weights are differences of rounded cumulative coverage, so they sum to exactly RESAMPLE_ONE
+    lInt64 t0 = dst * srclen;
+    lInt64 a = src * dstlen - t0;
+    lInt64 b = a + dstlen;
+    if ( a < 0 )
+        a = 0;
+    if ( b > srclen )
+        b = srclen;
+    if ( b <= a )
+        return 0;
+    return (lUInt32)((b * RESAMPLE_ONE + srclen / 2) / srclen - (a * RESAMPLE_ONE + srclen / 2) / srclen);
+}
+
+/// finds source pixels of target pixel dst and their weights; returns number of pixels
+static int resampleTaps( int dst, int srclen, int dstlen, int & start, lUInt16 * weights )
+{
+    if ( dstlen <= srclen ) {
+        // box filter
+        start = (int)((lInt64)dst * srclen / dstlen);
+        int last = (int)(((lInt64)dst * srclen + srclen - 1) / dstlen);
+        for ( int i=start; i<=last; i++ )
+            weights[i - start] = (lUInt16)resampleBoxWeight( dst, i, srclen, dstlen );
+        return last - start + 1;
+    }
+    // bilinear: center of target pixel mapped to source coordinates
+    lInt64 num = (lInt64)(2 * dst + 1) * srclen - dstlen;
+    lInt64 den = 2 * (lInt64)dstlen;
+    if ( num <= 0 ) {
+        start = 0;
+        weights[0] = RESAMPLE_ONE;
+        return 1;
+    }
+    start = (int)(num / den);
+    lUInt32 w1 = (lUInt32)(((num % den) * RESAMPLE_ONE + den / 2) / den);
+    if ( start >= srclen - 1 ) {
+        start = srclen - 1;
+        w1 = 0;
+    }
+    if ( w1 == 0 || w1 == RESAMPLE_ONE ) {
+        if ( w1 )
+            start++;
+        weights[0] = RESAMPLE_ONE;
+        return 1;
+    }
+    weights[0] = (lUInt16)(RESAMPLE_ONE - w1);
+    weights[1] = (lUInt16)w1;
+    return 2;
+}
+
+LVImageResampler::LVImageResampler( int srcdx, int srcdy, int dstdx, int dstdy )
+    : _src_dx( srcdx > 0 ? srcdx : 1 ), _src_dy( srcdy > 0 ? srcdy : 1 )
+    , _dst_dx( dstdx > 0 ? dstdx : 1 ), _dst_dy( dstdy > 0 ? dstdy : 1 )
+    , _next_src(0), _next_dst(0), _ready(false)
+{
+    _xstart = new int[_dst_dx];
+    _xcount = new int[_dst_dx];
+    // box filter: at most srclen + dstlen weights, bilinear: 2 per target pixel
+    _xweight = new lUInt16[_src_dx + 2 * _dst_dx];
+    initFilter( _src_dx, _dst_dx, _xstart, _xcount, _xweight );
+    _row = new lUInt16[_dst_dx * 4];
+    _prev = new lUInt16[_dst_dx * 4];
+    _acc = new lUInt32[_dst_dx * 4];
+    _out = new lUInt32[_dst_dx];
+    memset( _acc, 0, sizeof(lUInt32) * _dst_dx * 4 );
+}
+
+LVImageResampler::~LVImageResampler()
+{
+    delete[] _xstart;
+    delete[] _xcount;
+    delete[] _xweight;
+    delete[] _row;
+    delete[] _prev;
+    delete[] _acc;
+    delete[] _out;
+}
+
+void LVImageResampler::initFilter( int srclen, int dstlen, int * start, int * count, lUInt16 * weight )
+{
+    for ( int i=0; i<dstlen; i++ ) {
+        count[i] = resampleTaps( i, srclen, dstlen, start[i], weight );
+        weight += count[i];
+    }
+}
+
+void LVImageResampler::addRow( const lUInt32 * data )
+{
+    if ( _next_src >= _src_dy )
+        return;
+    int y = _next_src++;
+    lUInt16 * tmp = _prev;
+    _prev = _row;
+    _row = tmp;
+    resampleRow( _row, data, _dst_dx, _xstart, _xcount, _xweight );
+    if ( _dst_dy > _src_dy )
+        return; // enlarged rows are interpolated in getRow()
+    // box filter: row may end current target row and start next one
+    int j = _next_dst;
+    accumulateRow( _acc, _row, _dst_dx * 4, resampleBoxWeight( j, y, _src_dy, _dst_dy ) );
+    if ( ((lInt64)y + 1) * _dst_dy >= ((lInt64)j + 1) * _src_dy ) {
+        packRow( _out, _acc, _dst_dx );
+        _ready = true;
+        memset( _acc, 0, sizeof(lUInt32) * _dst_dx * 4 );
+        if ( j + 1 < _dst_dy ) {
+            lUInt32 w = resampleBoxWeight( j + 1, y, _src_dy, _dst_dy );
+            if ( w )
+                accumulateRow( _acc, _row, _dst_dx * 4, w );
+        }
+    }
+}
+
+lUInt32 * LVImageResampler::getRow( int & y )
+{
+    if ( _dst_dy <= _src_dy ) {
+        if ( !_ready )
+            return NULL;
+        _ready = false;
+        y = _next_dst++;
+        return _out;
+    }
+    if ( _next_dst >= _dst_dy )
+        return NULL;
+    int start;
+    lUInt16 weights[2];
+    int n = resampleTaps( _next_dst, _src_dy, _dst_dy, start, weights );
+    if ( start + n > _next_src )
+        return NULL;
+    memset( _acc, 0, sizeof(lUInt32) * _dst_dx * 4 );
+    for ( int i=0; i<n; i++ )
+        accumulateRow( _acc, start + i == _next_src - 1 ? _row : _prev, _dst_dx * 4, weights[i] );
+    packRow( _out, _acc, _dst_dx );
+    y = _next_dst++;
+    return _out;
+}
+
 static inline lUInt32 limit256(int n) {
     if (n < 0)
         return 0;
@@ -2563,3 +3047,179 @@ void LVDrawBatteryIcon( LVDrawBuf * drawbuf, const lvRect & batteryRc, int perce
         font->DrawTextString(drawbuf, x, y, txt.c_str(), txt.length(), '?', NULL);
     }
 }
+
+static lUInt32 imageTestRandom( lUInt32 & seed )
+{
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 8) & 0xFFFFFF;
+}
+
+/// checks resampling kernels against reference implementations, and streaming resampler against direct resampling
+static void runResamplerUnitTests()
+{
+    CRLog::info("runResamplerUnitTests()");
+    lUInt32 seed = 1;
+    const int maxsize = 61;
+    lUInt32 src[maxsize * maxsize];
+    lUInt16 rows[maxsize][maxsize * 4];
+    lUInt32 acc[maxsize * 4];
+    lUInt32 expected[maxsize];
+    int start[maxsize], count[maxsize];
+    lUInt16 weights[maxsize * 3];
+    for ( int pass=0; pass<300; pass++ ) {
+        int srcdx = 1 + imageTestRandom(seed) % maxsize;
+        int srcdy = 1 + imageTestRandom(seed) % maxsize;
+        int dstdx = 1 + imageTestRandom(seed) % maxsize;
+        int dstdy = 1 + imageTestRandom(seed) % maxsize;
+        for ( int i=0; i<srcdx*srcdy; i++ )
+            src[i] = imageTestRandom(seed) | (imageTestRandom(seed) << 24);
+        // weights of each target pixel sum to one
+        lUInt16 * w = weights;
+        for ( int x=0; x<dstdx; x++ ) {
+            count[x] = resampleTaps( x, srcdx, dstdx, start[x], w );
+            lUInt32 sum = 0;
+            for ( int k=0; k<count[x]; k++ )
+                sum += w[k];
+            MYASSERT( sum == RESAMPLE_ONE, "resampling weights" );
+            MYASSERT( start[x] >= 0 && start[x] + count[x] <= srcdx, "resampling taps" );
+            w += count[x];
+        }
+        // kernels
+        for ( int y=0; y<srcdy; y++ ) {
+            lUInt16 row[maxsize * 4];
+            resampleRowRef( rows[y], src + y*srcdx, dstdx, start, count, weights );
+            resampleRow( row, src + y*srcdx, dstdx, start, count, weights );
+            MYASSERT( !memcmp( row, rows[y], sizeof(lUInt16) * dstdx * 4 ), "horizontal resampling" );
+        }
+        lUInt32 acc2[maxsize * 4];
+        for ( int i=0; i<dstdx*4; i++ )
+            acc[i] = acc2[i] = imageTestRandom(seed);
+        lUInt32 rw = imageTestRandom(seed) % (RESAMPLE_ONE + 1);
+        accumulateRowRef( acc, rows[0], dstdx * 4, rw );
+        accumulateRow( acc2, rows[0], dstdx * 4, rw );
+        MYASSERT( !memcmp( acc, acc2, sizeof(lUInt32) * dstdx * 4 ), "vertical accumulation" );
+        for ( int i=0; i<dstdx*4; i++ )
+            acc[i] = ((imageTestRandom(seed) << 8) ^ imageTestRandom(seed)) % (255u << (RESAMPLE_BITS + 8));
+        lUInt32 out1[maxsize], out2[maxsize];
+        packRowRef( out1, acc, dstdx );
+        packRow( out2, acc, dstdx );
+        MYASSERT( !memcmp( out1, out2, sizeof(lUInt32) * dstdx ), "packing of resampled pixels" );
+        // streaming resampler gives all rows in order, same as direct resampling
+        LVImageResampler resampler( srcdx, srcdy, dstdx, dstdy );
+        int nextRow = 0;
+        for ( int y=0; y<srcdy; y++ ) {
+            MYASSERT( resampler.nextSourceRow() == y, "resampler source row" );
+            resampler.addRow( src + y*srcdx );
+            int yy;
+            lUInt32 * row;
+            while ( (row = resampler.getRow( yy )) != NULL ) {
+                MYASSERT( yy == nextRow, "resampled row order" );
+                lUInt16 vw[maxsize + 2];
+                int vstart;
+                int vcount = resampleTaps( yy, srcdy, dstdy, vstart, vw );
+                memset( acc, 0, sizeof(acc) );
+                for ( int k=0; k<vcount; k++ )
+                    accumulateRowRef( acc, rows[vstart + k], dstdx * 4, vw[k] );
+                packRowRef( expected, acc, dstdx );
+                MYASSERT( !memcmp( row, expected, sizeof(lUInt32) * dstdx ), "streaming resampling" );
+                nextRow++;
+            }
+        }
+        MYASSERT( nextRow == dstdy, "resampled row count" );
+    }
+    // solid color stays the same, same size image is copied exactly
+    for ( int i=0; i<maxsize*maxsize; i++ )
+        src[i] = 0x40A0C0E0;
+    LVImageResampler solid( maxsize, maxsize, 7, 97 );
+    for ( int y=0; y<maxsize; y++ ) {
+        solid.addRow( src );
+        int yy;
+        lUInt32 * row;
+        while ( (row = solid.getRow( yy )) != NULL )
+            for ( int x=0; x<7; x++ )
+                MYASSERT( row[x] == 0x40A0C0E0, "resampling of solid color" );
+    }
+    for ( int i=0; i<maxsize*maxsize; i++ )
+        src[i] = imageTestRandom(seed) | (imageTestRandom(seed) << 24);
+    LVImageResampler same( maxsize, maxsize, maxsize, maxsize );
+    for ( int y=0; y<maxsize; y++ ) {
+        same.addRow( src + y*maxsize );
+        int yy;
+        lUInt32 * row = same.getRow( yy );
+        MYASSERT( row && yy == y && !memcmp( row, src + y*maxsize, sizeof(lUInt32) * maxsize ), "resampling to same size" );
+    }
+    CRLog::info("runResamplerUnitTests() finished");
+}
+
+/// records size and center pixel of decoded image
+class LVSvgTestCallback : public LVImageDecoderCallback
+{
+public:
+    int target_dx;
+    int target_dy;
+    int dx;
+    int dy;
+    int rows;
+    lUInt32 center;
+    LVSvgTestCallback( int tdx, int tdy, int sdx, int sdy )
+        : target_dx(tdx), target_dy(tdy), dx(sdx), dy(sdy), rows(0), center(0) { }
+    virtual void OnStartDecode( LVImageSource * ) { }
+    virtual bool OnLineDecoded( LVImageSource *, int y, lUInt32 * data )
+    {
+        if ( y == dy / 2 )
+            center = data[dx / 2];
+        rows++;
+        return true;
+    }
+    virtual void OnEndDecode( LVImageSource *, bool ) { }
+    virtual bool GetTargetSize( int & tdx, int & tdy )
+    {
+        tdx = target_dx;
+        tdy = target_dy;
+        return target_dx > 0;
+    }
+    virtual void OnDecodedSize( LVImageSource *, int sdx, int sdy ) { dx = sdx; dy = sdy; }
+};
+
+static void runSvgUnitTests()
+{
+    CRLog::info("runSvgUnitTests()");
+    static const char * svg =
+        "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"20\" height=\"10\">"
+        "<rect x=\"0\" y=\"0\" width=\"20\" height=\"10\" fill=\"#000000\"/></svg>";
+    int len = (int)strlen( svg );
+    LVImageSourceRef img1 = LVCreateStreamImageSource( LVCreateMemoryStream( (void*)svg, len ) );
+    MYASSERT( !img1.isNull(), "SVG image parsing" );
+    MYASSERT( img1->GetWidth() == 22 && img1->GetHeight() == 12, "SVG image size with frame" );
+    // same text: parsed image is taken from cache
+    int hits = (int)CRMemoryGovernor::getStats( CRMEM_SVG_IMAGES ).hits;
+    LVImageSourceRef img2 = LVCreateStreamImageSource( LVCreateMemoryStream( (void*)svg, len ) );
+    MYASSERT( !img2.isNull() && img2->GetWidth() == 22, "SVG image from cache" );
+    MYASSERT( (int)CRMemoryGovernor::getStats( CRMEM_SVG_IMAGES ).hits == hits + 1, "SVG parsed image cache hit" );
+    // text of same length is not taken for cached one
+    static const char * other =
+        "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"30\" height=\"10\">"
+        "<rect x=\"0\" y=\"0\" width=\"30\" height=\"10\" fill=\"#000000\"/></svg>";
+    LVImageSourceRef img3 = LVCreateStreamImageSource( LVCreateMemoryStream( (void*)other, len ) );
+    MYASSERT( !img3.isNull() && img3->GetWidth() == 32, "SVG image of other text" );
+    MYASSERT( (int)CRMemoryGovernor::getStats( CRMEM_SVG_IMAGES ).hits == hits + 1, "SVG cache miss for other text" );
+    // intrinsic size when drawing size is unknown
+    LVSvgTestCallback intrinsic( 0, 0, 22, 12 );
+    MYASSERT( img1->Decode( &intrinsic ) && intrinsic.rows == 12, "SVG rasterizing at intrinsic size" );
+    MYASSERT( intrinsic.center == 0, "SVG rasterized pixels" );
+    // rasterized at drawing size; with different aspect ratio target size is covered
+    LVSvgTestCallback zoomed( 44, 24, 22, 12 );
+    MYASSERT( img2->Decode( &zoomed ), "SVG rasterizing at target size" );
+    MYASSERT( zoomed.dx == 44 && zoomed.dy == 24 && zoomed.rows == 24, "SVG rasterized size" );
+    MYASSERT( zoomed.center == 0, "SVG rasterized pixels at target size" );
+    LVSvgTestCallback wide( 66, 24, 22, 12 );
+    MYASSERT( img2->Decode( &wide ), "SVG rasterizing at target aspect ratio" );
+    MYASSERT( wide.dx == 66 && wide.dy == 36 && wide.rows == 36, "SVG rasterized size covers target" );
+    CRLog::info("runSvgUnitTests() finished");
+}
+
+void runImageUnitTests()
+{
+    runResamplerUnitTests();
+    runSvgUnitTests();
+}
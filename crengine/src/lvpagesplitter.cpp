@@ -144,7 +144,7 @@ void LVRendPageContext::AddLine( int starty, int endy, int flags )
 // We use 1.0rem (1x root font size) as the footnote margin (vertical margin
 // between text and first foornote)
 #define FOOTNOTE_MARGIN_REM 1
-extern int gRootFontSize;
+extern CR_THREAD_LOCAL int gRootFontSize;
 
 // helper class
 struct PageSplitState {
@@ -17,6 +17,7 @@
 #include "../include/lvtinydom.h"
 #include "../include/fb2def.h"
 #include "../include/lvrend.h"
+#include "../include/crtrace.h"
 
 // Note about box model/sizing in crengine:
 // https://quirksmode.org/css/user-interface/boxsizing.html says:
@@ -50,11 +51,11 @@
 // crengine default used to be "width: 100%", but now that we
 // can shrink to fit, it is "width: auto".
 
-int gInterlineScaleFactor = INTERLINE_SCALE_FACTOR_NO_SCALE;
+CR_THREAD_LOCAL int gInterlineScaleFactor = INTERLINE_SCALE_FACTOR_NO_SCALE;
 
-int gRenderDPI = DEF_RENDER_DPI; // if 0: old crengine behaviour: 1px/pt=1px, 1in/cm/pc...=0px
-bool gRenderScaleFontWithDPI = DEF_RENDER_SCALE_FONT_WITH_DPI;
-int gRootFontSize = 24; // will be reset as soon as font size is set
+CR_THREAD_LOCAL int gRenderDPI = DEF_RENDER_DPI; // if 0: old crengine behaviour: 1px/pt=1px, 1in/cm/pc...=0px
+CR_THREAD_LOCAL bool gRenderScaleFontWithDPI = DEF_RENDER_SCALE_FONT_WITH_DPI;
+CR_THREAD_LOCAL int gRootFontSize = 24; // will be reset as soon as font size is set
 
 int scaleForRenderDPI( int value ) {
     // if gRenderDPI == 0 or 96, use value as is (1px = 1px)
@@ -64,7 +65,27 @@ int scaleForRenderDPI( int value ) {
     return value;
 }
 
-int gRenderBlockRenderingFlags = DEF_RENDER_BLOCK_RENDERING_FLAGS;
+CR_THREAD_LOCAL int gRenderBlockRenderingFlags = DEF_RENDER_BLOCK_RENDERING_FLAGS;
+
+LVRendThreadSettings::LVRendThreadSettings()
+: renderDPI(gRenderDPI)
+, scaleFontWithDPI(gRenderScaleFontWithDPI)
+, rootFontSize(gRootFontSize)
+, interlineScaleFactor(gInterlineScaleFactor)
+, blockRenderingFlags(gRenderBlockRenderingFlags)
+, floatingPunctuation(gFlgFloatingPunctuationEnabled)
+{
+}
+
+void LVRendThreadSettings::apply() const
+{
+    gRenderDPI = renderDPI;
+    gRenderScaleFontWithDPI = scaleFontWithDPI;
+    gRootFontSize = rootFontSize;
+    gInterlineScaleFactor = interlineScaleFactor;
+    gRenderBlockRenderingFlags = blockRenderingFlags;
+    gFlgFloatingPunctuationEnabled = floatingPunctuation;
+}
 
 int validateBlockRenderingFlags(int f) {
     // Check coherency and ensure dependancies of flags
@@ -1810,7 +1831,7 @@ bool isSameFontStyle( css_style_rec_t * style1, css_style_rec_t * style2 )
 }
 
 //int rend_font_embolden = STYLE_FONT_EMBOLD_MODE_EMBOLD;
-int rend_font_embolden = STYLE_FONT_EMBOLD_MODE_NORMAL;
+CR_THREAD_LOCAL int rend_font_embolden = STYLE_FONT_EMBOLD_MODE_NORMAL;
 
 void LVRendSetFontEmbolden( int addWidth )
 {
@@ -2887,8 +2908,8 @@ void renderFinalBlock( ldomNode * enode, LFormattedText * txform, RenderRectAcce
     }
     else if ( enode->isText() ) {
         // text nodes
-        lString16 txt = enode->getText();
-        if ( !txt.empty() ) {
+        ldomTextRef text = enode->getTextRef();
+        if ( !text.empty() ) {
             #ifdef DEBUG_DUMP_ENABLED
                 for (int i=0; i<enode->getNodeLevel(); i++)
                     logfile << " . ";
@@ -2901,9 +2922,12 @@ void renderFinalBlock( ldomNode * enode, LFormattedText * txform, RenderRectAcce
             // if ( parent->getNodeId() == el_a ) // "123" in <a href=><sup>123</sup></a> would not be flagged
             if (is_link_start && *is_link_start) { // was propagated from some outer <A>
                 tflags |= LTEXT_IS_LINK; // used to gather in-page footnotes
-                lString16 tmp = lString16(txt);
-                if (!tmp.trim().empty()) // non empty text, will make out a word
-                    *is_link_start = false;
+                for ( const char * s = text.data(); s < text.end(); s++ ) {
+                    if ( *s != ' ' && *s != '\t' ) { // non empty text, will make out a word
+                        *is_link_start = false;
+                        break;
+                    }
+                }
                     // reset to false, so next text nodes in that link are not
                     // flagged, and don't make out duplicate in-page footnotes
             }
@@ -2923,15 +2947,32 @@ void renderFinalBlock( ldomNode * enode, LFormattedText * txform, RenderRectAcce
                 }
             }
 
+            // Short text is decoded into a per-thread buffer (AddSourceLine()
+            // copies it with LTEXT_FLAG_OWNTEXT), longer text into a string
+            static const int MAX_DECODED_TEXT_SIZE = 1024;
+            static CR_THREAD_LOCAL lChar16 decoded[MAX_DECODED_TEXT_SIZE];
+            lString16 longTxt;
+            lChar16 * txt = decoded;
+            int txtLen = text.length();
+            if ( txtLen <= MAX_DECODED_TEXT_SIZE ) {
+                const char * s = text.data();
+                int i = 0;
+                while ( i < txtLen )
+                    decoded[i++] = Utf8NextChar( s, text.end() );
+            } else {
+                text.getText( longTxt );
+                txt = longTxt.modify();
+                txtLen = longTxt.length();
+            }
             switch (style->text_transform) {
             case css_tt_uppercase:
-                txt.uppercase();
+                lStr_uppercase( txt, txtLen );
                 break;
             case css_tt_lowercase:
-                txt.lowercase();
+                lStr_lowercase( txt, txtLen );
                 break;
             case css_tt_capitalize:
-                txt.capitalize();
+                lStr_capitalize( txt, txtLen );
                 break;
             case css_tt_full_width:
                 // txt.fullWidthChars(); // disabled for now (may change CJK rendering)
@@ -2976,8 +3017,8 @@ void renderFinalBlock( ldomNode * enode, LFormattedText * txform, RenderRectAcce
                 }
             }
             */
-            if ( txt.length()>0 ) {
-                txform->AddSourceLine( txt.c_str(), txt.length(), cl, bgcl, font, baseflags | tflags,
+            if ( txtLen>0 ) {
+                txform->AddSourceLine( txt, txtLen, cl, bgcl, font, baseflags | tflags,
                     line_h, valign_dy, ident, enode, 0, letter_spacing );
                 baseflags &= ~LTEXT_FLAG_NEWLINE & ~LTEXT_SRC_IS_CLEAR_BOTH; // clear newline flag
             }
@@ -6594,16 +6635,9 @@ void renderBlockElementEnhanced( FlowState * flow, ldomNode * enode, int x, int
                 // if (top_overflow > 0) printf("final top_overflow=%d\n", top_overflow);
                 // if (bottom_overflow > 0) printf("final bottom_overflow=%d\n", bottom_overflow);
 
-                // Reload fmt, as enode->renderFinalBlock() will have
-                // updated it to store the float_footprint rects in.
-                //   Note: beware RenderRectAccessor's own state and refresh
-                //   management (push/_modified/_dirty) which may not be
-                //   super safe (push() sets dirty only if modified,
-                //   a getX() resets _dirty, and you can't set _dirty
-                //   explicitely when you know a 2nd instance will be
-                //   created and will modify the state).
-                //   So, safer to create a new instance to be sure
-                //   to get fresh data.
+                // enode->renderFinalBlock() will have updated fmt to
+                // store the float_footprint rects in (all RenderRectAccessor
+                // instances of a node share its stored record).
                 fmt = RenderRectAccessor( enode );
                 fmt.setHeight( h );
                 fmt.setTopOverflow( top_overflow );
@@ -7584,7 +7618,9 @@ void DrawDocument( LVDrawBuf & drawbuf, ldomNode * enode, int x0, int y0, int dx
                     lUInt32 h = txform->Format( (lUInt16)list_marker_width, (lUInt16)page_height, direction );
                     lvRect clip;
                     drawbuf.GetClipRect( &clip );
-                    if (doc_y + h <= clip.bottom) { // draw only if marker fully fits on page
+                    // draw only if marker fully fits on page (partial markers are
+                    // drawn when partial glyphs are, e.g. in scroll mode strips)
+                    if (doc_y + h <= clip.bottom || !drawbuf.getHidePartialGlyphs()) {
                         // In both LTR and RTL, for erm_block, we draw the marker inside 'width',
                         // (only the child elements got their width shrinked by list_marker_width).
                         if ( is_rtl ) {
@@ -7750,7 +7786,9 @@ void DrawDocument( LVDrawBuf & drawbuf, ldomNode * enode, int x0, int y0, int dx
                     lUInt32 h = txform->Format( (lUInt16)list_marker_width, (lUInt16)page_height, direction );
                     lvRect clip;
                     drawbuf.GetClipRect( &clip );
-                    if (doc_y + h <= clip.bottom) { // draw only if marker fully fits on page
+                    // draw only if marker fully fits on page (partial markers are
+                    // drawn when partial glyphs are, e.g. in scroll mode strips)
+                    if (doc_y + h <= clip.bottom || !drawbuf.getHidePartialGlyphs()) {
                         // In both LTR and RTL, for erm_final, we draw the marker outside 'width',
                         // as 'width' has already been shrinked by list_marker_width.
                         if ( is_rtl ) {
@@ -8347,6 +8385,23 @@ void setNodeStyle( ldomNode * enode, css_style_ref_t parent_style, LVFontRef par
 // Uncomment for debugging getRenderedWidths():
 // #define DEBUG_GETRENDEREDWIDTHS
 
+/// innermost cache of rendered widths of this thread, NULL if none
+static CR_THREAD_LOCAL RenderedWidthsCache * renderedWidthsCache = NULL;
+// text measuring state usage of last block node measured, for its parent
+static CR_THREAD_LOCAL bool renderedWidthsReadsState = false;
+static CR_THREAD_LOCAL bool renderedWidthsWritesState = false;
+
+RenderedWidthsCache::RenderedWidthsCache()
+: _items(1024), _prev(renderedWidthsCache)
+{
+    renderedWidthsCache = this;
+}
+
+RenderedWidthsCache::~RenderedWidthsCache()
+{
+    renderedWidthsCache = _prev;
+}
+
 // Estimate width of node when rendered:
 //   maxWidth: width if it would be rendered on an infinite width area
 //   minWidth: width with a wrap on all spaces (no hyphenation), so width taken by the longest word
@@ -8390,6 +8445,33 @@ void getRenderedWidths(ldomNode * node, int &maxWidth, int &minWidth, int direct
             m = erm_block;
         }
 
+        // Block-like node: check widths computed earlier in this render pass
+        // (only if they don't depend on text measured before this node)
+        RenderedWidthsCache * cache = m != erm_inline ? renderedWidthsCache : NULL;
+        lUInt64 cacheKey = 0;
+        if ( cache ) {
+            cacheKey = ((lUInt64)node->getDataIndex() << 8) | (direction << 1) | (ignoreMargin ? 1 : 0);
+            RenderedWidthsItem item;
+            if ( cache->_items.get( cacheKey, item ) && item.rendFlags == rendFlags ) {
+                CR_TRACE_COUNT(CRTRACE_WIDTHS_CACHE_HIT, 1);
+                if (item.maxWidth > maxWidth)
+                    maxWidth = item.maxWidth;
+                if (item.minWidth > minWidth)
+                    minWidth = item.minWidth;
+                if ( item.writesState ) {
+                    curMaxWidth = item.curMaxWidth;
+                    curWordWidth = item.curWordWidth;
+                    lastSpaceWidth = item.lastSpaceWidth;
+                    collapseNextSpace = item.collapseNextSpace;
+                }
+                renderedWidthsReadsState = false;
+                renderedWidthsWritesState = item.writesState;
+                return;
+            }
+        }
+        bool readsState = false;
+        bool writesState = false;
+
         css_style_rec_t * style = node->getStyle().get();
 
         // Get image size early
@@ -8599,6 +8681,7 @@ void getRenderedWidths(ldomNode * node, int &maxWidth, int &minWidth, int direct
                 }
                 collapseNextSpace = true; // skip leading spaces
                 lastSpaceWidth = 0;
+                writesState = true;
                 // Process children, which are either erm_inline or text nodes
                 for (int i = 0; i < node->getChildCount(); i++) {
                     ldomNode * child = node->getChildNode(i);
@@ -8636,6 +8719,15 @@ void getRenderedWidths(ldomNode * node, int &maxWidth, int &minWidth, int direct
                     _maxWidth = _maxw;
                 if (_minw > _minWidth)
                     _minWidth = _minw;
+                int cm = child->isElement() ? child->getRendMethod() : erm_inline;
+                if ( cm == erm_inline ) { // text and inline nodes continue current line
+                    readsState = true;
+                    writesState = true;
+                }
+                else if ( cm != erm_invisible ) {
+                    readsState = readsState || renderedWidthsReadsState;
+                    writesState = writesState || renderedWidthsWritesState;
+                }
             }
         }
 
@@ -8731,9 +8823,23 @@ void getRenderedWidths(ldomNode * node, int &maxWidth, int &minWidth, int direct
             maxWidth = _maxWidth;
         if (_minWidth > minWidth)
             minWidth = _minWidth;
+        if ( cache && !readsState ) {
+            RenderedWidthsItem item;
+            item.maxWidth = _maxWidth;
+            item.minWidth = _minWidth;
+            item.rendFlags = rendFlags;
+            item.curMaxWidth = curMaxWidth;
+            item.curWordWidth = curWordWidth;
+            item.lastSpaceWidth = lastSpaceWidth;
+            item.collapseNextSpace = collapseNextSpace;
+            item.writesState = writesState;
+            cache->_items.set( cacheKey, item );
+        }
+        renderedWidthsReadsState = readsState;
+        renderedWidthsWritesState = writesState;
     }
     else if (node->isText() ) {
-        lString16 nodeText = node->getText();
+        lString16 nodeText = node->getTextRef().getText();
         int start = 0;
         int len = nodeText.length();
         if ( len == 0 )
@@ -8769,8 +8875,8 @@ void getRenderedWidths(ldomNode * node, int &maxWidth, int &minWidth, int direct
             printf("GRW text:  (dumb text size=%d)\n", node->getParentNode()->getFont()->getTextWidth(txt, len));
         #endif
         #define MAX_TEXT_CHUNK_SIZE 4096
-        static lUInt16 widths[MAX_TEXT_CHUNK_SIZE+1];
-        static lUInt8 flags[MAX_TEXT_CHUNK_SIZE+1];
+        static CR_THREAD_LOCAL lUInt16 widths[MAX_TEXT_CHUNK_SIZE+1];
+        static CR_THREAD_LOCAL lUInt8 flags[MAX_TEXT_CHUNK_SIZE+1];
         // We adjust below each word width with calls to getLeftSideBearing()
         // and getRightSideBearing(). These should be called with the exact same
         // parameters as used in lvtextfm.cpp getAdditionalCharWidth() and
@@ -27,6 +27,7 @@
 #include "../include/lvstream.h"
 #include "../include/lvptrvec.h"
 #include "../include/crtxtenc.h"
+#include "../include/crmemgov.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -52,6 +53,7 @@ extern "C" {
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <errno.h>
 #endif
 
 #ifdef _LINUX
@@ -1699,7 +1701,7 @@ public:
     }
 };
 
-class LVCachedStream : public LVNamedStream
+class LVCachedStream : public LVNamedStream, public CRMemoryConsumer
 {
 private:
 
@@ -1727,6 +1729,40 @@ private:
     BufItem *   m_tail;
     int         m_bufItems;
     int         m_bufLen;
+    int         m_defBufSize;
+    int         m_hits;
+    int         m_memoryLimit;
+    int         m_trimTarget;
+
+    /// frees least recently used items
+    void shrink( int maxItems )
+    {
+        while ( m_bufLen > maxItems && m_tail ) {
+            BufItem * item = m_tail;
+            m_tail = item->prev;
+            if ( m_tail )
+                m_tail->next = NULL;
+            else
+                m_head = NULL;
+            m_buf[ item->getIndex() ] = NULL;
+            delete item;
+            m_bufLen--;
+        }
+    }
+    /// applies limit and trim request of CRMemoryGovernor
+    void applyMemoryLimit()
+    {
+        int limit = CR_ATOMIC_LOAD( m_memoryLimit );
+        m_bufSize = limit ? (int)(limit / sizeof(BufItem)) : m_defBufSize;
+        if ( m_bufSize<3 )
+            m_bufSize = 3;
+        shrink( m_bufSize );
+        int trimTarget = CR_ATOMIC_LOAD( m_trimTarget );
+        if ( trimTarget >= 0 ) {
+            CR_ATOMIC_STORE( m_trimTarget, -1 );
+            shrink( (int)(trimTarget / sizeof(BufItem)) );
+        }
+    }
 
     /// add item to head
     BufItem * addNewItem( int start )
@@ -1859,7 +1895,7 @@ private:
 public:
 
     LVCachedStream( LVStreamRef stream, int bufSize ) : m_stream(stream), m_pos(0),
-            m_head(NULL), m_tail(NULL), m_bufLen(0)
+            m_head(NULL), m_tail(NULL), m_bufLen(0), m_hits(0), m_memoryLimit(0), m_trimTarget(-1)
     {
         m_size = m_stream->GetSize();
         m_bufItems = (int)((m_size + CACHE_BUF_BLOCK_SIZE - 1) >> CACHE_BUF_BLOCK_SHIFT);
@@ -1868,11 +1904,14 @@ public:
         m_bufSize = (bufSize + CACHE_BUF_BLOCK_SIZE - 1) >> CACHE_BUF_BLOCK_SHIFT;
         if (m_bufSize<3)
             m_bufSize = 3;
+        m_defBufSize = m_bufSize;
         m_buf = new BufItem* [m_bufItems]();
         SetName( stream->GetName() );
+        CRMemoryGovernor::addConsumer( this );
     }
     virtual ~LVCachedStream()
     {
+        CRMemoryGovernor::removeConsumer( this );
         if (m_buf)
         {
             for (int i=0; i<m_bufItems; i++)
@@ -1882,6 +1921,13 @@ public:
         }
     }
 
+    virtual CRMemorySubsystem getMemorySubsystem() { return CRMEM_STREAM_BUFFERS; }
+    virtual int getMemoryUsed() { return m_bufLen * (int)sizeof(BufItem); }
+    virtual int getMemoryHits() { return m_hits; }
+    virtual void setMemoryLimit( int limit ) { CR_ATOMIC_STORE( m_memoryLimit, limit ); }
+    /// frees buffers on next read: stream may be read by other thread now
+    virtual void trimMemory( int target ) { CR_ATOMIC_STORE( m_trimTarget, target ); }
+
     /// fastly return already known CRC
     virtual lverror_t getcrc32( lUInt32 & dst )
     {
@@ -1936,6 +1982,7 @@ public:
                 *pBytesRead = 0;
             return LVERR_FAIL;
         }
+        applyMemoryLimit();
         int startIndex = (int)(m_pos >> CACHE_BUF_BLOCK_SHIFT);
         int endIndex = (int)((m_pos + size - 1) >> CACHE_BUF_BLOCK_SHIFT);
         int count = endIndex - startIndex + 1;
@@ -1960,6 +2007,7 @@ public:
                     isz = dstsz;
                 memcpy( dst, item->buf + istart, isz );
                 flags[i - startIndex] = 1;
+                m_hits++;
             }
             dstsz -= CACHE_BUF_BLOCK_SIZE - istart;
             dst += CACHE_BUF_BLOCK_SIZE - istart;
@@ -3908,6 +3956,42 @@ bool LVFileExists( const lString16 & pathName )
 #endif
 }
 
+/// retrieves size and last modification time (seconds since epoch) of file, returns false if file not found
+bool LVGetFileInfo( const lString8 & pathName, lUInt64 & size, lUInt64 & mtime )
+{
+    return LVGetFileInfo(Utf8ToUnicode(pathName), size, mtime);
+}
+
+/// retrieves size and last modification time (seconds since epoch) of file, returns false if file not found
+bool LVGetFileInfo( const lString16 & pathName, lUInt64 & size, lUInt64 & mtime )
+{
+    size = 0;
+    mtime = 0;
+    if (pathName.length() > 1 && pathName[0] == ASSET_PATH_PREFIX)
+        return false;
+#if !defined(__SYMBIAN32__) && defined(_WIN32)
+    WIN32_FILE_ATTRIBUTE_DATA attrs;
+    if (!GetFileAttributesExW(pathName.c_str(), GetFileExInfoStandard, &attrs))
+        return false;
+    if (attrs.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+        return false;
+    size = ((lUInt64)attrs.nFileSizeHigh << 32) | attrs.nFileSizeLow;
+    lUInt64 ft = ((lUInt64)attrs.ftLastWriteTime.dwHighDateTime << 32) | attrs.ftLastWriteTime.dwLowDateTime;
+    // FILETIME is in 100ns units since 1601-01-01
+    mtime = ft / 10000000ULL - 11644473600ULL;
+    return true;
+#else
+    struct stat st;
+    if (stat(UnicodeToUtf8(pathName).c_str(), &st))
+        return false;
+    if (S_ISDIR(st.st_mode))
+        return false;
+    size = (lUInt64)st.st_size;
+    mtime = (lUInt64)st.st_mtime;
+    return true;
+#endif
+}
+
 /// returns true if directory exists and your app can write to directory
 bool LVDirectoryIsWritable(const lString16 & pathName) {
     lString16 fn = pathName;
@@ -4051,6 +4135,116 @@ bool LVRenameFile(lString8 oldname, lString8 newname) {
 #endif
 }
 
+#ifdef _WIN32
+LVFileLock::LVFileLock() : _handle(INVALID_HANDLE_VALUE), _locked(false)
+{
+}
+
+bool LVFileLock::open( const lString16 & pathname )
+{
+    close();
+    _handle = CreateFileW( pathname.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                           NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL );
+    return _handle != INVALID_HANDLE_VALUE;
+}
+
+void LVFileLock::close()
+{
+    if ( _handle == INVALID_HANDLE_VALUE )
+        return;
+    unlock();
+    CloseHandle( (HANDLE)_handle );
+    _handle = INVALID_HANDLE_VALUE;
+}
+
+bool LVFileLock::isOpen() const
+{
+    return _handle != INVALID_HANDLE_VALUE;
+}
+
+bool LVFileLock::lock( bool exclusive )
+{
+    if ( _handle == INVALID_HANDLE_VALUE )
+        return false;
+    unlock();
+    OVERLAPPED ov;
+    memset( &ov, 0, sizeof(ov) );
+    if ( !LockFileEx( (HANDLE)_handle, exclusive ? LOCKFILE_EXCLUSIVE_LOCK : 0, 0, 1, 0, &ov ) )
+        return false;
+    _locked = true;
+    return true;
+}
+
+void LVFileLock::unlock()
+{
+    if ( !_locked )
+        return;
+    OVERLAPPED ov;
+    memset( &ov, 0, sizeof(ov) );
+    UnlockFileEx( (HANDLE)_handle, 0, 1, 0, &ov );
+    _locked = false;
+}
+#else
+LVFileLock::LVFileLock() : _fd(-1), _locked(false)
+{
+}
+
+bool LVFileLock::open( const lString16 & pathname )
+{
+    close();
+    _fd = ::open( UnicodeToUtf8( pathname ).c_str(), O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH );
+    return _fd != -1;
+}
+
+void LVFileLock::close()
+{
+    if ( _fd == -1 )
+        return;
+    unlock();
+    ::close( _fd );
+    _fd = -1;
+}
+
+bool LVFileLock::isOpen() const
+{
+    return _fd != -1;
+}
+
+bool LVFileLock::lock( bool exclusive )
+{
+    if ( _fd == -1 )
+        return false;
+    struct flock fl;
+    memset( &fl, 0, sizeof(fl) );
+    fl.l_type = exclusive ? F_WRLCK : F_RDLCK;
+    fl.l_whence = SEEK_SET;
+    // F_SETLKW converts a lock already held by this process, no need to release it first
+    while ( fcntl( _fd, F_SETLKW, &fl ) == -1 ) {
+        if ( errno != EINTR )
+            return false;
+    }
+    _locked = true;
+    return true;
+}
+
+void LVFileLock::unlock()
+{
+    if ( !_locked )
+        return;
+    struct flock fl;
+    memset( &fl, 0, sizeof(fl) );
+    fl.l_type = F_UNLCK;
+    fl.l_whence = SEEK_SET;
+    fcntl( _fd, F_SETLK, &fl );
+    _locked = false;
+}
+#endif
+
+LVFileLock::~LVFileLock()
+{
+    close();
+}
+
 /// delete file, return true if file found and successfully deleted
 bool LVDeleteFile( lString8 filename ) {
     return LVDeleteFile(Utf8ToUnicode(filename));
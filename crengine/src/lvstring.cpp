@@ -12,6 +12,7 @@
 *******************************************************/
 
 #include "../include/lvstring.h"
+#include "../include/crlocks.h"
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
@@ -75,17 +76,21 @@ static int size_8 = 0;
 const lString8 & cs8(const char * str) {
     int index = (((int)((ptrdiff_t)str)) * CONST_STRING_BUFFER_HASH_MULT) & CONST_STRING_BUFFER_MASK;
     for (;;) {
-        const void * p = const_ptrs_8[index];
+        const void * p = CR_ATOMIC_LOAD(const_ptrs_8[index]);
         if (p == str) {
             return values_8[index];
         } else if (p == NULL) {
+            STRING_GUARD
+            // slot may be taken by another thread meanwhile: check it again
+            if (const_ptrs_8[index] != NULL)
+                continue;
 #if DEBUG_STATIC_STRING_ALLOC == 1
             CRLog::trace("allocating static string8 %s", str);
 #endif
-            const_ptrs_8[index] = str;
             size_8++;
             values_8[index] = lString8(str);
             values_8[index].addref();
+            CR_ATOMIC_STORE(const_ptrs_8[index], (const void *)str);
             return values_8[index];
         }
         if (size_8 > CONST_STRING_BUFFER_SIZE / 4) {
@@ -104,17 +109,21 @@ static int size_16 = 0;
 const lString16 & cs16(const char * str) {
     int index = (((int)((ptrdiff_t)str)) * CONST_STRING_BUFFER_HASH_MULT) & CONST_STRING_BUFFER_MASK;
     for (;;) {
-        const void * p = const_ptrs_16[index];
+        const void * p = CR_ATOMIC_LOAD(const_ptrs_16[index]);
         if (p == str) {
             return values_16[index];
         } else if (p == NULL) {
+            STRING_GUARD
+            // slot may be taken by another thread meanwhile: check it again
+            if (const_ptrs_16[index] != NULL)
+                continue;
 #if DEBUG_STATIC_STRING_ALLOC == 1
             CRLog::trace("allocating static string16 %s", str);
 #endif
-            const_ptrs_16[index] = str;
             size_16++;
             values_16[index] = lString16(str);
             values_16[index].addref();
+            CR_ATOMIC_STORE(const_ptrs_16[index], (const void *)str);
             return values_16[index];
         }
         if (size_16 > CONST_STRING_BUFFER_SIZE / 4) {
@@ -129,17 +138,21 @@ const lString16 & cs16(const char * str) {
 const lString16 & cs16(const lChar16 * str) {
     int index = (((int)((ptrdiff_t)str)) * CONST_STRING_BUFFER_HASH_MULT) & CONST_STRING_BUFFER_MASK;
     for (;;) {
-        const void * p = const_ptrs_16[index];
+        const void * p = CR_ATOMIC_LOAD(const_ptrs_16[index]);
         if (p == str) {
             return values_16[index];
         } else if (p == NULL) {
+            STRING_GUARD
+            // slot may be taken by another thread meanwhile: check it again
+            if (const_ptrs_16[index] != NULL)
+                continue;
 #if DEBUG_STATIC_STRING_ALLOC == 1
             CRLog::trace("allocating static string16 %s", LCSTR(str));
 #endif
-            const_ptrs_16[index] = str;
             size_16++;
             values_16[index] = lString16(str);
             values_16[index].addref();
+            CR_ATOMIC_STORE(const_ptrs_16[index], (const void *)str);
             return values_16[index];
         }
         if (size_16 > CONST_STRING_BUFFER_SIZE / 4) {
@@ -690,7 +703,7 @@ lString16 & lString16::assign(const lChar16 * str)
     else
     {
         size_type len = _lStr_len(str);
-        if (pchunk->nref==1)
+        if (CR_ATOMIC_LOAD(pchunk->nref)==1)
         {
             if (pchunk->size<=len)
             {
@@ -719,7 +732,7 @@ lString16 & lString16::assign(const lChar8 * str)
     else
     {
         size_type len = _lStr_len(str);
-        if (pchunk->nref==1)
+        if (CR_ATOMIC_LOAD(pchunk->nref)==1)
         {
             if (pchunk->size<=len)
             {
@@ -748,7 +761,7 @@ lString16 & lString16::assign(const lChar16 * str, size_type count)
     else
     {
         size_type len = _lStr_nlen(str, count);
-        if (pchunk->nref==1)
+        if (CR_ATOMIC_LOAD(pchunk->nref)==1)
         {
             if (pchunk->size<=len)
             {
@@ -777,7 +790,7 @@ lString16 & lString16::assign(const lChar8 * str, size_type count)
     else
     {
         size_type len = _lStr_nlen(str, count);
-        if (pchunk->nref==1)
+        if (CR_ATOMIC_LOAD(pchunk->nref)==1)
         {
             if (pchunk->size<=len)
             {
@@ -822,7 +835,7 @@ lString16 & lString16::assign(const lString16 & str, size_type offset, size_type
         }
         else
         {
-            if (pchunk->nref==1)
+            if (CR_ATOMIC_LOAD(pchunk->nref)==1)
             {
                 if (pchunk->size<=count)
                 {
@@ -855,7 +868,7 @@ lString16 & lString16::erase(size_type offset, size_type count)
     else
     {
         size_type newlen = length()-count;
-        if (pchunk->nref==1)
+        if (CR_ATOMIC_LOAD(pchunk->nref)==1)
         {
             _lStr_memcpy( pchunk->buf16+offset, pchunk->buf16+offset+count, newlen-offset+1 );
         }
@@ -875,7 +888,7 @@ lString16 & lString16::erase(size_type offset, size_type count)
 
 void lString16::reserve(size_type n)
 {
-    if (pchunk->nref==1)
+    if (CR_ATOMIC_LOAD(pchunk->nref)==1)
     {
         if (pchunk->size < n)
         {
@@ -895,7 +908,7 @@ void lString16::reserve(size_type n)
 
 void lString16::lock( size_type newsize )
 {
-    if (pchunk->nref>1)
+    if (CR_ATOMIC_LOAD(pchunk->nref)>1)
     {
         lstring_chunk_t * poldchunk = pchunk;
         release();
@@ -912,7 +925,7 @@ void lString16::lock( size_type newsize )
 // lock string, allocate buffer and reset length to 0
 void lString16::reset( size_type size )
 {
-    if (pchunk->nref>1 || pchunk->size<size)
+    if (CR_ATOMIC_LOAD(pchunk->nref)>1 || pchunk->size<size)
     {
         release();
         alloc( size );
@@ -1041,7 +1054,7 @@ lString16 & lString16::pack()
 {
     if (pchunk->len + 4 < pchunk->size )
     {
-        if (pchunk->nref>1)
+        if (CR_ATOMIC_LOAD(pchunk->nref)>1)
         {
             lock(pchunk->len);
         }
@@ -1078,7 +1091,7 @@ lString16 & lString16::trimNonAlpha()
     int newlen = lastns-firstns+1;
     if (newlen == pchunk->len)
         return *this;
-    if (pchunk->nref == 1)
+    if (CR_ATOMIC_LOAD(pchunk->nref) == 1)
     {
         if (firstns>0)
             lStr_memcpy( pchunk->buf16, pchunk->buf16+firstns, newlen );
@@ -1116,7 +1129,7 @@ lString16 & lString16::trim()
     int newlen = lastns-firstns+1;
     if (newlen == pchunk->len)
         return *this;
-    if (pchunk->nref == 1)
+    if (CR_ATOMIC_LOAD(pchunk->nref) == 1)
     {
         if (firstns>0)
             lStr_memcpy( pchunk->buf16, pchunk->buf16+firstns, newlen );
@@ -1764,7 +1777,7 @@ lString8 & lString8::assign(const lChar8 * str)
     else
     {
         size_type len = _lStr_len(str);
-        if (pchunk->nref==1)
+        if (CR_ATOMIC_LOAD(pchunk->nref)==1)
         {
             if (pchunk->size<=len)
             {
@@ -1793,7 +1806,7 @@ lString8 & lString8::assign(const lChar8 * str, size_type count)
     else
     {
         size_type len = _lStr_nlen(str, count);
-        if (pchunk->nref==1)
+        if (CR_ATOMIC_LOAD(pchunk->nref)==1)
         {
             if (pchunk->size<=len)
             {
@@ -1838,7 +1851,7 @@ lString8 & lString8::assign(const lString8 & str, size_type offset, size_type co
         }
         else
         {
-            if (pchunk->nref==1)
+            if (CR_ATOMIC_LOAD(pchunk->nref)==1)
             {
                 if (pchunk->size<=count)
                 {
@@ -1871,7 +1884,7 @@ lString8 & lString8::erase(size_type offset, size_type count)
     else
     {
         size_type newlen = length()-count;
-        if (pchunk->nref==1)
+        if (CR_ATOMIC_LOAD(pchunk->nref)==1)
         {
             _lStr_memcpy( pchunk->buf8+offset, pchunk->buf8+offset+count, newlen-offset+1 );
         }
@@ -1891,7 +1904,7 @@ lString8 & lString8::erase(size_type offset, size_type count)
 
 void lString8::reserve(size_type n)
 {
-    if (pchunk->nref==1)
+    if (CR_ATOMIC_LOAD(pchunk->nref)==1)
     {
         if (pchunk->size < n)
         {
@@ -1911,7 +1924,7 @@ void lString8::reserve(size_type n)
 
 void lString8::lock( size_type newsize )
 {
-    if (pchunk->nref>1)
+    if (CR_ATOMIC_LOAD(pchunk->nref)>1)
     {
         lstring_chunk_t * poldchunk = pchunk;
         release();
@@ -1928,7 +1941,7 @@ void lString8::lock( size_type newsize )
 // lock string, allocate buffer and reset length to 0
 void lString8::reset( size_type size )
 {
-    if (pchunk->nref>1 || pchunk->size<size)
+    if (CR_ATOMIC_LOAD(pchunk->nref)>1 || pchunk->size<size)
     {
         release();
         alloc( size );
@@ -2381,7 +2394,7 @@ lString8 & lString8::pack()
 {
     if (pchunk->len + 4 < pchunk->size )
     {
-        if (pchunk->nref>1)
+        if (CR_ATOMIC_LOAD(pchunk->nref)>1)
         {
             lock(pchunk->len);
         }
@@ -2418,7 +2431,7 @@ lString8 & lString8::trim()
     int newlen = (int)(lastns - firstns + 1);
     if (newlen == pchunk->len)
         return *this;
-    if (pchunk->nref == 1)
+    if (CR_ATOMIC_LOAD(pchunk->nref) == 1)
     {
         if (firstns>0)
             lStr_memcpy( pchunk->buf8, pchunk->buf8+firstns, newlen );
@@ -3103,6 +3116,32 @@ lString16 Utf8ToUnicode( const char * s, int sz ) {
     return dst;
 }
 
+int Utf8FragmentCharCount( const char * s, int sz )
+{
+    int count = 0;
+    for ( const char * end = s + sz; s < end; ) {
+        // invalid byte 0x80 is decoded as 0 too, but counted as Utf8CharCount() does
+        const char * p = s;
+        if ( Utf8NextChar( s, end ) || (lUInt8)*p == 0x80 )
+            count++;
+    }
+    return count;
+}
+
+void Utf8ToUnicode( const char * s, int sz, lString16 & dst )
+{
+    int len = Utf8FragmentCharCount( s, sz );
+    if ( !len ) {
+        dst.clear();
+        return;
+    }
+    dst.reset( len );
+    dst.append( len, (lChar16)0 );
+    lChar16 * p = dst.modify();
+    const char * end = s + sz;
+    for ( int i=0; i<len; i++ )
+        p[i] = Utf8NextChar( s, end );
+}
 
 lString8 UnicodeToUtf8(const lChar16 * s, int count)
 {
@@ -4542,7 +4581,12 @@ protected:
         int memusage = 0;
 #endif
 #endif
+#if (CR_CONCURRENT_DOCUMENTS==1) && !defined(_WIN32)
+        tm btbuf;
+        tm * bt = localtime_r(&t, &btbuf);
+#else
         tm * bt = localtime(&t);
+#endif
 #if LOG_HEAP_USAGE
         fprintf(f, "%04d/%02d/%02d %02d:%02d:%02d.%04d [%d] %s ", bt->tm_year+1900, bt->tm_mon+1, bt->tm_mday, bt->tm_hour, bt->tm_min, bt->tm_sec, ms/100, memusage, level);
 #else
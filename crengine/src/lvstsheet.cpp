@@ -18,6 +18,7 @@
 #include "../include/fb2def.h"
 #include "../include/lvstream.h"
 #include "../include/lvrend.h"   // for -cr-only-if:
+#include "../include/crtest.h"
 
 // define to dump all tokens
 //#define DUMP_CSS_PARSING
@@ -2837,6 +2838,14 @@ bool parse_attr_value( const char * &str, char * buf, char stop_char=']' )
     return parse_attr_value( str, buf, parse_trailing_i, stop_char );
 }
 
+/// layer parsed on this thread: records names resolved by document
+static CR_THREAD_LOCAL LVStyleSheetLayer * css_parsingLayer = NULL;
+
+/// number of recently parsed layers kept for reuse
+#define CSS_LAYER_CACHE_SIZE 32
+/// recently parsed layers, most recently used last
+static LVArray<LVStyleSheetLayerRef> css_layerCache;
+
 LVCssSelectorRule * parse_attr( const char * &str, lxmlDocBase * doc )
 {
     // We should not skip_spaces() here: it's invalid just after one of '.#:'
@@ -2892,6 +2901,8 @@ LVCssSelectorRule * parse_attr( const char * &str, lxmlDocBase * doc )
             // Pseudoclasses after csspc_last_child can't be accurately checked
             // in the initial loading phase: a re-render will be needed.
             doc->setNodeStylesInvalidIfLoading();
+            if ( css_parsingLayer )
+                css_parsingLayer->setInvalidatesLoadingStyles();
             // There might still be some issues if CSS would set some display: property
             // as, when re-rendering, a cache might be present and prevent modifying
             // the DOM for some needed autoBoxing - or the invalid styles set now
@@ -2989,7 +3000,10 @@ LVCssSelectorRule * parse_attr( const char * &str, lxmlDocBase * doc )
     if (parse_trailing_i) { // cssrt_attr*_i met
         s.lowercase();
     }
-    lUInt16 id = doc->getAttrNameIndex( lString16(attrname).c_str() );
+    lString16 name( attrname );
+    lUInt16 id = doc->getAttrNameIndex( name.c_str() );
+    if ( css_parsingLayer )
+        css_parsingLayer->addName( name, id, true );
     rule->setAttr(id, s);
     return rule;
 }
@@ -3063,6 +3077,8 @@ bool LVCssSelector::parse( const char * &str, lxmlDocBase * doc )
                 element = element.lowercase();
             }
             _id = doc->getElementNameIndex( element.c_str() );
+            if ( css_parsingLayer )
+                css_parsingLayer->addName( element, _id, false );
                 // Note: non standard element names (not listed in fb2def.h) in
                 // selectors (eg: blah {font-style: italic}) may have different values
                 // returned by getElementNameIndex() across book loadings, and cause:
@@ -3183,59 +3199,95 @@ LVCssSelector::LVCssSelector( LVCssSelector & v )
         _rules = new LVCssSelectorRule( *v._rules );
 }
 
-void LVStyleSheet::set(LVPtrVector<LVCssSelector> & v  )
+LVStyleSheet::LVStyleSheet( LVStyleSheet & sheet )
+:   _doc( sheet._doc ), _layers( sheet._layers ), _stack( sheet._stack ), _mergedValid( false )
 {
-    _selectors.clear();
-    if ( !v.size() )
-        return;
-    _selectors.reserve( v.size() );
-    for ( int i=0; i<v.size(); i++ ) {
-        LVCssSelector * selector = v[i];
-        if ( selector )
-            _selectors.add( new LVCssSelector( *selector ) );
-        else
-            _selectors.add( NULL );
+}
+
+bool LVStyleSheet::pop()
+{
+    if ( !_stack.length() )
+        return false;
+    int count = _stack.remove( _stack.length() - 1 );
+    if ( count < _layers.length() ) {
+        // release layers, erase() keeps items past the end
+        for ( int i=count; i<_layers.length(); i++ )
+            _layers[i].Clear();
+        _layers.erase( count, _layers.length() - count );
+        _mergedValid = false;
     }
+    return true;
 }
 
-LVStyleSheet::LVStyleSheet( LVStyleSheet & sheet )
-:   _doc( sheet._doc )
+/// merges selector chains of all layers: ties in specificity keep layer order
+void LVStyleSheet::merge()
 {
-    set( sheet._selectors );
+    int idCount = 0;
+    for ( int k=0; k<_layers.length(); k++ ) {
+        if ( idCount < _layers[k]->_selectors.length() )
+            idCount = _layers[k]->_selectors.length();
+    }
+    _merged.reset();
+    _mergedStart.reset();
+    for ( int id=0; id<idCount; id++ ) {
+        int start = _merged.length();
+        _mergedStart.add( start );
+        for ( int k=0; k<_layers.length(); k++ ) {
+            LVPtrVector <LVCssSelector> & selectors = _layers[k]->_selectors;
+            if ( id >= selectors.length() )
+                continue;
+            for ( LVCssSelector * p = selectors[id]; p; p = p->getNext() ) {
+                // insert after selectors of same or lower specificity: chains are sorted, so it is usually the end
+                int pos = _merged.length();
+                while ( pos > start && _merged[pos - 1]->getSpecificity() > p->getSpecificity() )
+                    pos--;
+                _merged.insert( pos, p );
+            }
+        }
+    }
+    _mergedStart.add( _merged.length() );
+    _mergedValid = true;
 }
 
 void LVStyleSheet::apply( const ldomNode * node, css_style_rec_t * style )
 {
-    if (!_selectors.length())
+    if ( !_mergedValid )
+        merge();
+    int idCount = _mergedStart.length() - 1;
+    if ( idCount <= 0 )
         return; // no rules!
         
     lUInt16 id = node->getNodeId();
     
-    LVCssSelector * selector_0 = _selectors[0];
-    LVCssSelector * selector_id = id>0 && id<_selectors.length() ? _selectors[id] : NULL;
+    LVCssSelector ** selectors = _merged.get();
+    int i0 = _mergedStart[0];
+    int end0 = _mergedStart[1];
+    int iid = 0;
+    int endid = 0;
+    if ( id>0 && id<idCount ) {
+        iid = _mergedStart[id];
+        endid = _mergedStart[id + 1];
+    }
 
     for (;;)
     {
-        if (selector_0!=NULL)
+        if ( i0 < end0 )
         {
-            if (selector_id==NULL || selector_0->getSpecificity() < selector_id->getSpecificity() )
+            if ( iid == endid || selectors[i0]->getSpecificity() < selectors[iid]->getSpecificity() )
             {
                 // step by sel_0
-                selector_0->apply( node, style );
-                selector_0 = selector_0->getNext();
+                selectors[i0++]->apply( node, style );
             }
             else
             {
                 // step by sel_id
-                selector_id->apply( node, style );
-                selector_id = selector_id->getNext();
+                selectors[iid++]->apply( node, style );
             }
         }
-        else if (selector_id!=NULL)
+        else if ( iid < endid )
         {
             // step by sel_id
-            selector_id->apply( node, style );
-            selector_id = selector_id->getNext();
+            selectors[iid++]->apply( node, style );
         }
         else
         {
@@ -3256,11 +3308,12 @@ lUInt32 LVCssSelectorRule::getHash()
 
 lUInt32 LVCssSelector::getHash()
 {
-    lUInt32 hash = 0;
-    lUInt32 nextHash = 0;
+    return getHash( _next ? _next->getHash() : 0 );
+}
 
-    if (_next)
-        nextHash = _next->getHash();
+lUInt32 LVCssSelector::getHash( lUInt32 nextHash )
+{
+    lUInt32 hash = 0;
     for (LVCssSelectorRule * p = _rules; p; p = p->getNext()) {
         lUInt32 ruleHash = p->getHash();
         hash = hash * 31 + ruleHash;
@@ -3275,16 +3328,66 @@ lUInt32 LVCssSelector::getHash()
 /// calculate hash
 lUInt32 LVStyleSheet::getHash()
 {
+    LVArray<lUInt32> hashes;
+    getSelectorHashes( hashes );
     lUInt32 hash = 0;
-    for ( int i=0; i<_selectors.length(); i++ ) {
-        if ( _selectors[i] )
-            hash = hash * 31 + _selectors[i]->getHash() + i*15324;
+    for ( int i=0; i<hashes.length(); i++ ) {
+        if ( _mergedStart[i] < _mergedStart[i + 1] )
+            hash = hash * 31 + hashes[i] + i*15324;
     }
     return hash;
 }
 
-bool LVStyleSheet::parse( const char * str, bool higher_importance, lString16 codeBase )
+/// calculate hash of each selector chain, indexed by element name id (0 is for universal selectors)
+void LVStyleSheet::getSelectorHashes( LVArray<lUInt32> & hashes )
+{
+    if ( !_mergedValid )
+        merge();
+    hashes.clear();
+    for ( int i=0; i+1<_mergedStart.length(); i++ ) {
+        // same value as hash of selector chain of merged layers
+        lUInt32 hash = 0;
+        for ( int k=_mergedStart[i + 1] - 1; k >= _mergedStart[i]; k-- )
+            hash = _merged[k]->getHash( hash );
+        hashes.add( hash );
+    }
+}
+
+LVStyleSheetLayerRef LVStyleSheet::parseLayer( const char * str, bool higher_importance, lString16 codeBase )
 {
+    lString8 css( str );
+    lUInt32 cssHash = css.getHash();
+    int renderingFlags = gRenderBlockRenderingFlags;
+    int docFormat = _doc ? _doc->getProps()->getIntDef( DOC_PROP_FILE_FORMAT_ID, doc_format_none ) : -1;
+    // requested DOM version changes parsing of some declarations
+    int domVersion = gDOMVersionRequested;
+    {
+        STYLESHEET_GUARD
+        for ( int i=css_layerCache.length()-1; i>=0; i-- ) {
+            LVStyleSheetLayerRef layer = css_layerCache[i];
+            if ( layer->_cssHash != cssHash || layer->_higherImportance != higher_importance
+                    || layer->_renderingFlags != renderingFlags || layer->_docFormat != docFormat
+                    || layer->_domVersion != domVersion
+                    || layer->_codeBase != codeBase || layer->_css != css || !layer->isValidFor( _doc ) )
+                continue;
+            // most recently used layers are at the end
+            css_layerCache.erase( i, 1 );
+            css_layerCache.add( layer );
+            if ( layer->_invalidatesLoadingStyles && _doc )
+                _doc->setNodeStylesInvalidIfLoading();
+            return layer;
+        }
+    }
+    LVStyleSheetLayerRef layer( new LVStyleSheetLayer() );
+    layer->_css = css;
+    layer->_cssHash = cssHash;
+    layer->_higherImportance = higher_importance;
+    layer->_codeBase = codeBase;
+    layer->_renderingFlags = renderingFlags;
+    layer->_docFormat = docFormat;
+    layer->_domVersion = domVersion;
+    LVPtrVector <LVCssSelector> & _selectors = layer->_selectors;
+    css_parsingLayer = layer.get();
     LVCssSelector * selector = NULL;
     LVCssSelector * prev_selector;
     int err_count = 0;
@@ -3373,9 +3476,75 @@ bool LVStyleSheet::parse( const char * str, bool higher_importance, lString16 co
             }
         }
     }
-    return _selectors.length() > 0;
+    css_parsingLayer = NULL;
+    if ( !_selectors.length() )
+        return LVStyleSheetLayerRef();
+    STYLESHEET_GUARD
+    if ( css_layerCache.length() >= CSS_LAYER_CACHE_SIZE )
+        css_layerCache.erase( 0, 1 );
+    css_layerCache.add( layer );
+    return layer;
+}
+
+bool LVStyleSheet::parse( const char * str, bool higher_importance, lString16 codeBase )
+{
+    LVStyleSheetLayerRef layer = parseLayer( str, higher_importance, codeBase );
+    if ( !layer.isNull() ) {
+        _layers.add( layer );
+        _mergedValid = false;
+    }
+    return _layers.length() > 0;
+}
+
+void LVStyleSheet::clearLayerCache()
+{
+    STYLESHEET_GUARD
+    css_layerCache.clear();
+}
+
+void LVStyleSheetLayer::addName( const lString16 & name, lUInt16 id, bool isAttr )
+{
+    _names.add( name );
+    _nameIds.add( isAttr ? id + 0x10000 : id );
+}
+
+bool LVStyleSheetLayer::isValidFor( lxmlDocBase * doc )
+{
+    if ( !doc )
+        return _names.length() == 0;
+    // ids of names not listed in fb2def.h depend on names registered by document before
+    for ( int i=0; i<_names.length(); i++ ) {
+        int id = _nameIds[i] >= 0x10000 ? doc->getAttrNameIndex( _names[i].c_str() ) + 0x10000
+                                        : doc->getElementNameIndex( _names[i].c_str() );
+        if ( id != _nameIds[i] )
+            return false;
+    }
+    return true;
+}
+
+void runStyleSheetUnitTests()
+{
+    CRLog::info("runStyleSheetUnitTests()");
+    static const char * css = "li { display: list-item } "
+        "p { cr-ignore-if-dom-version-greater-or-equal: 20180524; text-indent: 1em }";
+    int oldVersion = gDOMVersionRequested;
+    ldomDocument * doc = new ldomDocument();
+    LVStyleSheet legacy( doc );
+    gDOMVersionRequested = 20171225;
+    legacy.parse( css );
+    LVStyleSheet current( doc );
+    LVStyleSheet again( doc );
+    gDOMVersionRequested = 20180524;
+    current.parse( css );
+    again.parse( css );
+    gDOMVersionRequested = oldVersion;
+    MYASSERT( legacy.getHash() != current.getHash(), "same CSS parsed under other DOM version" );
+    MYASSERT( again.getHash() == current.getHash(), "same CSS parsed under same DOM version" );
+    delete doc;
+    CRLog::info("runStyleSheetUnitTests() finished");
 }
 
+
 /// extract @import filename from beginning of CSS
 bool LVProcessStyleSheetImport( const char * &str, lString8 & import_file )
 {
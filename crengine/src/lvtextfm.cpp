@@ -290,7 +290,7 @@ void lvtextAddSourceObject(
 
 #define DUMMY_IMAGE_SIZE 16
 
-bool gFlgFloatingPunctuationEnabled = true;
+CR_THREAD_LOCAL bool gFlgFloatingPunctuationEnabled = true;
 
 void LFormattedText::AddSourceObject(
             lUInt32         flags,     /* flags */
@@ -379,7 +379,7 @@ public:
     int       m_length;
     int       m_size;
     bool      m_staticBufs;
-    static bool      m_staticBufs_inUse;
+    static CR_THREAD_LOCAL bool m_staticBufs_inUse;
     lChar16 * m_text;
     lUInt16 * m_flags;
     src_text_fragment_t * * m_srcs;
@@ -853,15 +853,15 @@ public:
             m_staticBufs = false;
         } else {
             // static buffer space
-            static lChar16 m_static_text[STATIC_BUFS_SIZE];
-            static lUInt16 m_static_flags[STATIC_BUFS_SIZE];
-            static src_text_fragment_t * m_static_srcs[STATIC_BUFS_SIZE];
-            static lUInt16 m_static_charindex[STATIC_BUFS_SIZE];
-            static int m_static_widths[STATIC_BUFS_SIZE];
+            static CR_THREAD_LOCAL lChar16 m_static_text[STATIC_BUFS_SIZE];
+            static CR_THREAD_LOCAL lUInt16 m_static_flags[STATIC_BUFS_SIZE];
+            static CR_THREAD_LOCAL src_text_fragment_t * m_static_srcs[STATIC_BUFS_SIZE];
+            static CR_THREAD_LOCAL lUInt16 m_static_charindex[STATIC_BUFS_SIZE];
+            static CR_THREAD_LOCAL int m_static_widths[STATIC_BUFS_SIZE];
             #if (USE_FRIBIDI==1)
-                static FriBidiCharType m_static_bidi_ctypes[STATIC_BUFS_SIZE];
-                static FriBidiBracketType m_static_bidi_btypes[STATIC_BUFS_SIZE];
-                static FriBidiLevel m_static_bidi_levels[STATIC_BUFS_SIZE];
+                static CR_THREAD_LOCAL FriBidiCharType m_static_bidi_ctypes[STATIC_BUFS_SIZE];
+                static CR_THREAD_LOCAL FriBidiBracketType m_static_bidi_btypes[STATIC_BUFS_SIZE];
+                static CR_THREAD_LOCAL FriBidiLevel m_static_bidi_levels[STATIC_BUFS_SIZE];
             #endif
             m_text = m_static_text;
             m_flags = m_static_flags;
@@ -1325,8 +1325,8 @@ public:
         const lChar16 * str = srcline->t.text + word->t.start;
         // Avoid malloc by using static buffers. Returns false if word too long.
         #define MAX_MEASURED_WORD_SIZE 127
-        static lUInt16 widths[MAX_MEASURED_WORD_SIZE+1];
-        static lUInt8 flags[MAX_MEASURED_WORD_SIZE+1];
+        static CR_THREAD_LOCAL lUInt16 widths[MAX_MEASURED_WORD_SIZE+1];
+        static CR_THREAD_LOCAL lUInt8 flags[MAX_MEASURED_WORD_SIZE+1];
         if (word->t.len > MAX_MEASURED_WORD_SIZE)
             return false;
         lUInt32 hints = WORD_FLAGS_TO_FNT_FLAGS(word->flags);
@@ -1353,8 +1353,8 @@ public:
         int start = 0;
         int lastWidth = 0;
         #define MAX_TEXT_CHUNK_SIZE 4096
-        static lUInt16 widths[MAX_TEXT_CHUNK_SIZE+1];
-        static lUInt8 flags[MAX_TEXT_CHUNK_SIZE+1];
+        static CR_THREAD_LOCAL lUInt16 widths[MAX_TEXT_CHUNK_SIZE+1];
+        static CR_THREAD_LOCAL lUInt8 flags[MAX_TEXT_CHUNK_SIZE+1];
         int tabIndex = -1;
         #if (USE_FRIBIDI==1)
             FriBidiLevel lastBidiLevel = 0;
@@ -1879,11 +1879,11 @@ public:
                 printf("CRE WARNING: bidi processing line overflow (%d > %d)\n", end-start, MAX_LINE_SIZE);
                 end = start + MAX_LINE_SIZE;
             }
-            static lChar16 bidi_tmp_text[MAX_LINE_SIZE];
-            static lUInt16 bidi_tmp_flags[MAX_LINE_SIZE];
-            static src_text_fragment_t * bidi_tmp_srcs[MAX_LINE_SIZE];
-            static lUInt16 bidi_tmp_charindex[MAX_LINE_SIZE];
-            static int     bidi_tmp_widths[MAX_LINE_SIZE];
+            static CR_THREAD_LOCAL lChar16 bidi_tmp_text[MAX_LINE_SIZE];
+            static CR_THREAD_LOCAL lUInt16 bidi_tmp_flags[MAX_LINE_SIZE];
+            static CR_THREAD_LOCAL src_text_fragment_t * bidi_tmp_srcs[MAX_LINE_SIZE];
+            static CR_THREAD_LOCAL lUInt16 bidi_tmp_charindex[MAX_LINE_SIZE];
+            static CR_THREAD_LOCAL int     bidi_tmp_widths[MAX_LINE_SIZE];
             // Map of string indices which is reordered to reflect where each
             // glyph ends up. Note that fribidi will access it starting
             // from 0 (and not from 'start'): this would need us to allocate
@@ -1893,7 +1893,7 @@ public:
             // if some other part than [start:end] would be accessed, but
             // we know fribid doesn't - by contract as it shouldn't reorder
             // any other part except between start:end).
-            static FriBidiStrIndex bidi_indices_map[MAX_LINE_SIZE];
+            static CR_THREAD_LOCAL FriBidiStrIndex bidi_indices_map[MAX_LINE_SIZE];
             for (int i=start; i<end; i++) {
                 bidi_indices_map[i-start] = i;
             }
@@ -3105,7 +3105,7 @@ public:
                     // flags on our upgraded (from lUInt8 to lUInt16) m_flags.
                     lUInt8 * flags = (lUInt8*) (m_flags + start);
                     // Fill static array with cumulative widths relative to word start
-                    static lUInt16 widths[MAX_WORD_SIZE];
+                    static CR_THREAD_LOCAL lUInt16 widths[MAX_WORD_SIZE];
                     int wordStart_w = start>0 ? m_widths[start-1] : 0;
                     for ( int i=0; i<len; i++ ) {
                         widths[i] = m_widths[start+i] - wordStart_w;
@@ -3329,7 +3329,7 @@ public:
     }
 };
 
-bool LVFormatter::m_staticBufs_inUse = false;
+CR_THREAD_LOCAL bool LVFormatter::m_staticBufs_inUse = false;
 
 static void freeFrmLines( formatted_text_fragment_t * m_pbuffer )
 {
@@ -67,7 +67,7 @@ int gDOMVersionRequested     = DOM_VERSION_CURRENT;
 
 /// change in case of incompatible changes in swap/cache file format to avoid using incompatible swap file
 // increment to force complete reload/reparsing of old file
-#define CACHE_FILE_FORMAT_VERSION "3.05.33k"
+#define CACHE_FILE_FORMAT_VERSION "3.05.35k"
 /// increment following value to force re-formatting of old book after load
 #define FORMATTING_VERSION_ID 0x001D
 
@@ -199,6 +199,8 @@ enum CacheFileBlockType {
 #include "../include/chmfmt.h"
 #endif
 #include "../include/crtest.h"
+#include "../include/crtrace.h"
+#include "../include/crconcurrent.h"
 #include <stddef.h>
 #include <math.h>
 #include <zlib.h>
@@ -233,6 +235,7 @@ ldomDocument * ldomNode::_documentInstances[MAX_DOCUMENT_INSTANCE_COUNT] = {NULL
 /// adds document to list, returns ID of allocated document, -1 if no space in instance array
 int ldomNode::registerDocument( ldomDocument * doc )
 {
+    DOCUMENT_GUARD
     for ( int i=0; i<MAX_DOCUMENT_INSTANCE_COUNT; i++ ) {
         if ( _nextDocumentIndex<0 || _nextDocumentIndex>=MAX_DOCUMENT_INSTANCE_COUNT )
             _nextDocumentIndex = 0;
@@ -249,6 +252,7 @@ int ldomNode::registerDocument( ldomDocument * doc )
 /// removes document from list
 void ldomNode::unregisterDocument( ldomDocument * doc )
 {
+    DOCUMENT_GUARD
     for ( int i=0; i<MAX_DOCUMENT_INSTANCE_COUNT; i++ ) {
         if ( _documentInstances[i]==doc ) {
             CRLog::info("ldomNode::unregisterDocument() - for index %d", i);
@@ -526,8 +530,16 @@ public:
     bool write( lUInt16 type, lUInt16 dataIndex, const lUInt8 * buf, int size, bool compress );
     /// reads and allocates block in memory
     bool read( lUInt16 type, lUInt16 dataIndex, lUInt8 * &buf, int &size );
+    /// returns size of block data once read, -1 if there is no such block
+    int getDataSize( lUInt16 type, lUInt16 dataIndex );
     /// reads and validates block
     bool validate( CacheFileItem * block );
+    /// reads block and checks its size and CRC without unpacking, false if there is no such block
+    bool validate( lUInt16 type, lUInt16 dataIndex )
+    {
+        CacheFileItem * block = findBlock( type, dataIndex );
+        return block && block->validate( _size ) && validate( block );
+    }
     /// writes content of serial buffer
     bool write( lUInt16 type, lUInt16 index, SerialBuf & buf, bool compress );
     /// reads content of serial buffer
@@ -799,6 +811,15 @@ CacheFileItem * CacheFile::findBlock( lUInt16 type, lUInt16 index )
     return existing;
 }
 
+/// returns size of block data once read, -1 if there is no such block
+int CacheFile::getDataSize( lUInt16 type, lUInt16 dataIndex )
+{
+    CacheFileItem * block = findBlock( type, dataIndex );
+    if ( !block )
+        return -1;
+    return block->_uncompressedSize ? (int)block->_uncompressedSize : block->_dataSize;
+}
+
 // allocates index record for block, sets its new size
 CacheFileItem * CacheFile::allocBlock( lUInt16 type, lUInt16 index, int size )
 {
@@ -1318,472 +1339,192 @@ LVStreamRef ldomBlobCache::getBlob( lString16 name )
 }
 
 #if BUILD_LITE!=1
-//#define DEBUG_RENDER_RECT_ACCESS
-#ifdef DEBUG_RENDER_RECT_ACCESS
-  static signed char render_rect_flags[200000]={0};
-  static void rr_lock( ldomNode * node )
-  {
-    int index = node->getDataIndex()>>4;
-    CRLog::debug("RenderRectAccessor(%d) lock", index );
-    if ( render_rect_flags[index] )
-        crFatalError(123, "render rect accessor: cannot get lock");
-    render_rect_flags[index] = 1;
-  }
-  static void rr_unlock( ldomNode * node )
-  {
-    int index = node->getDataIndex()>>4;
-    CRLog::debug("RenderRectAccessor(%d) lock", index );
-    if ( !render_rect_flags[index] )
-        crFatalError(123, "render rect accessor: unlock w/o lock");
-    render_rect_flags[index] = 0;
-  }
-#endif
-
-RenderRectAccessor::RenderRectAccessor( ldomNode * node )
-: _node(node), _modified(false), _dirty(false)
+void RenderRectAccessor::attach( ldomNode * node )
 {
-#ifdef DEBUG_RENDER_RECT_ACCESS
-    rr_lock( _node );
-#endif
-    _node->getRenderData(*this);
+    _node = node;
+    _rec = _node->pinRenderData( _chunk );
+    if ( !_rec )
+        _rec = new lvdomElementFormatRec(); // changes are not stored for non-element
 }
 
-RenderRectAccessor::~RenderRectAccessor()
+void RenderRectAccessor::detach()
 {
-    if ( _modified )
-        _node->setRenderData(*this);
-#ifdef DEBUG_RENDER_RECT_ACCESS
-    if ( !_dirty )
-        rr_unlock( _node );
-#endif
+    if ( _chunk )
+        _node->unpinRenderData( _chunk );
+    else
+        delete _rec;
 }
 
-void RenderRectAccessor::clear()
+void RenderRectAccessor::modified()
 {
-    lvdomElementFormatRec::clear(); // will clear every field
-    _modified = true;
-    _dirty = false;
+    if ( _chunk )
+        _chunk->modified();
 }
 
-void RenderRectAccessor::push()
+RenderRectAccessor::RenderRectAccessor( ldomNode * node )
 {
-    if ( _modified ) {
-        _node->setRenderData(*this);
-        _modified = false;
-        _dirty = true;
-        #ifdef DEBUG_RENDER_RECT_ACCESS
-            rr_unlock( _node );
-        #endif
-    }
+    attach( node );
 }
 
-void RenderRectAccessor::setX( int x )
-{
-    if ( _dirty ) {
-        _dirty = false;
-        _node->getRenderData(*this);
-#ifdef DEBUG_RENDER_RECT_ACCESS
-        rr_lock( _node );
-#endif
-    }
-    if ( _x != x ) {
-        _x = x;
-        _modified = true;
-    }
-}
-void RenderRectAccessor::setY( int y )
+RenderRectAccessor::RenderRectAccessor( const RenderRectAccessor & v )
 {
-    if ( _dirty ) {
-        _dirty = false;
-        _node->getRenderData(*this);
-#ifdef DEBUG_RENDER_RECT_ACCESS
-        rr_lock( _node );
-#endif
-    }
-    if ( _y != y ) {
-        _y = y;
-        _modified = true;
-    }
+    attach( v._node );
 }
-void RenderRectAccessor::setWidth( int w )
+
+RenderRectAccessor & RenderRectAccessor::operator = ( const RenderRectAccessor & v )
 {
-    if ( _dirty ) {
-        _dirty = false;
-        _node->getRenderData(*this);
-#ifdef DEBUG_RENDER_RECT_ACCESS
-        rr_lock( _node );
-#endif
-    }
-    if ( _width != w ) {
-        _width = w;
-        _modified = true;
+    if ( this != &v ) {
+        detach();
+        attach( v._node );
     }
+    return *this;
 }
-void RenderRectAccessor::setHeight( int h )
+
+RenderRectAccessor::~RenderRectAccessor()
 {
-    if ( _dirty ) {
-        _dirty = false;
-        _node->getRenderData(*this);
-#ifdef DEBUG_RENDER_RECT_ACCESS
-        rr_lock( _node );
-#endif
-    }
-    if ( _height != h ) {
-        _height = h;
-        _modified = true;
-    }
+    detach();
 }
 
-int RenderRectAccessor::getX()
+void RenderRectAccessor::clear()
 {
-    if ( _dirty ) {
-        _dirty = false;
-        _node->getRenderData(*this);
-#ifdef DEBUG_RENDER_RECT_ACCESS
-        rr_lock( _node );
-#endif
-    }
-    return _x;
+    _rec->clear(); // will clear every field
+    modified();
 }
-int RenderRectAccessor::getY()
+
+void RenderRectAccessor::setX( int x )
 {
-    if ( _dirty ) {
-        _dirty = false;
-        _node->getRenderData(*this);
-#ifdef DEBUG_RENDER_RECT_ACCESS
-        rr_lock( _node );
-#endif
+    if ( _rec->_x != x ) {
+        _rec->_x = x;
+        modified();
     }
-    return _y;
 }
-int RenderRectAccessor::getWidth()
+void RenderRectAccessor::setY( int y )
 {
-    if ( _dirty ) {
-        _dirty = false;
-        _node->getRenderData(*this);
-#ifdef DEBUG_RENDER_RECT_ACCESS
-        rr_lock( _node );
-#endif
+    if ( _rec->_y != y ) {
+        _rec->_y = y;
+        modified();
     }
-    return _width;
 }
-int RenderRectAccessor::getHeight()
+void RenderRectAccessor::setWidth( int w )
 {
-    if ( _dirty ) {
-        _dirty = false;
-        _node->getRenderData(*this);
-#ifdef DEBUG_RENDER_RECT_ACCESS
-        rr_lock( _node );
-#endif
+    if ( _rec->_width != w ) {
+        _rec->_width = w;
+        modified();
     }
-    return _height;
 }
-void RenderRectAccessor::getRect( lvRect & rc )
+void RenderRectAccessor::setHeight( int h )
 {
-    if ( _dirty ) {
-        _dirty = false;
-        _node->getRenderData(*this);
-#ifdef DEBUG_RENDER_RECT_ACCESS
-        rr_lock( _node );
-#endif
+    if ( _rec->_height != h ) {
+        _rec->_height = h;
+        modified();
     }
-    rc.left = _x;
-    rc.top = _y;
-    rc.right = _x + _width;
-    rc.bottom = _y + _height;
 }
 
 void RenderRectAccessor::setInnerX( int x )
 {
-    if ( _dirty ) {
-        _dirty = false;
-        _node->getRenderData(*this);
-#ifdef DEBUG_RENDER_RECT_ACCESS
-        rr_lock( _node );
-#endif
-    }
-    if ( _inner_x != x ) {
-        _inner_x = x;
-        _modified = true;
+    if ( _rec->_inner_x != x ) {
+        _rec->_inner_x = x;
+        modified();
     }
 }
 void RenderRectAccessor::setInnerY( int y )
 {
-    if ( _dirty ) {
-        _dirty = false;
-        _node->getRenderData(*this);
-#ifdef DEBUG_RENDER_RECT_ACCESS
-        rr_lock( _node );
-#endif
-    }
-    if ( _inner_y != y ) {
-        _inner_y = y;
-        _modified = true;
+    if ( _rec->_inner_y != y ) {
+        _rec->_inner_y = y;
+        modified();
     }
 }
 void RenderRectAccessor::setInnerWidth( int w )
 {
-    if ( _dirty ) {
-        _dirty = false;
-        _node->getRenderData(*this);
-#ifdef DEBUG_RENDER_RECT_ACCESS
-        rr_lock( _node );
-#endif
-    }
-    if ( _inner_width != w ) {
-        _inner_width = w;
-        _modified = true;
-    }
-}
-int RenderRectAccessor::getInnerX()
-{
-    if ( _dirty ) {
-        _dirty = false;
-        _node->getRenderData(*this);
-#ifdef DEBUG_RENDER_RECT_ACCESS
-        rr_lock( _node );
-#endif
-    }
-    return _inner_x;
-}
-int RenderRectAccessor::getInnerY()
-{
-    if ( _dirty ) {
-        _dirty = false;
-        _node->getRenderData(*this);
-#ifdef DEBUG_RENDER_RECT_ACCESS
-        rr_lock( _node );
-#endif
-    }
-    return _inner_y;
-}
-int RenderRectAccessor::getInnerWidth()
-{
-    if ( _dirty ) {
-        _dirty = false;
-        _node->getRenderData(*this);
-#ifdef DEBUG_RENDER_RECT_ACCESS
-        rr_lock( _node );
-#endif
-    }
-    return _inner_width;
-}
-int RenderRectAccessor::getTopOverflow()
-{
-    if ( _dirty ) {
-        _dirty = false;
-        _node->getRenderData(*this);
-#ifdef DEBUG_RENDER_RECT_ACCESS
-        rr_lock( _node );
-#endif
-    }
-    return _top_overflow;
-}
-int RenderRectAccessor::getBottomOverflow()
-{
-    if ( _dirty ) {
-        _dirty = false;
-        _node->getRenderData(*this);
-#ifdef DEBUG_RENDER_RECT_ACCESS
-        rr_lock( _node );
-#endif
+    if ( _rec->_inner_width != w ) {
+        _rec->_inner_width = w;
+        modified();
     }
-    return _bottom_overflow;
 }
 void RenderRectAccessor::setTopOverflow( int dy )
 {
-    if ( _dirty ) {
-        _dirty = false;
-        _node->getRenderData(*this);
-#ifdef DEBUG_RENDER_RECT_ACCESS
-        rr_lock( _node );
-#endif
-    }
     if ( dy < 0 ) dy = 0; // don't allow a negative value
-    if ( _top_overflow != dy ) {
-        _top_overflow = dy;
-        _modified = true;
+    if ( _rec->_top_overflow != dy ) {
+        _rec->_top_overflow = dy;
+        modified();
     }
 }
 void RenderRectAccessor::setBottomOverflow( int dy )
 {
-    if ( _dirty ) {
-        _dirty = false;
-        _node->getRenderData(*this);
-#ifdef DEBUG_RENDER_RECT_ACCESS
-        rr_lock( _node );
-#endif
-    }
     if ( dy < 0 ) dy = 0; // don't allow a negative value
-    if ( _bottom_overflow != dy ) {
-        _bottom_overflow = dy;
-        _modified = true;
-    }
-}
-int RenderRectAccessor::getBaseline()
-{
-    if ( _dirty ) {
-        _dirty = false;
-        _node->getRenderData(*this);
-#ifdef DEBUG_RENDER_RECT_ACCESS
-        rr_lock( _node );
-#endif
+    if ( _rec->_bottom_overflow != dy ) {
+        _rec->_bottom_overflow = dy;
+        modified();
     }
-    return _baseline;
 }
 void RenderRectAccessor::setBaseline( int baseline )
 {
-    if ( _dirty ) {
-        _dirty = false;
-        _node->getRenderData(*this);
-#ifdef DEBUG_RENDER_RECT_ACCESS
-        rr_lock( _node );
-#endif
-    }
-    if ( _baseline != baseline ) {
-        _baseline = baseline;
-        _modified = true;
-    }
-}
-int RenderRectAccessor::getListPropNodeIndex()
-{
-    if ( _dirty ) {
-        _dirty = false;
-        _node->getRenderData(*this);
-#ifdef DEBUG_RENDER_RECT_ACCESS
-        rr_lock( _node );
-#endif
+    if ( _rec->_baseline != baseline ) {
+        _rec->_baseline = baseline;
+        modified();
     }
-    return _listprop_node_idx;
 }
 void RenderRectAccessor::setListPropNodeIndex( int idx )
 {
-    if ( _dirty ) {
-        _dirty = false;
-        _node->getRenderData(*this);
-#ifdef DEBUG_RENDER_RECT_ACCESS
-        rr_lock( _node );
-#endif
-    }
-    if ( _listprop_node_idx != idx ) {
-        _listprop_node_idx = idx;
-        _modified = true;
-    }
-}
-unsigned short RenderRectAccessor::getFlags()
-{
-    if ( _dirty ) {
-        _dirty = false;
-        _node->getRenderData(*this);
-#ifdef DEBUG_RENDER_RECT_ACCESS
-        rr_lock( _node );
-#endif
+    if ( _rec->_listprop_node_idx != idx ) {
+        _rec->_listprop_node_idx = idx;
+        modified();
     }
-    return _flags;
 }
 void RenderRectAccessor::setFlags( unsigned short flags )
 {
-    if ( _dirty ) {
-        _dirty = false;
-        _node->getRenderData(*this);
-#ifdef DEBUG_RENDER_RECT_ACCESS
-        rr_lock( _node );
-#endif
-    }
-    if ( _flags != flags ) {
-        _flags = flags;
-        _modified = true;
+    if ( _rec->_flags != flags ) {
+        _rec->_flags = flags;
+        modified();
     }
 }
 void RenderRectAccessor::getTopRectsExcluded( int & lw, int & lh, int & rw, int & rh )
 {
-    if ( _dirty ) {
-        _dirty = false;
-        _node->getRenderData(*this);
-#ifdef DEBUG_RENDER_RECT_ACCESS
-        rr_lock( _node );
-#endif
-    }
-    lw = _extra1 >> 16;    // Both stored in a single int slot (widths are
-    rw = _extra1 & 0xFFFF; // constrained to lUint16 in many other places)
-    lh = _extra2;
-    rh = _extra3;
+    lw = _rec->_extra1 >> 16;    // Both stored in a single int slot (widths are
+    rw = _rec->_extra1 & 0xFFFF; // constrained to lUint16 in many other places)
+    lh = _rec->_extra2;
+    rh = _rec->_extra3;
 }
 void RenderRectAccessor::setTopRectsExcluded( int lw, int lh, int rw, int rh )
 {
-    if ( _dirty ) {
-        _dirty = false;
-        _node->getRenderData(*this);
-#ifdef DEBUG_RENDER_RECT_ACCESS
-        rr_lock( _node );
-#endif
-    }
-    if ( _extra2 != lh || _extra3 != rh || (_extra1>>16) != lw || (_extra1&0xFFFF) != rw ) {
-        _extra1 = (lw<<16) + rw;
-        _extra2 = lh;
-        _extra3 = rh;
-        _modified = true;
+    if ( _rec->_extra2 != lh || _rec->_extra3 != rh || (_rec->_extra1>>16) != lw || (_rec->_extra1&0xFFFF) != rw ) {
+        _rec->_extra1 = (lw<<16) + rw;
+        _rec->_extra2 = lh;
+        _rec->_extra3 = rh;
+        modified();
     }
 }
 void RenderRectAccessor::getNextFloatMinYs( int & left, int & right )
 {
-    if ( _dirty ) {
-        _dirty = false;
-        _node->getRenderData(*this);
-#ifdef DEBUG_RENDER_RECT_ACCESS
-        rr_lock( _node );
-#endif
-    }
-    left = _extra4;
-    right = _extra5;
+    left = _rec->_extra4;
+    right = _rec->_extra5;
 }
 void RenderRectAccessor::setNextFloatMinYs( int left, int right )
 {
-    if ( _dirty ) {
-        _dirty = false;
-        _node->getRenderData(*this);
-#ifdef DEBUG_RENDER_RECT_ACCESS
-        rr_lock( _node );
-#endif
-    }
-    if ( _extra4 != left || _extra5 != right ) {
-        _extra4 = left;
-        _extra5 = right;
-        _modified = true;
+    if ( _rec->_extra4 != left || _rec->_extra5 != right ) {
+        _rec->_extra4 = left;
+        _rec->_extra5 = right;
+        modified();
     }
 }
 void RenderRectAccessor::getInvolvedFloatIds( int & float_count, lUInt32 * float_ids )
 {
-    if ( _dirty ) {
-        _dirty = false;
-        _node->getRenderData(*this);
-#ifdef DEBUG_RENDER_RECT_ACCESS
-        rr_lock( _node );
-#endif
-    }
-    float_count = _extra0;
-    if (float_count > 0) float_ids[0] = _extra1;
-    if (float_count > 1) float_ids[1] = _extra2;
-    if (float_count > 2) float_ids[2] = _extra3;
-    if (float_count > 3) float_ids[3] = _extra4;
-    if (float_count > 4) float_ids[4] = _extra5;
+    float_count = _rec->_extra0;
+    if (float_count > 0) float_ids[0] = _rec->_extra1;
+    if (float_count > 1) float_ids[1] = _rec->_extra2;
+    if (float_count > 2) float_ids[2] = _rec->_extra3;
+    if (float_count > 3) float_ids[3] = _rec->_extra4;
+    if (float_count > 4) float_ids[4] = _rec->_extra5;
 }
 void RenderRectAccessor::setInvolvedFloatIds( int float_count, lUInt32 * float_ids )
 {
-    if ( _dirty ) {
-        _dirty = false;
-        _node->getRenderData(*this);
-#ifdef DEBUG_RENDER_RECT_ACCESS
-        rr_lock( _node );
-#endif
-    }
-    _extra0 = float_count;
-    if (float_count > 0) _extra1 = float_ids[0];
-    if (float_count > 1) _extra2 = float_ids[1];
-    if (float_count > 2) _extra3 = float_ids[2];
-    if (float_count > 3) _extra4 = float_ids[3];
-    if (float_count > 4) _extra5 = float_ids[4];
-    _modified = true;
+    _rec->_extra0 = float_count;
+    if (float_count > 0) _rec->_extra1 = float_ids[0];
+    if (float_count > 1) _rec->_extra2 = float_ids[1];
+    if (float_count > 2) _rec->_extra3 = float_ids[2];
+    if (float_count > 3) _rec->_extra4 = float_ids[3];
+    if (float_count > 4) _rec->_extra5 = float_ids[4];
+    modified();
 }
 
 #endif
@@ -1882,6 +1623,9 @@ tinyNodeCollection::tinyNodeCollection()
 , _nodeDisplayStyleHash(NODE_DISPLAY_STYLE_HASH_UNITIALIZED)
 , _nodeDisplayStyleHashInitial(NODE_DISPLAY_STYLE_HASH_UNITIALIZED)
 , _nodeStylesInvalidIfLoading(false)
+, _lazyElemCount(0)
+, _lazyTextCount(0)
+, _lazyStylesEnabled(false)
 #endif
 , _textStorage(this, 't', (int)(TEXT_CACHE_UNPACKED_SPACE*_storageMaxUncompressedSizeFactor), TEXT_CACHE_CHUNK_SIZE ) // persistent text node data storage
 , _elemStorage(this, 'e', (int)(ELEM_CACHE_UNPACKED_SPACE*_storageMaxUncompressedSizeFactor), ELEM_CACHE_CHUNK_SIZE ) // persistent element data storage
@@ -1890,6 +1634,10 @@ tinyNodeCollection::tinyNodeCollection()
 ,_docProps(LVCreatePropsContainer())
 ,_docFlags(DOC_FLAG_DEFAULTS)
 ,_fontMap(113)
+#if (CR_CONCURRENT_DOCUMENTS==1)
+,_concurrentReads(0)
+,_concurrentReadsMutex(NULL)
+#endif
 {
     memset( _textList, 0, sizeof(_textList) );
     memset( _elemList, 0, sizeof(_elemList) );
@@ -1919,6 +1667,9 @@ tinyNodeCollection::tinyNodeCollection( tinyNodeCollection & v )
 , _nodeDisplayStyleHash(NODE_DISPLAY_STYLE_HASH_UNITIALIZED)
 , _nodeDisplayStyleHashInitial(NODE_DISPLAY_STYLE_HASH_UNITIALIZED)
 , _nodeStylesInvalidIfLoading(false)
+, _lazyElemCount(0)
+, _lazyTextCount(0)
+, _lazyStylesEnabled(false)
 #endif
 , _textStorage(this, 't', (int)(TEXT_CACHE_UNPACKED_SPACE*_storageMaxUncompressedSizeFactor), TEXT_CACHE_CHUNK_SIZE ) // persistent text node data storage
 , _elemStorage(this, 'e', (int)(ELEM_CACHE_UNPACKED_SPACE*_storageMaxUncompressedSizeFactor), ELEM_CACHE_CHUNK_SIZE ) // persistent element data storage
@@ -1928,6 +1679,10 @@ tinyNodeCollection::tinyNodeCollection( tinyNodeCollection & v )
 ,_docFlags(v._docFlags)
 ,_stylesheet(v._stylesheet)
 ,_fontMap(113)
+#if (CR_CONCURRENT_DOCUMENTS==1)
+,_concurrentReads(0)
+,_concurrentReadsMutex(NULL)
+#endif
 {
     _docIndex = ldomNode::registerDocument((ldomDocument*)this);
 }
@@ -2031,15 +1786,67 @@ lString16 tinyNodeCollection::getCacheFilePath() {
     return _cacheFile != NULL ? _cacheFile->getCachePath() : lString16::empty_str;
 }
 
+// _nodeStyleHash and _nodeDisplayStyleHash are sums of per node contributions,
+// so they can be maintained when a single node style changes, without walking
+// the whole DOM again: the node previous contribution is removed and the new
+// one added. The contribution must be computed before the previous style or
+// font is released from the cache, otherwise the hashes are invalidated and
+// fully recomputed by calcStyleHash().
+bool tinyNodeCollection::calcNodeStyleHash( lUInt32 dataIndex, const ldomNodeStyleInfo & info, lUInt32 & styleHash, lUInt32 & displayHash )
+{
+    styleHash = displayHash = 0;
+    if ( !info._styleIndex && !info._fontIndex )
+        return true;
+    css_style_ref_t style = _styles.get( info._styleIndex );
+    font_ref_t font = _fonts.get( info._fontIndex );
+    if ( (info._styleIndex && style.isNull()) || (info._fontIndex && font.isNull()) )
+        return false; // already released: can't know what it contributed
+    lUInt32 h = dataIndex * 0x9E3779B1;
+    h = (h ^ calcHash( style )) * 0x85EBCA6B;
+    h = (h ^ (h >> 13)) + calcHash( font );
+    h *= 0xC2B2AE35;
+    styleHash = h ^ (h >> 16);
+    if ( !style.isNull() ) {
+        // Also account for "white_space: pre": if white_space changes from/to "pre",
+        // the document will need to be reloaded so that the HTML text parts are
+        // parsed according the the PRE/not-PRE rules.
+        // Also account for style->float_, as it should create/remove new floatBox
+        // elements wrapping floats when toggling BLOCK_RENDERING_G(ENHANCED)
+        lUInt32 d = style->display + 1;
+        if ( style->white_space == css_ws_pre ) d += 29;
+        if ( style->float_ > css_f_none ) d += 123;
+        d = (dataIndex * 0x9E3779B1) ^ (d * 0x85EBCA6B);
+        displayHash = d ^ (d >> 15);
+    }
+    return true;
+}
+
+void tinyNodeCollection::updateNodeStyleHash( bool known, lUInt32 dataIndex, const ldomNodeStyleInfo & info, lUInt32 oldStyleHash, lUInt32 oldDisplayHash )
+{
+    if ( !_nodeStyleHash )
+        return; // not computed yet
+    lUInt32 styleHash, displayHash;
+    if ( !known || !calcNodeStyleHash( dataIndex, info, styleHash, displayHash ) ) {
+        _nodeStyleHash = 0; // force recalculation by calcStyleHash()
+        return;
+    }
+    _nodeStyleHash += styleHash - oldStyleHash;
+    _nodeDisplayStyleHash += displayHash - oldDisplayHash;
+}
+
 void tinyNodeCollection::clearNodeStyle( lUInt32 dataIndex )
 {
     ldomNodeStyleInfo info;
     _styleStorage.getStyleData( dataIndex, &info );
+    lUInt32 oldHash, oldDisplayHash;
+    bool known = _nodeStyleHash && calcNodeStyleHash( dataIndex, info, oldHash, oldDisplayHash );
     _styles.release( info._styleIndex );
     _fonts.release( info._fontIndex );
+    if ( info._styleIndex && _styles.get( info._styleIndex ).isNull() )
+        _fontMap.remove( info._styleIndex ); // index may be reused by another style
     info._fontIndex = info._styleIndex = 0;
     _styleStorage.setStyleData( dataIndex, &info );
-    _nodeStyleHash = 0;
+    updateNodeStyleHash( known, dataIndex, info, oldHash, oldDisplayHash );
 }
 
 void tinyNodeCollection::setNodeStyleIndex( lUInt32 dataIndex, lUInt16 index )
@@ -2047,9 +1854,11 @@ void tinyNodeCollection::setNodeStyleIndex( lUInt32 dataIndex, lUInt16 index )
     ldomNodeStyleInfo info;
     _styleStorage.getStyleData( dataIndex, &info );
     if ( info._styleIndex!=index ) {
+        lUInt32 oldHash, oldDisplayHash;
+        bool known = _nodeStyleHash && calcNodeStyleHash( dataIndex, info, oldHash, oldDisplayHash );
         info._styleIndex = index;
         _styleStorage.setStyleData( dataIndex, &info );
-        _nodeStyleHash = 0;
+        updateNodeStyleHash( known, dataIndex, info, oldHash, oldDisplayHash );
     }
 }
 
@@ -2058,9 +1867,11 @@ void tinyNodeCollection::setNodeFontIndex( lUInt32 dataIndex, lUInt16 index )
     ldomNodeStyleInfo info;
     _styleStorage.getStyleData( dataIndex, &info );
     if ( info._fontIndex!=index ) {
+        lUInt32 oldHash, oldDisplayHash;
+        bool known = _nodeStyleHash && calcNodeStyleHash( dataIndex, info, oldHash, oldDisplayHash );
         info._fontIndex = index;
         _styleStorage.setStyleData( dataIndex, &info );
-        _nodeStyleHash = 0;
+        updateNodeStyleHash( known, dataIndex, info, oldHash, oldDisplayHash );
     }
 }
 
@@ -2095,23 +1906,30 @@ void tinyNodeCollection::setNodeStyle( lUInt32 dataIndex, css_style_ref_t & v )
 {
     ldomNodeStyleInfo info;
     _styleStorage.getStyleData( dataIndex, &info );
+    lUInt32 oldHash, oldDisplayHash;
+    bool known = _nodeStyleHash && calcNodeStyleHash( dataIndex, info, oldHash, oldDisplayHash );
+    lUInt16 oldIndex = info._styleIndex;
     _styles.cache( info._styleIndex, v );
+    if ( oldIndex && oldIndex!=info._styleIndex && _styles.get( oldIndex ).isNull() )
+        _fontMap.remove( oldIndex ); // index may be reused by another style
 #if DEBUG_DOM_STORAGE==1
     if ( info._styleIndex==0 ) {
         CRLog::error("tinyNodeCollection::setNodeStyle() styleIndex is 0 after caching");
     }
 #endif
     _styleStorage.setStyleData( dataIndex, &info );
-    _nodeStyleHash = 0;
+    updateNodeStyleHash( known, dataIndex, info, oldHash, oldDisplayHash );
 }
 
 void tinyNodeCollection::setNodeFont( lUInt32 dataIndex, font_ref_t & v )
 {
     ldomNodeStyleInfo info;
     _styleStorage.getStyleData( dataIndex, &info );
+    lUInt32 oldHash, oldDisplayHash;
+    bool known = _nodeStyleHash && calcNodeStyleHash( dataIndex, info, oldHash, oldDisplayHash );
     _fonts.cache( info._fontIndex, v );
     _styleStorage.setStyleData( dataIndex, &info );
-    _nodeStyleHash = 0;
+    updateNodeStyleHash( known, dataIndex, info, oldHash, oldDisplayHash );
 }
 
 lUInt16 tinyNodeCollection::getNodeFontIndex( lUInt32 dataIndex )
@@ -2121,37 +1939,6 @@ lUInt16 tinyNodeCollection::getNodeFontIndex( lUInt32 dataIndex )
     return info._fontIndex;
 }
 
-bool tinyNodeCollection::loadNodeData(lUInt16 type, ldomNode ** list, int nodecount)
-{
-    int count = ((nodecount + TNC_PART_LEN - 1) >> TNC_PART_SHIFT);
-    for (lUInt16 i=0; i<count; i++) {
-        int offs = i*TNC_PART_LEN;
-        int sz = TNC_PART_LEN;
-        if (offs + sz > nodecount) {
-            sz = nodecount - offs;
-        }
-
-        lUInt8 * p;
-        int buflen;
-        if (!_cacheFile->read( type, i, p, buflen ))
-            return false;
-        ldomNode * buf = (ldomNode *)p;
-        if (!buf || (unsigned)buflen != sizeof(ldomNode) * sz)
-            return false;
-        list[i] = buf;
-        for (int j=0; j<sz; j++) {
-            buf[j].setDocumentIndex( _docIndex );
-            if ( buf[j].isElement() ) {
-                // will be set by loadStyles/updateStyles
-                //buf[j]._data._pelem._styleIndex = 0;
-                setNodeFontIndex( buf[j]._handle._dataIndex, 0 );
-                //buf[j]._data._pelem._fontIndex = 0;
-            }
-        }
-    }
-    return true;
-}
-
 bool tinyNodeCollection::saveNodeData( lUInt16 type, ldomNode ** list, int nodecount )
 {
     int count = ((nodecount+TNC_PART_LEN-1) >> TNC_PART_SHIFT);
@@ -2198,6 +1985,10 @@ bool tinyNodeCollection::saveNodeData()
     return true;
 }
 
+// Node instances are not all read when opening a document from cache: only
+// the index is, and each part of TNC_PART_LEN nodes is read on first access
+// to one of its nodes. Only the few parts needed to show a page are then
+// read, and the time to reopen a cached book doesn't grow with its size.
 bool tinyNodeCollection::loadNodeData()
 {
     SerialBuf buf(0, true);
@@ -2214,19 +2005,21 @@ bool tinyNodeCollection::loadNodeData()
         return false;
     if ( textcount<=0 )
         return false;
-    ldomNode * elemList[TNC_PART_COUNT] = { 0 };
-    ldomNode * textList[TNC_PART_COUNT] = { 0 };
-    if ( !loadNodeData( CBT_ELEM_NODE, elemList, elemcount+1 ) ) {
-        for ( int i=0; i<TNC_PART_COUNT; i++ )
-            if ( elemList[i] )
-                free( elemList[i] );
-        return false;
-    }
-    if ( !loadNodeData( CBT_TEXT_NODE, textList, textcount+1 ) ) {
-        for ( int i=0; i<TNC_PART_COUNT; i++ )
-            if ( textList[i] )
-                free( textList[i] );
-        return false;
+    // check all parts are there and not damaged (if not done for whole file on open),
+    // so they can be read later: damaged cache file is to fail opening, not page drawing
+    for ( int t=0; t<2; t++ ) {
+        lUInt16 type = t ? CBT_TEXT_NODE : CBT_ELEM_NODE;
+        int nodecount = (t ? textcount : elemcount) + 1;
+        int count = ((nodecount + TNC_PART_LEN - 1) >> TNC_PART_SHIFT);
+        for ( int i=0; i<count; i++ ) {
+            int sz = nodecount - i*TNC_PART_LEN;
+            if ( sz > TNC_PART_LEN )
+                sz = TNC_PART_LEN;
+            if ( _cacheFile->getDataSize( type, (lUInt16)i ) != (int)sizeof(ldomNode) * sz )
+                return false;
+            if ( !_enableCacheFileContentsValidation && !_cacheFile->validate( type, (lUInt16)i ) )
+                return false;
+        }
     }
     for ( int i=0; i<TNC_PART_COUNT; i++ ) {
         if ( _elemList[i] )
@@ -2234,12 +2027,83 @@ bool tinyNodeCollection::loadNodeData()
         if ( _textList[i] )
             free( _textList[i] );
     }
-    memcpy( _elemList, elemList, sizeof(elemList) );
-    memcpy( _textList, textList, sizeof(textList) );
+    memset( _elemList, 0, sizeof(_elemList) );
+    memset( _textList, 0, sizeof(_textList) );
     _elemCount = elemcount;
     _textCount = textcount;
+    _lazyElemCount = elemcount;
+    _lazyTextCount = textcount;
     return true;
 }
+
+/// read part of nodes from cache file on first access, returns NULL if it's not in cache file
+ldomNode * tinyNodeCollection::loadNodePart( bool elements, int partIndex )
+{
+    int lazycount = elements ? _lazyElemCount : _lazyTextCount;
+    int nodecount = lazycount + 1;
+    int offs = partIndex*TNC_PART_LEN;
+    if ( !lazycount || offs >= nodecount || !_cacheFile )
+        return NULL; // not opened from cache (may be parsed after failed open), or new part
+    int sz = nodecount - offs;
+    if ( sz > TNC_PART_LEN )
+        sz = TNC_PART_LEN;
+    lUInt8 * p = NULL;
+    int buflen = 0;
+    if ( !_cacheFile->read( elements ? CBT_ELEM_NODE : CBT_TEXT_NODE, (lUInt16)partIndex, p, buflen )
+            || !p || (unsigned)buflen != sizeof(ldomNode) * sz )
+        crFatalError(-1, "Cannot read node data");
+    // full size part, as new nodes may be added to the last one
+    ldomNode * buf = (ldomNode *)realloc( p, sizeof(ldomNode) * TNC_PART_LEN );
+    memset( buf + sz, 0, sizeof(ldomNode) * (TNC_PART_LEN - sz) );
+    for ( int j=0; j<sz; j++ ) {
+        buf[j].setDocumentIndex( _docIndex );
+        if ( elements && buf[j].isElement() )
+            initLoadedNodeStyle( buf[j]._handle._dataIndex );
+    }
+    if ( elements )
+        _elemList[partIndex] = buf;
+    else
+        _textList[partIndex] = buf;
+    return buf;
+}
+
+/// set style and font of element read from cache file
+void tinyNodeCollection::initLoadedNodeStyle( lUInt32 dataIndex )
+{
+    // Style data is set directly: the saved node style hash already
+    // accounts for it, and the font index saved is from another session.
+    ldomNodeStyleInfo info;
+    _styleStorage.getStyleData( dataIndex, &info );
+    info._fontIndex = 0;
+    if ( _lazyStylesEnabled && info._styleIndex!=0 ) {
+        css_style_ref_t s = _styles.get( info._styleIndex );
+        if ( !s.isNull() ) {
+            lUInt16 fntIndex = _fontMap.get( info._styleIndex );
+            if ( fntIndex==0 ) {
+                LVFontRef fnt = getFont(s.get(), getFontContextDocIndex());
+                fntIndex = (lUInt16)_fonts.cache( fnt );
+                if ( fnt.isNull() ) {
+                    CRLog::error("font not found for style!");
+                } else {
+                    _fontMap.set(info._styleIndex, fntIndex);
+                }
+            } else {
+                _fonts.addIndexRef( fntIndex );
+            }
+            if ( fntIndex<=0 ) {
+                CRLog::error("font caching failed for style!");
+            } else {
+                info._fontIndex = fntIndex;
+            }
+        } else {
+            CRLog::error("Loaded style index %d not found in style collection", (int)info._styleIndex);
+            info._styleIndex = 0;
+        }
+    } else {
+        info._styleIndex = 0;
+    }
+    _styleStorage.setStyleData( dataIndex, &info );
+}
 #endif
 
 /// get ldomNode instance pointer
@@ -2247,10 +2111,12 @@ ldomNode * tinyNodeCollection::getTinyNode( lUInt32 index )
 {
     if ( !index )
         return NULL;
-    if ( index & 1 ) // element
-        return &(_elemList[index>>TNC_PART_INDEX_SHIFT][(index>>4)&TNC_PART_MASK]);
-    else // text
-        return &(_textList[index>>TNC_PART_INDEX_SHIFT][(index>>4)&TNC_PART_MASK]);
+    ldomNode * part = (index & 1) ? _elemList[index>>TNC_PART_INDEX_SHIFT] : _textList[index>>TNC_PART_INDEX_SHIFT];
+#if BUILD_LITE!=1
+    if ( !part ) // not yet read from cache file
+        part = loadNodePart( (index & 1)!=0, index>>TNC_PART_INDEX_SHIFT );
+#endif
+    return &(part[(index>>4)&TNC_PART_MASK]);
 }
 
 /// allocate new tiny node
@@ -2271,6 +2137,10 @@ ldomNode * tinyNodeCollection::allocTinyNode( int type )
             if (_elemCount >= (TNC_PART_COUNT << TNC_PART_SHIFT))
                 crFatalError(1003, "allocTinyNode: can't create any more element nodes (hard limit)");
             ldomNode * part = _elemList[_elemCount >> TNC_PART_SHIFT];
+#if BUILD_LITE!=1
+            if ( !part ) // last part in cache file, not yet read
+                part = loadNodePart( true, _elemCount >> TNC_PART_SHIFT );
+#endif
             if ( !part ) {
                 part = (ldomNode*)calloc(TNC_PART_LEN, sizeof(*part));
                 _elemList[ _elemCount >> TNC_PART_SHIFT ] = part;
@@ -2294,6 +2164,10 @@ ldomNode * tinyNodeCollection::allocTinyNode( int type )
             if (_textCount >= (TNC_PART_COUNT << TNC_PART_SHIFT))
                 crFatalError(1003, "allocTinyNode: can't create any more text nodes (hard limit)");
             ldomNode * part = _textList[_textCount >> TNC_PART_SHIFT];
+#if BUILD_LITE!=1
+            if ( !part ) // last part in cache file, not yet read
+                part = loadNodePart( false, _textCount >> TNC_PART_SHIFT );
+#endif
             if ( !part ) {
                 part = (ldomNode*)calloc(TNC_PART_LEN, sizeof(*part));
                 _textList[ _textCount >> TNC_PART_SHIFT ] = part;
@@ -2334,6 +2208,9 @@ void tinyNodeCollection::recycleTinyNode( lUInt32 index )
 
 tinyNodeCollection::~tinyNodeCollection()
 {
+#if (CR_CONCURRENT_DOCUMENTS==1)
+    delete _concurrentReadsMutex;
+#endif
 #if BUILD_LITE!=1
     if ( _cacheFile )
         delete _cacheFile;
@@ -2502,8 +2379,15 @@ bool ldomDataStorageManager::load()
 /// get chunk pointer and update usage data
 ldomTextStorageChunk * ldomDataStorageManager::getChunk( lUInt32 address )
 {
+    DOC_READS_GUARD(_owner)
     ldomTextStorageChunk * chunk = _chunks[address>>16];
     if ( chunk!=_recentChunk ) {
+        if ( chunk->_buf )
+            _hits++;
+#if BUILD_LITE!=1
+        if ( CR_ATOMIC_LOAD(_trimTarget) >= 0 )
+            compact( 0 );
+#endif
         if ( chunk->_prevRecent )
             chunk->_prevRecent->_nextRecent = chunk->_nextRecent;
         if ( chunk->_nextRecent )
@@ -2575,6 +2459,31 @@ void ldomDataStorageManager::setStyleData( lUInt32 elemDataIndex, const ldomNode
 }
 
 
+/// get or allocate space for rect data item, returns pointer to item in pinned chunk
+lvdomElementFormatRec * ldomDataStorageManager::pinRendRectData( lUInt32 elemDataIndex, ldomTextStorageChunk * & chunk )
+{
+    // chunk is pinned before another reader's getChunk() may pack it
+    DOC_READS_GUARD(_owner)
+    // assume storage has raw data chunks
+    int index = elemDataIndex>>4; // element sequential index
+    int chunkIndex = index >> RECT_DATA_CHUNK_ITEMS_SHIFT;
+    while ( _chunks.length() <= chunkIndex ) {
+        _chunks.add( new ldomTextStorageChunk(RECT_DATA_CHUNK_SIZE, this, _chunks.length()) );
+        getChunk( (_chunks.length()-1)<<16 );
+        compact( 0 );
+    }
+    chunk = getChunk( chunkIndex<<16 );
+    CR_ATOMIC_INC( chunk->_pinCount );
+    int offsetIndex = index & RECT_DATA_CHUNK_MASK;
+    return (lvdomElementFormatRec *)(chunk->_buf + offsetIndex * sizeof(lvdomElementFormatRec));
+}
+
+/// release chunk pinned by pinRendRectData()
+void ldomDataStorageManager::unpinRendRectData( ldomTextStorageChunk * chunk )
+{
+    CR_ATOMIC_DEC( chunk->_pinCount );
+}
+
 /// get or allocate space for rect data item
 void ldomDataStorageManager::getRendRectData( lUInt32 elemDataIndex, lvdomElementFormatRec * dst )
 {
@@ -2686,6 +2595,19 @@ lString8 ldomDataStorageManager::getText( lUInt32 address )
     return chunk->getText(address&0xFFFF);
 }
 
+/// get text by address, to read it in place
+ldomTextRef ldomDataStorageManager::getTextRef( lUInt32 address )
+{
+    // chunk is pinned by ldomTextRef before another reader's getChunk() may pack it
+    DOC_READS_GUARD(_owner)
+    ldomTextStorageChunk * chunk = getChunk(address);
+    int offset = (address&0xFFFF) << 4;
+    if ( !chunk->_buf || offset>=(int)chunk->_bufpos )
+        return ldomTextRef();
+    TextDataStorageItem * item = (TextDataStorageItem *)(chunk->_buf+offset);
+    return ldomTextRef( chunk, item->text, item->length );
+}
+
 /// get pointer to element data
 ElementDataStorageItem * ldomDataStorageManager::getElem( lUInt32 addr )
 {
@@ -2701,11 +2623,52 @@ lUInt32 ldomDataStorageManager::getParent( lUInt32 addr )
 }
 #endif
 
+CRMemorySubsystem ldomDataStorageManager::getMemorySubsystem()
+{
+    switch ( _type ) {
+    case 't':
+        return CRMEM_TEXT_STORAGE;
+    case 'r':
+        return CRMEM_RECT_STORAGE;
+    case 's':
+        return CRMEM_STYLE_STORAGE;
+    default:
+        return CRMEM_ELEM_STORAGE;
+    }
+}
+
+/// releases unpacked chunks down to target size: now, or on next access in CR_CONCURRENT_DOCUMENTS builds
+void ldomDataStorageManager::trimMemory( int target )
+{
+    CR_ATOMIC_STORE( _trimTarget, target );
+#if BUILD_LITE!=1 && CR_CONCURRENT_DOCUMENTS!=1
+    compact( 0 );
+#endif
+}
+
 void ldomDataStorageManager::compact( int reservedSpace )
 {
 #if BUILD_LITE!=1
-    if ( _uncompressedSize + reservedSpace > _maxUncompressedSize + _maxUncompressedSize/10 ) { // allow +10% overflow
-        if (!_maxSizeReachedWarned) {
+#if (CR_CONCURRENT_DOCUMENTS==1)
+    // items of unpacked chunks may be in use by other readers
+    if ( _owner->getConcurrentReadsMutex() )
+        return;
+#endif
+    int maxSize = CR_ATOMIC_LOAD( _memoryLimit );
+    bool governed = maxSize > 0;
+    if ( !governed )
+        maxSize = _maxUncompressedSize;
+    int trimTarget = CR_ATOMIC_LOAD( _trimTarget );
+    bool trimming = trimTarget >= 0 && trimTarget < _uncompressedSize;
+    if ( trimTarget >= 0 )
+        CR_ATOMIC_STORE( _trimTarget, -1 );
+    if ( trimming && trimTarget < maxSize )
+        maxSize = trimTarget;
+    // items of recently used chunks may still be referenced by caller
+    if ( (governed || trimming) && maxSize < _chunkSize * 4 )
+        maxSize = _chunkSize * 4;
+    if ( trimming || _uncompressedSize + reservedSpace > maxSize + maxSize/10 ) { // allow +10% overflow
+        if (!_maxSizeReachedWarned && !governed && !trimming) {
             // Log once to stdout that we reached maxUncompressedSize, so we can know
             // of this fact and consider it as a possible cause for crengine bugs
             printf("CRE WARNING: storage for %s reached max allowed uncompressed size (%u > %u)\n",
@@ -2718,7 +2681,8 @@ void ldomDataStorageManager::compact( int reservedSpace )
         // do compacting
         int sumsize = reservedSpace;
         for ( ldomTextStorageChunk * p = _recentChunk; p; p = p->_nextRecent ) {
-			if ( (int)p->_bufsize + sumsize < _maxUncompressedSize || (p==_activeChunk && reservedSpace<0xFFFFFFF)) {
+			// chunk just unpacked is kept even if it alone exceeds the limit
+			if ( (int)p->_bufsize + sumsize < maxSize || (p==_activeChunk && reservedSpace<0xFFFFFFF) || p->_pinCount || p==_recentChunk ) {
 				// fits
 				sumsize += p->_bufsize;
 			} else {
@@ -2748,11 +2712,16 @@ ldomDataStorageManager::ldomDataStorageManager( tinyNodeCollection * owner, char
 , _chunkSize(chunkSize)
 , _type(type)
 , _maxSizeReachedWarned(false)
+, _hits(0)
+, _memoryLimit(0)
+, _trimTarget(-1)
 {
+    CRMemoryGovernor::addConsumer( this );
 }
 
 ldomDataStorageManager::~ldomDataStorageManager()
 {
+    CRMemoryGovernor::removeConsumer( this );
 }
 
 /// create chunk to be read from cache file
@@ -2766,6 +2735,7 @@ ldomTextStorageChunk::ldomTextStorageChunk(ldomDataStorageManager * manager, lUI
 	, _index(index)      /// ? index of chunk in storage
 	, _type( manager->_type )
 	, _saved(true)
+	, _pinCount(0)
 {
     CR_UNUSED(compsize);
 }
@@ -2780,6 +2750,7 @@ ldomTextStorageChunk::ldomTextStorageChunk(int preAllocSize, ldomDataStorageMana
 	, _index(index)      /// ? index of chunk in storage
 	, _type( manager->_type )
 	, _saved(false)
+	, _pinCount(0)
 {
     _buf = (lUInt8*)calloc(preAllocSize, sizeof(*_buf));
     _manager->_uncompressedSize += _bufsize;
@@ -2795,6 +2766,7 @@ ldomTextStorageChunk::ldomTextStorageChunk(ldomDataStorageManager * manager, lUI
 	, _index(index)      /// ? index of chunk in storage
 	, _type( manager->_type )
 	, _saved(false)
+	, _pinCount(0)
 {
 }
 
@@ -3026,6 +2998,7 @@ lString8 ldomTextStorageChunk::getText( int offset )
 /// pack data from _buf to _compbuf
 bool ldomPack( const lUInt8 * buf, int bufsize, lUInt8 * &dstbuf, lUInt32 & dstsize )
 {
+    CR_TRACE_SCOPE(CRTRACE_CHUNK_PACK);
     lUInt8 tmp[PACK_BUF_SIZE]; // 64K buffer for compressed data
     int ret;
     z_stream z;
@@ -3068,6 +3041,7 @@ bool ldomPack( const lUInt8 * buf, int bufsize, lUInt8 * &dstbuf, lUInt32 & dsts
 /// unpack data from _compbuf to _buf
 bool ldomUnpack( const lUInt8 * compbuf, int compsize, lUInt8 * &dstbuf, lUInt32 & dstsize  )
 {
+    CR_TRACE_SCOPE(CRTRACE_CHUNK_UNPACK);
     lUInt8 tmp[UNPACK_BUF_SIZE]; // 256K buffer for uncompressed data
     int ret;
     z_stream z = { 0 };
@@ -3396,6 +3370,8 @@ ldomDocument::ldomDocument()
 , _rendered(false)
 , _just_rendered_from_cache(false)
 , _toc_from_cache_valid(false)
+, _renderedStyleSheetHash(0)
+, _lastRestyledNodeCount(-1)
 #endif
 , lists(100)
 {
@@ -3443,6 +3419,8 @@ ldomDocument::ldomDocument( ldomDocument & doc )
 , _last_docflags(doc._last_docflags)
 , _page_height(doc._page_height)
 , _page_width(doc._page_width)
+, _renderedStyleSheetHash(0)
+, _lastRestyledNodeCount(-1)
 #endif
 , _container(doc._container)
 , lists(100)
@@ -4232,7 +4210,7 @@ void tinyNodeCollection::dropStyles()
         if ( offs + sz > _elemCount+1 ) {
             sz = _elemCount+1 - offs;
         }
-        ldomNode * buf = _elemList[i];
+        ldomNode * buf = getElemPart(i);
         for ( int j=0; j<sz; j++ ) {
             if ( buf[j].isElement() ) {
                 setNodeStyleIndex( buf[j]._handle._dataIndex, 0 );
@@ -4253,7 +4231,7 @@ int tinyNodeCollection::calcFinalBlocks()
         if ( offs + sz > _elemCount+1 ) {
             sz = _elemCount+1 - offs;
         }
-        ldomNode * buf = _elemList[i];
+        ldomNode * buf = getElemPart(i);
         for ( int j=0; j<sz; j++ ) {
             if ( buf[j].isElement() ) {
                 int rm = buf[j].getRendMethod();
@@ -4338,41 +4316,45 @@ int ldomDocument::render( LVRendPageList * pages, LVDocViewCallback * callback,
             // or some pseudoclass like :last-child has been met).
             printf("CRE: styles re-init needed after load, re-rendering\n");
         }
-        CRLog::info("rendering context is changed - full render required...");
         // Clear LFormattedTextRef cache
         _renderedBlockCache.clear();
-        CRLog::trace("init format data...");
-        //CRLog::trace("validate 1...");
-        //validateDocument();
-        CRLog::trace("Dropping existing styles...");
-        //CRLog::debug( "root style before drop style %d", getNodeStyleIndex(getRootNode()->getDataIndex()));
-        dropStyles();
-        //CRLog::debug( "root style after drop style %d", getNodeStyleIndex(getRootNode()->getDataIndex()));
-
-        // After having dropped styles, which should have dropped most references
-        // to fonts instances, we want to drop these fonts instances.
-        // Mostly because some fallback fonts, possibly synthetized (fake bold and
-        // italic) may have been instantiated in the late phase of text rendering.
-        // We don't want such instances to be used for styles as it could cause some
-        // cache check issues (perpetual "style hash mismatch", as these synthetised
-        // fonts would not yet be there when loading from cache).
-        // We need 2 gc() for a complete cleanup. The performance impact of
-        // reinstantiating the fonts is minimal.
-        gc(); // drop font instances that were only referenced by dropped styles
-        gc(); // drop fallback font instances that were only referenced by dropped fonts
-
-        //ldomNode * root = getRootNode();
-        //css_style_ref_t roots = root->getStyle();
-        //CRLog::trace("validate 2...");
-        //validateDocument();
-
-        CRLog::trace("Save stylesheet...");
-        _stylesheet.push();
-        CRLog::trace("Init node styles...");
-        applyDocumentStyleSheet();
-        getRootNode()->initNodeStyleRecursive( callback );
-        CRLog::trace("Restoring stylesheet...");
-        _stylesheet.pop();
+        if ( restyleChangedElements( callback ) ) {
+            CRLog::info("rendering context is changed - styles of %d elements updated", _lastRestyledNodeCount);
+        } else {
+            CRLog::info("rendering context is changed - full render required...");
+            CRLog::trace("init format data...");
+            //CRLog::trace("validate 1...");
+            //validateDocument();
+            CRLog::trace("Dropping existing styles...");
+            //CRLog::debug( "root style before drop style %d", getNodeStyleIndex(getRootNode()->getDataIndex()));
+            dropStyles();
+            //CRLog::debug( "root style after drop style %d", getNodeStyleIndex(getRootNode()->getDataIndex()));
+
+            // After having dropped styles, which should have dropped most references
+            // to fonts instances, we want to drop these fonts instances.
+            // Mostly because some fallback fonts, possibly synthetized (fake bold and
+            // italic) may have been instantiated in the late phase of text rendering.
+            // We don't want such instances to be used for styles as it could cause some
+            // cache check issues (perpetual "style hash mismatch", as these synthetised
+            // fonts would not yet be there when loading from cache).
+            // We need 2 gc() for a complete cleanup. The performance impact of
+            // reinstantiating the fonts is minimal.
+            gc(); // drop font instances that were only referenced by dropped styles
+            gc(); // drop fallback font instances that were only referenced by dropped fonts
+
+            //ldomNode * root = getRootNode();
+            //css_style_ref_t roots = root->getStyle();
+            //CRLog::trace("validate 2...");
+            //validateDocument();
+
+            CRLog::trace("Save stylesheet...");
+            _stylesheet.push();
+            CRLog::trace("Init node styles...");
+            applyDocumentStyleSheet();
+            _lastRestyledNodeCount = getRootNode()->initNodeStyleRecursive( callback );
+            CRLog::trace("Restoring stylesheet...");
+            _stylesheet.pop();
+        }
 
         CRLog::trace("init render method...");
         getRootNode()->initNodeRendMethodRecursive();
@@ -4407,8 +4389,14 @@ int ldomDocument::render( LVRendPageList * pages, LVDocViewCallback * callback,
         context.setCallback(callback, numFinalBlocks);
         //updateStyles();
         CRLog::trace("rendering...");
-        int height = renderBlockElement( context, getRootNode(),
-            0, y0, width ) + y0;
+        int height;
+        {
+            CR_TRACE_SCOPE(CRTRACE_RENDER);
+            // tables, floats and inline-blocks measure nested content once per pass
+            RenderedWidthsCache widthsCache;
+            height = renderBlockElement( context, getRootNode(),
+                0, y0, width ) + y0;
+        }
         _rendered = true;
     #if 0 //def _DEBUG
         LVStreamRef ostream = LVOpenFileStream( "test_save_after_init_rend_method.xml", LVOM_WRITE );
@@ -4416,7 +4404,10 @@ int ldomDocument::render( LVRendPageList * pages, LVDocViewCallback * callback,
     #endif
         gc();
         CRLog::trace("finalizing... fonts.length=%d", _fonts.length());
-        context.Finalize();
+        {
+            CR_TRACE_SCOPE(CRTRACE_PAGINATE);
+            context.Finalize();
+        }
         updateRenderContext();
         _pagesData.reset();
         pages->serialize( _pagesData );
@@ -4689,7 +4680,7 @@ bool IsEmptySpace( const lChar16 * text, int len )
 /////////////////////////////////////////////////////////////////
 /// lxmlElementWriter
 
-static bool IS_FIRST_BODY = false;
+static CR_THREAD_LOCAL bool IS_FIRST_BODY = false;
 
 ldomElementWriter::ldomElementWriter(ldomDocument * document, lUInt16 nsid, lUInt16 id, ldomElementWriter * parent)
     : _parent(parent), _document(document), _tocItem(NULL), _isBlock(true), _isSection(false), _stylesheetIsSet(false), _bodyEnterCalled(false)
@@ -6703,7 +6694,7 @@ ldomXPointer ldomDocument::createXPointer( lvPoint pt, int direction, bool stric
         // No node found, return start or end of document if pt overflows it, otherwise NULL
         if ( pt.y >= getFullHeight()) {
             ldomNode * node = getRootNode()->getLastTextChild();
-            return ldomXPointer(node,node ? node->getText().length() : 0);
+            return ldomXPointer(node,node ? node->getTextRef().length() : 0);
         } else if ( pt.y <= 0 ) {
             ldomNode * node = getRootNode()->getFirstTextChild();
             return ldomXPointer(node, 0);
@@ -7575,7 +7566,7 @@ ldomXPointer ldomDocument::createXPointer( ldomNode * baseNode, const lString16
                 return ldomXPointer(currNode, index);
             } else {
                 // text point
-                if ( index<0 || index>(int)currNode->getText().length() )
+                if ( index<0 || index>(int)currNode->getTextRef().length() )
                     return ldomXPointer();
                 return ldomXPointer(currNode, index);
             }
@@ -7837,7 +7828,7 @@ bool ldomXPointerEx::lastInnerNode(bool toTextEnd)
         return false;
     while ( lastChild() ) {}
     if ( isText() && toTextEnd ) {
-        setOffset(getNode()->getText().length());
+        setOffset(getNode()->getTextRef().length());
     }
     return true;
 }
@@ -7849,7 +7840,7 @@ bool ldomXPointerEx::lastInnerTextNode(bool toTextEnd)
         return false;
     if ( isText() ) {
         if (toTextEnd)
-            setOffset(getNode()->getText().length());
+            setOffset(getNode()->getTextRef().length());
         return true;
     }
     if ( lastChild() ) {
@@ -7971,7 +7962,7 @@ ldomXRangeList::ldomXRangeList( ldomXRangeList & srcList, ldomXRange & filter )
 
 /// copy constructor of full node range
 ldomXRange::ldomXRange( ldomNode * p, bool fitEndToLastInnerChild )
-: _start( p, 0 ), _end( p, p->isText() ? p->getText().length() : p->getChildCount() ), _flags(1)
+: _start( p, 0 ), _end( p, p->isText() ? p->getTextRef().length() : p->getChildCount() ), _flags(1)
 {
     // Note: the above initialization seems wrong: for a non-text
     // node, offset seems of no-use, and setting it to the number
@@ -8256,13 +8247,13 @@ bool ldomXRange::findText( lString16 pattern, bool caseInsensitive, bool reverse
         // reverse search
         if ( !_end.isText() ) {
             _end.prevVisibleText();
-            lString16 txt = _end.getNode()->getText();
-            _end.setOffset(txt.length());
+            _end.setOffset(_end.getNode()->getTextRef().length());
         }
         int firstFoundTextY = -1;
+        lString16 txt;
         while ( !isNull() ) {
 
-            lString16 txt = _end.getNode()->getText();
+            _end.getNode()->getTextRef().getText( txt );
             int offs = _end.getOffset();
             int endpos;
 
@@ -8288,8 +8279,7 @@ bool ldomXRange::findText( lString16 pattern, bool caseInsensitive, bool reverse
             }
             if ( !_end.prevVisibleText() )
                 break;
-            txt = _end.getNode()->getText();
-            _end.setOffset(txt.length());
+            _end.setOffset(_end.getNode()->getTextRef().length());
             if ( words.length() >= maxCount )
                 break;
         }
@@ -8302,6 +8292,7 @@ bool ldomXRange::findText( lString16 pattern, bool caseInsensitive, bool reverse
 			ldomXPointer p( _start.getNode(), _start.getOffset() );
 			firstFoundTextY = p.toPoint().y;
 		}
+        lString16 txt;
         while ( !isNull() ) {
             int offs = _start.getOffset();
             int endpos;
@@ -8314,7 +8305,7 @@ bool ldomXRange::findText( lString16 pattern, bool caseInsensitive, bool reverse
                     return words.length()>0;
             }
 
-            lString16 txt = _start.getNode()->getText();
+            _start.getNode()->getTextRef().getText( txt );
             if ( caseInsensitive )
                 txt.lowercase();
 
@@ -9116,9 +9107,7 @@ bool ldomXPointerEx::prevVisibleChar( bool thisBlockOnly )
         if ( !prevVisibleText(thisBlockOnly) )
             return false;
         ldomNode * node = getNode();
-        lString16 text = node->getText();
-        int textLen = text.length();
-        _data->setOffset( textLen );
+        _data->setOffset( node->getTextRef().length() );
     }
     _data->addOffset(-1);
     return true;
@@ -9137,8 +9126,7 @@ bool ldomXPointerEx::nextVisibleChar( bool thisBlockOnly )
         return true;
     }
     ldomNode * node = getNode();
-    lString16 text = node->getText();
-    int textLen = text.length();
+    int textLen = node->getTextRef().length();
     if ( _data->getOffset() == textLen ) {
         // move to next text
         if ( !nextVisibleText(thisBlockOnly) )
@@ -9228,12 +9216,12 @@ bool ldomXPointerEx::prevVisibleWordStart( bool thisBlockOnly )
             if ( !prevVisibleText(thisBlockOnly) )
                 return false;
             node = getNode();
-            text = node->getText();
+            node->getTextRef().getText( text );
             textLen = text.length();
             _data->setOffset( textLen );
         } else {
             node = getNode();
-            text = node->getText();
+            node->getTextRef().getText( text );
             textLen = text.length();
         }
         bool foundNonSpace = false;
@@ -9265,13 +9253,13 @@ bool ldomXPointerEx::prevVisibleWordEnd( bool thisBlockOnly )
             if ( !prevVisibleText(thisBlockOnly) )
                 return false;
             node = getNode();
-            text = node->getText();
+            node->getTextRef().getText( text );
             textLen = text.length();
             _data->setOffset( textLen );
             moved = true;
         } else {
             node = getNode();
-            text = node->getText();
+            node->getTextRef().getText( text );
             textLen = text.length();
         }
         // skip spaces
@@ -9312,14 +9300,14 @@ bool ldomXPointerEx::nextVisibleWordStart( bool thisBlockOnly )
             if ( !nextVisibleText(thisBlockOnly) )
                 return false;
             node = getNode();
-            text = node->getText();
+            node->getTextRef().getText( text );
             textLen = text.length();
             _data->setOffset( 0 );
             moved = true;
         } else {
             for (;;) {
                 node = getNode();
-                text = node->getText();
+                node->getTextRef().getText( text );
                 textLen = text.length();
                 if ( _data->getOffset() < textLen )
                     break;
@@ -9366,7 +9354,7 @@ bool ldomXPointerEx::thisVisibleWordEnd(bool thisBlockOnly)
     if ( !isText() || !isVisible() )
         return false;
     node = getNode();
-    text = node->getText();
+    node->getTextRef().getText( text );
     textLen = text.length();
     if ( _data->getOffset() >= textLen )
         return false;
@@ -9400,14 +9388,14 @@ bool ldomXPointerEx::nextVisibleWordEnd( bool thisBlockOnly )
             if ( !nextVisibleText(thisBlockOnly) )
                 return false;
             node = getNode();
-            text = node->getText();
+            node->getTextRef().getText( text );
             textLen = text.length();
             _data->setOffset( 0 );
             //moved = true;
         } else {
             for (;;) {
                 node = getNode();
-                text = node->getText();
+                node->getTextRef().getText( text );
                 textLen = text.length();
                 if ( _data->getOffset() < textLen )
                     break;
@@ -9769,10 +9757,9 @@ void ldomXRange::forEach( ldomNodeCallback * callback )
         if ( node->isElement() ) {
             allowGoRecurse = callback->onElement( &pos.getStart() );
         } else if ( node->isText() ) {
-            lString16 txt = node->getText();
             pos._end = pos._start;
             pos._start.setOffset( 0 );
-            pos._end.setOffset( txt.length() );
+            pos._end.setOffset( node->getTextRef().length() );
             if ( _start.getNode() == node ) {
                 pos._start.setOffset( _start.getOffset() );
             }
@@ -9812,19 +9799,24 @@ public:
     virtual void onText( ldomXRange * nodeRange )
     {
         ldomNode * node = nodeRange->getStart().getNode();
-        lString16 text = node->getText();
-        int len = text.length();
-        int end = nodeRange->getEnd().getOffset();
-        if ( len>end )
-            len = end;
+        ldomTextRef text = node->getTextRef();
+        const char * s = text.data();
+        int start = nodeRange->getStart().getOffset();
+        int len = nodeRange->getEnd().getOffset();
         int beginOfWord = -1;
-        for ( int i=nodeRange->getStart().getOffset(); i <= len; i++ ) {
+        // characters are decoded from UTF-8 one by one, from text start
+        for ( int i=0; i <= len; i++ ) {
+            lChar16 ch = s < text.end() ? Utf8NextChar( s, text.end() ) : 0;
+            if ( !ch && s >= text.end() )
+                len = i; // end of text
+            if ( i < start )
+                continue;
             // int alpha = lGetCharProps(text[i]) & CH_PROP_ALPHA;
             // Also allow digits (years, page numbers) to be considered words
             // int alpha = lGetCharProps(text[i]) & (CH_PROP_ALPHA|CH_PROP_DIGIT|CH_PROP_HYPHEN);
             // We use lStr_isWordSeparator() as the other word finding/skipping functions do,
             // so they all share the same notion of what a word is.
-            int alpha = !lStr_isWordSeparator(text[i]); // alpha, number, CJK char
+            int alpha = !lStr_isWordSeparator(ch); // alpha, number, CJK char
             if (alpha && beginOfWord<0 ) {
                 beginOfWord = i;
             }
@@ -9832,7 +9824,7 @@ public:
                 _list.add( ldomWord( node, beginOfWord, i ) );
                 beginOfWord = -1;
             }
-            if (lGetCharProps(text[i]) == CH_PROP_CJK && i < len) { // a CJK char makes its own word
+            if (lGetCharProps(ch) == CH_PROP_CJK && i < len) { // a CJK char makes its own word
                 _list.add( ldomWord( node, i, i+1 ) );
                 beginOfWord = -1;
             }
@@ -10129,11 +10121,10 @@ public:
         if ( newBlock && !text.empty()) {
             text << delimiter;
         }
-        lString16 txt = nodeRange->getStart().getNode()->getText();
         int start = nodeRange->getStart().getOffset();
         int end = nodeRange->getEnd().getOffset();
         if ( start < end ) {
-            text << txt.substr( start, end-start );
+            text << nodeRange->getStart().getNode()->getTextRef().substr( start, end-start );
         }
         lastText = true;
         newBlock = false;
@@ -11137,6 +11128,7 @@ void ldomDocument::clear()
 #if BUILD_LITE!=1
 bool ldomDocument::openFromCache( CacheLoadingCallback * formatCallback, LVDocViewCallback * progressCallback )
 {
+    CR_TRACE_SCOPE(CRTRACE_CACHE_LOAD);
     setCacheFileStale(true);
     if ( !openCacheFile() ) {
         CRLog::info("Cannot open document from cache. Need to read fully");
@@ -11327,6 +11319,7 @@ static const char * styles_magic = "CRSTYLES";
 /// saves changes to cache file, limited by time interval (can be called again to continue after TIMEOUT)
 ContinuousOperationResult ldomDocument::saveChanges( CRTimerUtil & maxTime, LVDocViewCallback * progressCallback )
 {
+    CR_TRACE_SCOPE(CRTRACE_CACHE_SAVE);
     if ( !_cacheFile )
         return CR_DONE;
 
@@ -11570,9 +11563,13 @@ bool tinyNodeCollection::saveStylesData()
 {
     SerialBuf stylebuf(0, true);
     lUInt32 stHash = _stylesheet.getHash();
+    if ( !_nodeStyleHash )
+        calcStyleHash();
     LVArray<css_style_ref_t> * list = _styles.getIndex();
     stylebuf.putMagic(styles_magic);
     stylebuf << stHash;
+    // saved so that nodes don't all need to be read to check the style hash after loading
+    stylebuf << _nodeStyleHash << _nodeDisplayStyleHash;
     stylebuf << (lUInt32)list->length(); // index
     for ( int i=0; i<list->length(); i++ ) {
         css_style_ref_t rec = list->get(i);
@@ -11603,6 +11600,8 @@ bool tinyNodeCollection::loadStylesData()
     lUInt32 stHash = 0;
     lInt32 len = 0;
     lUInt32 myHash = _stylesheet.getHash();
+    lUInt32 nodeStyleHash = 0;
+    lUInt32 nodeDisplayStyleHash = 0;
 
     //LVArray<css_style_ref_t> * list = _styles.getIndex();
     stylebuf.checkMagic(styles_magic);
@@ -11611,6 +11610,7 @@ bool tinyNodeCollection::loadStylesData()
         CRLog::info("tinyNodeCollection::loadStylesData() - stylesheet hash is changed: skip loading styles");
         return false;
     }
+    stylebuf >> nodeStyleHash >> nodeDisplayStyleHash;
     stylebuf >> len; // index
     if ( stylebuf.error() )
         return false;
@@ -11631,6 +11631,8 @@ bool tinyNodeCollection::loadStylesData()
 
     CRLog::trace("Setting style data: %d bytes", stylebuf.size());
     _styles.setIndex( list );
+    _nodeStyleHash = nodeStyleHash;
+    _nodeDisplayStyleHash = nodeDisplayStyleHash;
 
     return !stylebuf.error();
 }
@@ -11665,33 +11667,15 @@ lUInt32 tinyNodeCollection::calcStyleHash()
             if ( offs + sz > _elemCount+1 ) {
                 sz = _elemCount+1 - offs;
             }
-            ldomNode * buf = _elemList[i];
+            ldomNode * buf = getElemPart(i);
             for ( int j=0; j<sz; j++ ) {
                 if ( buf[j].isElement() ) {
-                    css_style_ref_t style = buf[j].getStyle();
-                    lUInt32 sh = calcHash( style );
-                    res = res * 31 + sh;
-                    if (!style.isNull()) {
-                        _nodeDisplayStyleHash = _nodeDisplayStyleHash * 31 + style.get()->display;
-                        // Also account in this hash if this node is "white_space: pre"
-                        // If white_space change from/to "pre" to/from any other value,
-                        // the document will need to be reloaded so that the HTML text parts
-                        // are parsed according the the PRE/not-PRE rules
-                        if (style.get()->white_space == css_ws_pre) _nodeDisplayStyleHash += 29;
-                        // Also account for style->float_, as it should create/remove new floatBox
-                        // elements wrapping floats when toggling BLOCK_RENDERING_G(ENHANCED)
-                        if (style.get()->float_ > css_f_none) _nodeDisplayStyleHash += 123;
-                    }
-                    //printf("element %d %d style hash: %x\n", i, j, sh);
-                    LVFontRef font = buf[j].getFont();
-                    lUInt32 fh = calcHash( font );
-                    res = res * 31 + fh;
-                    //printf("element %d %d font hash: %x\n", i, j, fh);
-//                    if ( maxlog>0 && sh==0 ) {
-//                        style = buf[j].getStyle();
-//                        CRLog::trace("[%06d] : s=%08x f=%08x  res=%08x", offs+j, sh, fh, res);
-//                        maxlog--;
-//                    }
+                    ldomNodeStyleInfo info;
+                    _styleStorage.getStyleData( buf[j]._handle._dataIndex, &info );
+                    lUInt32 sh, dh;
+                    calcNodeStyleHash( buf[j]._handle._dataIndex, info, sh, dh );
+                    res += sh;
+                    _nodeDisplayStyleHash += dh;
                 }
             }
         }
@@ -11729,7 +11713,7 @@ bool tinyNodeCollection::validateDocument()
         if ( offs + sz > _elemCount+1 ) {
             sz = _elemCount+1 - offs;
         }
-        ldomNode * buf = _elemList[i];
+        ldomNode * buf = getElemPart(i);
         for ( int j=0; j<sz; j++ ) {
             buf[j].setDocumentIndex( _docIndex );
             if ( buf[j].isElement() ) {
@@ -11761,82 +11745,14 @@ bool tinyNodeCollection::validateDocument()
 
 bool tinyNodeCollection::updateLoadedStyles( bool enabled )
 {
-    int count = ((_elemCount+TNC_PART_LEN-1) >> TNC_PART_SHIFT);
-    bool res = true;
-    LVArray<css_style_ref_t> * list = _styles.getIndex();
-
+    // Fonts are resolved from styles by initLoadedNodeStyle() as each part
+    // of nodes is read from the cache file (only the root one for now).
     _fontMap.clear(); // style index to font index
-
-    for ( int i=0; i<count; i++ ) {
-        int offs = i*TNC_PART_LEN;
-        int sz = TNC_PART_LEN;
-        if ( offs + sz > _elemCount+1 ) {
-            sz = _elemCount+1 - offs;
-        }
-        ldomNode * buf = _elemList[i];
-        for ( int j=0; j<sz; j++ ) {
-            buf[j].setDocumentIndex( _docIndex );
-            if ( buf[j].isElement() ) {
-                lUInt16 style = getNodeStyleIndex( buf[j]._handle._dataIndex );
-                if ( enabled && style!=0 ) {
-                    css_style_ref_t s = list->get( style );
-                    if ( !s.isNull() ) {
-                        lUInt16 fntIndex = _fontMap.get( style );
-                        if ( fntIndex==0 ) {
-                            LVFontRef fnt = getFont(s.get(), getFontContextDocIndex());
-                            fntIndex = (lUInt16)_fonts.cache( fnt );
-                            if ( fnt.isNull() ) {
-                                CRLog::error("font not found for style!");
-                            } else {
-                                _fontMap.set(style, fntIndex);
-                            }
-                        } else {
-                            _fonts.addIndexRef( fntIndex );
-                        }
-                        if ( fntIndex<=0 ) {
-                            CRLog::error("font caching failed for style!");
-                            res = false;
-                        } else {
-                            setNodeFontIndex( buf[j]._handle._dataIndex, fntIndex );
-                            //buf[j]._data._pelem._fontIndex = fntIndex;
-                        }
-                    } else {
-                        CRLog::error("Loaded style index %d not found in style collection", (int)style);
-                        setNodeFontIndex( buf[j]._handle._dataIndex, 0 );
-                        setNodeStyleIndex( buf[j]._handle._dataIndex, 0 );
-//                        buf[j]._data._pelem._styleIndex = 0;
-//                        buf[j]._data._pelem._fontIndex = 0;
-                        res = false;
-                    }
-                } else {
-                    setNodeFontIndex( buf[j]._handle._dataIndex, 0 );
-                    setNodeStyleIndex( buf[j]._handle._dataIndex, 0 );
-//                    buf[j]._data._pelem._styleIndex = 0;
-//                    buf[j]._data._pelem._fontIndex = 0;
-                }
-            }
-        }
-    }
-#ifdef TODO_INVESTIGATE
-    if ( enabled && res) {
-        //_styles.setIndex( *list );
-        // correct list reference counters
-
-        for ( int i=0; i<list->length(); i++ ) {
-            if ( !list->get(i).isNull() ) {
-                // decrease reference counter
-                // TODO:
-                //_styles.release( list->get(i) );
-            }
-        }
-    }
-#endif
-    delete list;
-//    getRootNode()->setFont( _def_font );
-//    getRootNode()->setStyle( _def_style );
-    _nodeStyleHash = 0;
-    return res;
-}
+    _lazyStylesEnabled = enabled;
+    if ( !enabled )
+        _nodeStyleHash = 0;
+    return getElemPart(0) != NULL;
+}
 
 /// swaps to cache file or saves changes, limited by time interval
 ContinuousOperationResult ldomDocument::swapToCache( CRTimerUtil & maxTime )
@@ -11902,114 +11818,260 @@ ContinuousOperationResult ldomDocument::updateMap(CRTimerUtil & maxTime, LVDocVi
 
 #endif
 
-static const char * doccache_magic = "CoolReader3 Document Cache Directory Index\nV1.00\n";
+static const char * doccache_magic = "CoolReader3 Document Cache Directory Index\nV2.00\n";
+
+// document cache index records
+#define DOCCACHE_RECORD_ACCESS 'A' // file created or opened: size and access sequence number
+#define DOCCACHE_RECORD_REMOVE 'R' // file removed
+// index is rewritten once it has this many records more than twice the number of files
+#define DOCCACHE_INDEX_SLACK 64
 
 /// document cache
+/**
+    Files are evicted in least recently used order to keep total size within
+    the limit. Index cr3cache.inx is a journal: access and removal records are
+    appended, and on each call records added by other processes since the last
+    one are read, so several processes can share one cache directory. Access
+    is serialized by lock on cr3cache.lock: shared for lookups, exclusive for
+    changes. Index is rewritten from scratch when it gets much larger than the
+    list of files, or when its tail is damaged.
+*/
 class ldomDocCacheImpl : public ldomDocCache
 {
     lString16 _cacheDir;
     lvsize_t _maxSize;
-    lUInt32 _oldStreamSize;
-    lUInt32 _oldStreamCRC;
 
     struct FileItem {
         lString16 filename;
         lUInt32 size;
+        lUInt32 access; // access sequence number, highest for most recently used file
     };
     LVPtrVector<FileItem> _files;
-public:
-    ldomDocCacheImpl( lString16 cacheDir, lvsize_t maxSize )
-        : _cacheDir( cacheDir ), _maxSize( maxSize ), _oldStreamSize(0), _oldStreamCRC(0)
+    LVFileLock _lock;
+    lUInt32 _generation; // index id, changed when index is rewritten
+    lUInt32 _indexPos;   // bytes of index already read
+    int _records;        // number of records in index
+    bool _indexValid;    // index is read up to its end, records may be appended
+    lUInt32 _lastAccess;
+    int _hits;
+    int _misses;
+    int _evictions;
+
+    /// holds lock on cache directory, with list of files updated from index
+    class IndexLock {
+        ldomDocCacheImpl * _cache;
+    public:
+        bool found; // index file exists and has valid header
+        IndexLock( ldomDocCacheImpl * cache, bool exclusive ) : _cache( cache )
+        {
+            if ( _cache->_lock.isOpen() && !_cache->_lock.lock( exclusive ) )
+                CRLog::error("Cannot lock document cache directory %s", UnicodeToUtf8(_cache->_cacheDir).c_str() );
+            found = _cache->readIndex();
+        }
+        ~IndexLock()
+        {
+            _cache->_lock.unlock();
+        }
+    };
+
+    lString16 indexFileName()
     {
-        LVAppendPathDelimiter( _cacheDir );
-        CRLog::trace("ldomDocCacheImpl(%s maxSize=%d)", LCSTR(_cacheDir), (int)maxSize);
+        return _cacheDir + "cr3cache.inx";
     }
 
-    bool writeIndex()
+    static int headerSize()
     {
-        lString16 filename = _cacheDir + "cr3cache.inx";
-        if (_oldStreamSize == 0)
-        {
-            LVStreamRef oldStream = LVOpenFileStream(filename.c_str(), LVOM_READ);
-            if (!oldStream.isNull()) {
-                _oldStreamSize = (lUInt32)oldStream->GetSize();
-                _oldStreamCRC = (lUInt32)oldStream->getcrc32();
-            }
+        return (int)strlen( doccache_magic ) + 8;
+    }
+
+    void putRecord( SerialBuf & buf, lUInt8 op, FileItem * item )
+    {
+        int start = buf.pos();
+        buf << op << item->access << item->size << item->filename;
+        buf.putCRC( buf.pos() - start );
+    }
+
+    /// reads and applies one index record, returns false if record is incomplete or damaged
+    bool readRecord( SerialBuf & buf )
+    {
+        int start = buf.pos();
+        lUInt8 op = 0;
+        lUInt32 access = 0;
+        lUInt32 size = 0;
+        lString16 filename;
+        buf >> op >> access >> size >> filename;
+        if ( !buf.checkCRC( buf.pos() - start ) )
+            return false;
+        _records++;
+        int index = findFileIndex( filename );
+        if ( op == DOCCACHE_RECORD_REMOVE ) {
+            if ( index >= 0 )
+                _files.erase( index, 1 );
+            return true;
+        }
+        if ( index < 0 ) {
+            FileItem * item = new FileItem();
+            item->filename = filename;
+            _files.add( item );
+            index = _files.length() - 1;
+        }
+        _files[index]->size = size;
+        _files[index]->access = access;
+        if ( _lastAccess < access )
+            _lastAccess = access;
+        return true;
+    }
+
+    /// reads records added to index since last call, or whole index if it has been rewritten; returns false if there is no valid index
+    bool readIndex()
+    {
+        _indexValid = false;
+        LVStreamRef stream = LVOpenFileStream( indexFileName().c_str(), LVOM_READ );
+        if ( stream.isNull() )
+            return false;
+        lUInt32 size = (lUInt32)stream->GetSize();
+        int hsize = headerSize();
+        if ( size < (lUInt32)hsize )
+            return false;
+        LVArray<lUInt8> data( hsize, 0 );
+        lvsize_t bytesRead = 0;
+        if ( stream->Read( data.get(), hsize, &bytesRead ) != LVERR_OK || bytesRead != (lvsize_t)hsize )
+            return false;
+        SerialBuf hdr( data.get(), hsize );
+        lUInt32 generation = 0;
+        if ( !hdr.checkMagic( doccache_magic ) ) {
+            CRLog::error("wrong cache index file format");
+            return false;
+        }
+        hdr >> generation;
+        if ( !hdr.checkCRC( 4 ) ) {
+            CRLog::error("CRC32 doesn't match in cache index file");
+            return false;
+        }
+        if ( generation != _generation || _indexPos < (lUInt32)hsize || _indexPos > size ) {
+            // rewritten by another process
+            _files.clear();
+            _records = 0;
+            _generation = generation;
+            _indexPos = hsize;
+        }
+        if ( _indexPos < size ) {
+            int len = (int)(size - _indexPos);
+            data.reserve( len );
+            if ( stream->SetPos( _indexPos ) != _indexPos || stream->Read( data.get(), len, &bytesRead ) != LVERR_OK )
+                return true;
+            SerialBuf buf( data.get(), (int)bytesRead );
+            int pos = 0;
+            while ( pos < (int)bytesRead && readRecord( buf ) )
+                pos = buf.pos();
+            _indexPos += pos;
         }
+        _indexValid = _indexPos == size;
+        return true;
+    }
 
-        // fill buffer
+    /// rewrites index with one record per file, caller holds exclusive lock
+    bool writeIndex()
+    {
         SerialBuf buf( 16384, true );
         buf.putMagic( doccache_magic );
-        lUInt32 start = buf.pos();
-        int count = _files.length();
-        buf << (lUInt32)count;
-        for ( int i=0; i<count && !buf.error(); i++ ) {
-            FileItem * item = _files[i];
-            buf << item->filename;
-            buf << item->size;
-            CRLog::trace("cache item: %s %d", LCSTR(item->filename), (int)item->size);
-        }
+        int start = buf.pos();
+        lUInt32 generation = lStr_crc32( _generation, doccache_magic, 8 ) ^ (lUInt32)GetCurrentTimeMillis() ^ (lUInt32)_records;
+        if ( generation == _generation )
+            generation++;
+        buf << generation;
         buf.putCRC( buf.pos() - start );
+        for ( int i=0; i<_files.length(); i++ )
+            putRecord( buf, DOCCACHE_RECORD_ACCESS, _files[i] );
         if ( buf.error() )
             return false;
-        lUInt32 newCRC = buf.getCRC();
-        lUInt32 newSize = buf.pos();
-
-        // check to avoid rewritting of identical file
-        if (newCRC != _oldStreamCRC || newSize != _oldStreamSize) {
-            // changed: need to write
-            CRLog::trace("Writing cache index");
-            LVStreamRef stream = LVOpenFileStream(filename.c_str(), LVOM_WRITE);
-            if ( !stream )
-                return false;
-            if ( stream->Write( buf.buf(), buf.pos(), NULL )!=LVERR_OK )
-                return false;
-            _oldStreamCRC = newCRC;
-            _oldStreamSize = newSize;
+        CRLog::trace("Writing cache index, %d files", _files.length());
+        LVStreamRef stream = LVOpenFileStream( indexFileName().c_str(), LVOM_WRITE );
+        if ( !stream )
+            return false;
+        if ( stream->Write( buf.buf(), buf.pos(), NULL )!=LVERR_OK )
+            return false;
+        _generation = generation;
+        _indexPos = buf.pos();
+        _records = _files.length();
+        _indexValid = true;
+        return true;
+    }
+
+    /// appends record to index, caller holds exclusive lock
+    bool appendRecord( lUInt8 op, FileItem * item )
+    {
+        if ( !_indexValid || _records >= _files.length() * 2 + DOCCACHE_INDEX_SLACK )
+            return writeIndex();
+        SerialBuf buf( 256, true );
+        putRecord( buf, op, item );
+        LVStreamRef stream = LVOpenFileStream( indexFileName().c_str(), LVOM_APPEND );
+        if ( stream.isNull() || stream->SetPos( _indexPos ) != _indexPos
+             || stream->Write( buf.buf(), buf.pos(), NULL ) != LVERR_OK ) {
+            _indexValid = false;
+            return false;
         }
+        _indexPos += buf.pos();
+        _records++;
         return true;
     }
 
-    bool readIndex(  )
+    /// marks file as most recently used, adding it to index if absent; caller holds exclusive lock
+    bool touchFile( lString16 filename, lUInt32 size )
     {
-        lString16 filename = _cacheDir + "cr3cache.inx";
-        // read index
-        lUInt32 totalSize = 0;
-        LVStreamRef instream = LVOpenFileStream( filename.c_str(), LVOM_READ );
-        if ( !instream.isNull() ) {
-            LVStreamBufferRef sb = instream->GetReadBuffer(0, instream->GetSize() );
-            if ( !sb )
-                return false;
-            SerialBuf buf( sb->getReadOnly(), sb->getSize() );
-            if ( !buf.checkMagic( doccache_magic ) ) {
-                CRLog::error("wrong cache index file format");
-                return false;
-            }
+        int index = findFileIndex( filename );
+        if ( index < 0 ) {
+            if ( !LVFileExists( _cacheDir + filename ) )
+                return false; // removed by another process meanwhile
+            FileItem * item = new FileItem();
+            item->filename = filename;
+            _files.add( item );
+            index = _files.length() - 1;
+        }
+        _files[index]->size = size;
+        _files[index]->access = ++_lastAccess;
+        return appendRecord( DOCCACHE_RECORD_ACCESS, _files[index] );
+    }
 
-            lUInt32 start = buf.pos();
-            lUInt32 count;
-            buf >> count;
-            for (lUInt32 i=0; i < count && !buf.error(); i++) {
-                FileItem * item = new FileItem();
-                _files.add( item );
-                buf >> item->filename;
-                buf >> item->size;
-                CRLog::trace("cache %d: %s [%d]", i, UnicodeToUtf8(item->filename).c_str(), (int)item->size );
-                totalSize += item->size;
-            }
-            if ( !buf.checkCRC( buf.pos() - start ) ) {
-                CRLog::error("CRC32 doesn't match in cache index file");
-                return false;
-            }
+    /// removes file from index, caller holds exclusive lock
+    void forgetFile( int index )
+    {
+        appendRecord( DOCCACHE_RECORD_REMOVE, _files[index] );
+        _files.erase( index, 1 );
+    }
 
-            if ( buf.error() )
-                return false;
+    static int compareAccess( const void * a, const void * b )
+    {
+        lUInt32 a1 = (*(FileItem * const *)a)->access;
+        lUInt32 b1 = (*(FileItem * const *)b)->access;
+        return a1 < b1 ? -1 : (a1 > b1 ? 1 : 0);
+    }
 
-            CRLog::info( "Document cache index file read ok, %d files in cache, %d bytes", _files.length(), totalSize );
-            return true;
-        } else {
-            CRLog::error( "Document cache index file cannot be read" );
-            return false;
+public:
+    ldomDocCacheImpl( lString16 cacheDir, lvsize_t maxSize )
+        : _cacheDir( cacheDir ), _maxSize( maxSize ), _generation(0), _indexPos(0), _records(0)
+        , _indexValid(false), _lastAccess(0), _hits(0), _misses(0), _evictions(0)
+    {
+        LVAppendPathDelimiter( _cacheDir );
+        CRLog::trace("ldomDocCacheImpl(%s maxSize=%d)", LCSTR(_cacheDir), (int)maxSize);
+    }
+
+    /// add all .cr3 files of directory to index, as least recently used
+    void addExistingFiles()
+    {
+        LVContainerRef container = LVOpenDirectory( _cacheDir.c_str(), L"*.cr3" );
+        if ( container.isNull() )
+            return;
+        for ( int i=0; i<container->GetObjectCount(); i++ ) {
+            const LVContainerItemInfo * info = container->GetObjectInfo( i );
+            lString16 fn = info->GetName();
+            if ( info->IsContainer() || !fn.endsWith(".cr3") || findFileIndex( fn ) >= 0 )
+                continue;
+            FileItem * item = new FileItem();
+            item->filename = fn;
+            item->size = (lUInt32)info->GetSize();
+            item->access = 0;
+            _files.add( item );
         }
     }
 
@@ -12019,15 +12081,8 @@ public:
         LVContainerRef container;
         container = LVOpenDirectory( _cacheDir.c_str(), L"*.cr3" );
         if ( container.isNull() ) {
-            if ( !LVCreateDirectory( _cacheDir ) ) {
-                CRLog::error("Cannot create directory %s", UnicodeToUtf8(_cacheDir).c_str() );
-                return false;
-            }
-            container = LVOpenDirectory( _cacheDir.c_str(), L"*.cr3" );
-            if ( container.isNull() ) {
-                CRLog::error("Cannot open directory %s", UnicodeToUtf8(_cacheDir).c_str() );
-                return false;
-            }
+            CRLog::error("Cannot open directory %s", UnicodeToUtf8(_cacheDir).c_str() );
+            return false;
         }
         for ( int i=0; i<container->GetObjectCount(); i++ ) {
             const LVContainerItemInfo * item = container->GetObjectInfo( i );
@@ -12047,32 +12102,50 @@ public:
         return true;
     }
 
-    // remove all extra files to add new one of specified size
+    /// remove least recently used files to add new one of specified size, caller holds exclusive lock
     bool reserve( lvsize_t allocSize )
     {
-        bool res = true;
-        // remove extra files specified in list
+        // take actual sizes from directory: files grow after they are added to index
+        LVArray<lUInt8> found( _files.length(), 0 );
+        LVContainerRef container = LVOpenDirectory( _cacheDir.c_str(), L"*.cr3" );
+        for ( int i=0; !container.isNull() && i<container->GetObjectCount(); i++ ) {
+            const LVContainerItemInfo * info = container->GetObjectInfo( i );
+            int index = info->IsContainer() ? -1 : findFileIndex( info->GetName() );
+            if ( index >= 0 ) {
+                found[index] = 1;
+                _files[index]->size = (lUInt32)info->GetSize();
+            }
+        }
         lvsize_t dirsize = allocSize;
-        for ( int i=0; i<_files.length(); ) {
-            if ( LVFileExists( _cacheDir + _files[i]->filename ) ) {
-                if ( (i>0 || allocSize>0) && dirsize+_files[i]->size > _maxSize ) {
-                    if ( LVDeleteFile( _cacheDir + _files[i]->filename ) ) {
-                        _files.erase(i, 1);
-                    } else {
-                        CRLog::error("Cannot delete cache file %s", UnicodeToUtf8(_files[i]->filename).c_str() );
-                        dirsize += _files[i]->size;
-                        res = false;
-                        i++;
-                    }
-                } else {
-                    dirsize += _files[i]->size;
-                    i++;
-                }
+        for ( int i=_files.length()-1; i>=0; i-- ) {
+            if ( found[i] ) {
+                dirsize += _files[i]->size;
             } else {
                 CRLog::error("File %s is found in cache index, but does not exist", UnicodeToUtf8(_files[i]->filename).c_str() );
-                _files.erase(i, 1);
+                forgetFile( i );
             }
         }
+        if ( dirsize <= _maxSize )
+            return true;
+        bool res = true;
+        LVArray<FileItem*> lru( _files.length(), NULL );
+        for ( int i=0; i<_files.length(); i++ )
+            lru[i] = _files[i];
+        qsort( lru.get(), lru.length(), sizeof(FileItem*), compareAccess );
+        // most recently used file is kept unless room for new one is needed
+        int count = allocSize > 0 ? lru.length() : lru.length() - 1;
+        for ( int i=0; i<count && dirsize > _maxSize; i++ ) {
+            FileItem * item = lru[i];
+            if ( !LVDeleteFile( _cacheDir + item->filename ) ) {
+                CRLog::error("Cannot delete cache file %s", UnicodeToUtf8(item->filename).c_str() );
+                res = false;
+                continue;
+            }
+            CRLog::debug("Removing cache file %s to keep cache size within limit", UnicodeToUtf8(item->filename).c_str() );
+            dirsize -= item->size;
+            _evictions++;
+            forgetFile( findFileIndex( item->filename ) );
+        }
         return res;
     }
 
@@ -12085,52 +12158,55 @@ public:
         return -1;
     }
 
-    bool moveFileToTop( lString16 filename, lUInt32 size )
-    {
-        int index = findFileIndex( filename );
-        if ( index<0 ) {
-            FileItem * item = new FileItem();
-            item->filename = filename;
-            item->size = size;
-            _files.insert( 0, item );
-        } else {
-            _files.move( 0, index );
-            _files[0]->size = size;
-        }
-        return writeIndex();
-    }
-
     bool init()
     {
         CRLog::info("Initialize document cache in directory %s", UnicodeToUtf8(_cacheDir).c_str() );
-        // read index
-        if ( readIndex(  ) ) {
-            // read successfully
+        if ( !LVDirectoryExists( _cacheDir ) && !LVCreateDirectory( _cacheDir ) ) {
+            CRLog::error("Document Cache: cannot create cache directory %s, disabling cache", UnicodeToUtf8(_cacheDir).c_str() );
+            return false;
+        }
+        if ( !_lock.open( _cacheDir + "cr3cache.lock" ) )
+            CRLog::error("Document Cache: cannot create lock file, cache directory must not be shared");
+        IndexLock lock( this, true );
+        if ( lock.found ) {
             // remove files not specified in list
             removeExtraFiles( );
         } else {
-            if ( !LVCreateDirectory( _cacheDir ) ) {
-                CRLog::error("Document Cache: cannot create cache directory %s, disabling cache", UnicodeToUtf8(_cacheDir).c_str() );
-                return false;
-            }
-            _files.clear();
-
+            // no index or index of older version: keep files, their usage order is lost
+            addExistingFiles();
         }
         reserve(0);
-        if ( !writeIndex() )
+        if ( !_indexValid && !writeIndex() )
             return false; // cannot write index: read only?
+        CRLog::info( "Document cache index read ok, %d files in cache", _files.length() );
         return true;
     }
 
     /// remove all files
     bool clear()
     {
+        IndexLock lock( this, true );
         for ( int i=0; i<_files.length(); i++ )
-            LVDeleteFile( _files[i]->filename );
+            LVDeleteFile( _cacheDir + _files[i]->filename );
         _files.clear();
         return writeIndex();
     }
 
+    /// returns cache counters
+    ldomDocCacheStats getStats()
+    {
+        IndexLock lock( this, false );
+        ldomDocCacheStats stats;
+        stats.hits = _hits;
+        stats.misses = _misses;
+        stats.evictions = _evictions;
+        stats.files = _files.length();
+        stats.size = 0;
+        for ( int i=0; i<_files.length(); i++ )
+            stats.size += _files[i]->size;
+        return stats;
+    }
+
     // dir/filename.{crc32}.cr3
     lString16 makeFileName( lString16 filename, lUInt32 crc, lUInt32 docFlags )
     {
@@ -12185,16 +12261,22 @@ public:
             }
         }
         LVStreamRef res;
-        if ( findFileIndex( fn ) < 0 ) {
-            CRLog::error( "ldomDocCache::openExisting - File %s is not found in cache index", UnicodeToUtf8(fn).c_str() );
-            return res;
-        }
         lString16 pathname = _cacheDir + fn;
-        res = LVOpenFileStream( pathname.c_str(), LVOM_APPEND|LVOM_FLAG_SYNC );
+        {
+            IndexLock lock( this, false );
+            if ( findFileIndex( fn ) < 0 ) {
+                CRLog::error( "ldomDocCache::openExisting - File %s is not found in cache index", UnicodeToUtf8(fn).c_str() );
+                _misses++;
+                return res;
+            }
+            res = LVOpenFileStream( pathname.c_str(), LVOM_APPEND|LVOM_FLAG_SYNC );
+        }
         if ( !res ) {
             CRLog::error( "ldomDocCache::openExisting - File %s is listed in cache index, but cannot be opened", UnicodeToUtf8(fn).c_str() );
+            _misses++;
             return res;
         }
+        _hits++;
         cachePath = pathname;
 
 #if ENABLED_BLOCK_WRITE_CACHE
@@ -12211,7 +12293,8 @@ public:
 #endif
 
         lUInt32 fileSize = (lUInt32) res->GetSize();
-        moveFileToTop( fn, fileSize );
+        IndexLock lock( this, true );
+        touchFile( fn, fileSize );
         return res;
     }
 
@@ -12240,8 +12323,7 @@ public:
                 return stream;
             }
         }
-        if ( findFileIndex( pathname ) >= 0 )
-            LVDeleteFile( pathname );
+        IndexLock lock( this, true );
         reserve( fileSize/10 );
         //res = LVMapFileStream( (_cacheDir+fn).c_str(), LVOM_APPEND, fileSize );
         LVDeleteFile( pathname ); // try to delete, ignore errors
@@ -12262,7 +12344,7 @@ public:
         res = LVCreateCompareTestStream(res, stream2);
 #endif
 #endif
-        moveFileToTop( fn, fileSize );
+        touchFile( fn, fileSize );
         return res;
     }
 
@@ -12299,6 +12381,7 @@ bool ldomDocCache::close()
 /// open existing cache file stream
 LVStreamRef ldomDocCache::openExisting( lString16 filename, lUInt32 crc, lUInt32 docFlags, lString16 &cachePath )
 {
+    DOCUMENT_GUARD
     if ( !_cacheInstance )
         return LVStreamRef();
     return _cacheInstance->openExisting( filename, crc, docFlags, cachePath );
@@ -12307,6 +12390,7 @@ LVStreamRef ldomDocCache::openExisting( lString16 filename, lUInt32 crc, lUInt32
 /// create new cache file
 LVStreamRef ldomDocCache::createNew( lString16 filename, lUInt32 crc, lUInt32 docFlags, lUInt32 fileSize, lString16 &cachePath )
 {
+    DOCUMENT_GUARD
     if ( !_cacheInstance )
         return LVStreamRef();
     return _cacheInstance->createNew( filename, crc, docFlags, fileSize, cachePath );
@@ -12315,6 +12399,7 @@ LVStreamRef ldomDocCache::createNew( lString16 filename, lUInt32 crc, lUInt32 do
 /// delete all cache files
 bool ldomDocCache::clear()
 {
+    DOCUMENT_GUARD
     if ( !_cacheInstance )
         return false;
     return _cacheInstance->clear();
@@ -12326,6 +12411,18 @@ bool ldomDocCache::enabled()
     return _cacheInstance!=NULL;
 }
 
+/// returns cache counters, zeroes if cache is disabled
+ldomDocCacheStats ldomDocCache::getStats()
+{
+    DOCUMENT_GUARD
+    if ( !_cacheInstance ) {
+        ldomDocCacheStats stats;
+        memset( &stats, 0, sizeof(stats) );
+        return stats;
+    }
+    return _cacheInstance->getStats();
+}
+
 //void calcStyleHash( ldomNode * node, lUInt32 & value )
 //{
 //    if ( !node )
@@ -12356,7 +12453,8 @@ void ldomDocument::updateRenderContext()
 {
     int dx = _page_width;
     int dy = _page_height;
-    _nodeStyleHash = 0; // force recalculation by calcStyleHash()
+    // _nodeStyleHash is kept up to date by node style changes, or
+    // recalculated by calcStyleHash() when it has been invalidated
     lUInt32 styleHash = calcStyleHash();
     lUInt32 stylesheetHash = (((_stylesheet.getHash() * 31) + calcHash(_def_style))*31 + calcHash(_def_font));
     //calcStyleHash( getRootNode(), styleHash );
@@ -12366,6 +12464,7 @@ void ldomDocument::updateRenderContext()
     _hdr.render_dy = dy;
     _hdr.render_docflags = _docFlags;
     _hdr.node_displaystyle_hash = _nodeDisplayStyleHashInitial; // we keep using the initial one
+    saveRenderedStyleSheet();
     CRLog::info("Updating render properties: styleHash=%x, stylesheetHash=%x, docflags=%x, width=%x, height=%x, nodeDisplayStyleHash=%x",
                 _hdr.render_style_hash, _hdr.stylesheet_hash, _hdr.render_docflags, _hdr.render_dx, _hdr.render_dy, _hdr.node_displaystyle_hash);
 }
@@ -12418,6 +12517,7 @@ bool ldomDocument::checkRenderContext()
     // this is implicitely done by styleHash != _hdr.render_style_hash (whose _nodeDisplayStyleHash is a subset)
     _just_rendered_from_cache = false;
     if ( res ) {
+        saveRenderedStyleSheet();
 
         //if ( pages->length()==0 ) {
 //            _pagesData.reset();
@@ -12504,6 +12604,40 @@ void tinyNodeCollection::compact()
     _styleStorage.compact(0xFFFFFF);
 }
 
+#if (CR_CONCURRENT_DOCUMENTS==1)
+/// document is going to be read by several threads at once, until endConcurrentReads()
+void tinyNodeCollection::beginConcurrentReads()
+{
+    if ( !_concurrentReadsMutex && concurrencyProvider )
+        _concurrentReadsMutex = concurrencyProvider->createMutex();
+#if BUILD_LITE!=1
+    if ( !_concurrentReads ) {
+        // Node parts not yet read from cache file are read now: reading one
+        // changes node lists and the font cache, which readers use unlocked.
+        for ( int i=0; i <= (_elemCount >> TNC_PART_SHIFT); i++ )
+            if ( !_elemList[i] )
+                loadNodePart( true, i );
+        for ( int i=0; i <= (_textCount >> TNC_PART_SHIFT); i++ )
+            if ( !_textList[i] )
+                loadNodePart( false, i );
+    }
+#endif
+    _concurrentReads++;
+}
+
+/// ends beginConcurrentReads(), compacts storage
+void tinyNodeCollection::endConcurrentReads()
+{
+    if ( --_concurrentReads )
+        return;
+    // chunks unpacked by readers were kept
+    _textStorage.compact(0);
+    _elemStorage.compact(0);
+    _rectStorage.compact(0);
+    _styleStorage.compact(0);
+}
+#endif
+
 /// allocate new tinyElement
 ldomNode * tinyNodeCollection::allocTinyElement( ldomNode * parent, lUInt16 nsid, lUInt16 id )
 {
@@ -13306,7 +13440,7 @@ lString16 ldomNode::getText( lChar16 blockDelimiter, int maxSize ) const
         break;
 #if BUILD_LITE!=1
     case NT_PTEXT:
-        return Utf8ToUnicode(getDocument()->_textStorage.getText( _data._ptext_addr ));
+        return getDocument()->_textStorage.getTextRef( _data._ptext_addr ).getText();
 #endif
     case NT_TEXT:
         return _data._text_ptr->getText16();
@@ -13314,6 +13448,36 @@ lString16 ldomNode::getText( lChar16 blockDelimiter, int maxSize ) const
     return lString16::empty_str;
 }
 
+/// returns count characters from start character as wide string
+lString16 ldomTextRef::substr( int start, int count ) const
+{
+    const char * s = _text;
+    const char * e = end();
+    for ( int i=0; i<start && s<e; i++ )
+        Utf8NextChar( s, e );
+    const char * p = s;
+    for ( int i=0; i<count && p<e; i++ )
+        Utf8NextChar( p, e );
+    lString16 res;
+    Utf8ToUnicode( s, (int)(p - s), res );
+    return res;
+}
+
+/// returns text node text as utf8, accessed in place (empty for elements)
+ldomTextRef ldomNode::getTextRef() const
+{
+    ASSERT_NODE_NOT_NULL;
+    switch ( TNTYPE ) {
+#if BUILD_LITE!=1
+    case NT_PTEXT:
+        return getDocument()->_textStorage.getTextRef( _data._ptext_addr );
+#endif
+    case NT_TEXT:
+        return ldomTextRef( _data._text_ptr->getText() );
+    }
+    return ldomTextRef();
+}
+
 /// returns text node text as utf8 string
 lString8 ldomNode::getText8( lChar8 blockDelimiter, int maxSize ) const
 {
@@ -13470,6 +13634,23 @@ void ldomNode::setRenderData( lvdomElementFormatRec & newData)
     getDocument()->_rectStorage.setRendRectData(_handle._dataIndex, &newData);
 }
 
+/// returns render data structure in place, pinning its storage chunk; NULL for non-element node
+lvdomElementFormatRec * ldomNode::pinRenderData( ldomTextStorageChunk * & chunk )
+{
+    ASSERT_NODE_NOT_NULL;
+    if ( !isElement() ) {
+        chunk = NULL;
+        return NULL;
+    }
+    return getDocument()->_rectStorage.pinRendRectData(_handle._dataIndex, chunk);
+}
+
+/// releases storage chunk pinned by pinRenderData()
+void ldomNode::unpinRenderData( ldomTextStorageChunk * chunk )
+{
+    getDocument()->_rectStorage.unpinRendRectData(chunk);
+}
+
 /// sets node rendering structure pointer
 void ldomNode::clearRenderData()
 {
@@ -13528,7 +13709,7 @@ static void updateStyleData( ldomNode * node )
 #endif
 
 #if BUILD_LITE!=1
-static void updateStyleDataRecursive( ldomNode * node, LVDocViewCallback * progressCallback, int & lastProgressPercent )
+static void updateStyleDataRecursive( ldomNode * node, LVDocViewCallback * progressCallback, int & lastProgressPercent, int & count )
 {
     if ( !node->isElement() )
         return;
@@ -13554,27 +13735,139 @@ static void updateStyleDataRecursive( ldomNode * node, LVDocViewCallback * progr
     }
 
     node->initNodeStyle();
+    count++;
     int n = node->getChildCount();
     for ( int i=0; i<n; i++ ) {
         ldomNode * child = node->getChildNode(i);
         if ( child->isElement() )
-            updateStyleDataRecursive( child, progressCallback, lastProgressPercent );
+            updateStyleDataRecursive( child, progressCallback, lastProgressPercent, count );
     }
     if ( styleSheetChanged )
         node->getDocument()->getStyleSheet()->pop();
 }
 
-/// init render method for the whole subtree
-void ldomNode::initNodeStyleRecursive( LVDocViewCallback * progressCallback )
+/// init node styles for the whole subtree, returns number of elements styled
+int ldomNode::initNodeStyleRecursive( LVDocViewCallback * progressCallback )
 {
     if (progressCallback)
         progressCallback->OnNodeStylesUpdateStart();
     getDocument()->_fontMap.clear();
     int lastProgressPercent = -1;
-    updateStyleDataRecursive( this, progressCallback, lastProgressPercent );
+    int count = 0;
+    updateStyleDataRecursive( this, progressCallback, lastProgressPercent, count );
     //recurseElements( updateStyleData );
     if (progressCallback)
         progressCallback->OnNodeStylesUpdateEnd();
+    return count;
+}
+
+static bool hasChangedStyleElements( ldomNode * node, const LVArray<lUInt8> & changedIds )
+{
+    lUInt16 id = node->getNodeId();
+    if ( id < changedIds.length() && changedIds[id] )
+        return true;
+    int n = node->getChildCount();
+    for ( int i=0; i<n; i++ ) {
+        ldomNode * child = node->getChildNode(i);
+        if ( child->isElement() && hasChangedStyleElements( child, changedIds ) )
+            return true;
+    }
+    return false;
+}
+
+// Same walk as updateStyleDataRecursive(), but only elements with an id in
+// changedIds, and descendants of elements whose style or font did change,
+// get their style recomputed.
+static void restyleElementsRecursive( ldomNode * node, const LVArray<lUInt8> & changedIds, bool parentChanged, int & count )
+{
+    lUInt16 id = node->getNodeId();
+    bool restyle = parentChanged || ( id < changedIds.length() && changedIds[id] );
+    bool styleSheetChanged = false;
+    if ( id==el_DocFragment || id==el_body ) {
+        // avoid parsing embedded stylesheets of untouched fragments
+        if ( !restyle && !hasChangedStyleElements( node, changedIds ) )
+            return;
+        styleSheetChanged = node->applyNodeStylesheet();
+    }
+    bool changed = false;
+    if ( restyle ) {
+        css_style_ref_t style = node->getStyle();
+        font_ref_t font = node->getFont();
+        node->initNodeStyle();
+        count++;
+        // equal styles are shared by the styles cache, as are fonts
+        changed = style.get() != node->getStyle().get() || font.get() != node->getFont().get();
+    }
+    int n = node->getChildCount();
+    for ( int i=0; i<n; i++ ) {
+        ldomNode * child = node->getChildNode(i);
+        if ( child->isElement() )
+            restyleElementsRecursive( child, changedIds, changed, count );
+    }
+    if ( styleSheetChanged )
+        node->getDocument()->getStyleSheet()->pop();
+}
+
+/// remember main stylesheet rules the document styles are computed with
+void ldomDocument::saveRenderedStyleSheet()
+{
+    _stylesheet.getSelectorHashes( _renderedSelectorHashes );
+    _renderedStyleSheetHash = _stylesheet.getHash();
+}
+
+/// recompute styles of only the elements matched by main stylesheet rules changed since last rendering,
+/// returns false if a full styles recomputation is needed
+bool ldomDocument::restyleChangedElements( LVDocViewCallback * callback )
+{
+    // Only changes to the main stylesheet (i.e. style tweaks) are handled here:
+    // the styles currently set on nodes must be the ones computed with the
+    // previously rendered rules, with all other settings unchanged.
+    if ( !_renderedSelectorHashes.length() || _nodeDisplayStyleHashInitial == NODE_DISPLAY_STYLE_HASH_UNITIALIZED )
+        return false;
+    if ( getRootNode()->getFont().isNull() )
+        return false;
+    if ( _docFlags != _hdr.render_docflags || _page_width != (int)_hdr.render_dx || _page_height != (int)_hdr.render_dy )
+        return false;
+    if ( calcStyleHash() != _hdr.render_style_hash )
+        return false;
+    if ( (((_renderedStyleSheetHash * 31) + calcHash(_def_style))*31 + calcHash(_def_font)) != _hdr.stylesheet_hash )
+        return false;
+
+    // Rules are stored by the element name id of their selector subject, so a
+    // changed rules chain can only change the style of these elements (and,
+    // through inheritance, of their descendants). A change in universal
+    // selector rules may match any element.
+    LVArray<lUInt32> hashes;
+    _stylesheet.getSelectorHashes( hashes );
+    int n = hashes.length() > _renderedSelectorHashes.length() ? hashes.length() : _renderedSelectorHashes.length();
+    LVArray<lUInt8> changedIds( n, 0 );
+    int changedCount = 0;
+    for ( int i=0; i<n; i++ ) {
+        lUInt32 oldHash = i < _renderedSelectorHashes.length() ? _renderedSelectorHashes[i] : 0;
+        lUInt32 newHash = i < hashes.length() ? hashes[i] : 0;
+        if ( oldHash != newHash ) {
+            if ( i == 0 )
+                return false;
+            changedIds[i] = 1;
+            changedCount++;
+        }
+    }
+    if ( !changedCount )
+        return false;
+
+    if ( callback )
+        callback->OnNodeStylesUpdateStart();
+    resetNodeNumberingProps();
+    _stylesheet.push();
+    applyDocumentStyleSheet();
+    int count = 0;
+    restyleElementsRecursive( getRootNode(), changedIds, false, count );
+    _stylesheet.pop();
+    if ( callback )
+        callback->OnNodeStylesUpdateEnd();
+    _lastRestyledNodeCount = count;
+    CRLog::info("Restyled %d elements for %d changed selector chains", count, changedCount);
+    return true;
 }
 #endif
 
@@ -13954,11 +14247,13 @@ bool ldomNode::initNodeFont()
         } else {
             getDocument()->_fontMap.set(style, fntIndex);
         }
+        // Set the new index before releasing the previous font, so its
+        // contribution to the style hash can still be known
+        getDocument()->setNodeFontIndex( _handle._dataIndex, fntIndex);
         if ( font != 0 ) {
             if ( font!=fntIndex ) // ???
                 getDocument()->_fonts.release(font);
         }
-        getDocument()->setNodeFontIndex( _handle._dataIndex, fntIndex);
         return true;
     } else {
         if ( font!=fntIndex )
@@ -13978,6 +14273,7 @@ void ldomNode::initNodeStyle()
     // assume all parent styles already initialized
     if ( !getDocument()->isDefStyleSet() )
         return;
+    CR_TRACE_SCOPE(CRTRACE_STYLE);
     if ( isElement() ) {
         if ( isRoot() || getParentNode()->isRoot() )
         {
@@ -14768,7 +15064,12 @@ int ldomNode::renderFinalBlock(  LFormattedTextRef & frmtext, RenderRectAccessor
     LFormattedTextRef f;
     lvdom_element_render_method rm = getRendMethod();
 
-    if ( cache.get( this, f ) ) {
+    bool cached;
+    {
+        DOC_READS_GUARD(getDocument())
+        cached = cache.get( this, f );
+    }
+    if ( cached ) {
         frmtext = f;
         if ( rm != erm_final && rm != erm_list_item && rm != erm_table_caption )
             return 0;
@@ -14784,7 +15085,6 @@ int ldomNode::renderFinalBlock(  LFormattedTextRef & frmtext, RenderRectAccessor
     int direction = RENDER_RECT_PTR_GET_DIRECTION(fmt);
     int flags = styleToTextFmtFlags( getStyle(), 0, direction );
     ::renderFinalBlock( this, f.get(), fmt, flags, 0, -1 );
-    cache.set( this, f );
     bool flg=gFlgFloatingPunctuationEnabled;
     if (this->getNodeName()=="th"||this->getNodeName()=="td"||
             (!this->getParentNode()->isNull()&&this->getParentNode()->getNodeName()=="td")||
@@ -14808,6 +15108,11 @@ int ldomNode::renderFinalBlock(  LFormattedTextRef & frmtext, RenderRectAccessor
     int h = f->Format((lUInt16)width, (lUInt16)page_h, direction, float_footprint);
     gFlgFloatingPunctuationEnabled=flg;
     frmtext = f;
+    {
+        // added once formatted, as another drawing thread may take it from cache
+        DOC_READS_GUARD(getDocument())
+        cache.set( this, frmtext );
+    }
     //CRLog::trace("Created new formatted object for node #%08X", (lUInt32)this);
     return h;
 }
@@ -15148,6 +15453,63 @@ void ldomDocument::buildAlternativeToc()
 }
 
 
+#if BUILD_LITE!=1
+#include "../include/lvdocview.h"
+
+static void collectNodeStyleHashes( ldomNode * node, LVArray<lUInt32> & hashes )
+{
+    css_style_ref_t style = node->getStyle();
+    font_ref_t font = node->getFont();
+    hashes.add( calcHash( style ) * 31 + calcHash( font ) );
+    int n = node->getChildCount();
+    for ( int i=0; i<n; i++ ) {
+        ldomNode * child = node->getChildNode(i);
+        if ( child->isElement() )
+            collectNodeStyleHashes( child, hashes );
+    }
+}
+
+/// checks that a stylesheet change restyles only the matching elements, with the same result as a full restyle
+void runStyleInvalidationUnitTests()
+{
+    CRLog::info("runStyleInvalidationUnitTests()");
+    lString8 html("<html><body>");
+    for ( int i=0; i<50; i++ )
+        html << "<h2>Chapter</h2><p>Some <i>text</i> and <b>more</b> text.</p><blockquote><p>Quote</p></blockquote>";
+    html << "</body></html>";
+    lString8 css("body { text-indent: 1em } i { font-style: italic } blockquote { margin-left: 2em }");
+
+    LVDocView view( 4, true );
+    view.Resize( 600, 800 );
+    view.setStyleSheet( css );
+    MYASSERT( view.LoadDocument( LVCreateStringStream( html ) ), "load document" );
+    view.checkRender();
+    ldomDocument * doc = view.getDocument();
+
+    // b has no children: only the 50 b elements should be restyled
+    view.setStyleSheet( css + " b { color: red }" );
+    view.checkRender();
+    MYASSERT( doc->getLastRestyledNodeCount() == 50, "restyle changed element" );
+    // blockquote font change is inherited by its p child
+    view.setStyleSheet( css + " b { color: red } blockquote { font-size: 80% }" );
+    view.checkRender();
+    MYASSERT( doc->getLastRestyledNodeCount() == 100, "restyle changed element subtree" );
+
+    LVArray<lUInt32> restyled;
+    collectNodeStyleHashes( doc->getRootNode(), restyled );
+    doc->forceReinitStyles();
+    view.requestRender();
+    view.checkRender();
+    MYASSERT( doc->getLastRestyledNodeCount() > 300, "full restyle after reinit" );
+    LVArray<lUInt32> full;
+    collectNodeStyleHashes( doc->getRootNode(), full );
+    MYASSERT( restyled.length() == full.length(), "same element count" );
+    for ( int i=0; i<full.length(); i++ )
+        MYASSERT( restyled[i] == full[i], "same styles as full restyle" );
+    CRLog::info("runStyleInvalidationUnitTests() finished");
+}
+#endif
+
 #if 0 && defined(_DEBUG)
 
 #define TEST_FILE_NAME "/tmp/test-cache-file.dat"
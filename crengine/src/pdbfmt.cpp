@@ -1,5 +1,7 @@
 #include "../include/pdbfmt.h"
+#include "../include/crconcurrent.h"
 #include <ctype.h>
+#include <string.h>
 
 // uncomment following line to save PDB content streams to /tmp
 //#define DUMP_PDB_CONTENTS
@@ -104,6 +106,9 @@ struct PalmDocPreamble
     }
 };
 
+/// Mobipocket HUFF/CDIC compression type ("DH")
+#define PDB_COMPRESSION_HUFF_CDIC 17480
+
 struct MobiPreamble : public PalmDocPreamble
 {
     lUInt16 mobiEncryption;  // 2  Encryption Type	0 == no encryption, 1 = Old Mobipocket Encryption, 2 = Mobipocket Encryption
@@ -183,7 +188,7 @@ struct MobiPreamble : public PalmDocPreamble
             cnv.rev(&drmSize); //    172	4	DRM Size	Number of bytes in DRM info.
             cnv.rev(&drmFlags); //    176	4	DRM Flags	Some flags concerning the DRM info.
         }
-        if ( compression!=1 && compression!=2 )
+        if ( compression!=1 && compression!=2 && compression!=PDB_COMPRESSION_HUFF_CDIC )
             return false;
         if ( mobiType!=2 && mobiType!=3 && mobiType!=517 && mobiType!=518
                  && mobiType!=257 && mobiType!=258 && mobiType!=259 )
@@ -381,6 +386,239 @@ static bool pattern_cmp( const lUInt8 * buf, const char * pattern ) {
     return true;
 }
 
+static inline lUInt32 pdbReadBE32( const lUInt8 * p ) {
+    return ((lUInt32)p[0] << 24) | ((lUInt32)p[1] << 16) | ((lUInt32)p[2] << 8) | p[3];
+}
+
+static inline lUInt16 pdbReadBE16( const lUInt8 * p ) {
+    return (lUInt16)((p[0] << 8) | p[1]);
+}
+
+/// Mobipocket HUFF/CDIC decompressor
+/**
+    Text records are streams of Huffman codes, MSB first, each code selecting
+    a phrase of the CDIC dictionaries. Codes of up to 8 bits are resolved with
+    a single lookup of the next byte in the HUFF table, longer ones continue
+    with the per code length ranges.
+
+    Phrases may themselves be compressed. All of them are expanded when the
+    dictionary is loaded, so unpack() does not change the decoder and may run
+    on several threads at once.
+*/
+class PDBHuffCdicDecoder {
+    enum PhraseState {
+        PHRASE_PACKED,    // compressed, in _raw
+        PHRASE_EXPANDING, // being expanded, seen again means a loop in the dictionary
+        PHRASE_READY      // plain text, in _data
+    };
+    struct Phrase {
+        lUInt32 offset;
+        lUInt32 size;
+        int state;
+    };
+    struct CodeEntry {
+        int codelen;      // code length, or shortest length of codes with this first byte
+        bool terminal;    // code length is final
+        lUInt64 maxcode;  // left aligned to 32 bits, valid if terminal
+    };
+    CodeEntry _dict1[256];
+    lUInt64 _mincode[33];  // smallest code of each length, left aligned to 32 bits
+    lUInt64 _maxcode[33];  // phrase index base of each length, left aligned to 32 bits
+    LVArray<Phrase> _phrases;
+    LVArray<lUInt8> _raw;  // compressed phrases, until expanded
+    LVArray<lUInt8> _data; // expanded phrases
+    int _phraseCount;      // total number of phrases, from CDIC header
+
+    /// reads 8 bytes starting at pos, zero padded past the end of data
+    static lUInt64 read64( const lUInt8 * src, int srclen, int pos ) {
+        lUInt64 x = 0;
+        for ( int i=0; i<8; i++ )
+            x = (x << 8) | (pos + i < srclen ? src[pos + i] : 0);
+        return x;
+    }
+
+    bool expand( int index, int depth ) {
+        Phrase & ph = _phrases[index];
+        if ( ph.state==PHRASE_READY )
+            return true;
+        if ( ph.state==PHRASE_EXPANDING || depth>32 )
+            return false;
+        ph.state = PHRASE_EXPANDING;
+        LVArray<lUInt8> buf;
+        if ( !decode( _raw.get() + ph.offset, ph.size, buf, depth + 1 ) )
+            return false;
+        ph.offset = _data.length();
+        ph.size = buf.length();
+        ph.state = PHRASE_READY;
+        _data.add( buf );
+        return true;
+    }
+
+    bool decode( const lUInt8 * src, int srclen, LVArray<lUInt8> & dst, int depth ) {
+        lInt64 bitsLeft = (lInt64)srclen * 8;
+        int pos = 0;
+        lUInt64 x = read64( src, srclen, pos );
+        int n = 32;
+        for (;;) {
+            if ( n<=0 ) {
+                pos += 4;
+                x = read64( src, srclen, pos );
+                n += 32;
+            }
+            lUInt32 code = (lUInt32)(x >> n);
+            const CodeEntry & e = _dict1[code >> 24];
+            int codelen = e.codelen;
+            lUInt64 maxcode = e.maxcode;
+            if ( !e.terminal ) {
+                while ( codelen<32 && code<_mincode[codelen] )
+                    codelen++;
+                maxcode = _maxcode[codelen];
+            }
+            n -= codelen;
+            bitsLeft -= codelen;
+            if ( bitsLeft<0 )
+                break;
+            lUInt64 index = (maxcode - code) >> (32 - codelen);
+            if ( index>=(lUInt64)_phrases.length() )
+                return false;
+            if ( _phrases[(int)index].state!=PHRASE_READY && !expand( (int)index, depth ) )
+                return false;
+            const Phrase & ph = _phrases[(int)index];
+            dst.add( _data.get() + ph.offset, ph.size );
+        }
+        return true;
+    }
+public:
+    PDBHuffCdicDecoder() : _phraseCount(0) {
+        memset( _dict1, 0, sizeof(_dict1) );
+        memset( _mincode, 0, sizeof(_mincode) );
+        memset( _maxcode, 0, sizeof(_maxcode) );
+    }
+
+    /// reads code tables from HUFF record
+    bool loadHuff( const lUInt8 * data, int size ) {
+        if ( size<24 || memcmp( data, "HUFF\0\0\0\x18", 8 ) )
+            return false;
+        lUInt32 offset1 = pdbReadBE32( data + 8 );
+        lUInt32 offset2 = pdbReadBE32( data + 12 );
+        // offsets are read from file: compare without wrapping around
+        if ( size < 256 * 4 || offset1 > (lUInt32)size - 256 * 4 || offset2 > (lUInt32)size - 64 * 4 )
+            return false;
+        for ( int i=0; i<256; i++ ) {
+            lUInt32 v = pdbReadBE32( data + offset1 + i * 4 );
+            CodeEntry & e = _dict1[i];
+            e.codelen = v & 0x1F;
+            e.terminal = (v & 0x80)!=0;
+            if ( e.codelen==0 || (e.codelen<=8 && !e.terminal) )
+                return false;
+            e.maxcode = (((lUInt64)(v >> 8) + 1) << (32 - e.codelen)) - 1;
+        }
+        for ( int len=1; len<=32; len++ ) {
+            const lUInt8 * p = data + offset2 + (len - 1) * 8;
+            _mincode[len] = (lUInt64)pdbReadBE32( p ) << (32 - len);
+            _maxcode[len] = (((lUInt64)pdbReadBE32( p + 4 ) + 1) << (32 - len)) - 1;
+        }
+        return true;
+    }
+
+    /// adds phrases of next CDIC record
+    bool loadCdic( const lUInt8 * data, int size ) {
+        if ( size<16 || memcmp( data, "CDIC\0\0\0\x10", 8 ) )
+            return false;
+        _phraseCount = (int)pdbReadBE32( data + 8 );
+        lUInt32 bits = pdbReadBE32( data + 12 );
+        if ( bits>16 )
+            return false;
+        int count = _phraseCount - _phrases.length();
+        if ( count > (1 << bits) )
+            count = 1 << bits;
+        if ( 16 + count * 2 > size )
+            return false;
+        for ( int i=0; i<count; i++ ) {
+            int offset = 16 + pdbReadBE16( data + 16 + i * 2 );
+            if ( offset + 2 > size )
+                return false;
+            lUInt16 len = pdbReadBE16( data + offset );
+            Phrase ph;
+            ph.size = len & 0x7FFF;
+            if ( offset + 2 + (int)ph.size > size )
+                return false;
+            if ( len & 0x8000 ) {
+                // stored as is
+                ph.offset = _data.length();
+                ph.state = PHRASE_READY;
+                _data.add( data + offset + 2, ph.size );
+            } else {
+                ph.offset = _raw.length();
+                ph.state = PHRASE_PACKED;
+                _raw.add( data + offset + 2, ph.size );
+            }
+            _phrases.add( ph );
+        }
+        return true;
+    }
+
+    /// expands compressed phrases, call after all CDIC records are loaded
+    bool finishLoading() {
+        if ( _phrases.length()==0 || _phrases.length()!=_phraseCount )
+            return false;
+        for ( int i=0; i<_phrases.length(); i++ )
+            if ( !expand( i, 0 ) )
+                return false;
+        _raw.clear();
+        return true;
+    }
+
+    /// decompresses text record
+    bool unpack( const lUInt8 * src, int srclen, LVArray<lUInt8> & dst ) {
+        return decode( src, srclen, dst, 0 );
+    }
+};
+
+/// number of worker threads decompressing text records
+#define PDB_UNPACK_THREADS 2
+/// number of text records decompressed ahead of the reader
+#define PDB_UNPACK_AHEAD 8
+
+/// Decompresses text records following the one being read, on worker threads
+/**
+    Only decompression runs on the workers: packed records are read by the
+    reader thread, which owns the source stream. Unpacked records wait in a
+    ring of PDB_UNPACK_AHEAD slots until taken.
+*/
+class PDBRecordPrefetcher : public CRRunnable {
+    enum SlotState {
+        SLOT_FREE,
+        SLOT_QUEUED,
+        SLOT_UNPACKING,
+        SLOT_READY
+    };
+    struct Slot {
+        int index;
+        SlotState state;
+        bool ok;
+        LVArray<lUInt8> src;
+        LVArray<lUInt8> dst;
+        Slot() : index(-1), state(SLOT_FREE), ok(false) { }
+    };
+    PDBFile * _file;
+    CRMonitorRef _monitor;
+    CRThreadRef _threads[PDB_UNPACK_THREADS];
+    Slot _slots[PDB_UNPACK_AHEAD];
+    volatile bool _stopped;
+public:
+    PDBRecordPrefetcher( PDBFile * file );
+    virtual ~PDBRecordPrefetcher();
+    /// returns true if record is queued or already unpacked
+    bool scheduled( int index );
+    /// queues packed record for unpacking
+    void schedule( int index, LVArray<lUInt8> & src );
+    /// returns false if record was not scheduled, otherwise waits for it and puts result to dst
+    bool take( int index, LVArray<lUInt8> & dst, bool & ok );
+    /// worker thread loop
+    virtual void run();
+};
+
 class PDBFile : public LVNamedStream {
 public:
     enum Format {
@@ -412,7 +650,11 @@ private:
     lvpos_t _pos;
     lUInt16 _mobiExtraDataFlags;
     CRPropRef m_doc_props;
+    PDBHuffCdicDecoder * _huff;
+    PDBRecordPrefetcher * _prefetcher;
+    friend class PDBRecordPrefetcher;
     //LVPDBContainer * _container;
+    /// unpacks record data, may be called from PDBRecordPrefetcher worker threads
     bool unpack( LVArray<lUInt8> & dst, LVArray<lUInt8> & src ) {
         int srclen = src.length();
         dst.reset();
@@ -465,16 +707,10 @@ private:
                 return false;
             dst.add(dstbuf, dstsize);
             free(dstbuf);
-        } else if ( _compression==17480 ) {
-            // zlib
-            // TODO: shouldn't it be HUFFMAN unpacker?
-            /// unpack data from _compbuf to _buf
-            lUInt8 * dstbuf;
-            lUInt32 dstsize;
-            if ( !ldomUnpack( src.get(), src.size(), dstbuf, dstsize ) )
+        } else if ( _compression==PDB_COMPRESSION_HUFF_CDIC ) {
+            // HUFF/CDIC
+            if ( !_huff || !_huff->unpack( src.get(), srclen, dst ) )
                 return false;
-            dst.add(dstbuf, dstsize);
-            free(dstbuf);
         }
         return true;
     }
@@ -551,17 +787,45 @@ private:
             return false;
         return true;
     }
+    /// reads packed text record, with trailing entries removed
+    bool readPackedRecord( int index, LVArray<lUInt8> * dstbuf ) {
+        if (!readRecordNoUnpack(index, dstbuf))
+            return false;
+        if (_mobiExtraDataFlags && index < _recordCount)
+            removeExtraData(index, *dstbuf);
+        return true;
+    }
+
+    /// queues text records following index for unpacking on worker threads
+    void prefetch( int index ) {
+        LVArray<lUInt8> buf;
+        for ( int i=index+1; i<=index+PDB_UNPACK_AHEAD && i<=_recordCount; i++ ) {
+            if ( _prefetcher->scheduled(i) )
+                continue;
+            if ( !readPackedRecord(i, &buf) )
+                break;
+            _prefetcher->schedule(i, buf);
+        }
+    }
+
     bool readRecord( int index, LVArray<lUInt8> * dstbuf ) {
         if (index >= _records.length())
             return false;
+        if ( _prefetcher && index>0 && index<=_recordCount ) {
+            bool res = false;
+            if ( !_prefetcher->take(index, *dstbuf, res) )
+                res = readAndUnpackRecord(index, dstbuf);
+            prefetch(index);
+            return res;
+        }
+        return readAndUnpackRecord(index, dstbuf);
+    }
+
+    bool readAndUnpackRecord( int index, LVArray<lUInt8> * dstbuf ) {
         LVArray<lUInt8> srcbuf;
         LVArray<lUInt8> * buf = _compression ? &srcbuf : dstbuf;
-        if (!readRecordNoUnpack(index, buf))
+        if (!readPackedRecord(index, buf))
             return false;
-
-        if (_mobiExtraDataFlags && index < _recordCount)
-            removeExtraData(index, *buf);
-
         if (!_compression)
             return true;
         // unpack
@@ -623,6 +887,22 @@ public:
 //        return NULL;
 //    }
 
+    /// reads HUFF record and CDIC records following it
+    bool loadHuffCdic( lUInt32 firstRecord, lUInt32 recordCount ) {
+        lUInt32 len = (lUInt32)_records.length();
+        if ( recordCount<2 || firstRecord >= len || recordCount > len - firstRecord )
+            return false;
+        _huff = new PDBHuffCdicDecoder();
+        LVArray<lUInt8> buf;
+        for ( lUInt32 i=0; i<recordCount; i++ ) {
+            if ( !readRecordNoUnpack(firstRecord + i, &buf) )
+                return false;
+            if ( !(i==0 ? _huff->loadHuff(buf.get(), buf.length()) : _huff->loadCdic(buf.get(), buf.length())) )
+                return false;
+        }
+        return _huff->finishLoading();
+    }
+
     void detectFormat( doc_format_t & contentFormat ) {
         if ( contentFormat == doc_format_none ) {
             // autodetect format
@@ -761,6 +1041,11 @@ public:
                 _compression = 0;
             _textSize = preamble.textLength;
             _recordCount = preamble.firstNonBookIndex - 1;
+            if ( _compression==PDB_COMPRESSION_HUFF_CDIC && validateContent
+                    && !loadHuffCdic(preamble.huffmanRecordOffset, preamble.huffmanRecordCount) ) {
+                CRLog::error("PDB: cannot read HUFF/CDIC dictionary");
+                return false;
+            }
             lUInt32 coverOffset = (lUInt32)-1;
             lUInt32 thumbOffset = 0;
             if (preamble.mobiFlags & 0x40) {
@@ -899,6 +1184,9 @@ public:
         if ( !validateContent )
             return true; // for simple format check
 
+        if ( _compression && concurrencyProvider )
+            _prefetcher = new PDBRecordPrefetcher(this);
+
         LVArray<lUInt8> buf;
         lUInt32 unpoffset = 0;
         _crc = 0;
@@ -1094,14 +1382,125 @@ public:
         //_container.AddRef();
         _bufIndex = -1;
         _mobiExtraDataFlags = 0;
+        _huff = NULL;
+        _prefetcher = NULL;
         m_doc_props = LVCreatePropsContainer();
     }
 
     /// Destructor
-    virtual ~PDBFile() { }
+    virtual ~PDBFile();
 
 };
 
+PDBFile::~PDBFile()
+{
+    // stops worker threads before the decoder they use is gone
+    delete _prefetcher;
+    delete _huff;
+}
+
+PDBRecordPrefetcher::PDBRecordPrefetcher( PDBFile * file ) : _file(file), _stopped(false)
+{
+    _monitor = concurrencyProvider->createMonitor();
+    for ( int i=0; i<PDB_UNPACK_THREADS; i++ ) {
+        _threads[i] = concurrencyProvider->createThread(this);
+        _threads[i]->start();
+    }
+}
+
+PDBRecordPrefetcher::~PDBRecordPrefetcher()
+{
+    {
+        CRGuard guard(_monitor);
+        CR_UNUSED(guard);
+        _stopped = true;
+        _monitor->notifyAll();
+    }
+    for ( int i=0; i<PDB_UNPACK_THREADS; i++ )
+        _threads[i]->join();
+}
+
+bool PDBRecordPrefetcher::scheduled( int index )
+{
+    CRGuard guard(_monitor);
+    CR_UNUSED(guard);
+    Slot & slot = _slots[index % PDB_UNPACK_AHEAD];
+    return slot.index==index && slot.state!=SLOT_FREE;
+}
+
+void PDBRecordPrefetcher::schedule( int index, LVArray<lUInt8> & src )
+{
+    CRGuard guard(_monitor);
+    CR_UNUSED(guard);
+    Slot & slot = _slots[index % PDB_UNPACK_AHEAD];
+    // the slot may still be used for a record skipped by a seek
+    while ( slot.state==SLOT_UNPACKING )
+        _monitor->wait();
+    slot.index = index;
+    slot.src.reset();
+    slot.src.add(src);
+    slot.state = SLOT_QUEUED;
+    _monitor->notify();
+}
+
+bool PDBRecordPrefetcher::take( int index, LVArray<lUInt8> & dst, bool & ok )
+{
+    Slot & slot = _slots[index % PDB_UNPACK_AHEAD];
+    {
+        CRGuard guard(_monitor);
+        CR_UNUSED(guard);
+        if ( slot.index!=index || slot.state==SLOT_FREE )
+            return false;
+        if ( slot.state!=SLOT_QUEUED ) {
+            while ( slot.state!=SLOT_READY )
+                _monitor->wait();
+            dst.reset();
+            dst.add(slot.dst);
+            ok = slot.ok;
+            slot.state = SLOT_FREE;
+            return true;
+        }
+        // no worker has started it yet: unpack on this thread instead of waiting
+        slot.state = SLOT_UNPACKING;
+    }
+    ok = _file->unpack(dst, slot.src);
+    CRGuard guard(_monitor);
+    CR_UNUSED(guard);
+    slot.state = SLOT_FREE;
+    _monitor->notifyAll();
+    return true;
+}
+
+void PDBRecordPrefetcher::run()
+{
+    for (;;) {
+        Slot * slot = NULL;
+        {
+            CRGuard guard(_monitor);
+            CR_UNUSED(guard);
+            for (;;) {
+                if ( _stopped )
+                    return;
+                // nearest record first
+                for ( int i=0; i<PDB_UNPACK_AHEAD; i++ ) {
+                    if ( _slots[i].state==SLOT_QUEUED && (!slot || _slots[i].index<slot->index) )
+                        slot = &_slots[i];
+                }
+                if ( slot )
+                    break;
+                _monitor->wait();
+            }
+            slot->state = SLOT_UNPACKING;
+        }
+        bool ok = _file->unpack(slot->dst, slot->src);
+        CRGuard guard(_monitor);
+        CR_UNUSED(guard);
+        slot->ok = ok;
+        slot->state = SLOT_READY;
+        _monitor->notifyAll();
+    }
+}
+
 // open PDB stream from stream
 //LVStreamRef LVOpenPDBStream( LVStreamRef srcstream, int &format )
 //{
@@ -1146,7 +1545,7 @@ bool isCorrectUtf8Text(LVStreamRef & stream) {
     return res != 0;
 }
 
-LVStreamRef GetPDBCoverpage(LVStreamRef stream)
+LVStreamRef GetPDBCoverpage(LVStreamRef stream, CRPropRef props)
 {
     doc_format_t contentFormat = doc_format_none;
     PDBFile * pdb = new PDBFile();
@@ -1159,6 +1558,8 @@ LVStreamRef GetPDBCoverpage(LVStreamRef stream)
     stream = LVStreamRef(pdb);
     LVContainerRef cnt(container);
     container->setStream(stream);
+    if (!props.isNull())
+        props->set(pdb->getDocProps());
     LVStreamRef coverStream;
     lString16 coverName = pdb->getDocProps()->getStringDef(DOC_PROP_COVER_FILE);
     if (!coverName.empty()) {
@@ -576,8 +576,9 @@ bAddTableRow(diagram_type *pDiag, char **aszColTxt,
 
 static LVStream * antiword_stream = NULL;
 class AntiwordStreamGuard {
+    CRGuard _guard; // antiword keeps its state in globals: one document at a time
 public:
-    AntiwordStreamGuard(LVStreamRef stream) {
+    AntiwordStreamGuard(LVStreamRef stream) : _guard(_documentMutex) {
         antiword_stream = stream.get();
     }
     ~AntiwordStreamGuard() {